@@ -18,6 +18,7 @@
 #define SSOL_H
 
 #include <rsys/rsys.h>
+#include <stdio.h>
 
 /* Library symbol management */
 #if defined(SSOL_SHARED_BUILD) /* Build shared library */
@@ -41,6 +42,9 @@
  * as many threads as CPU cores */
 #define SSOL_NTHREADS_DEFAULT (~0u)
 
+/* Maximum number of wavelengths carried by a radiative path */
+#define SSOL_MAX_PATH_WAVELENGTHS 8
+
 /* Forward declaration of external types */
 struct logger;
 struct mem_allocator;
@@ -57,6 +61,7 @@ struct ssol_instance;
 struct ssol_param_buffer;
 struct ssol_scene;
 struct ssol_shape;
+struct ssol_slope_distribution;
 struct ssol_spectrum;
 struct ssol_sun;
 struct ssol_estimator;
@@ -75,6 +80,7 @@ enum ssol_path_type {
 };
 
 enum ssol_material_type {
+  SSOL_MATERIAL_ABSORBER,
   SSOL_MATERIAL_DIELECTRIC,
   SSOL_MATERIAL_MATTE,
   SSOL_MATERIAL_MIRROR,
@@ -133,6 +139,47 @@ enum ssol_data_type {
   SSOL_DATA_SPECTRUM
 };
 
+/* Define the quantities estimated by the solves */
+enum ssol_accounting {
+  /* Estimate the receiver fluxes and the whole energy balance, i.e. the
+   * shadowed, blocked, missing and absorbed fluxes and the receiver fluxes
+   * if there were no atmospheric or field losses. Default */
+  SSOL_ACCOUNTING_FULL,
+  /* Only estimate the cos factor and the incoming and absorbed fluxes of the
+   * receivers; the other estimations are null. The radiative paths end as
+   * soon as they leave the bounding box of the receivers and of the instances
+   * that can redirect the flux, i.e. whose materials are neither virtual nor
+   * absorbers, since they cannot reach a receiver anymore */
+  SSOL_ACCOUNTING_RECEIVERS,
+  SSOL_ACCOUNTING_COUNT__
+};
+
+/* Define how the realisations are distributed over the sampled instances */
+enum ssol_stratification {
+  /* Each realisation randomly selects the instance to sample. Default */
+  SSOL_STRATIFICATION_NONE,
+  /* The realisations are deterministically split over the instances
+   * proportionally to their area, or to their adapted sampling probability if
+   * the adaptive sampling is enabled */
+  SSOL_STRATIFICATION_AREA,
+  /* The realisations are deterministically split over the instances
+   * proportionally to their sampling quota, or to their adapted sampling
+   * probability if the adaptive sampling is enabled */
+  SSOL_STRATIFICATION_QUOTA,
+  SSOL_STRATIFICATION_COUNT__
+};
+
+/* Quantity whose variance is reduced by the adaptive sampling */
+enum ssol_adaptive_quantity {
+  /* Overall flux absorbed by the receivers. Default */
+  SSOL_ADAPTIVE_ABSORBED_BY_RECEIVERS,
+  /* Flux incoming onto a given receiver side */
+  SSOL_ADAPTIVE_RECEIVER_INCOMING,
+  /* Flux absorbed by a given receiver side */
+  SSOL_ADAPTIVE_RECEIVER_ABSORBED,
+  SSOL_ADAPTIVE_QUANTITY_COUNT__
+};
+
 /* Describe a vertex data */
 struct ssol_vertex_data {
   enum ssol_attrib_usage usage; /* Semantic of the data */
@@ -306,11 +353,34 @@ typedef void
    const struct ssol_surface_fragment* fragment,
    double* val); /* Returned value */
 
+/* Batched variant of a shader getter. Evaluate the parameter of `count'
+ * fragments at once: the value of the i^th fragment at the i^th wavelength is
+ * written in `vals' at the offset i*dim, with dim the dimension of the
+ * parameter, i.e. 3 for the normal and 1 otherwise. The batched getters are
+ * optional: the scalar getter is invoked per fragment when they are NULL.
+ *
+ * They are only invoked where a parameter is evaluated several times at once:
+ * by the solver, for the wavelengths of the paths that carry several
+ * wavelengths (see ssol_scene_set_path_wavelengths), and by the draft
+ * renderer, for the samples of a pixel. The solver traces its paths one at a
+ * time per thread and shades the normals at the hero wavelength of the paths:
+ * the normals and the parameters of the single wavelength paths are thus
+ * always evaluated with the scalar getters */
+typedef void
+(*ssol_shader_batch_getter_T)
+  (struct ssol_device* dev,
+   struct ssol_param_buffer* buf,
+   const size_t count, /* #fragments */
+   const double* wavelengths, /* List of `count' wavelengths */
+   const struct ssol_surface_fragment* fragments, /* List of `count' frags */
+   double* vals); /* Returned values */
+
 /* Dielectric material shader */
 struct ssol_dielectric_shader {
   ssol_shader_getter_T normal;
+  ssol_shader_batch_getter_T normal_batch; /* May be NULL */
 };
-#define SSOL_DIELECTRIC_SHADER_NULL__ { NULL }
+#define SSOL_DIELECTRIC_SHADER_NULL__ { NULL, NULL }
 static const struct ssol_dielectric_shader SSOL_DIELECTRIC_SHADER_NULL =
   SSOL_DIELECTRIC_SHADER_NULL__;
 
@@ -319,8 +389,11 @@ struct ssol_mirror_shader {
   ssol_shader_getter_T normal;
   ssol_shader_getter_T reflectivity;
   ssol_shader_getter_T roughness;
+  ssol_shader_batch_getter_T normal_batch; /* May be NULL */
+  ssol_shader_batch_getter_T reflectivity_batch; /* May be NULL */
+  ssol_shader_batch_getter_T roughness_batch; /* May be NULL */
 };
-#define SSOL_MIRROR_SHADER_NULL__ { NULL, NULL, NULL }
+#define SSOL_MIRROR_SHADER_NULL__ { NULL, NULL, NULL, NULL, NULL, NULL }
 static const struct ssol_mirror_shader SSOL_MIRROR_SHADER_NULL =
   SSOL_MIRROR_SHADER_NULL__;
 
@@ -328,16 +401,19 @@ static const struct ssol_mirror_shader SSOL_MIRROR_SHADER_NULL =
 struct ssol_matte_shader {
   ssol_shader_getter_T normal;
   ssol_shader_getter_T reflectivity;
+  ssol_shader_batch_getter_T normal_batch; /* May be NULL */
+  ssol_shader_batch_getter_T reflectivity_batch; /* May be NULL */
 };
-#define SSOL_MATTE_SHADER_NULL__ { NULL, NULL }
+#define SSOL_MATTE_SHADER_NULL__ { NULL, NULL, NULL, NULL }
 static const struct ssol_matte_shader SSOL_MATTE_SHADER_NULL =
   SSOL_MATTE_SHADER_NULL__;
 
 /* Thin dielectric shader */
 struct ssol_thin_dielectric_shader {
   ssol_shader_getter_T normal;
+  ssol_shader_batch_getter_T normal_batch; /* May be NULL */
 };
-#define SSOL_THIN_DIELECTRIC_SHADER_NULL__ { NULL }
+#define SSOL_THIN_DIELECTRIC_SHADER_NULL__ { NULL, NULL }
 static const struct ssol_thin_dielectric_shader
 SSOL_THIN_DIELECTRIC_SHADER_NULL = SSOL_THIN_DIELECTRIC_SHADER_NULL__;
 
@@ -356,6 +432,19 @@ struct ssol_instantiated_shaded_shape {
 static const struct ssol_instantiated_shaded_shape
 SSOL_INSTANTIATED_SHADED_SHAPE_NULL = SSOL_INSTANTIATED_SHADED_SHAPE_NULL__;
 
+/* Objective of the adaptive sampling of the instances */
+struct ssol_adaptive_objective {
+  enum ssol_adaptive_quantity quantity;
+  /* Receiver of the per receiver quantities. Unused otherwise */
+  struct ssol_instance* receiver;
+  enum ssol_side_flag side; /* Receiver side, i.e. SSOL_FRONT or SSOL_BACK */
+};
+
+#define SSOL_ADAPTIVE_OBJECTIVE_DEFAULT__ \
+  {SSOL_ADAPTIVE_ABSORBED_BY_RECEIVERS, NULL, SSOL_FRONT}
+static const struct ssol_adaptive_objective SSOL_ADAPTIVE_OBJECTIVE_DEFAULT =
+  SSOL_ADAPTIVE_OBJECTIVE_DEFAULT__;
+
 struct ssol_path_tracker {
   /* Control the length of the path segment starting/ending from/to the
    * infinite. A value less than zero means for default value */
@@ -367,6 +456,91 @@ struct ssol_path_tracker {
 static const struct ssol_path_tracker SSOL_PATH_TRACKER_DEFAULT =
   SSOL_PATH_TRACKER_DEFAULT__;
 
+/* Receiver hit submitted to a tally */
+struct ssol_tally_hit {
+  size_t realisation; /* Identifier of the realisation */
+  size_t depth; /* Number of non virtual surfaces hit before this one */
+  uint32_t instance; /* Identifier of the receiver instance */
+  enum ssol_side_flag side; /* Receiver side */
+  unsigned primitive; /* Identifier of the hit primitive in its shape */
+  double pos[3]; /* World space position */
+  double dir[3]; /* Normalized incoming direction */
+  double normal[3]; /* Normalized world space normal of the hit side */
+  double uv[2]; /* Parametric coordinates of the hit onto its primitive */
+  double wavelength; /* Sampled (hero) wavelength */
+  double incoming_flux; /* In W */
+  double absorbed_flux; /* In W */
+};
+
+/* Radiative path submitted to a tally once it is terminated */
+struct ssol_tally_path {
+  size_t realisation; /* Identifier of the realisation */
+  size_t depth; /* Number of non virtual surfaces hit along the path */
+  double wavelength; /* Sampled (hero) wavelength */
+  double initial_flux; /* Flux of the path starting point. In W */
+  double missing_flux; /* Flux leaving the scene. In W */
+  int receiver_hit; /* Define if at least one receiver was hit */
+};
+
+/* User defined statistic evaluated during the random walk. Each thread
+ * accumulates into its own copy of the tally data, allocated by the solver
+ * and merged at the end of the solve. The hits of a realisation are submitted
+ * once it is terminated, with the weights of the canceled or rescaled
+ * realisations already taken into account. A callback returning an error
+ * aborts the solve. */
+struct ssol_tally {
+  size_t sizeof_data; /* Size in bytes of the tally data. Must be > 0 */
+  /* Initialise the tally data. May be NULL <=> data are zeroed */
+  res_T (*init)(void* data, void* context);
+  /* Release the resources of the tally data. May be NULL */
+  void (*release)(void* data, void* context);
+  /* Accumulate a receiver hit. May be NULL */
+  res_T (*hit)(void* data, const struct ssol_tally_hit* hit, void* context);
+  /* Accumulate a terminated path. May be NULL */
+  res_T (*path_end)
+    (void* data, const struct ssol_tally_path* path, void* context);
+  /* Add the `src' tally data to the `dst' ones */
+  res_T (*merge)(void* dst, const void* src, void* context);
+  /* Serialize the tally data. May be NULL <=> the estimators using the tally
+   * cannot be written nor sent */
+  res_T (*write)(const void* data, FILE* stream, void* context);
+  /* Overwrite the initialised tally data with the data serialized by `write'.
+   * May be NULL <=> the estimators using the tally cannot be read */
+  res_T (*read)(void* data, FILE* stream, void* context);
+  void* context; /* User data sent as the last argument of the callbacks */
+};
+
+#define SSOL_TALLY_NULL__ {0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+static const struct ssol_tally SSOL_TALLY_NULL = SSOL_TALLY_NULL__;
+
+/* Periodic snapshot of a simulation. The simulation is set up once and its
+ * realisations are then run in consecutive batches, each batch starting from
+ * the RNG state of the previous one. Once a batch is done, the snapshot is
+ * written if at least `realisations_period' realisations were done or if at
+ * least `time_period' seconds have elapsed since the previous snapshot,
+ * whichever comes first. At least one period must be defined */
+struct ssol_checkpoint {
+  const char* filename; /* Path of the snapshot file */
+  size_t realisations_period; /* 0 <=> not used */
+  double time_period; /* In seconds. <= 0 <=> not used */
+};
+
+#define SSOL_CHECKPOINT_NULL__ {NULL, 0, -1}
+static const struct ssol_checkpoint SSOL_CHECKPOINT_NULL =
+  SSOL_CHECKPOINT_NULL__;
+
+/* Byte channel used to transfer data between processes, e.g. a pipe, a socket
+ * or the transport layer of a message passing library */
+struct ssol_channel {
+  /* Send/receive exactly `size' bytes */
+  res_T (*send)(const void* data, const size_t size, void* context);
+  res_T (*receive)(void* data, const size_t size, void* context);
+  void* context; /* User defined data sent to the callbacks */
+};
+
+#define SSOL_CHANNEL_NULL__ {NULL, NULL, NULL}
+static const struct ssol_channel SSOL_CHANNEL_NULL = SSOL_CHANNEL_NULL__;
+
 struct ssol_path {
   /* Internal data */
   const void* path__;
@@ -459,12 +633,32 @@ struct ssol_mc_shape {
 #define SSOL_MC_SHAPE_NULL__ { 0, NULL, NULL }
 static const struct ssol_mc_shape SSOL_MC_SHAPE_NULL = SSOL_MC_SHAPE_NULL__;
 
+/* Losses of the flux starting from a sampled instance. Except for the cos
+ * factor, they are estimated over all the realisations: summed over the
+ * sampled instances, they give the global estimations. The initial flux of a
+ * sampled instance is split into shadowed, blocked, missing,
+ * extinguished_by_atmosphere, other_absorbed and absorbed_by_receivers. */
 struct ssol_mc_sampled {
   struct ssol_mc_result cos_factor; /* [0 1] */
-  struct ssol_mc_result shadowed;
+  struct ssol_mc_result shadowed; /* In W */
+  /* Absorbed by the non receiver instances other than the sampled one, e.g.
+   * by blocking heliostats or secondary reflectors. In W */
+  struct ssol_mc_result blocked;
+  struct ssol_mc_result missing; /* In W */
+  struct ssol_mc_result extinguished_by_atmosphere; /* In W */
+  /* Absorbed by the sampled instance itself or by the media. In W */
+  struct ssol_mc_result other_absorbed;
+  struct ssol_mc_result absorbed_by_receivers; /* In W */
   size_t nb_samples;
 };
 
+/* Contribution of a non receiver instance to the blocking of the flux
+ * starting from a sampled instance */
+struct ssol_mc_blocker {
+  struct ssol_mc_result absorbed_flux; /* In W */
+  struct ssol_mc_result hits; /* Number of hits per realisation */
+};
+
 struct ssol_mc_primitive {
   struct ssol_mc_result incoming_flux; /* In W */
   struct ssol_mc_result incoming_if_no_atm_loss; /* In W */
@@ -492,6 +686,85 @@ struct ssol_mc_primitive {
 static const struct ssol_mc_primitive SSOL_MC_PRIMITIVE_NULL =
   SSOL_MC_PRIMITIVE_NULL__;
 
+/* Receiver MC estimations */
+enum ssol_mc_channel {
+  SSOL_MC_INCOMING_FLUX,
+  SSOL_MC_INCOMING_IF_NO_ATM_LOSS,
+  SSOL_MC_INCOMING_IF_NO_FIELD_LOSS,
+  SSOL_MC_INCOMING_LOST_IN_FIELD,
+  SSOL_MC_INCOMING_LOST_IN_ATMOSPHERE,
+  SSOL_MC_ABSORBED_FLUX,
+  SSOL_MC_ABSORBED_IF_NO_ATM_LOSS,
+  SSOL_MC_ABSORBED_IF_NO_FIELD_LOSS,
+  SSOL_MC_ABSORBED_LOST_IN_FIELD,
+  SSOL_MC_ABSORBED_LOST_IN_ATMOSPHERE,
+  SSOL_MC_CHANNELS_COUNT__
+};
+
+/* Per primitive expectations and standard errors, in W/m^2, stored as a
+ * structure of arrays. A NULL array means that the corresponding channel is
+ * not retrieved; otherwise it must store one value per primitive */
+struct ssol_mc_primitives {
+  double* E[SSOL_MC_CHANNELS_COUNT__];
+  double* SE[SSOL_MC_CHANNELS_COUNT__];
+};
+#define SSOL_MC_PRIMITIVES_NULL__ {{NULL}, {NULL}}
+static const struct ssol_mc_primitives SSOL_MC_PRIMITIVES_NULL =
+  SSOL_MC_PRIMITIVES_NULL__;
+
+/* Read only view of the per primitive expectations and standard errors of a
+ * shape. The arrays are NULL if no primitive of the shape was reached */
+struct ssol_mc_primitives_view {
+  const double* E[SSOL_MC_CHANNELS_COUNT__];
+  const double* SE[SSOL_MC_CHANNELS_COUNT__];
+  size_t count; /* #primitives */
+};
+#define SSOL_MC_PRIMITIVES_VIEW_NULL__ {{NULL}, {NULL}, 0}
+static const struct ssol_mc_primitives_view SSOL_MC_PRIMITIVES_VIEW_NULL =
+  SSOL_MC_PRIMITIVES_VIEW_NULL__;
+
+enum ssol_flux_map_domain {
+  SSOL_FLUX_MAP_UV, /* Texture coordinates of the receiver surface */
+  /* Local (x,y) position, i.e. in quadric space for punched surfaces and in
+   * object space for meshes */
+  SSOL_FLUX_MAP_LOCAL_XY
+};
+
+/* Regular 2D grid onto which the incoming and absorbed fluxes of a receiver
+ * are binned during the simulation, independently of its tessellation */
+struct ssol_flux_map {
+  enum ssol_flux_map_domain domain;
+  size_t definition[2]; /* #bins along the 2 dimensions. 0 disables the map */
+  double lower[2]; /* Lower bound of the mapped domain */
+  double upper[2]; /* Upper bound of the mapped domain */
+};
+#define SSOL_FLUX_MAP_NULL__ { SSOL_FLUX_MAP_UV, {0, 0}, {0, 0}, {1, 1} }
+static const struct ssol_flux_map SSOL_FLUX_MAP_NULL = SSOL_FLUX_MAP_NULL__;
+
+/* Impact of a radiative path onto a receiver whose hits are recorded */
+struct ssol_hit {
+  uint64_t realisation; /* Index of the realisation, failed ones included */
+  float pos[3]; /* Local position, as defined by SSOL_FLUX_MAP_LOCAL_XY */
+  float incoming_flux; /* In W */
+  float absorbed_flux; /* In W */
+  uint32_t instance; /* Receiver instance identifier */
+  uint32_t side; /* Receiver side, i.e. SSOL_FRONT or SSOL_BACK */
+};
+
+enum ssol_kernel_type {
+  SSOL_KERNEL_BOX, /* A hit contributes only to the bin in which it lies */
+  SSOL_KERNEL_EPANECHNIKOV, /* Support radius is the bandwidth */
+  SSOL_KERNEL_GAUSSIAN /* Bandwidth is the std dev. Truncated at 3 std dev */
+};
+
+/* Smoothing kernel used to reconstruct a flux map from recorded hits */
+struct ssol_kernel {
+  enum ssol_kernel_type type;
+  double bandwidth; /* In local units. Not used by SSOL_KERNEL_BOX */
+};
+#define SSOL_KERNEL_BOX__ { SSOL_KERNEL_BOX, 0 }
+static const struct ssol_kernel SSOL_KERNEL_DEFAULT = SSOL_KERNEL_BOX__;
+
 typedef res_T
 (*ssol_write_pixels_T)
   (void* context, /* Image data */
@@ -696,6 +969,114 @@ ssol_scene_for_each_instance
    res_T (*func)(struct ssol_instance* instance, void* ctx),
    void* ctx);
 
+/* Register a tally evaluated by the subsequent solves. `id' is the index of
+ * the tally data in the resulting estimators. May be NULL */
+SSOL_API res_T
+ssol_scene_add_tally
+  (struct ssol_scene* scn,
+   const struct ssol_tally* tally,
+   size_t* id);
+
+SSOL_API res_T
+ssol_scene_clear_tallies
+  (struct ssol_scene* scn);
+
+/* Define the quantities estimated by the subsequent solves. Default is
+ * SSOL_ACCOUNTING_FULL */
+SSOL_API res_T
+ssol_scene_set_accounting
+  (struct ssol_scene* scn,
+   const enum ssol_accounting accounting);
+
+SSOL_API res_T
+ssol_scene_get_accounting
+  (const struct ssol_scene* scn,
+   enum ssol_accounting* accounting);
+
+/* Define the number of reflections sampled at the first glossy bounce of the
+ * radiative paths, i.e. onto the first mirror whose roughness is not null.
+ * The path forks in `nsplits' sub-paths that share its starting point and
+ * its shadow test, each sub-path contributing to the realisation with a
+ * weight divided by `nsplits'. Default is 1, i.e. no splitting */
+SSOL_API res_T
+ssol_scene_set_glossy_splitting
+  (struct ssol_scene* scn,
+   const size_t nsplits);
+
+SSOL_API res_T
+ssol_scene_get_glossy_splitting
+  (const struct ssol_scene* scn,
+   size_t* nsplits);
+
+/* Define the number of wavelengths carried by each radiative path of a
+ * spectral solve, in [1, SSOL_MAX_PATH_WAVELENGTHS]. They stratify the sun
+ * spectrum from a first "hero" wavelength that drives the sampling of the
+ * scattering directions; each wavelength has its own weights and the
+ * estimates are their mean. A path falls back onto its hero wavelength at the
+ * first surface whose scattering directions depend on the wavelength, e.g. a
+ * dispersive dielectric. Ignored by gray solves. Default is 1 */
+SSOL_API res_T
+ssol_scene_set_path_wavelengths
+  (struct ssol_scene* scn,
+   const size_t count);
+
+SSOL_API res_T
+ssol_scene_get_path_wavelengths
+  (const struct ssol_scene* scn,
+   size_t* count);
+
+/* Enable the adaptive sampling of the instances. Each solve first traces
+ * `npilots' pilot realisations whose results are discarded. They estimate the
+ * contribution of each sampled instance to the quantity of the adaptive
+ * objective, from which the probability to sample each instance is defined in
+ * order to reduce the variance of this quantity. The estimates remain
+ * unbiased. Note that with a partitioned solve, each worker runs its own pilot
+ * realisations. Default is 0, i.e. the instances are sampled wrt their area */
+SSOL_API res_T
+ssol_scene_set_adaptive_sampling
+  (struct ssol_scene* scn,
+   const size_t npilots);
+
+SSOL_API res_T
+ssol_scene_get_adaptive_sampling
+  (const struct ssol_scene* scn,
+   size_t* npilots);
+
+/* Define the quantity whose variance is reduced by the adaptive sampling. By
+ * default, this is the overall flux absorbed by the receivers: the samples are
+ * then allocated to the instances that bring the most flux onto any receiver,
+ * possibly to the detriment of a specific receiver. The receiver of the per
+ * receiver quantities must be a receiver side of the solved scene */
+SSOL_API res_T
+ssol_scene_set_adaptive_objective
+  (struct ssol_scene* scn,
+   const struct ssol_adaptive_objective* objective);
+
+SSOL_API res_T
+ssol_scene_get_adaptive_objective
+  (const struct ssol_scene* scn,
+   struct ssol_adaptive_objective* objective);
+
+/* Define how the realisations are distributed over the sampled instances. A
+ * stratified solve devotes at least one realisation to each instance. Within
+ * an instance, the starting points are still randomly sampled. The per sampled
+ * instance estimations are normalised by the number of realisations of their
+ * stratum, i.e. their variance and standard error are the ones of their
+ * stratum. The global and per receiver estimations are still unbiased but
+ * their variance and standard error are computed as for independent
+ * realisations: they ignore the variance reduction of the stratification and
+ * are thus conservative, i.e. they overestimate the actual error. Stratified
+ * estimators cannot be merged with not stratified ones */
+SSOL_API res_T
+ssol_scene_set_stratification
+  (struct ssol_scene* scn,
+   const enum ssol_stratification stratification);
+
+SSOL_API res_T
+ssol_scene_get_stratification
+  (const struct ssol_scene* scn,
+   enum ssol_stratification* stratification);
+
 /*******************************************************************************
  * Shape API - Define a geometry that can be generated from a quadric equation
  * or from a triangular mesh.
@@ -784,6 +1165,14 @@ ssol_material_create_virtual
   (struct ssol_device* dev,
    struct ssol_material** mtl);
 
+/* Opaque material that absorbs the whole incoming flux, e.g. for the towers,
+ * the terrain or the back of the heliostats. A radiative path ends onto it
+ * without any shading */
+SSOL_API res_T
+ssol_material_create_absorber
+  (struct ssol_device* dev,
+   struct ssol_material** mtl);
+
 SSOL_API res_T
 ssol_material_create_thin_dielectric
   (struct ssol_device* dev,
@@ -833,6 +1222,38 @@ ssol_thin_dielectric_setup
    const struct ssol_medium* slab_medium,
    const double thickness);
 
+/* Setup a mirror whose parameters do not vary over its surface, i.e. they
+ * depend on the wavelength only. Both the reflectivity and the roughness must
+ * lie in [0, 1]. Its shading normal is the normal of the shape. Its shading
+ * thus invokes no shader and, if the shape has no per vertex normal, does not
+ * compute the texture coordinates and partial derivatives of the hit */
+SSOL_API res_T
+ssol_mirror_setup_uniform
+  (struct ssol_material* mtl,
+   const struct ssol_data* reflectivity,
+   const struct ssol_data* roughness,
+   const enum ssol_microfacet_distribution distrib);
+
+/* Setup a matte material whose reflectivity, in [0, 1], does not vary over its
+ * surface. Refer to ssol_mirror_setup_uniform */
+SSOL_API res_T
+ssol_matte_setup_uniform
+  (struct ssol_material* mtl,
+   const struct ssol_data* reflectivity);
+
+/* Distribute the microfacet normals of the mirror wrt the tabulated `slopes'
+ * rather than wrt its analytic microfacet distribution whose roughness is then
+ * ignored. The first slope axis follows the dPdu partial derivative of the
+ * hit. For the shapes without texcoords, the dPdu and dPdv of the fragments
+ * submitted to the mirror are the normalised X axis of the instance projected
+ * onto the surface and its cross product with the normal, respectively; the
+ * slopes are thus consistently oriented over the instance. A NULL `slopes'
+ * restores the analytic distribution */
+SSOL_API res_T
+ssol_mirror_set_slope_distribution
+  (struct ssol_material* mtl,
+   struct ssol_slope_distribution* slopes);
+
 /*******************************************************************************
  * Object API - Opaque abstraction of a geometry with its associated properties.
  ******************************************************************************/
@@ -904,6 +1325,18 @@ ssol_instance_is_receiver
    int* mask, /* Combination of ssol_side_flag */
    int* per_primitive);
 
+/* Define the flux map of the receiver. Hits outside the mapped domain are not
+ * binned. A NULL map or a map with a null definition disables it */
+SSOL_API res_T
+ssol_instance_set_receiver_flux_map
+  (struct ssol_instance* instance,
+   const struct ssol_flux_map* map);
+
+SSOL_API res_T
+ssol_instance_get_receiver_flux_map
+  (const struct ssol_instance* instance,
+   struct ssol_flux_map* map);
+
 /* Define whether or not the instance is sampled or not. By default an instance
  * is sampled. */
 SSOL_API res_T
@@ -911,6 +1344,31 @@ ssol_instance_sample
   (struct ssol_instance* instance,
    const int sample);
 
+/* Define whether or not the solver records the hits onto the receiver. By
+ * default the hits are not recorded */
+SSOL_API res_T
+ssol_instance_record_hits
+  (struct ssol_instance* instance,
+   const int record);
+
+/* Define whether or not the receiver sides of the instance are perfect
+ * absorbers: a hit onto them absorbs the whole incoming flux and ends the
+ * radiative path, without evaluating the material of the instance. By default
+ * the receivers are not perfect absorbers */
+SSOL_API res_T
+ssol_instance_absorb_all
+  (struct ssol_instance* instance,
+   const int absorb_all);
+
+/* Define the relative number of realisations devoted to the instance by the
+ * SSOL_STRATIFICATION_QUOTA stratification. The quota must be strictly
+ * positive. Default is 1, i.e. the sampled instances get the same number of
+ * realisations */
+SSOL_API res_T
+ssol_instance_set_sampling_quota
+  (struct ssol_instance* instance,
+   const double quota);
+
 /* Retrieve the id of the shape */
 SSOL_API res_T
 ssol_instance_get_id
@@ -976,6 +1434,38 @@ SSOL_API res_T
 ssol_param_buffer_clear
   (struct ssol_param_buffer* buf);
 
+/*******************************************************************************
+ * Slope distribution API - Tabulated 2D distribution of the slopes of the
+ * microfacets of a surface, i.e. the derivatives of its height along its 2
+ * tangent directions.
+ ******************************************************************************/
+SSOL_API res_T
+ssol_slope_distribution_create
+  (struct ssol_device* dev,
+   struct ssol_slope_distribution** slopes);
+
+SSOL_API res_T
+ssol_slope_distribution_ref_get
+  (struct ssol_slope_distribution* slopes);
+
+SSOL_API res_T
+ssol_slope_distribution_ref_put
+  (struct ssol_slope_distribution* slopes);
+
+/* The slopes lie in [-max_slope[0], max_slope[0]]x[-max_slope[1],max_slope[1]]
+ * that is regularly partitioned in definition[0] x definition[1] bins. The
+ * `get' functor returns the density of the (ix, iy) bin. The densities need
+ * not be normalised but must be positive and their sum must not be null. They
+ * are preprocessed once in an alias table that is sampled in constant time.
+ * On error, the slopes are left unchanged */
+SSOL_API res_T
+ssol_slope_distribution_setup
+  (struct ssol_slope_distribution* slopes,
+   void (*get)(const size_t ix, const size_t iy, double* density, void* ctx),
+   const size_t definition[2],
+   const double max_slope[2],
+   void* ctx);
+
 /*******************************************************************************
  * Spectrum API - Collection of wavelengths with their associated data.
  ******************************************************************************/
@@ -1102,7 +1592,9 @@ ssol_atmosphere_set_extinction
    struct ssol_data* extinction);
 
 /*******************************************************************************
- * Estimator API - Describe the state of a simulation.
+ * Estimator API - Describe the state of a simulation. An estimator is not
+ * modified by its queries: the estimations of an estimator can be retrieved
+ * concurrently from several threads.
  ******************************************************************************/
 SSOL_API res_T
 ssol_estimator_ref_get
@@ -1114,12 +1606,12 @@ ssol_estimator_ref_put
 
 SSOL_API res_T
 ssol_estimator_get_mc_global
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    struct ssol_mc_global* mc_global);
 
 SSOL_API res_T
 ssol_estimator_get_mc_sampled_x_receiver
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    const struct ssol_instance* prim_instance,
    const struct ssol_instance* recv_instance,
    const enum ssol_side_flag side,
@@ -1148,16 +1640,130 @@ ssol_estimator_get_sampled_count
 
 SSOL_API res_T
 ssol_estimator_get_mc_sampled
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    const struct ssol_instance* samp_instance,
    struct ssol_mc_sampled* sampled);
 
+/* Retrieve the blocking of the flux starting from `samp_instance' due to
+ * `blocker_instance'. The results are null if no radiative path starting from
+ * the sampled instance hits the blocker */
+SSOL_API res_T
+ssol_estimator_get_mc_sampled_x_blocker
+  (const struct ssol_estimator* estimator,
+   const struct ssol_instance* samp_instance,
+   const struct ssol_instance* blocker_instance,
+   struct ssol_mc_blocker* blocker);
+
 /* Retrieve the RNG state at the end of the simulation */
 SSOL_API res_T
 ssol_estimator_get_rng_state
   (const struct ssol_estimator* estimator,
    const struct ssp_rng** rng_state);
 
+/* Add to `dst' the MC estimations of `src', i.e. its global, per receiver,
+ * per sampled instance and per primitive weights, its realisation and failure
+ * counts and its tracked paths. Both estimators must be computed on the same
+ * scene. Once merged, `dst' reports the results of a single simulation whose
+ * number of realisations is the sum of the realisations of the 2 estimators.
+ * The realisation identifiers of the `src' hits are offset by the number of
+ * realisations attempted by `dst', failed ones included. Note that the RNG
+ * state of `dst' is not updated. On error, `dst' may be partially merged. */
+SSOL_API res_T
+ssol_estimator_merge
+  (struct ssol_estimator* dst,
+   const struct ssol_estimator* src);
+
+/* Serialize the MC weights of the estimator, i.e. its global, per receiver,
+ * per sampled instance and per primitive weights, its realisation and failure
+ * counts, its RNG state and its recorded hits. Instances are referenced by
+ * their identifier (see ssol_instance_get_id) and shapes by their rank in the
+ * instantiated object. The tracked paths are not serialized. The data are
+ * written in binary following the native endianness and every record is
+ * aligned on 8 bytes. They form a sequential stream to be read back by
+ * ssol_estimator_read and are not laid out to be accessed in place, e.g. once
+ * mapped in memory: the receivers and the sampled instances are written in an
+ * unspecified order and their records have a variable size, as have the RNG
+ * state and the list of hits. */
+SSOL_API res_T
+ssol_estimator_write
+  (const struct ssol_estimator* estimator,
+   FILE* stream);
+
+/* Create an estimator from the data serialized by ssol_estimator_write. `scn'
+ * is the scene on which the serialized estimator was computed: it must
+ * register the serialized receiver and sampled instances. Note that the
+ * instance identifiers are assigned by the device, from the same pool as the
+ * shapes, in their creation order. A scene built by another process, e.g. on
+ * restart, is thus given the serialized identifiers only if its device creates
+ * the same shapes and instances in the same order. */
+SSOL_API res_T
+ssol_estimator_read
+  (struct ssol_scene* scn,
+   FILE* stream,
+   struct ssol_estimator** estimator);
+
+/* Send the serialized estimator through `channel' */
+SSOL_API res_T
+ssol_estimator_send
+  (const struct ssol_estimator* estimator,
+   const struct ssol_channel* channel);
+
+/* Create an estimator from the data sent by ssol_estimator_send */
+SSOL_API res_T
+ssol_estimator_receive
+  (struct ssol_scene* scn,
+   const struct ssol_channel* channel,
+   struct ssol_estimator** estimator);
+
+/*******************************************************************************
+ * Recorded hits. They are appended on merge and serialized with the
+ * estimator.
+ ******************************************************************************/
+/* Retrieve the list of hits recorded onto the receivers. The hits of a
+ * realisation are contiguous */
+SSOL_API res_T
+ssol_estimator_get_hits
+  (const struct ssol_estimator* estimator,
+   const struct ssol_hit** hits,
+   size_t* count);
+
+/* Write the recorded hits as a raw list of ssol_hit */
+SSOL_API res_T
+ssol_estimator_write_hits
+  (const struct ssol_estimator* estimator,
+   FILE* stream);
+
+/* Reconstruct from the recorded hits the flux map of a receiver side and
+ * write it into `image', as done by ssol_mc_receiver_get_flux_map. The domain
+ * of `map' must be SSOL_FLUX_MAP_LOCAL_XY and `channel' is either
+ * SSOL_MC_INCOMING_FLUX or SSOL_MC_ABSORBED_FLUX */
+SSOL_API res_T
+ssol_estimator_build_flux_map
+  (const struct ssol_estimator* estimator,
+   const struct ssol_instance* instance,
+   const enum ssol_side_flag side,
+   const enum ssol_mc_channel channel,
+   const struct ssol_flux_map* map,
+   const struct ssol_kernel* kernel,
+   struct ssol_image* image);
+
+/*******************************************************************************
+ * Tallies. Their data are merged on merge and serialized with the estimator
+ * through the write and read callbacks of the tallies.
+ ******************************************************************************/
+SSOL_API res_T
+ssol_estimator_get_tallies_count
+  (const struct ssol_estimator* estimator,
+   size_t* count);
+
+/* Retrieve the merged data of the tally `id' as registered by
+ * ssol_scene_add_tally */
+SSOL_API res_T
+ssol_estimator_get_tally
+  (const struct ssol_estimator* estimator,
+   const size_t id,
+   const void** data);
+
 /*******************************************************************************
  * Tracked paths
  ******************************************************************************/
@@ -1193,23 +1799,67 @@ ssol_path_get_type
  ******************************************************************************/
 SSOL_API res_T
 ssol_estimator_get_mc_receiver
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    const struct ssol_instance* instance,
    const enum ssol_side_flag side,
    struct ssol_mc_receiver* rcv);
 
 SSOL_API res_T
 ssol_mc_receiver_get_mc_shape
-  (struct ssol_mc_receiver* rcv,
+  (const struct ssol_mc_receiver* rcv,
    const struct ssol_shape* shape,
    struct ssol_mc_shape* mc);
 
 SSOL_API res_T
 ssol_mc_shape_get_mc_primitive
-  (struct ssol_mc_shape* shape,
+  (const struct ssol_mc_shape* shape,
    const unsigned i, /* In [0, ssol_shape_get_triangles_count[ */
    struct ssol_mc_primitive* prim);
 
+/* Retrieve in one pass the per primitive estimations of the shape */
+SSOL_API res_T
+ssol_mc_shape_get_mc_primitives
+  (const struct ssol_mc_shape* shape,
+   struct ssol_mc_primitives* prims);
+
+/* Retrieve in one pass the per primitive estimations of all the shapes of the
+ * receiver. The primitives of a shape follow the ones of the previous shapes,
+ * in the order in which the shapes were added to the instantiated object */
+SSOL_API res_T
+ssol_mc_receiver_get_mc_primitives
+  (const struct ssol_mc_receiver* rcv,
+   struct ssol_mc_primitives* prims);
+
+/* Compute the per primitive estimations of the receiver shapes onto which
+ * ssol_mc_shape_get_mc_primitives_view gives a view. They are not computed by
+ * default since they store 2 values per primitive and per MC channel. Once
+ * built, they are updated each time another estimator is merged into this
+ * one. */
+SSOL_API res_T
+ssol_estimator_build_mc_primitives_views
+  (struct ssol_estimator* estimator);
+
+/* Retrieve a view onto the per primitive estimations of the shape. The arrays
+ * are computed by ssol_estimator_build_mc_primitives_views and are valid until
+ * the estimator is released or merged with another estimator. The function can
+ * thus be invoked concurrently. Return RES_BAD_OP if the views of the
+ * estimator are not built */
+SSOL_API res_T
+ssol_mc_shape_get_mc_primitives_view
+  (const struct ssol_mc_shape* shape,
+   struct ssol_mc_primitives_view* view);
+
+/* Write the flux map of the receiver into `image' that is setup to the map
+ * definition with the SSOL_PIXEL_DOUBLE3 format. Each pixel stores the
+ * expectation, the variance and the standard error of the flux density of the
+ * bin, in W per unit area of the mapped domain. `channel' is either
+ * SSOL_MC_INCOMING_FLUX or SSOL_MC_ABSORBED_FLUX */
+SSOL_API res_T
+ssol_mc_receiver_get_flux_map
+  (const struct ssol_mc_receiver* rcv,
+   const enum ssol_mc_channel channel,
+   struct ssol_image* image);
+
 /*******************************************************************************
  * Miscellaneous functions
  ******************************************************************************/
@@ -1222,6 +1872,58 @@ ssol_solve
    const struct ssol_path_tracker* tracker, /* NULL<=>Do not record the paths */
    struct ssol_estimator** estimator);
 
+/* Run the share of a simulation devoted to the worker `iworker' out of
+ * `nworkers', i.e. realisations_count/nworkers realisations, the remainder
+ * being distributed over the first workers. All the workers must submit the
+ * same scene, the same RNG state and the same number of realisations: each
+ * one then uses its own independent random sequences. These sequences do not
+ * depend on the number of threads of the workers that can thus run on devices
+ * with different numbers of threads. Once merged with
+ * ssol_estimator_merge, the estimators of the workers give the results of a
+ * single simulation of realisations_count realisations. Note that
+ * `max_failed_count' is defined per worker. */
+SSOL_API res_T
+ssol_solve_partition
+  (struct ssol_scene* scn,
+   const struct ssp_rng* rng,
+   const size_t realisations_count, /* Overall number of realisations */
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* tracker, /* NULL<=>Do not record the paths */
+   const size_t nworkers,
+   const size_t iworker, /* In [0, nworkers[ */
+   struct ssol_estimator** estimator);
+
+/* Run a simulation that periodically writes its progress into the
+ * checkpoint file, i.e. its partial estimator with its recorded hits and its
+ * tally data, its RNG states and its progress counters. The file is replaced
+ * atomically so that it always stores a consistent snapshot. The realisations
+ * of the simulation are the same whether or not it is restarted from one of
+ * its snapshots, whatever the number of threads. The tallies of the scene must
+ * thus define their write and read callbacks. Note that the paths tracked
+ * before a snapshot are not restored on restart. Also note that the snapshots
+ * are written between 2 batches: no realisation is run while a snapshot is
+ * written, which is worth considering when defining the periods of the
+ * checkpoint of large estimators, e.g. with many recorded hits. */
+SSOL_API res_T
+ssol_solve_checkpointed
+  (struct ssol_scene* scn,
+   const struct ssp_rng* rng,
+   const size_t realisations_count,
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* tracker, /* NULL<=>Do not record the paths */
+   const struct ssol_checkpoint* checkpoint,
+   struct ssol_estimator** estimator);
+
+/* Continue the simulation saved in the checkpoint file. `scn' must be the
+ * scene of the interrupted simulation. */
+SSOL_API res_T
+ssol_solve_restart
+  (struct ssol_scene* scn,
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* tracker, /* NULL<=>Do not record the paths */
+   const struct ssol_checkpoint* checkpoint,
+   struct ssol_estimator** estimator);
+
 SSOL_API res_T
 ssol_draw_draft
   (struct ssol_scene* scn,
@@ -0,0 +1,472 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#define _POSIX_C_SOURCE 200112L /* fileno and fsync support */
+
+#include "ssol.h"
+#include "ssol_c.h"
+#include "ssol_device_c.h"
+#include "ssol_estimator_c.h"
+#include "ssol_scene_c.h"
+#include "ssol_solver_c.h"
+
+#include <rsys/clock_time.h>
+#include <rsys/str.h>
+
+#include <star/ssp.h>
+
+#include <string.h>
+
+#ifdef OS_UNIX
+  #include <unistd.h>
+#elif defined(OS_WINDOWS)
+  #define WIN32_LEAN_AND_MEAN
+  #include <io.h>
+  #include <windows.h>
+#endif
+
+/* Layout of a snapshot: "SSCK" magic, uint32 version, uint64 overall number
+ * of realisations, uint64 number of realisations already done, uint64 number
+ * of realisations per batch, uint32 type of the initial RNG, the initial RNG
+ * state, followed by the serialized partial estimator whose RNG state is the
+ * one of the next batch */
+#define CHECKPOINT_VERSION 2
+static const char CHECKPOINT_MAGIC[4] = { 'S', 'S', 'C', 'K' };
+
+/* Default number of batches */
+#define CHECKPOINT_DEFAULT_NBATCHES 100
+
+struct progress {
+  uint64_t realisations_count; /* Overall number of realisations */
+  uint64_t realisations_done; /* Number of realisations already done */
+  uint64_t batch_size; /* Number of realisations per batch */
+};
+
+/*******************************************************************************
+ * Helper functions
+ ******************************************************************************/
+static int
+check_checkpoint(const struct ssol_checkpoint* checkpoint)
+{
+  return checkpoint
+      && checkpoint->filename
+      && (checkpoint->realisations_period || checkpoint->time_period > 0);
+}
+
+/* The tally data are saved in the snapshots: the tallies must be
+ * serializable */
+static res_T
+check_tallies(struct ssol_scene* scn, const char* func_name)
+{
+  size_t i;
+  ASSERT(scn && func_name);
+  FOR_EACH(i, 0, darray_tally_size_get(&scn->tallies)) {
+    const struct ssol_tally* tally = darray_tally_cdata_get(&scn->tallies) + i;
+    if(!tally->write || !tally->read) {
+      log_error(scn->dev,
+        "%s: the tally %lu cannot be saved in a checkpoint file: it has no "
+        "write or read callback.\n", func_name, (unsigned long)i);
+      return RES_BAD_ARG;
+    }
+  }
+  return RES_OK;
+}
+
+/* Commit the data written into `fp' to the storage device. Return 0 on
+ * success */
+static int
+file_sync(FILE* fp)
+{
+  ASSERT(fp);
+  if(fflush(fp)) return -1;
+#ifdef OS_UNIX
+  return fsync(fileno(fp));
+#elif defined(OS_WINDOWS)
+  return _commit(_fileno(fp));
+#else
+  return 0;
+#endif
+}
+
+/* Atomically replace the file `dst' by the file `src'. Return 0 on success */
+static int
+file_replace(const char* src, const char* dst)
+{
+  ASSERT(src && dst);
+#ifdef OS_WINDOWS
+  /* rename does not overwrite files on Windows */
+  return MoveFileExA(src, dst, MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH)
+    ? 0 : -1;
+#else
+  return rename(src, dst);
+#endif
+}
+
+static res_T
+checkpoint_write
+  (struct ssol_device* dev,
+   const struct ssol_checkpoint* checkpoint,
+   const struct progress* progress,
+   const struct ssp_rng* rng_state,
+   struct ssol_estimator* estimator)
+{
+  struct str tmp;
+  FILE* fp = NULL;
+  enum ssp_rng_type rng_type;
+  uint32_t u32;
+  uint64_t counters[3];
+  res_T res = RES_OK;
+  ASSERT(dev && check_checkpoint(checkpoint) && progress && rng_state);
+  ASSERT(estimator);
+
+  /* Write the snapshot in a temporary file that then replaces the previous
+   * snapshot once committed to the storage device. The checkpoint file is
+   * thus always consistent, even if the process is interrupted during the
+   * write */
+  str_init(dev->allocator, &tmp);
+  res = str_set(&tmp, checkpoint->filename);
+  if(res != RES_OK) goto error;
+  res = str_append(&tmp, ".tmp");
+  if(res != RES_OK) goto error;
+
+  fp = fopen(str_cget(&tmp), "wb");
+  if(!fp) {
+    log_error(dev, "Could not open the checkpoint file `%s'.\n",
+      str_cget(&tmp));
+    res = RES_IO_ERR;
+    goto error;
+  }
+
+  u32 = CHECKPOINT_VERSION;
+  counters[0] = progress->realisations_count;
+  counters[1] = progress->realisations_done;
+  counters[2] = progress->batch_size;
+  if(fwrite(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC), 1, fp) != 1
+  || fwrite(&u32, sizeof(u32), 1, fp) != 1
+  || fwrite(counters, sizeof(counters), 1, fp) != 1) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+  SSP(rng_get_type(rng_state, &rng_type));
+  u32 = (uint32_t)rng_type;
+  if(fwrite(&u32, sizeof(u32), 1, fp) != 1) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+  res = ssp_rng_write(rng_state, fp);
+  if(res != RES_OK) goto error;
+  res = ssol_estimator_write(estimator, fp);
+  if(res != RES_OK) goto error;
+
+  if(file_sync(fp)) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+  if(fclose(fp)) {
+    fp = NULL;
+    res = RES_IO_ERR;
+    goto error;
+  }
+  fp = NULL;
+
+  if(file_replace(str_cget(&tmp), checkpoint->filename)) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+
+exit:
+  if(fp) fclose(fp);
+  str_release(&tmp);
+  return res;
+error:
+  log_error(dev, "Could not write the checkpoint file `%s'.\n",
+    checkpoint->filename);
+  goto exit;
+}
+
+static res_T
+checkpoint_read
+  (struct ssol_scene* scn,
+   const struct ssol_checkpoint* checkpoint,
+   struct progress* progress,
+   struct ssp_rng** out_rng_state,
+   struct ssol_estimator** out_estimator)
+{
+  struct ssol_estimator* estimator = NULL;
+  struct ssp_rng* rng_state = NULL;
+  FILE* fp = NULL;
+  char magic[4];
+  uint32_t version;
+  uint32_t rng_type;
+  uint64_t counters[3];
+  res_T res = RES_OK;
+  ASSERT(scn && check_checkpoint(checkpoint) && progress);
+  ASSERT(out_rng_state && out_estimator);
+
+  fp = fopen(checkpoint->filename, "rb");
+  if(!fp) {
+    log_error(scn->dev, "Could not open the checkpoint file `%s'.\n",
+      checkpoint->filename);
+    res = RES_IO_ERR;
+    goto error;
+  }
+
+  if(fread(magic, sizeof(magic), 1, fp) != 1
+  || fread(&version, sizeof(version), 1, fp) != 1
+  || fread(counters, sizeof(counters), 1, fp) != 1
+  || fread(&rng_type, sizeof(rng_type), 1, fp) != 1) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+  if(memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic))
+  || version != CHECKPOINT_VERSION
+  || !counters[2]
+  || counters[1] > counters[0]
+  || counters[0] > SIZE_MAX) {
+    log_error(scn->dev, "Invalid checkpoint file `%s'.\n",
+      checkpoint->filename);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  progress->realisations_count = counters[0];
+  progress->realisations_done = counters[1];
+  progress->batch_size = counters[2];
+
+  res = ssp_rng_create
+    (scn->dev->allocator, (enum ssp_rng_type)rng_type, &rng_state);
+  if(res != RES_OK) goto error;
+  res = ssp_rng_read(rng_state, fp);
+  if(res != RES_OK) goto error;
+
+  res = ssol_estimator_read(scn, fp, &estimator);
+  if(res != RES_OK) goto error;
+  if(!estimator->rng) {
+    log_error(scn->dev, "Missing RNG state in the checkpoint file `%s'.\n",
+      checkpoint->filename);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+exit:
+  if(fp) fclose(fp);
+  *out_rng_state = rng_state;
+  *out_estimator = estimator;
+  return res;
+error:
+  if(rng_state) {
+    SSP(rng_ref_put(rng_state));
+    rng_state = NULL;
+  }
+  if(estimator) {
+    SSOL(estimator_ref_put(estimator));
+    estimator = NULL;
+  }
+  goto exit;
+}
+
+/* Run the remaining batches of the simulation. The simulation is set up once
+ * from its initial RNG state `rng_state', i.e. its pilot realisations and its
+ * stratification are the same whether or not it is restarted. Each batch is a
+ * range of the realisations of this simulation whose random sequences start
+ * from the RNG state of the previous batch. `acc' is the estimator of the
+ * realisations already done; NULL if the simulation starts */
+static res_T
+solve_batches
+  (struct ssol_scene* scn,
+   const struct ssp_rng* rng_state,
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* tracker,
+   const struct ssol_checkpoint* checkpoint,
+   struct progress* progress,
+   struct ssol_estimator* acc,
+   struct ssol_estimator** out_estimator)
+{
+  struct solver* solver = NULL;
+  struct ssol_estimator* batch = NULL;
+  struct time t0, t1;
+  uint64_t last_snapshot;
+  res_T res = RES_OK;
+  ASSERT(scn && rng_state && check_checkpoint(checkpoint) && progress);
+  ASSERT(out_estimator);
+
+  if(acc) SSOL(estimator_ref_get(acc));
+
+  res = solver_create(scn, rng_state, (size_t)progress->realisations_count,
+    tracker, 1, 0, &solver);
+  if(res != RES_OK) goto error;
+  if(acc) {
+    res = solver_reseed(solver, acc->rng);
+    if(res != RES_OK) goto error;
+  }
+
+  last_snapshot = progress->realisations_done;
+  time_current(&t0);
+  while(progress->realisations_done < progress->realisations_count) {
+    const size_t begin = (size_t)progress->realisations_done;
+    const size_t n = (size_t)MMIN(progress->batch_size,
+      progress->realisations_count - progress->realisations_done);
+    const size_t nfailures = acc ? acc->failed_count : 0;
+    struct ssp_rng* rng;
+    size_t ihit;
+
+    if(nfailures > max_failed_count) {
+      log_error(scn->dev, "Too many unexpected radiative paths.\n");
+      res = RES_BAD_OP;
+      goto error;
+    }
+
+    res = solver_run(solver, begin, begin + n, max_failed_count - nfailures);
+    if(res != RES_OK) goto error;
+    res = solver_gather(solver, &batch);
+    if(res != RES_OK) goto error;
+
+    if(!acc) {
+      acc = batch;
+    } else {
+      /* The realisations of the batch are already identified by their index
+       * in the simulation: cancel the offset that the merge applies to the
+       * identifiers of their hits */
+      FOR_EACH(ihit, 0, darray_hit_size_get(&batch->hits)) {
+        darray_hit_data_get(&batch->hits)[ihit].realisation -=
+          (uint64_t)(acc->realisation_count + acc->failed_count);
+      }
+      res = ssol_estimator_merge(acc, batch);
+      if(res != RES_OK) goto error;
+      /* Keep the RNG state of the last batch */
+      rng = acc->rng;
+      acc->rng = batch->rng;
+      batch->rng = rng;
+      SSOL(estimator_ref_put(batch));
+    }
+    batch = NULL;
+    progress->realisations_done += n;
+
+    if(progress->realisations_done < progress->realisations_count) {
+      int snapshot = 0;
+
+      /* Start the next batch from the saved RNG state, as a restart does */
+      res = solver_reseed(solver, acc->rng);
+      if(res != RES_OK) goto error;
+
+      /* Snapshot once either of the periods has elapsed */
+      if(checkpoint->realisations_period) {
+        snapshot = progress->realisations_done - last_snapshot
+          >= (uint64_t)checkpoint->realisations_period;
+      }
+      if(!snapshot && checkpoint->time_period > 0) {
+        time_sub(&t1, time_current(&t1), &t0);
+        snapshot =
+          (double)time_val(&t1, TIME_MSEC) >= checkpoint->time_period * 1000.0;
+      }
+      if(snapshot) {
+        res = checkpoint_write(scn->dev, checkpoint, progress, rng_state, acc);
+        if(res != RES_OK) goto error;
+        last_snapshot = progress->realisations_done;
+        time_current(&t0);
+      }
+    }
+  }
+
+exit:
+  if(solver) solver_ref_put(solver);
+  *out_estimator = acc;
+  return res;
+error:
+  if(batch) SSOL(estimator_ref_put(batch));
+  if(acc) {
+    SSOL(estimator_ref_put(acc));
+    acc = NULL;
+  }
+  goto exit;
+}
+
+/*******************************************************************************
+ * Exported functions
+ ******************************************************************************/
+res_T
+ssol_solve_checkpointed
+  (struct ssol_scene* scn,
+   const struct ssp_rng* rng_state,
+   const size_t realisations_count,
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* tracker,
+   const struct ssol_checkpoint* checkpoint,
+   struct ssol_estimator** out_estimator)
+{
+  struct progress progress;
+  uint64_t batch_size;
+  res_T res = RES_OK;
+
+  if(!scn || !rng_state || !realisations_count || !out_estimator
+  || !check_checkpoint(checkpoint))
+    return RES_BAD_ARG;
+
+  res = check_tallies(scn, FUNC_NAME);
+  if(res != RES_OK) return res;
+
+  /* The batches are the granularity of the snapshots. Use the realisations
+   * period if it is the only period; otherwise use at most the default batch
+   * size so that the time period is regularly checked */
+  batch_size = (uint64_t)MMAX(realisations_count/CHECKPOINT_DEFAULT_NBATCHES,1);
+  if(checkpoint->realisations_period) {
+    batch_size = checkpoint->time_period > 0
+      ? MMIN(batch_size, (uint64_t)checkpoint->realisations_period)
+      : (uint64_t)checkpoint->realisations_period;
+  }
+
+  progress.realisations_count = (uint64_t)realisations_count;
+  progress.realisations_done = 0;
+  progress.batch_size = batch_size;
+
+  return solve_batches(scn, rng_state, max_failed_count, tracker, checkpoint,
+    &progress, NULL, out_estimator);
+}
+
+res_T
+ssol_solve_restart
+  (struct ssol_scene* scn,
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* tracker,
+   const struct ssol_checkpoint* checkpoint,
+   struct ssol_estimator** out_estimator)
+{
+  struct ssol_estimator* acc = NULL;
+  struct ssp_rng* rng_state = NULL;
+  struct progress progress;
+  res_T res = RES_OK;
+
+  if(!scn || !out_estimator || !check_checkpoint(checkpoint)) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  res = check_tallies(scn, FUNC_NAME);
+  if(res != RES_OK) goto error;
+
+  res = checkpoint_read(scn, checkpoint, &progress, &rng_state, &acc);
+  if(res != RES_OK) goto error;
+
+  res = solve_batches(scn, rng_state, max_failed_count, tracker, checkpoint,
+    &progress, acc, out_estimator);
+  if(res != RES_OK) goto error;
+
+exit:
+  if(acc) SSOL(estimator_ref_put(acc));
+  if(rng_state) SSP(rng_ref_put(rng_state));
+  return res;
+error:
+  goto exit;
+}
@@ -16,12 +16,14 @@
 
 #include "ssol.h"
 #include "ssol_device_c.h"
+#include "ssol_slope_distribution_c.h"
 
 #include <rsys/logger.h>
 #include <rsys/mem_allocator.h>
 
 #include <star/s3d.h>
 #include <star/scpr.h>
+#include <star/ssf.h>
 
 #include <omp.h>
 
@@ -43,6 +45,57 @@ log_msg
   }
 }
 
+static void
+shading_pool_release(struct shading_pool* pool)
+{
+  ASSERT(pool);
+  if(pool->lambertian) SSF(bsdf_ref_put(pool->lambertian));
+  if(pool->specular) SSF(bsdf_ref_put(pool->specular));
+  if(pool->microfacet) SSF(bsdf_ref_put(pool->microfacet));
+  if(pool->microfacet2) SSF(bsdf_ref_put(pool->microfacet2));
+  if(pool->dielectric) SSF(bsdf_ref_put(pool->dielectric));
+  if(pool->thin_dielectric) SSF(bsdf_ref_put(pool->thin_dielectric));
+  if(pool->fresnel_constant) SSF(fresnel_ref_put(pool->fresnel_constant));
+  if(pool->beckmann) SSF(microfacet_distribution_ref_put(pool->beckmann));
+  if(pool->pillbox) SSF(microfacet_distribution_ref_put(pool->pillbox));
+  if(pool->slopes) SSF(microfacet_distribution_ref_put(pool->slopes));
+}
+
+static res_T
+shading_pool_setup(struct shading_pool* pool, struct mem_allocator* allocator)
+{
+  res_T res = RES_OK;
+  ASSERT(pool && allocator);
+
+  #define CALL(Func) { res = Func; if(res != RES_OK) goto error; } (void)0
+  CALL(ssf_fresnel_create
+    (allocator, &ssf_fresnel_constant, &pool->fresnel_constant));
+  CALL(ssf_microfacet_distribution_create
+    (allocator, &ssf_beckmann_distribution, &pool->beckmann));
+  CALL(ssf_microfacet_distribution_create
+    (allocator, &ssf_pillbox_distribution, &pool->pillbox));
+  CALL(ssf_microfacet_distribution_create
+    (allocator, &slope_microfacet_distribution, &pool->slopes));
+  CALL(ssf_bsdf_create
+    (allocator, &ssf_lambertian_reflection, &pool->lambertian));
+  CALL(ssf_bsdf_create
+    (allocator, &ssf_specular_reflection, &pool->specular));
+  CALL(ssf_bsdf_create
+    (allocator, &ssf_microfacet_reflection, &pool->microfacet));
+  CALL(ssf_bsdf_create
+    (allocator, &ssf_microfacet2_reflection, &pool->microfacet2));
+  CALL(ssf_bsdf_create(allocator,
+    &ssf_specular_dielectric_dielectric_interface, &pool->dielectric));
+  CALL(ssf_bsdf_create
+    (allocator, &ssf_thin_specular_dielectric, &pool->thin_dielectric));
+  #undef CALL
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
 static void
 device_release(ref_T* ref)
 {
@@ -50,12 +103,12 @@ device_release(ref_T* ref)
   ASSERT(ref);
   dev = CONTAINER_OF(ref, struct ssol_device, ref);
   darray_tile_release(&dev->tiles);
-  if(dev->bsdf_allocators) {
+  if(dev->shading_pools) {
     unsigned i;
     FOR_EACH(i, 0, dev->nthreads) {
-      mem_shutdown_lifo_allocator(&dev->bsdf_allocators[i]);
+      shading_pool_release(&dev->shading_pools[i]);
     }
-    MEM_RM(dev->allocator, dev->bsdf_allocators);
+    MEM_RM(dev->allocator, dev->shading_pools);
   }
   if(dev->s3d) S3D(device_ref_put(dev->s3d));
   if(dev->scpr_mesh) SCPR(mesh_ref_put(dev->scpr_mesh));
@@ -97,19 +150,18 @@ ssol_device_create
   dev->nthreads = MMIN(nthreads_hint, (unsigned)omp_get_num_procs());
   omp_set_num_threads((int)dev->nthreads);
 
-  dev->bsdf_allocators = MEM_CALLOC
-    (dev->allocator, dev->nthreads, sizeof(struct mem_allocator));
-  if(!dev->bsdf_allocators) {
+  dev->shading_pools = MEM_CALLOC
+    (dev->allocator, dev->nthreads, sizeof(struct shading_pool));
+  if(!dev->shading_pools) {
     res = RES_MEM_ERR;
     goto error;
   }
 
   FOR_EACH(i, 0, dev->nthreads) {
-    res = mem_init_lifo_allocator
-      (&dev->bsdf_allocators[i], dev->allocator, 4096);
+    res = shading_pool_setup(&dev->shading_pools[i], dev->allocator);
     if(res != RES_OK) goto error;
   }
-  
+
   res = darray_tile_resize(&dev->tiles, dev->nthreads);
   if(res != RES_OK) goto error;
   res = s3d_device_create(logger, mem_allocator, 0, &dev->s3d);
@@ -36,11 +36,30 @@
 
 struct scpr_mesh;
 struct s3d_device;
+struct ssf_bsdf;
+struct ssf_fresnel;
+struct ssf_microfacet_distribution;
+
+/* Per thread shading objects. They are created once by the device and setup
+ * in place on each surface interaction, i.e. the shading does not allocate
+ * any memory. A thread thus uses at most one BSDF of each type at a time */
+struct shading_pool {
+  struct ssf_fresnel* fresnel_constant;
+  struct ssf_microfacet_distribution* beckmann;
+  struct ssf_microfacet_distribution* pillbox;
+  struct ssf_microfacet_distribution* slopes; /* Tabulated slopes */
+  struct ssf_bsdf* lambertian;
+  struct ssf_bsdf* specular;
+  struct ssf_bsdf* microfacet;
+  struct ssf_bsdf* microfacet2;
+  struct ssf_bsdf* dielectric;
+  struct ssf_bsdf* thin_dielectric;
+};
 
 struct ssol_device {
   struct logger* logger;
   struct mem_allocator* allocator;
-  struct mem_allocator* bsdf_allocators; /* Per thread allocator */
+  struct shading_pool* shading_pools; /* Per thread shading objects */
   unsigned nthreads;
   int verbose;
 
@@ -24,6 +24,7 @@
 #include "ssol_shape_c.h"
 
 #include <rsys/double3.h>
+#include <rsys/dynamic_array_double.h>
 #include <rsys/dynamic_array_float.h>
 #include <rsys/float3.h>
 
@@ -32,68 +33,154 @@
 #include <float.h>
 
 /*******************************************************************************
- * Helper functions
+ * Per thread draw_draft context
  ******************************************************************************/
+/* Declare the dynamic array of surface fragments */
+#define DARRAY_NAME fragment
+#define DARRAY_DATA struct ssol_surface_fragment
+#include <rsys/dynamic_array.h>
+
+/* Declare the dynamic array of material pointers */
+#define DARRAY_NAME material_ptr
+#define DARRAY_DATA const struct ssol_material*
+#include <rsys/dynamic_array.h>
+
+/* The fragments hit by the samples of a pixel are first gathered in order to
+ * shade their normals with the batched getters of the materials */
+struct thread_context {
+  const struct darray_float* samples; /* Pixel samples shared by the threads */
+  struct darray_fragment frags;
+  struct darray_material_ptr mtls; /* Material of each fragment */
+  struct darray_double wavelengths; /* Wavelength of each fragment */
+  struct darray_double normals; /* Shading normal of each fragment */
+};
+
 static void
-Li
+thread_context_release(struct thread_context* ctx)
+{
+  ASSERT(ctx);
+  darray_fragment_release(&ctx->frags);
+  darray_material_ptr_release(&ctx->mtls);
+  darray_double_release(&ctx->wavelengths);
+  darray_double_release(&ctx->normals);
+}
+
+static res_T
+thread_context_init
+  (struct mem_allocator* allocator,
+   struct thread_context* ctx)
+{
+  ASSERT(ctx);
+  ctx->samples = NULL;
+  darray_fragment_init(allocator, &ctx->frags);
+  darray_material_ptr_init(allocator, &ctx->mtls);
+  darray_double_init(allocator, &ctx->wavelengths);
+  darray_double_init(allocator, &ctx->normals);
+  return RES_OK;
+}
+
+static res_T
+thread_context_setup
+  (struct thread_context* ctx,
+   const struct darray_float* samples,
+   const size_t spp)
+{
+  res_T res = RES_OK;
+  ASSERT(ctx && samples && spp);
+
+  ctx->samples = samples;
+  res = darray_fragment_reserve(&ctx->frags, spp);
+  if(res != RES_OK) goto error;
+  res = darray_material_ptr_reserve(&ctx->mtls, spp);
+  if(res != RES_OK) goto error;
+  res = darray_double_reserve(&ctx->wavelengths, spp);
+  if(res != RES_OK) goto error;
+  res = darray_double_reserve(&ctx->normals, spp*3);
+  if(res != RES_OK) goto error;
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+/* Declare the container of the per thread contexts */
+#define DARRAY_NAME thread_context
+#define DARRAY_DATA struct thread_context
+#define DARRAY_FUNCTOR_INIT thread_context_init
+#define DARRAY_FUNCTOR_RELEASE thread_context_release
+#include <rsys/dynamic_array.h>
+
+/*******************************************************************************
+ * Helper functions
+ ******************************************************************************/
+/* Trace the ray and register the surface fragment that it hits, if any */
+static res_T
+trace_sample
   (struct ssol_scene* scn,
    struct s3d_scene_view* view,
+   struct thread_context* ctx,
    const float org[3],
-   const float dir[3],
-   double val[3])
+   const float dir[3])
 {
   const float range[2] = {0, FLT_MAX};
+  const double wavelength = 1; /* TODO wavelength */
   struct ssol_surface_fragment frag;
   struct ray_data ray_data = RAY_DATA_NULL;
   struct s3d_hit hit;
-  ASSERT(scn && view && org && dir && val);
+  struct ssol_instance* inst;
+  const struct ssol_material* mtl;
+  const struct shaded_shape* sshape;
+  size_t isshape;
+  double o[3], wi[3];
+  double N[3]={0};
+  res_T res = RES_OK;
+  ASSERT(scn && view && ctx && org && dir);
 
   ray_data.scn = scn;
   ray_data.discard_virtual_materials = 1;
   S3D(scene_view_trace_ray(view, org, dir, range, &ray_data, &hit));
-  if(S3D_HIT_NONE(&hit)) {
-    d3_splat(val, 0);
-  } else {
-    struct ssol_instance* inst;
-    struct ssol_material* mtl;
-    const struct shaded_shape* sshape;
-    size_t isshape;
-    double o[3], wi[3];
-    double N[3]={0};
-    double cos_N_wi;
-
-    /* Retrieve the hit shaded shape */
-    inst = *htable_instance_find(&scn->instances_rt, &hit.prim.inst_id);
-    isshape = *htable_shaded_shape_find
-      (&inst->object->shaded_shapes_rt, &hit.prim.geom_id);
-    sshape = darray_shaded_shape_cdata_get
-      (&inst->object->shaded_shapes) + isshape;
-
-    /* Retrieve and normalized the hit normal */
-    switch(sshape->shape->type) {
-      case SHAPE_MESH: d3_normalize(N, d3_set_f3(N, hit.normal)); break;
-      case SHAPE_PUNCHED: d3_normalize(N, ray_data.N); break;
-        break;
-      default: FATAL("Unreachable code"); break;
-    }
-
-    d3_set_f3(o, org);
-    d3_set_f3(wi, dir);
-    d3_normalize(wi, wi);
-    if(d3_dot(N, wi) < 0) {
-      mtl = sshape->mtl_front;
-    } else {
-      mtl = sshape->mtl_back;
-      d3_minus(N, N);
-    }
-
-    surface_fragment_setup(&frag, o, wi, N, &hit.prim, hit.uv);
-    material_shade_normal(mtl, &frag, 1/*TODO wavelength*/, N);
+  if(S3D_HIT_NONE(&hit)) goto exit;
 
-    ASSERT(d3_is_normalized(N));
-    cos_N_wi = d3_dot(N, d3_minus(wi, wi));
-    d3_splat(val, MMAX(cos_N_wi, 0));
+  /* Retrieve the hit shaded shape */
+  inst = *htable_instance_find(&scn->instances_rt, &hit.prim.inst_id);
+  isshape = *htable_shaded_shape_find
+    (&inst->object->shaded_shapes_rt, &hit.prim.geom_id);
+  sshape = darray_shaded_shape_cdata_get
+    (&inst->object->shaded_shapes) + isshape;
+
+  /* Retrieve and normalized the hit normal */
+  switch(sshape->shape->type) {
+    case SHAPE_MESH: d3_normalize(N, d3_set_f3(N, hit.normal)); break;
+    case SHAPE_PUNCHED: d3_normalize(N, ray_data.N); break;
+      break;
+    default: FATAL("Unreachable code"); break;
   }
+
+  d3_set_f3(o, org);
+  d3_set_f3(wi, dir);
+  d3_normalize(wi, wi);
+  if(d3_dot(N, wi) < 0) {
+    mtl = sshape->mtl_front;
+  } else {
+    mtl = sshape->mtl_back;
+    d3_minus(N, N);
+  }
+
+  material_setup_fragment
+    (mtl, &frag, o, wi, N, inst, sshape->shape, &hit.prim, hit.uv);
+
+  res = darray_fragment_push_back(&ctx->frags, &frag);
+  if(res != RES_OK) goto error;
+  res = darray_material_ptr_push_back(&ctx->mtls, &mtl);
+  if(res != RES_OK) goto error;
+  res = darray_double_push_back(&ctx->wavelengths, &wavelength);
+  if(res != RES_OK) goto error;
+
+exit:
+  return res;
+error:
+  goto exit;
 }
 
 static void
@@ -108,17 +195,27 @@ draw_pixel
    double pixel[3],
    void* data)
 {
-  struct darray_float* samples = data;
+  struct darray_thread_context* thread_ctxs = data;
+  struct thread_context* ctx;
+  const struct ssol_surface_fragment* frags;
+  const struct ssol_material* const* mtls;
+  const double* wavelengths;
+  double* normals;
   float samp[2];
   float ray_org[3], ray_dir[3];
-  double sum[3] = {0, 0, 0};
-  size_t i;
+  double sum = 0;
+  size_t i, j, nhits;
+  res_T res = RES_OK;
   ASSERT(scn && cam && view && pix_coords && pix_sz && nsamples && pixel && data);
-  (void)ithread;
+  ASSERT((size_t)ithread < darray_thread_context_size_get(thread_ctxs));
+
+  ctx = darray_thread_context_data_get(thread_ctxs) + ithread;
+  darray_fragment_clear(&ctx->frags);
+  darray_material_ptr_clear(&ctx->mtls);
+  darray_double_clear(&ctx->wavelengths);
 
   FOR_EACH(i, 0, nsamples) {
-    double weight[3];
-    const float* r = darray_float_cdata_get(samples) + i*2;
+    const float* r = darray_float_cdata_get(ctx->samples) + i*2;
 
     /* Generate a sample into the pixel */
     samp[0] = ((float)pix_coords[0] + r[0]) * pix_sz[0];
@@ -128,13 +225,40 @@ draw_pixel
      * pixel sample */
     camera_ray(cam, samp, ray_org, ray_dir);
 
-    /* Compute the radiance arriving through the sampled camera ray */
-    Li(scn, view, ray_org, ray_dir, weight);
-    d3_add(sum, sum, weight);
+    res = trace_sample(scn, view, ctx, ray_org, ray_dir);
+    if(res != RES_OK) goto error;
   }
-  d3_divd(pixel, sum, (double)nsamples);
-}
 
+  nhits = darray_fragment_size_get(&ctx->frags);
+  res = darray_double_resize(&ctx->normals, nhits*3);
+  if(res != RES_OK) goto error;
+
+  frags = darray_fragment_cdata_get(&ctx->frags);
+  mtls = darray_material_ptr_cdata_get(&ctx->mtls);
+  wavelengths = darray_double_cdata_get(&ctx->wavelengths);
+  normals = darray_double_data_get(&ctx->normals);
+
+  /* Shade the normals of the runs of fragments sharing the same material */
+  for(i = 0; i < nhits; i = j) {
+    for(j = i + 1; j < nhits && mtls[j] == mtls[i]; ++j);
+    material_shade_normals
+      (mtls[i], j-i, frags+i, wavelengths+i, normals + i*3);
+  }
+
+  FOR_EACH(i, 0, nhits) {
+    const double* N = normals + i*3;
+    ASSERT(d3_is_normalized(N));
+    sum += MMAX(-d3_dot(N, frags[i].dir), 0);
+  }
+  d3_splat(pixel, sum / (double)nsamples);
+
+exit:
+  return;
+error:
+  log_error(scn->dev, "Draft rendering error.\n");
+  d3(pixel, 1, 1, 0);
+  goto exit;
+}
 
 /*******************************************************************************
  * Exported function
@@ -149,6 +273,7 @@ ssol_draw_draft
    ssol_write_pixels_T writer,
    void* data)
 {
+  struct darray_thread_context thread_ctxs;
   struct darray_float samples;
   struct ssp_rng* rng = NULL;
   size_t i;
@@ -157,6 +282,7 @@ ssol_draw_draft
   if(!scn || !spp) return RES_BAD_ARG;
 
   darray_float_init(scn->dev->allocator, &samples);
+  darray_thread_context_init(scn->dev->allocator, &thread_ctxs);
 
   res = scene_check(scn, FUNC_NAME);
   if(res != RES_OK) goto error;
@@ -175,14 +301,24 @@ ssol_draw_draft
     darray_float_push_back(&samples, &y);
   }
 
-  res = draw(scn, cam, width, height, spp, writer, data, draw_pixel, &samples);
+  /* Create the thread contexts */
+  res = darray_thread_context_resize(&thread_ctxs, scn->dev->nthreads);
+  if(res != RES_OK) goto error;
+  FOR_EACH(i, 0, scn->dev->nthreads) {
+    res = thread_context_setup
+      (darray_thread_context_data_get(&thread_ctxs)+i, &samples, spp);
+    if(res != RES_OK) goto error;
+  }
+
+  res = draw
+    (scn, cam, width, height, spp, writer, data, draw_pixel, &thread_ctxs);
   if(res != RES_OK) goto error;
 
 exit:
+  darray_thread_context_release(&thread_ctxs);
   darray_float_release(&samples);
   if(rng) SSP(rng_ref_put(rng));
   return res;
 error:
   goto exit;
 }
-
@@ -217,7 +217,8 @@ Li(struct ssol_scene* scn,
       d3_minus(N, N);
     }
 
-    surface_fragment_setup(&frag, o, wo, N, &hit.prim, hit.uv);
+    material_setup_fragment
+      (mtl, &frag, o, wo, N, inst, sshape->shape, &hit.prim, hit.uv);
     material_shade_normal(mtl, &frag, wl, N);
 
     /* Shaded normal may look backward the outgoing direction */
@@ -14,12 +14,15 @@
  * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>. */
 
+#define _POSIX_C_SOURCE 200809L /* open_memstream and fmemopen support */
+
 #include "ssol.h"
 #include "ssol_c.h"
 #include "ssol_scene_c.h"
 #include "ssol_estimator_c.h"
 #include "ssol_device_c.h"
 #include "ssol_instance_c.h"
+#include "ssol_object_c.h"
 
 #include <rsys/double3.h>
 #include <rsys/mem_allocator.h>
@@ -29,6 +32,8 @@
 #include <star/ssp.h>
 
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
 /*******************************************************************************
  * Helper functions
@@ -73,6 +78,655 @@ error:
   goto exit;
 }
 
+/* Check that the submitted estimators were computed on the same scene, i.e.
+ * that they register the same set of receiver and sampled instances */
+static int
+check_estimators_compatibility
+  (const struct ssol_estimator* a,
+   const struct ssol_estimator* b)
+{
+  struct htable_receiver_iterator r_it, r_end;
+  struct htable_sampled_iterator s_it, s_end;
+  ASSERT(a && b);
+
+  if(a->sampled_area != b->sampled_area) return 0;
+  if(htable_receiver_size_get(&a->mc_receivers)
+  != htable_receiver_size_get(&b->mc_receivers))
+    return 0;
+  if(htable_sampled_size_get(&a->mc_sampled)
+  != htable_sampled_size_get(&b->mc_sampled))
+    return 0;
+
+  /* The iterations and lookups do not modify the hash tables */
+  htable_receiver_begin((struct htable_receiver*)&a->mc_receivers, &r_it);
+  htable_receiver_end((struct htable_receiver*)&a->mc_receivers, &r_end);
+  while(!htable_receiver_iterator_eq(&r_it, &r_end)) {
+    const struct ssol_instance* inst = *htable_receiver_iterator_key_get(&r_it);
+    htable_receiver_iterator_next(&r_it);
+    if(!htable_receiver_find((struct htable_receiver*)&b->mc_receivers, &inst))
+      return 0;
+  }
+
+  htable_sampled_begin((struct htable_sampled*)&a->mc_sampled, &s_it);
+  htable_sampled_end((struct htable_sampled*)&a->mc_sampled, &s_end);
+  while(!htable_sampled_iterator_eq(&s_it, &s_end)) {
+    const struct ssol_instance* inst = *htable_sampled_iterator_key_get(&s_it);
+    htable_sampled_iterator_next(&s_it);
+    if(!htable_sampled_find((struct htable_sampled*)&b->mc_sampled, &inst))
+      return 0;
+  }
+  return 1;
+}
+
+/* Setup the MC result of a per sampled instance quantity. Once stratified,
+ * only the `nsamples' realisations of the instance stratum contribute to the
+ * quantity, each one with a weight scaled by nsamples/N: its variance and
+ * standard error are thus the ones of its stratum */
+static void
+setup_mc_sampled_result
+  (const struct ssol_estimator* estimator,
+   const size_t nsamples,
+   const struct mc_data* data,
+   struct ssol_mc_result* result)
+{
+  const double N = (double)estimator->realisation_count;
+  double n = N;
+  double weight, sqr_weight;
+  ASSERT(estimator && data && result);
+
+  mc_data_get(data, &weight, &sqr_weight);
+  if(estimator->stratified && nsamples) {
+    const double f = (double)nsamples / N;
+    n = (double)nsamples;
+    sqr_weight *= f*f;
+  }
+  result->E = weight / N;
+  result->V = sqr_weight / n - result->E*result->E;
+  result->V = result->V > 0 ? result->V : 0;
+  result->SE = sqrt(result->V / n);
+}
+
+/* Open a stream whose data are stored in memory on POSIX systems; others fall
+ * back to a temporary file. `buf' and `size' are defined once the stream is
+ * reopened in read mode by mem_stream_rewind */
+static FILE*
+mem_stream_open(char** buf, size_t* size)
+{
+  ASSERT(buf && size);
+  *buf = NULL;
+  *size = 0;
+#ifdef OS_UNIX
+  return open_memstream(buf, size);
+#else
+  return tmpfile();
+#endif
+}
+
+/* Reopen the memory stream in read mode. Return NULL on error, in which case
+ * the submitted stream is closed */
+static FILE*
+mem_stream_rewind(FILE* stream, char** buf, size_t* size)
+{
+  ASSERT(stream && buf && size);
+#ifdef OS_UNIX
+  /* Closing the memory stream commits the written data into `buf' */
+  if(fclose(stream)) return NULL;
+  return *size ? fmemopen(*buf, *size, "r") : NULL;
+#else
+  {
+    long len;
+    if(fflush(stream) || (len = ftell(stream)) < 0) {
+      fclose(stream);
+      return NULL;
+    }
+    *size = (size_t)len;
+    rewind(stream);
+    return stream;
+  }
+#endif
+}
+
+static void
+mem_stream_close(FILE* stream, char* buf)
+{
+  if(stream) fclose(stream);
+  if(buf) free(buf); /* Allocated by open_memstream */
+}
+
+/* Layout of a serialized estimator; every record is aligned on 8 bytes:
+ *  - header: "SSOL" magic, uint32 version, uint32 accounting, uint32
+ *    stratified flag,
+ *    uint64 realisation count, uint64 failed count, uint64 #receivers, uint64
+ *    #sampled, double sampled area, followed by the 6 global MC data;
+ *  - #receivers receiver records;
+ *  - #sampled sampled records: uint32 instance id, uint32 padding, uint64
+ *    #samples, the cos factor, shadowed, blocked, missing, extinguished by
+ *    atmosphere, other absorbed and absorbed by receivers MC data, uint64
+ *    #receivers and the corresponding receiver records, uint64 #blockers and,
+ *    for each blocker, an uint32 instance id, an uint32 padding and its
+ *    absorbed flux and hits MC data;
+ *  - uint32 has RNG, uint32 RNG type and the RNG state as written by Star-SP;
+ *  - uint64 #hits and the recorded hits as a raw list of ssol_hit, i.e. as
+ *    written by ssol_estimator_write_hits;
+ *  - uint64 #tallies and the data of each tally as written by its write
+ *    callback.
+ * A MC data is stored as 2 doubles, i.e. its sum of weights and its sum of
+ * squared weights. A receiver record is an uint32 instance id and an uint32
+ * side mask followed, for each side, by the 10 receiver MC data, an uint64
+ * #shapes and, for each shape, an uint32 shape rank, an uint32 padding, an
+ * uint64 #primitives and, for each primitive, an uint32 primitive id, an
+ * uint32 padding and its 10 MC data. The side ends with the uint64 #MC data
+ * of its flux map followed, if not null, by the uint32 map domain, an uint32
+ * padding, 2 uint64 for the map definition, 4 doubles for its lower and upper
+ * bounds and the MC data of its bins. */
+#define ESTIMATOR_VERSION 7
+static const char ESTIMATOR_MAGIC[4] = { 'S', 'S', 'O', 'L' };
+
+#define WRITE(Var, Count) {                                                    \
+  if(fwrite((Var), sizeof(*(Var)), (Count), stream) != (Count)) {              \
+    res = RES_IO_ERR;                                                          \
+    goto error;                                                                \
+  }                                                                            \
+} (void)0
+#define READ(Var, Count) {                                                     \
+  if(fread((Var), sizeof(*(Var)), (Count), stream) != (Count)) {               \
+    res = RES_IO_ERR;                                                          \
+    goto error;                                                                \
+  }                                                                            \
+} (void)0
+
+#define MC_RECEIVER_DATA_FOR_EACH(Func, Mc) {                                  \
+  Func(Mc, incoming_flux);                                                     \
+  Func(Mc, incoming_if_no_atm_loss);                                           \
+  Func(Mc, incoming_if_no_field_loss);                                         \
+  Func(Mc, incoming_lost_in_field);                                            \
+  Func(Mc, incoming_lost_in_atmosphere);                                       \
+  Func(Mc, absorbed_flux);                                                     \
+  Func(Mc, absorbed_if_no_atm_loss);                                           \
+  Func(Mc, absorbed_if_no_field_loss);                                         \
+  Func(Mc, absorbed_lost_in_field);                                            \
+  Func(Mc, absorbed_lost_in_atmosphere);                                       \
+} (void)0
+
+static res_T
+write_mc_data(const struct mc_data* data, FILE* stream)
+{
+  double w[2];
+  res_T res = RES_OK;
+  ASSERT(data && stream);
+  mc_data_get(data, w+0, w+1);
+  WRITE(w, 2);
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+read_mc_data(struct mc_data* data, FILE* stream)
+{
+  double w[2];
+  res_T res = RES_OK;
+  ASSERT(data && stream);
+  READ(w, 2);
+  *data = MC_DATA_NULL;
+  data->weight__ = w[0];
+  data->sqr_weight__ = w[1];
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+/* Retrieve the rank of `shape' into the object instantiated by `inst' */
+static res_T
+get_shape_rank
+  (const struct ssol_instance* inst,
+   const struct ssol_shape* shape,
+   uint32_t* rank)
+{
+  const struct shaded_shape* shaded_shapes;
+  size_t i, n;
+  ASSERT(inst && shape && rank);
+
+  n = darray_shaded_shape_size_get(&inst->object->shaded_shapes);
+  shaded_shapes = darray_shaded_shape_cdata_get(&inst->object->shaded_shapes);
+  FOR_EACH(i, 0, n) {
+    if(shaded_shapes[i].shape == shape) {
+      *rank = (uint32_t)i;
+      return RES_OK;
+    }
+  }
+  return RES_BAD_ARG;
+}
+
+static res_T
+write_flux_map(const struct mc_receiver_1side* mc_rcv1, FILE* stream)
+{
+  const struct mc_data* bins;
+  uint64_t u64[2];
+  uint32_t u32[2];
+  double bounds[4];
+  size_t i, n;
+  res_T res = RES_OK;
+  ASSERT(mc_rcv1 && stream);
+
+  n = darray_mc_data_size_get(&mc_rcv1->flux_map_bins);
+  u64[0] = (uint64_t)n;
+  WRITE(u64, 1);
+  if(!n) goto exit;
+
+  u32[0] = (uint32_t)mc_rcv1->flux_map.domain;
+  u32[1] = 0;
+  u64[0] = (uint64_t)mc_rcv1->flux_map.definition[0];
+  u64[1] = (uint64_t)mc_rcv1->flux_map.definition[1];
+  bounds[0] = mc_rcv1->flux_map.lower[0];
+  bounds[1] = mc_rcv1->flux_map.lower[1];
+  bounds[2] = mc_rcv1->flux_map.upper[0];
+  bounds[3] = mc_rcv1->flux_map.upper[1];
+  WRITE(u32, 2);
+  WRITE(u64, 2);
+  WRITE(bounds, 4);
+
+  bins = darray_mc_data_cdata_get(&mc_rcv1->flux_map_bins);
+  FOR_EACH(i, 0, n) {
+    res = write_mc_data(bins + i, stream);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+read_flux_map(struct mc_receiver_1side* mc_rcv1, FILE* stream)
+{
+  struct ssol_flux_map map = SSOL_FLUX_MAP_NULL;
+  struct mc_data* bins;
+  uint64_t u64[2];
+  uint32_t u32[2];
+  double bounds[4];
+  size_t i, n;
+  res_T res = RES_OK;
+  ASSERT(mc_rcv1 && stream);
+
+  READ(u64, 1);
+  n = (size_t)u64[0];
+  if(!n) goto exit;
+
+  READ(u32, 2);
+  READ(u64, 2);
+  READ(bounds, 4);
+  map.domain = (enum ssol_flux_map_domain)u32[0];
+  map.definition[0] = (size_t)u64[0];
+  map.definition[1] = (size_t)u64[1];
+  map.lower[0] = bounds[0];
+  map.lower[1] = bounds[1];
+  map.upper[0] = bounds[2];
+  map.upper[1] = bounds[3];
+  if(!flux_map_bins_count(&map)
+  || n != flux_map_bins_count(&map) * FLUX_MAP_BIN_DATA_COUNT) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  res = mc_receiver_1side_setup_flux_map(mc_rcv1, &map);
+  if(res != RES_OK) goto error;
+
+  bins = darray_mc_data_data_get(&mc_rcv1->flux_map_bins);
+  FOR_EACH(i, 0, n) {
+    res = read_mc_data(bins + i, stream);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+write_mc_receiver_1side
+  (const struct ssol_instance* inst,
+   struct mc_receiver_1side* mc_rcv1,
+   FILE* stream)
+{
+  struct htable_shape2mc_iterator it_shape, end_shape;
+  uint64_t nshapes;
+  res_T res = RES_OK;
+  ASSERT(inst && mc_rcv1 && stream);
+
+  #define WRITE_MC_DATA(Mc, Name) {                                            \
+    res = write_mc_data(&(Mc)->Name, stream);                                  \
+    if(res != RES_OK) goto error;                                              \
+  } (void)0
+  MC_RECEIVER_DATA_FOR_EACH(WRITE_MC_DATA, mc_rcv1);
+
+  nshapes = (uint64_t)htable_shape2mc_size_get(&mc_rcv1->shape2mc);
+  WRITE(&nshapes, 1);
+
+  htable_shape2mc_begin(&mc_rcv1->shape2mc, &it_shape);
+  htable_shape2mc_end(&mc_rcv1->shape2mc, &end_shape);
+  while(!htable_shape2mc_iterator_eq(&it_shape, &end_shape)) {
+    struct htable_prim2mc_iterator it_prim, end_prim;
+    const struct ssol_shape* shape = *htable_shape2mc_iterator_key_get(&it_shape);
+    struct mc_shape_1side* mc_shape1 = htable_shape2mc_iterator_data_get(&it_shape);
+    uint32_t ids[2] = { 0, 0 }; /* Shape rank and padding */
+    uint64_t nprims;
+    htable_shape2mc_iterator_next(&it_shape);
+
+    res = get_shape_rank(inst, shape, ids+0);
+    if(res != RES_OK) goto error;
+    nprims = (uint64_t)htable_prim2mc_size_get(&mc_shape1->prim2mc);
+    WRITE(ids, 2);
+    WRITE(&nprims, 1);
+
+    htable_prim2mc_begin(&mc_shape1->prim2mc, &it_prim);
+    htable_prim2mc_end(&mc_shape1->prim2mc, &end_prim);
+    while(!htable_prim2mc_iterator_eq(&it_prim, &end_prim)) {
+      struct mc_primitive_1side* mc_prim1 =
+        htable_prim2mc_iterator_data_get(&it_prim);
+      ids[0] = (uint32_t)*htable_prim2mc_iterator_key_get(&it_prim);
+      htable_prim2mc_iterator_next(&it_prim);
+
+      WRITE(ids, 2);
+      MC_RECEIVER_DATA_FOR_EACH(WRITE_MC_DATA, mc_prim1);
+    }
+  }
+  #undef WRITE_MC_DATA
+
+  res = write_flux_map(mc_rcv1, stream);
+  if(res != RES_OK) goto error;
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+read_mc_receiver_1side
+  (const struct ssol_instance* inst,
+   struct mc_receiver_1side* mc_rcv1,
+   FILE* stream)
+{
+  uint64_t ishape, nshapes;
+  res_T res = RES_OK;
+  ASSERT(inst && mc_rcv1 && stream);
+
+  #define READ_MC_DATA(Mc, Name) {                                             \
+    res = read_mc_data(&(Mc)->Name, stream);                                   \
+    if(res != RES_OK) goto error;                                              \
+  } (void)0
+  MC_RECEIVER_DATA_FOR_EACH(READ_MC_DATA, mc_rcv1);
+
+  READ(&nshapes, 1);
+  FOR_EACH(ishape, 0, nshapes) {
+    const struct shaded_shape* shaded_shapes;
+    struct mc_shape_1side* mc_shape1;
+    uint32_t ids[2];
+    uint64_t iprim, nprims;
+
+    READ(ids, 2);
+    READ(&nprims, 1);
+    if(ids[0] >= darray_shaded_shape_size_get(&inst->object->shaded_shapes)) {
+      res = RES_BAD_ARG;
+      goto error;
+    }
+    shaded_shapes = darray_shaded_shape_cdata_get(&inst->object->shaded_shapes);
+    res = mc_receiver_1side_get_mc_shape
+      (mc_rcv1, shaded_shapes[ids[0]].shape, &mc_shape1);
+    if(res != RES_OK) goto error;
+
+    FOR_EACH(iprim, 0, nprims) {
+      struct mc_primitive_1side* mc_prim1;
+      READ(ids, 2);
+      res = mc_shape_1side_get_mc_primitive(mc_shape1, ids[0], &mc_prim1);
+      if(res != RES_OK) goto error;
+      MC_RECEIVER_DATA_FOR_EACH(READ_MC_DATA, mc_prim1);
+    }
+  }
+  #undef READ_MC_DATA
+
+  res = read_flux_map(mc_rcv1, stream);
+  if(res != RES_OK) goto error;
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+write_mc_receiver
+  (const struct ssol_instance* inst,
+   struct mc_receiver* mc_rcv,
+   FILE* stream)
+{
+  uint32_t header[2];
+  res_T res = RES_OK;
+  ASSERT(inst && mc_rcv && stream);
+
+  SSOL(instance_get_id(inst, header+0));
+  header[1] = (uint32_t)inst->receiver_mask;
+  WRITE(header, 2);
+
+  if(inst->receiver_mask & (int)SSOL_FRONT) {
+    res = write_mc_receiver_1side(inst, &mc_rcv->front, stream);
+    if(res != RES_OK) goto error;
+  }
+  if(inst->receiver_mask & (int)SSOL_BACK) {
+    res = write_mc_receiver_1side(inst, &mc_rcv->back, stream);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+/* Read a receiver record and retrieve its instance in `scn'. If `mc_samp' is
+ * not NULL, the per receiver MC data are registered against this sampled
+ * instance; otherwise they are stored in the estimator receivers */
+static res_T
+read_mc_receiver
+  (struct ssol_estimator* estimator,
+   struct ssol_scene* scn,
+   struct mc_sampled* mc_samp,
+   FILE* stream)
+{
+  struct mc_receiver_1side* mc_rcv1;
+  struct ssol_instance** pinst;
+  struct ssol_instance* inst;
+  uint32_t header[2];
+  unsigned id;
+  int iside;
+  res_T res = RES_OK;
+  ASSERT(estimator && scn && stream);
+
+  READ(header, 2);
+  id = (unsigned)header[0];
+  pinst = htable_instance_find(&scn->instances_rt, &id);
+  if(!pinst || (*pinst)->receiver_mask != (int)header[1]) {
+    log_error(estimator->dev,
+      "The receiver %u does not match the receivers of the scene.\n", id);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  inst = *pinst;
+
+  FOR_EACH(iside, 0, 2) {
+    const enum ssol_side_flag side = iside == 0 ? SSOL_FRONT : SSOL_BACK;
+    if(!(inst->receiver_mask & (int)side)) continue;
+    if(mc_samp) {
+      res = mc_sampled_get_mc_receiver_1side(mc_samp, inst, side, &mc_rcv1);
+      if(res != RES_OK) goto error;
+    } else {
+      const struct ssol_instance* rcv = inst;
+      struct mc_receiver* mc_rcv;
+      mc_rcv = htable_receiver_find(&estimator->mc_receivers, &rcv);
+      if(!mc_rcv) {
+        log_error(estimator->dev,
+          "The instance %u is not a receiver of the scene.\n", id);
+        res = RES_BAD_ARG;
+        goto error;
+      }
+      mc_rcv1 = side == SSOL_FRONT ? &mc_rcv->front : &mc_rcv->back;
+    }
+    res = read_mc_receiver_1side(inst, mc_rcv1, stream);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+write_mc_sampled
+  (const struct ssol_instance* inst,
+   struct mc_sampled* mc_samp,
+   FILE* stream)
+{
+  struct htable_receiver_iterator it, end;
+  struct htable_blocker_iterator b_it, b_end;
+  uint32_t header[2] = { 0, 0 }; /* Instance id and padding */
+  uint64_t u64;
+  res_T res = RES_OK;
+  ASSERT(inst && mc_samp && stream);
+
+  SSOL(instance_get_id(inst, header+0));
+  WRITE(header, 2);
+  u64 = (uint64_t)mc_samp->nb_samples;
+  WRITE(&u64, 1);
+  #define WRITE_MC_DATA(Name) {                                                \
+    res = write_mc_data(&mc_samp->Name, stream);                               \
+    if(res != RES_OK) goto error;                                              \
+  } (void)0
+  WRITE_MC_DATA(cos_factor);
+  WRITE_MC_DATA(shadowed);
+  WRITE_MC_DATA(blocked);
+  WRITE_MC_DATA(missing);
+  WRITE_MC_DATA(extinguished_by_atmosphere);
+  WRITE_MC_DATA(other_absorbed);
+  WRITE_MC_DATA(absorbed_by_receivers);
+  #undef WRITE_MC_DATA
+
+  u64 = (uint64_t)htable_receiver_size_get(&mc_samp->mc_rcvs);
+  WRITE(&u64, 1);
+  htable_receiver_begin(&mc_samp->mc_rcvs, &it);
+  htable_receiver_end(&mc_samp->mc_rcvs, &end);
+  while(!htable_receiver_iterator_eq(&it, &end)) {
+    const struct ssol_instance* rcv = *htable_receiver_iterator_key_get(&it);
+    struct mc_receiver* mc_rcv = htable_receiver_iterator_data_get(&it);
+    htable_receiver_iterator_next(&it);
+    res = write_mc_receiver(rcv, mc_rcv, stream);
+    if(res != RES_OK) goto error;
+  }
+
+  u64 = (uint64_t)htable_blocker_size_get(&mc_samp->mc_blockers);
+  WRITE(&u64, 1);
+  htable_blocker_begin(&mc_samp->mc_blockers, &b_it);
+  htable_blocker_end(&mc_samp->mc_blockers, &b_end);
+  while(!htable_blocker_iterator_eq(&b_it, &b_end)) {
+    const struct ssol_instance* blocker;
+    struct mc_blocker* mc_blocker;
+    blocker = *htable_blocker_iterator_key_get(&b_it);
+    mc_blocker = htable_blocker_iterator_data_get(&b_it);
+    htable_blocker_iterator_next(&b_it);
+    SSOL(instance_get_id(blocker, header+0));
+    WRITE(header, 2);
+    res = write_mc_data(&mc_blocker->absorbed_flux, stream);
+    if(res != RES_OK) goto error;
+    res = write_mc_data(&mc_blocker->hits, stream);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+read_mc_sampled
+  (struct ssol_estimator* estimator,
+   struct ssol_scene* scn,
+   FILE* stream)
+{
+  struct ssol_instance** pinst;
+  struct mc_sampled* mc_samp = NULL;
+  uint32_t header[2];
+  uint64_t i, u64;
+  unsigned id;
+  res_T res = RES_OK;
+  ASSERT(estimator && scn && stream);
+
+  READ(header, 2);
+  id = (unsigned)header[0];
+  pinst = htable_instance_find(&scn->instances_rt, &id);
+  if(pinst) {
+    const struct ssol_instance* inst = *pinst;
+    mc_samp = htable_sampled_find(&estimator->mc_sampled, &inst);
+  }
+  if(!mc_samp) {
+    log_error(estimator->dev,
+      "The instance %u is not a sampled instance of the scene.\n", id);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  READ(&u64, 1);
+  mc_samp->nb_samples = (size_t)u64;
+  #define READ_MC_DATA(Name) {                                                 \
+    res = read_mc_data(&mc_samp->Name, stream);                                \
+    if(res != RES_OK) goto error;                                              \
+  } (void)0
+  READ_MC_DATA(cos_factor);
+  READ_MC_DATA(shadowed);
+  READ_MC_DATA(blocked);
+  READ_MC_DATA(missing);
+  READ_MC_DATA(extinguished_by_atmosphere);
+  READ_MC_DATA(other_absorbed);
+  READ_MC_DATA(absorbed_by_receivers);
+  #undef READ_MC_DATA
+
+  READ(&u64, 1);
+  FOR_EACH(i, 0, u64) {
+    res = read_mc_receiver(estimator, scn, mc_samp, stream);
+    if(res != RES_OK) goto error;
+  }
+
+  READ(&u64, 1);
+  FOR_EACH(i, 0, u64) {
+    struct mc_blocker* mc_blocker;
+    READ(header, 2);
+    id = (unsigned)header[0];
+    pinst = htable_instance_find(&scn->instances_rt, &id);
+    if(!pinst) {
+      log_error(estimator->dev,
+        "The blocker %u is not an instance of the scene.\n", id);
+      res = RES_BAD_ARG;
+      goto error;
+    }
+    res = mc_sampled_get_mc_blocker(mc_samp, *pinst, &mc_blocker);
+    if(res != RES_OK) goto error;
+    res = read_mc_data(&mc_blocker->absorbed_flux, stream);
+    if(res != RES_OK) goto error;
+    res = read_mc_data(&mc_blocker->hits, stream);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
 static void
 estimator_release(ref_T* ref)
 {
@@ -84,6 +738,8 @@ estimator_release(ref_T* ref)
   htable_receiver_release(&estimator->mc_receivers);
   htable_sampled_release(&estimator->mc_sampled);
   darray_path_release(&estimator->paths);
+  darray_hit_release(&estimator->hits);
+  darray_tally_data_release(&estimator->tallies);
   if(estimator->rng) SSP(rng_ref_put(estimator->rng));
   ASSERT(dev && dev->allocator);
   MEM_RM(dev->allocator, estimator);
@@ -111,13 +767,13 @@ ssol_estimator_ref_put(struct ssol_estimator* estimator)
 
 res_T
 ssol_estimator_get_mc_global
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    struct ssol_mc_global* global)
 {
   if(!estimator || !global) return RES_BAD_ARG;
   #define SETUP_MC_RESULT(Name) {                                              \
     const double N = (double)estimator->realisation_count;                     \
-    struct mc_data* data = &estimator->Name;                                   \
+    const struct mc_data* data = &estimator->Name;                             \
     double weight, sqr_weight;                                                 \
     mc_data_get(data, &weight, &sqr_weight);                                   \
     global->Name.E = weight / N;                                               \
@@ -137,7 +793,7 @@ ssol_estimator_get_mc_global
 
 res_T
 ssol_estimator_get_mc_sampled_x_receiver
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    const struct ssol_instance* samp_instance,
    const struct ssol_instance* recv_instance,
    const enum ssol_side_flag side,
@@ -155,7 +811,9 @@ ssol_estimator_get_mc_sampled_x_receiver
 
   memset(rcv, 0, sizeof(rcv[0]));
 
-  mc_samp = htable_sampled_find(&estimator->mc_sampled, &samp_instance);
+  /* The lookup does not modify the hash table */
+  mc_samp = htable_sampled_find
+    ((struct htable_sampled*)&estimator->mc_sampled, &samp_instance);
   if(!mc_samp) {
     /* The sampled instance has no MC estimation */
     return RES_BAD_ARG;
@@ -169,16 +827,9 @@ ssol_estimator_get_mc_sampled_x_receiver
   }
 
   mc_rcv1 = side == SSOL_FRONT ? &mc_rcv->front : &mc_rcv->back;
-  #define SETUP_MC_RESULT(Name) {                                              \
-    const double N = (double)estimator->realisation_count;                     \
-    struct mc_data* data = &mc_rcv1->Name;                                     \
-    double weight, sqr_weight;                                                 \
-    mc_data_get(data, &weight, &sqr_weight);                                   \
-    rcv->Name.E = weight / N;                                                  \
-    rcv->Name.V = sqr_weight / N - rcv->Name.E*rcv->Name.E;                    \
-    rcv->Name.V = rcv->Name.V > 0 ? rcv->Name.V : 0;                           \
-    rcv->Name.SE = sqrt(rcv->Name.V / N);                                      \
-  } (void)0
+  #define SETUP_MC_RESULT(Name)                                                \
+    setup_mc_sampled_result                                                    \
+      (estimator, mc_samp->nb_samples, &mc_rcv1->Name, &rcv->Name)
   SETUP_MC_RESULT(incoming_flux);
   SETUP_MC_RESULT(incoming_if_no_atm_loss);
   SETUP_MC_RESULT(incoming_if_no_field_loss);
@@ -233,18 +884,20 @@ ssol_estimator_get_sampled_count
 
 res_T
 ssol_estimator_get_mc_sampled
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    const struct ssol_instance* samp_instance,
    struct ssol_mc_sampled* sampled)
 {
   struct mc_sampled* mc = NULL;
   if (!estimator || !samp_instance || !sampled) return RES_BAD_ARG;
-  mc = htable_sampled_find(&estimator->mc_sampled, &samp_instance);
+  /* The lookup does not modify the hash table */
+  mc = htable_sampled_find
+    ((struct htable_sampled*)&estimator->mc_sampled, &samp_instance);
   if(!mc) return RES_BAD_ARG;
   sampled->nb_samples = mc->nb_samples;
   #define SETUP_MC_RESULT(Name, Count) {                                      \
     const double N = (double)(Count);                                         \
-    struct mc_data* data = &mc->Name;                                         \
+    const struct mc_data* data = &mc->Name;                                   \
     double weight, sqr_weight;                                                \
     mc_data_get(data, &weight, &sqr_weight);                                  \
     sampled->Name.E = weight / N;                                             \
@@ -253,36 +906,224 @@ ssol_estimator_get_mc_sampled
     sampled->Name.SE = sqrt(sampled->Name.V / N);                             \
   } (void)0
   SETUP_MC_RESULT(cos_factor, sampled->nb_samples);
-  SETUP_MC_RESULT(shadowed, estimator->realisation_count);
+  #undef SETUP_MC_RESULT
+  #define SETUP_MC_RESULT(Name)                                                \
+    setup_mc_sampled_result                                                    \
+      (estimator, mc->nb_samples, &mc->Name, &sampled->Name)
+  SETUP_MC_RESULT(shadowed);
+  SETUP_MC_RESULT(blocked);
+  SETUP_MC_RESULT(missing);
+  SETUP_MC_RESULT(extinguished_by_atmosphere);
+  SETUP_MC_RESULT(other_absorbed);
+  SETUP_MC_RESULT(absorbed_by_receivers);
   #undef SETUP_MC_RESULT
   return RES_OK;
 }
 
 res_T
-ssol_estimator_get_rng_state
-  (const struct ssol_estimator* estimator, const struct ssp_rng** rng_state)
+ssol_estimator_get_mc_sampled_x_blocker
+  (const struct ssol_estimator* estimator,
+   const struct ssol_instance* samp_instance,
+   const struct ssol_instance* blocker_instance,
+   struct ssol_mc_blocker* blocker)
 {
-  if(!estimator || !rng_state) return RES_BAD_ARG;
-  *rng_state = estimator->rng;
+  struct mc_sampled* mc_samp = NULL;
+  struct mc_blocker* mc_blocker = NULL;
+
+  if(!estimator || !samp_instance || !blocker_instance || !blocker
+  || !samp_instance->sample)
+    return RES_BAD_ARG;
+
+  memset(blocker, 0, sizeof(blocker[0]));
+
+  /* The lookup does not modify the hash table */
+  mc_samp = htable_sampled_find
+    ((struct htable_sampled*)&estimator->mc_sampled, &samp_instance);
+  if(!mc_samp) return RES_BAD_ARG;
+
+  mc_blocker = htable_blocker_find(&mc_samp->mc_blockers, &blocker_instance);
+  if(!mc_blocker) return RES_OK; /* The blocker is never hit */
+
+  #define SETUP_MC_RESULT(Name)                                                \
+    setup_mc_sampled_result                                                    \
+      (estimator, mc_samp->nb_samples, &mc_blocker->Name, &blocker->Name)
+  SETUP_MC_RESULT(absorbed_flux);
+  SETUP_MC_RESULT(hits);
+  #undef SETUP_MC_RESULT
   return RES_OK;
 }
 
 res_T
-ssol_estimator_get_tracked_paths_count
-  (const struct ssol_estimator* estimator, size_t* npaths)
+ssol_estimator_get_rng_state
+  (const struct ssol_estimator* estimator, const struct ssp_rng** rng_state)
 {
-  if(!estimator || !npaths) return RES_BAD_ARG;
-  *npaths = darray_path_size_get(&estimator->paths);
+  if(!estimator || !rng_state) return RES_BAD_ARG;
+  *rng_state = estimator->rng;
   return RES_OK;
 }
 
 res_T
-ssol_estimator_get_tracked_path
-  (const struct ssol_estimator* estimator,
-   const size_t ipath,
-   struct ssol_path* path)
+ssol_estimator_merge
+  (struct ssol_estimator* dst,
+   const struct ssol_estimator* src)
 {
-  if(!estimator || ipath >= darray_path_size_get(&estimator->paths) || !path)
+  struct htable_receiver_iterator r_it, r_end;
+  struct htable_sampled_iterator s_it, s_end;
+  size_t ipath, npaths_dst, npaths_src;
+  size_t ihit, nhits_dst, nhits_src;
+  size_t nrealisations_dst;
+  res_T res = RES_OK;
+
+  if(!dst || !src || dst == src) return RES_BAD_ARG;
+
+  if(!check_estimators_compatibility(dst, src)) {
+    log_error(dst->dev, "%s: the estimators do not come from the same scene.\n",
+      FUNC_NAME);
+    return RES_BAD_ARG;
+  }
+  if(!tallies_eq(&dst->tallies, &src->tallies)) {
+    log_error(dst->dev, "%s: the estimators do not use the same tallies.\n",
+      FUNC_NAME);
+    return RES_BAD_ARG;
+  }
+  if(dst->accounting != src->accounting) {
+    log_error(dst->dev,
+      "%s: the estimators do not estimate the same quantities.\n", FUNC_NAME);
+    return RES_BAD_ARG;
+  }
+  if(dst->stratified != src->stratified) {
+    log_error(dst->dev,
+      "%s: the estimators do not use the same stratification.\n", FUNC_NAME);
+    return RES_BAD_ARG;
+  }
+
+  /* Merge the global MC estimations */
+  #define ACCUM_WEIGHT(Name) mc_data_accum(&dst->Name, &src->Name)
+  ACCUM_WEIGHT(cos_factor);
+  ACCUM_WEIGHT(absorbed_by_receivers);
+  ACCUM_WEIGHT(shadowed);
+  ACCUM_WEIGHT(missing);
+  ACCUM_WEIGHT(extinguished_by_atmosphere);
+  ACCUM_WEIGHT(other_absorbed);
+  #undef ACCUM_WEIGHT
+  /* The hits are identified by the index of their realisation among the
+   * attempted ones, i.e. failed realisations included */
+  nrealisations_dst = dst->realisation_count + dst->failed_count;
+  dst->realisation_count += src->realisation_count;
+  dst->failed_count += src->failed_count;
+
+  /* Merge the per receiver MC estimations. The iterations over the src hash
+   * tables do not modify them */
+  htable_receiver_begin((struct htable_receiver*)&src->mc_receivers, &r_it);
+  htable_receiver_end((struct htable_receiver*)&src->mc_receivers, &r_end);
+  while(!htable_receiver_iterator_eq(&r_it, &r_end)) {
+    struct mc_receiver* mc_rcv_src = htable_receiver_iterator_data_get(&r_it);
+    const struct ssol_instance* inst = *htable_receiver_iterator_key_get(&r_it);
+    struct mc_receiver* mc_rcv_dst = htable_receiver_find(&dst->mc_receivers, &inst);
+    htable_receiver_iterator_next(&r_it);
+    ASSERT(mc_rcv_dst);
+
+    if(inst->receiver_mask & (int)SSOL_FRONT) {
+      res = accum_mc_receivers_1side(&mc_rcv_dst->front, &mc_rcv_src->front);
+      if(res != RES_OK) goto error;
+    }
+    if(inst->receiver_mask & (int)SSOL_BACK) {
+      res = accum_mc_receivers_1side(&mc_rcv_dst->back, &mc_rcv_src->back);
+      if(res != RES_OK) goto error;
+    }
+  }
+
+  /* Merge the per sampled instance MC estimations */
+  htable_sampled_begin((struct htable_sampled*)&src->mc_sampled, &s_it);
+  htable_sampled_end((struct htable_sampled*)&src->mc_sampled, &s_end);
+  while(!htable_sampled_iterator_eq(&s_it, &s_end)) {
+    struct mc_sampled* mc_samp_src = htable_sampled_iterator_data_get(&s_it);
+    const struct ssol_instance* inst = *htable_sampled_iterator_key_get(&s_it);
+    struct mc_sampled* mc_samp_dst = htable_sampled_find(&dst->mc_sampled, &inst);
+    htable_sampled_iterator_next(&s_it);
+    ASSERT(mc_samp_dst);
+
+    res = accum_mc_sampled(mc_samp_dst, mc_samp_src);
+    if(res != RES_OK) goto error;
+  }
+
+  /* Append the tracked paths of src to the dst ones */
+  npaths_dst = darray_path_size_get(&dst->paths);
+  npaths_src = darray_path_size_get(&src->paths);
+  res = darray_path_resize(&dst->paths, npaths_dst + npaths_src);
+  if(res != RES_OK) goto error;
+  FOR_EACH(ipath, 0, npaths_src) {
+    res = path_copy
+      (darray_path_data_get(&dst->paths) + npaths_dst + ipath,
+       darray_path_cdata_get(&src->paths) + ipath);
+    if(res != RES_OK) goto error;
+  }
+
+  /* Append the recorded hits of src to the dst ones. Offset the identifiers
+   * of the src realisations to keep them unique */
+  nhits_dst = darray_hit_size_get(&dst->hits);
+  nhits_src = darray_hit_size_get(&src->hits);
+  res = darray_hit_resize(&dst->hits, nhits_dst + nhits_src);
+  if(res != RES_OK) goto error;
+  FOR_EACH(ihit, 0, nhits_src) {
+    struct ssol_hit* hit = darray_hit_data_get(&dst->hits) + nhits_dst + ihit;
+    *hit = darray_hit_cdata_get(&src->hits)[ihit];
+    hit->realisation += (uint64_t)nrealisations_dst;
+  }
+
+  /* Merge the tally data */
+  res = tallies_merge(&dst->tallies, &src->tallies);
+  if(res != RES_OK) goto error;
+
+  /* Update the per primitive views wrt the merged MC weights */
+  res = estimator_setup_mc_primitives(dst);
+  if(res != RES_OK) goto error;
+
+exit:
+  return res;
+error:
+  log_error(dst->dev, "%s: could not merge the estimators.\n", FUNC_NAME);
+  goto exit;
+}
+
+res_T
+ssol_estimator_get_tallies_count
+  (const struct ssol_estimator* estimator, size_t* count)
+{
+  if(!estimator || !count) return RES_BAD_ARG;
+  *count = darray_tally_data_size_get(&estimator->tallies);
+  return RES_OK;
+}
+
+res_T
+ssol_estimator_get_tally
+  (const struct ssol_estimator* estimator,
+   const size_t id,
+   const void** data)
+{
+  if(!estimator || id >= darray_tally_data_size_get(&estimator->tallies)
+  || !data)
+    return RES_BAD_ARG;
+  *data = darray_tally_data_cdata_get(&estimator->tallies)[id].data;
+  return RES_OK;
+}
+
+res_T
+ssol_estimator_get_tracked_paths_count
+  (const struct ssol_estimator* estimator, size_t* npaths)
+{
+  if(!estimator || !npaths) return RES_BAD_ARG;
+  *npaths = darray_path_size_get(&estimator->paths);
+  return RES_OK;
+}
+
+res_T
+ssol_estimator_get_tracked_path
+  (const struct ssol_estimator* estimator,
+   const size_t ipath,
+   struct ssol_path* path)
+{
+  if(!estimator || ipath >= darray_path_size_get(&estimator->paths) || !path)
     return RES_BAD_ARG;
   path->path__  = darray_path_cdata_get(&estimator->paths) + ipath;
   return RES_OK;
@@ -321,6 +1162,356 @@ ssol_path_get_type(const struct ssol_path* path, enum ssol_path_type* type)
   return RES_OK;
 }
 
+res_T
+ssol_estimator_write(const struct ssol_estimator* estimator, FILE* stream)
+{
+  struct htable_receiver_iterator r_it, r_end;
+  struct htable_sampled_iterator s_it, s_end;
+  uint64_t u64[4];
+  uint32_t u32[2];
+  size_t i;
+  res_T res = RES_OK;
+
+  if(!estimator || !stream) return RES_BAD_ARG;
+
+  FOR_EACH(i, 0, darray_tally_data_size_get(&estimator->tallies)) {
+    if(!darray_tally_data_cdata_get(&estimator->tallies)[i].desc.write) {
+      log_error(estimator->dev,
+        "%s: the tally %lu cannot be serialized: it has no write callback.\n",
+        FUNC_NAME, (unsigned long)i);
+      return RES_BAD_OP;
+    }
+  }
+
+  u32[0] = ESTIMATOR_VERSION;
+  WRITE(ESTIMATOR_MAGIC, 4);
+  WRITE(u32, 1);
+  u32[0] = (uint32_t)estimator->accounting;
+  u32[1] = (uint32_t)estimator->stratified;
+  WRITE(u32, 2);
+  u64[0] = (uint64_t)estimator->realisation_count;
+  u64[1] = (uint64_t)estimator->failed_count;
+  u64[2] = (uint64_t)htable_receiver_size_get(&estimator->mc_receivers);
+  u64[3] = (uint64_t)htable_sampled_size_get(&estimator->mc_sampled);
+  WRITE(u64, 4);
+  WRITE(&estimator->sampled_area, 1);
+
+  #define WRITE_MC_DATA(Name) {                                                \
+    res = write_mc_data(&estimator->Name, stream);                             \
+    if(res != RES_OK) goto error;                                              \
+  } (void)0
+  WRITE_MC_DATA(cos_factor);
+  WRITE_MC_DATA(absorbed_by_receivers);
+  WRITE_MC_DATA(shadowed);
+  WRITE_MC_DATA(missing);
+  WRITE_MC_DATA(extinguished_by_atmosphere);
+  WRITE_MC_DATA(other_absorbed);
+  #undef WRITE_MC_DATA
+
+  /* The iterations do not modify the hash tables */
+  htable_receiver_begin
+    ((struct htable_receiver*)&estimator->mc_receivers, &r_it);
+  htable_receiver_end
+    ((struct htable_receiver*)&estimator->mc_receivers, &r_end);
+  while(!htable_receiver_iterator_eq(&r_it, &r_end)) {
+    const struct ssol_instance* inst = *htable_receiver_iterator_key_get(&r_it);
+    struct mc_receiver* mc_rcv = htable_receiver_iterator_data_get(&r_it);
+    htable_receiver_iterator_next(&r_it);
+    res = write_mc_receiver(inst, mc_rcv, stream);
+    if(res != RES_OK) goto error;
+  }
+
+  htable_sampled_begin((struct htable_sampled*)&estimator->mc_sampled, &s_it);
+  htable_sampled_end((struct htable_sampled*)&estimator->mc_sampled, &s_end);
+  while(!htable_sampled_iterator_eq(&s_it, &s_end)) {
+    const struct ssol_instance* inst = *htable_sampled_iterator_key_get(&s_it);
+    struct mc_sampled* mc_samp = htable_sampled_iterator_data_get(&s_it);
+    htable_sampled_iterator_next(&s_it);
+    res = write_mc_sampled(inst, mc_samp, stream);
+    if(res != RES_OK) goto error;
+  }
+
+  u32[0] = estimator->rng != NULL;
+  u32[1] = 0;
+  if(estimator->rng) {
+    enum ssp_rng_type rng_type;
+    SSP(rng_get_type(estimator->rng, &rng_type));
+    u32[1] = (uint32_t)rng_type;
+  }
+  WRITE(u32, 2);
+  if(estimator->rng) {
+    res = ssp_rng_write(estimator->rng, stream);
+    if(res != RES_OK) goto error;
+  }
+
+  u64[0] = (uint64_t)darray_hit_size_get(&estimator->hits);
+  WRITE(u64, 1);
+  if(u64[0]) WRITE(darray_hit_cdata_get(&estimator->hits), (size_t)u64[0]);
+
+  u64[0] = (uint64_t)darray_tally_data_size_get(&estimator->tallies);
+  WRITE(u64, 1);
+  FOR_EACH(i, 0, darray_tally_data_size_get(&estimator->tallies)) {
+    const struct tally_data* tally =
+      darray_tally_data_cdata_get(&estimator->tallies) + i;
+    res = tally->desc.write(tally->data, stream, tally->desc.context);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  log_error(estimator->dev, "%s: could not write the estimator.\n", FUNC_NAME);
+  goto exit;
+}
+
+res_T
+ssol_estimator_read
+  (struct ssol_scene* scn,
+   FILE* stream,
+   struct ssol_estimator** out_estimator)
+{
+  struct ssol_estimator* estimator = NULL;
+  char magic[4];
+  uint64_t u64[4];
+  uint64_t i;
+  uint32_t u32[2];
+  res_T res = RES_OK;
+
+  if(!scn || !stream || !out_estimator) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  res = estimator_create(scn->dev, scn, &estimator);
+  if(res != RES_OK) goto error;
+
+  READ(magic, 4);
+  READ(u32, 1);
+  if(memcmp(magic, ESTIMATOR_MAGIC, sizeof(magic))) {
+    log_error(scn->dev, "%s: invalid estimator data.\n", FUNC_NAME);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  if(u32[0] != ESTIMATOR_VERSION) {
+    log_error(scn->dev,
+      "%s: unexpected estimator version %u; expecting version %u.\n",
+      FUNC_NAME, (unsigned)u32[0], (unsigned)ESTIMATOR_VERSION);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  READ(u32, 2);
+  if(u32[0] >= SSOL_ACCOUNTING_COUNT__) {
+    log_error(scn->dev, "%s: invalid estimator accounting %u.\n",
+      FUNC_NAME, (unsigned)u32[0]);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  estimator->accounting = (enum ssol_accounting)u32[0];
+  if(u32[1] > 1) {
+    log_error(scn->dev, "%s: invalid estimator stratification flag %u.\n",
+      FUNC_NAME, (unsigned)u32[1]);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  estimator->stratified = (int)u32[1];
+
+  READ(u64, 4);
+  READ(&estimator->sampled_area, 1);
+  estimator->realisation_count = (size_t)u64[0];
+  estimator->failed_count = (size_t)u64[1];
+  if(u64[2] != htable_receiver_size_get(&estimator->mc_receivers)
+  || u64[3] != htable_sampled_size_get(&estimator->mc_sampled)) {
+    log_error(scn->dev,
+      "%s: the estimator was not computed on the submitted scene.\n",
+      FUNC_NAME);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  #define READ_MC_DATA(Name) {                                                 \
+    res = read_mc_data(&estimator->Name, stream);                              \
+    if(res != RES_OK) goto error;                                              \
+  } (void)0
+  READ_MC_DATA(cos_factor);
+  READ_MC_DATA(absorbed_by_receivers);
+  READ_MC_DATA(shadowed);
+  READ_MC_DATA(missing);
+  READ_MC_DATA(extinguished_by_atmosphere);
+  READ_MC_DATA(other_absorbed);
+  #undef READ_MC_DATA
+
+  FOR_EACH(i, 0, u64[2]) {
+    res = read_mc_receiver(estimator, scn, NULL, stream);
+    if(res != RES_OK) goto error;
+  }
+  FOR_EACH(i, 0, u64[3]) {
+    res = read_mc_sampled(estimator, scn, stream);
+    if(res != RES_OK) goto error;
+  }
+
+  READ(u32, 2);
+  if(u32[0]) {
+    res = ssp_rng_create
+      (scn->dev->allocator, (enum ssp_rng_type)u32[1], &estimator->rng);
+    if(res != RES_OK) goto error;
+    res = ssp_rng_read(estimator->rng, stream);
+    if(res != RES_OK) goto error;
+  }
+
+  READ(u64, 1);
+  if(u64[0] > SIZE_MAX) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  res = darray_hit_resize(&estimator->hits, (size_t)u64[0]);
+  if(res != RES_OK) goto error;
+  if(u64[0]) READ(darray_hit_data_get(&estimator->hits), (size_t)u64[0]);
+
+  READ(u64, 1);
+  if(u64[0] != darray_tally_data_size_get(&estimator->tallies)) {
+    log_error(scn->dev,
+      "%s: the estimator was not computed with the tallies of the scene.\n",
+      FUNC_NAME);
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  FOR_EACH(i, 0, u64[0]) {
+    struct tally_data* tally =
+      darray_tally_data_data_get(&estimator->tallies) + i;
+    if(!tally->desc.read) {
+      log_error(scn->dev,
+        "%s: the tally %lu cannot be read: it has no read callback.\n",
+        FUNC_NAME, (unsigned long)i);
+      res = RES_BAD_ARG;
+      goto error;
+    }
+    res = tally->desc.read(tally->data, stream, tally->desc.context);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  if(out_estimator) *out_estimator = estimator;
+  return res;
+error:
+  if(scn) log_error(scn->dev, "%s: could not read the estimator.\n", FUNC_NAME);
+  if(estimator) {
+    SSOL(estimator_ref_put(estimator));
+    estimator = NULL;
+  }
+  goto exit;
+}
+
+res_T
+ssol_estimator_send
+  (const struct ssol_estimator* estimator,
+   const struct ssol_channel* channel)
+{
+  char chunk[4096];
+  FILE* stream = NULL;
+  char* buf = NULL;
+  size_t bufsz = 0;
+  size_t n;
+  uint64_t size;
+  res_T res = RES_OK;
+
+  if(!estimator || !channel || !channel->send) return RES_BAD_ARG;
+
+  stream = mem_stream_open(&buf, &bufsz);
+  if(!stream) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+  res = ssol_estimator_write(estimator, stream);
+  if(res != RES_OK) goto error;
+  stream = mem_stream_rewind(stream, &buf, &bufsz);
+  if(!stream) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+
+  /* Send the size of the serialized data followed by the data themselves */
+  size = (uint64_t)bufsz;
+  res = channel->send(&size, sizeof(size), channel->context);
+  if(res != RES_OK) goto error;
+  while((n = fread(chunk, 1, sizeof(chunk), stream)) != 0) {
+    res = channel->send(chunk, n, channel->context);
+    if(res != RES_OK) goto error;
+  }
+  if(ferror(stream)) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+
+exit:
+  mem_stream_close(stream, buf);
+  return res;
+error:
+  log_error(estimator->dev, "%s: could not send the estimator.\n", FUNC_NAME);
+  goto exit;
+}
+
+res_T
+ssol_estimator_receive
+  (struct ssol_scene* scn,
+   const struct ssol_channel* channel,
+   struct ssol_estimator** out_estimator)
+{
+  char chunk[4096];
+  struct ssol_estimator* estimator = NULL;
+  FILE* stream = NULL;
+  char* buf = NULL;
+  size_t bufsz = 0;
+  uint64_t size;
+  res_T res = RES_OK;
+
+  if(!scn || !channel || !channel->receive || !out_estimator) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  stream = mem_stream_open(&buf, &bufsz);
+  if(!stream) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+
+  res = channel->receive(&size, sizeof(size), channel->context);
+  if(res != RES_OK) goto error;
+  while(size) {
+    const size_t n = (size_t)MMIN(size, sizeof(chunk));
+    res = channel->receive(chunk, n, channel->context);
+    if(res != RES_OK) goto error;
+    if(fwrite(chunk, 1, n, stream) != n) {
+      res = RES_IO_ERR;
+      goto error;
+    }
+    size -= n;
+  }
+
+  stream = mem_stream_rewind(stream, &buf, &bufsz);
+  if(!stream) {
+    res = RES_IO_ERR;
+    goto error;
+  }
+  res = ssol_estimator_read(scn, stream, &estimator);
+  if(res != RES_OK) goto error;
+
+exit:
+  mem_stream_close(stream, buf);
+  if(out_estimator) *out_estimator = estimator;
+  return res;
+error:
+  if(scn) {
+    log_error(scn->dev, "%s: could not receive the estimator.\n", FUNC_NAME);
+  }
+  goto exit;
+}
+
+#undef WRITE
+#undef READ
+#undef MC_RECEIVER_DATA_FOR_EACH
+
 /*******************************************************************************
  * Local function
  ******************************************************************************/
@@ -347,6 +1538,10 @@ estimator_create
   htable_receiver_init(dev->allocator, &estimator->mc_receivers);
   htable_sampled_init(dev->allocator, &estimator->mc_sampled);
   darray_path_init(dev->allocator, &estimator->paths);
+  darray_hit_init(dev->allocator, &estimator->hits);
+  darray_tally_data_init(dev->allocator, &estimator->tallies);
+  estimator->accounting = scene->accounting;
+  estimator->stratified = scene->stratification != SSOL_STRATIFICATION_NONE;
   SSOL(device_ref_get(dev));
   estimator->dev = dev;
   ref_init(&estimator->ref);
@@ -354,6 +1549,9 @@ estimator_create
   res = create_mc_receivers(estimator, scene);
   if(res != RES_OK) goto error;
 
+  res = tallies_setup(&estimator->tallies, &scene->tallies);
+  if(res != RES_OK) goto error;
+
 exit:
   if(out_estimator) *out_estimator = estimator;
   return res;
@@ -371,6 +1569,8 @@ estimator_save_rng_state
 {
   enum ssp_rng_type rng_type;
   FILE* stream = NULL;
+  char* buf = NULL;
+  size_t bufsz = 0;
   res_T res = RES_OK;
   ASSERT(estimator && proxy);
 
@@ -380,14 +1580,6 @@ estimator_save_rng_state
     estimator->rng = NULL;
   }
 
-  stream = tmpfile();
-  if(!stream) {
-    log_error(estimator->dev,
-      "Could not open a stream to store the proxy RNG state.\n");
-    res = RES_IO_ERR;
-    goto error;
-  }
-
   SSP(rng_proxy_get_type(proxy, &rng_type));
   res = ssp_rng_create(estimator->dev->allocator, rng_type, &estimator->rng);
   if(res != RES_OK) {
@@ -396,13 +1588,29 @@ estimator_save_rng_state
     goto error;
   }
 
+  /* Serialize the proxy RNG state in memory rather than in a file */
+  stream = mem_stream_open(&buf, &bufsz);
+  if(!stream) {
+    log_error(estimator->dev,
+      "Could not open a stream to store the proxy RNG state.\n");
+    res = RES_IO_ERR;
+    goto error;
+  }
+
   res = ssp_rng_proxy_write(proxy, stream);
   if(res != RES_OK) {
     log_error(estimator->dev, "Could not serialize the proxy RNG state.\n");
     goto error;
   }
 
-  rewind(stream);
+  stream = mem_stream_rewind(stream, &buf, &bufsz);
+  if(!stream) {
+    log_error(estimator->dev,
+      "Could not open a stream to read the proxy RNG state.\n");
+    res = RES_IO_ERR;
+    goto error;
+  }
+
   res = ssp_rng_read(estimator->rng, stream);
   if(res != RES_OK) {
     log_error(estimator->dev, "Could not save the proxy RNG state.\n");
@@ -410,10 +1618,211 @@ estimator_save_rng_state
   }
 
 exit:
-  if(stream) fclose(stream);
+  mem_stream_close(stream, buf);
+  return res;
+error:
+  if(estimator->rng) {
+    SSP(rng_ref_put(estimator->rng));
+    estimator->rng = NULL;
+  }
+  goto exit;
+}
+
+res_T
+accum_mc_receivers_1side
+  (struct mc_receiver_1side* dst,
+   struct mc_receiver_1side* src)
+{
+  struct htable_shape2mc_iterator it_shape, end_shape;
+  res_T res = RES_OK;
+  ASSERT(dst && src);
+
+  #define ACCUM_ALL {                                                          \
+    ACCUM_WEIGHT(incoming_flux);                                               \
+    ACCUM_WEIGHT(incoming_if_no_atm_loss);                                     \
+    ACCUM_WEIGHT(incoming_lost_in_field);                                      \
+    ACCUM_WEIGHT(incoming_lost_in_atmosphere);                                 \
+    ACCUM_WEIGHT(incoming_if_no_field_loss);                                   \
+    ACCUM_WEIGHT(absorbed_flux);                                               \
+    ACCUM_WEIGHT(absorbed_if_no_atm_loss);                                     \
+    ACCUM_WEIGHT(absorbed_if_no_field_loss);                                   \
+    ACCUM_WEIGHT(absorbed_lost_in_field);                                      \
+    ACCUM_WEIGHT(absorbed_lost_in_atmosphere);                                 \
+  } (void)0
+
+  #define ACCUM_WEIGHT(Name) mc_data_accum(&dst->Name, &src->Name)
+  ACCUM_ALL;
+  #undef ACCUM_WEIGHT
+
+  /* Merge the flux map */
+  if(darray_mc_data_size_get(&src->flux_map_bins)) {
+    const struct mc_data* src_bins;
+    struct mc_data* dst_bins;
+    size_t i, n;
+
+    res = mc_receiver_1side_setup_flux_map(dst, &src->flux_map);
+    if(res != RES_OK) goto error;
+
+    n = darray_mc_data_size_get(&src->flux_map_bins);
+    src_bins = darray_mc_data_cdata_get(&src->flux_map_bins);
+    dst_bins = darray_mc_data_data_get(&dst->flux_map_bins);
+    FOR_EACH(i, 0, n) mc_data_accum(dst_bins + i, src_bins + i);
+  }
+
+  /* Merge the per shape MC */
+  htable_shape2mc_begin(&src->shape2mc, &it_shape);
+  htable_shape2mc_end(&src->shape2mc, &end_shape);
+  while(!htable_shape2mc_iterator_eq(&it_shape, &end_shape)) {
+    struct htable_prim2mc_iterator it_prim, end_prim;
+    const struct ssol_shape* shape = *htable_shape2mc_iterator_key_get(&it_shape);
+    struct mc_shape_1side* mc_shape1_src;
+    struct mc_shape_1side* mc_shape1_dst;
+
+    mc_shape1_src = htable_shape2mc_iterator_data_get(&it_shape);
+
+    res = mc_receiver_1side_get_mc_shape(dst, shape, &mc_shape1_dst);
+    if(res != RES_OK) goto error;
+
+    /* Merge the per primitive MC */
+    htable_prim2mc_begin(&mc_shape1_src->prim2mc, &it_prim);
+    htable_prim2mc_end(&mc_shape1_src->prim2mc, &end_prim);
+    while(!htable_prim2mc_iterator_eq(&it_prim, &end_prim)) {
+      const unsigned iprim = *htable_prim2mc_iterator_key_get(&it_prim);
+      struct mc_primitive_1side* mc_prim1_src;
+      struct mc_primitive_1side* mc_prim1_dst;
+
+      mc_prim1_src = htable_prim2mc_iterator_data_get(&it_prim);
+
+      res = mc_shape_1side_get_mc_primitive(mc_shape1_dst, iprim, &mc_prim1_dst);
+      if(res != RES_OK) goto error;
+
+      #define ACCUM_WEIGHT(Name) \
+        mc_data_accum(&mc_prim1_dst->Name, &mc_prim1_src->Name)
+      ACCUM_ALL;
+      #undef ACCUM_WEIGHT
+
+      htable_prim2mc_iterator_next(&it_prim);
+    }
+    htable_shape2mc_iterator_next(&it_shape);
+  }
+  #undef ACCUM_ALL
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+res_T
+estimator_setup_mc_primitives(struct ssol_estimator* estimator)
+{
+  struct htable_receiver_iterator r_it, r_end;
+  res_T res = RES_OK;
+  ASSERT(estimator);
+
+  htable_receiver_begin(&estimator->mc_receivers, &r_it);
+  htable_receiver_end(&estimator->mc_receivers, &r_end);
+  while(!htable_receiver_iterator_eq(&r_it, &r_end)) {
+    struct mc_receiver* mc_rcv = htable_receiver_iterator_data_get(&r_it);
+    const struct ssol_instance* inst = *htable_receiver_iterator_key_get(&r_it);
+    struct mc_receiver_1side* sides[2];
+    int iside;
+    htable_receiver_iterator_next(&r_it);
+
+    sides[0] = inst->receiver_mask & (int)SSOL_FRONT ? &mc_rcv->front : NULL;
+    sides[1] = inst->receiver_mask & (int)SSOL_BACK ? &mc_rcv->back : NULL;
+    FOR_EACH(iside, 0, 2) {
+      struct htable_shape2mc_iterator it, end;
+      if(!sides[iside]) continue;
+
+      htable_shape2mc_begin(&sides[iside]->shape2mc, &it);
+      htable_shape2mc_end(&sides[iside]->shape2mc, &end);
+      while(!htable_shape2mc_iterator_eq(&it, &end)) {
+        const struct ssol_shape* shape = *htable_shape2mc_iterator_key_get(&it);
+        struct mc_shape_1side* mc_shape1;
+        mc_shape1 = htable_shape2mc_iterator_data_get(&it);
+        htable_shape2mc_iterator_next(&it);
+
+        if(!estimator->mc_primitives_views) {
+          darray_double_purge(&mc_shape1->dense);
+          continue;
+        }
+        res = mc_shape_1side_setup_dense
+          (mc_shape1, shape, estimator->realisation_count);
+        if(res != RES_OK) return res;
+      }
+    }
+  }
+  return RES_OK;
+}
+
+res_T
+accum_mc_sampled(struct mc_sampled* dst, struct mc_sampled* src)
+{
+  struct htable_receiver_iterator it, end;
+  struct htable_blocker_iterator b_it, b_end;
+  struct mc_receiver mc_rcv_null;
+  res_T res = RES_OK;
+  ASSERT(dst && src);
+
+  mc_receiver_init(NULL, &mc_rcv_null);
+
+  #define ACCUM_WEIGHT(Name) mc_data_accum(&dst->Name, &src->Name)
+  ACCUM_WEIGHT(cos_factor);
+  ACCUM_WEIGHT(shadowed);
+  ACCUM_WEIGHT(blocked);
+  ACCUM_WEIGHT(missing);
+  ACCUM_WEIGHT(extinguished_by_atmosphere);
+  ACCUM_WEIGHT(other_absorbed);
+  ACCUM_WEIGHT(absorbed_by_receivers);
+  #undef ACCUM_WEIGHT
+
+  dst->nb_samples += src->nb_samples;
+
+  /* dst->by_blocker += src->by_blocker; */
+  htable_blocker_begin(&src->mc_blockers, &b_it);
+  htable_blocker_end(&src->mc_blockers, &b_end);
+  while(!htable_blocker_iterator_eq(&b_it, &b_end)) {
+    struct mc_blocker* src_mc_blocker = htable_blocker_iterator_data_get(&b_it);
+    const struct ssol_instance* inst = *htable_blocker_iterator_key_get(&b_it);
+    struct mc_blocker* dst_mc_blocker;
+    htable_blocker_iterator_next(&b_it);
+
+    res = mc_sampled_get_mc_blocker(dst, inst, &dst_mc_blocker);
+    if(res != RES_OK) goto error;
+    mc_data_accum
+      (&dst_mc_blocker->absorbed_flux, &src_mc_blocker->absorbed_flux);
+    mc_data_accum(&dst_mc_blocker->hits, &src_mc_blocker->hits);
+  }
+
+  /* dst->by_receiver += src->by_receiver; */
+  htable_receiver_begin(&src->mc_rcvs, &it);
+  htable_receiver_end(&src->mc_rcvs, &end);
+  while(!htable_receiver_iterator_eq(&it, &end)) {
+    struct mc_receiver* src_mc_rcv = htable_receiver_iterator_data_get(&it);
+    const struct ssol_instance* inst = *htable_receiver_iterator_key_get(&it);
+    struct mc_receiver* dst_mc_rcv = htable_receiver_find(&dst->mc_rcvs, &inst);
+    htable_receiver_iterator_next(&it);
+
+    if(!dst_mc_rcv) {
+      res = htable_receiver_set(&dst->mc_rcvs, &inst, &mc_rcv_null);
+      if(res != RES_OK) goto error;
+      dst_mc_rcv = htable_receiver_find(&dst->mc_rcvs, &inst);
+    }
+
+    if(inst->receiver_mask & (int)SSOL_FRONT) {
+      res = accum_mc_receivers_1side(&dst_mc_rcv->front, &src_mc_rcv->front);
+      if(res != RES_OK) goto error;
+    }
+    if(inst->receiver_mask & (int)SSOL_BACK) {
+      res = accum_mc_receivers_1side(&dst_mc_rcv->back, &src_mc_rcv->back);
+      if(res != RES_OK) goto error;
+    }
+  }
+exit:
+  mc_receiver_release(&mc_rcv_null);
   return res;
 error:
-  if(estimator->rng) SSP(rng_ref_put(estimator->rng));
   goto exit;
 }
 
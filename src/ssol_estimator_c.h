@@ -20,7 +20,9 @@
 #include "ssol_device_c.h"
 #include "ssol_instance_c.h"
 #include "ssol_shape_c.h"
+#include "ssol_tally_c.h"
 
+#include <rsys/dynamic_array_double.h>
 #include <rsys/ref_count.h>
 #include <rsys/hash_table.h>
 
@@ -87,21 +89,26 @@ mc_data_add_weight
   data->tmp += w;
 }
 
+/* Accumulate `src' into `dst' that is left flushed. `src' is only read: its
+ * pending weight is taken into account without being flushed */
 static INLINE void
-mc_data_accum(struct mc_data* dst, struct mc_data* src)
+mc_data_accum(struct mc_data* dst, const struct mc_data* src)
 {
   ASSERT(dst && src);
   mc_data_flush(dst);
-  mc_data_flush(src);
-  dst->weight__ += src->weight__;
-  dst->sqr_weight__ += src->sqr_weight__;
+  dst->weight__ += src->weight__ + src->tmp;
+  dst->sqr_weight__ += src->sqr_weight__ + src->tmp * src->tmp;
 }
 
+/* Read the accumulated weights. The data must be flushed, which is the case of
+ * the data of an estimator returned by the solver, read from a stream or
+ * resulting from a merge. The data is thus never written on query and can be
+ * read concurrently */
 static INLINE void
-mc_data_get(struct mc_data* data, double* weight, double* sqr_weight)
+mc_data_get(const struct mc_data* data, double* weight, double* sqr_weight)
 {
   ASSERT(data && weight && sqr_weight);
-  mc_data_flush(data);
+  ASSERT(data->tmp == 0);
   *weight = data->weight__;
   *sqr_weight = data->sqr_weight__;
 }
@@ -125,6 +132,19 @@ mc_data_apply_factor
   data->tmp *= factor;
 }
 
+static INLINE void
+mc_data_init_functor(struct mem_allocator* allocator, struct mc_data* data)
+{
+  (void)allocator;
+  mc_data_init(data);
+}
+
+/* Declare the dynamic array of MC data */
+#define DARRAY_NAME mc_data
+#define DARRAY_DATA struct mc_data
+#define DARRAY_FUNCTOR_INIT mc_data_init_functor
+#include <rsys/dynamic_array.h>
+
 /*******************************************************************************
  * One sided per shape MC data
  ******************************************************************************/
@@ -148,6 +168,49 @@ struct mc_primitive_1side {
 static const struct mc_primitive_1side MC_PRIMITIVE_1SIDE_NULL =
   MC_PRIMITIVE_1SIDE_NULL__;
 
+static INLINE const struct mc_data*
+mc_primitive_1side_get_channel
+  (const struct mc_primitive_1side* mc_prim1,
+   const enum ssol_mc_channel channel)
+{
+  const struct mc_data* data = NULL;
+  ASSERT(mc_prim1);
+  switch(channel) {
+    case SSOL_MC_INCOMING_FLUX:
+      data = &mc_prim1->incoming_flux;
+      break;
+    case SSOL_MC_INCOMING_IF_NO_ATM_LOSS:
+      data = &mc_prim1->incoming_if_no_atm_loss;
+      break;
+    case SSOL_MC_INCOMING_IF_NO_FIELD_LOSS:
+      data = &mc_prim1->incoming_if_no_field_loss;
+      break;
+    case SSOL_MC_INCOMING_LOST_IN_FIELD:
+      data = &mc_prim1->incoming_lost_in_field;
+      break;
+    case SSOL_MC_INCOMING_LOST_IN_ATMOSPHERE:
+      data = &mc_prim1->incoming_lost_in_atmosphere;
+      break;
+    case SSOL_MC_ABSORBED_FLUX:
+      data = &mc_prim1->absorbed_flux;
+      break;
+    case SSOL_MC_ABSORBED_IF_NO_ATM_LOSS:
+      data = &mc_prim1->absorbed_if_no_atm_loss;
+      break;
+    case SSOL_MC_ABSORBED_IF_NO_FIELD_LOSS:
+      data = &mc_prim1->absorbed_if_no_field_loss;
+      break;
+    case SSOL_MC_ABSORBED_LOST_IN_FIELD:
+      data = &mc_prim1->absorbed_lost_in_field;
+      break;
+    case SSOL_MC_ABSORBED_LOST_IN_ATMOSPHERE:
+      data = &mc_prim1->absorbed_lost_in_atmosphere;
+      break;
+    default: FATAL("Unreachable code.\n"); break;
+  }
+  return data;
+}
+
 /* Map an unsigned to a struct mc_primitive_1side */
 #define HTABLE_NAME prim2mc
 #define HTABLE_KEY unsigned
@@ -156,6 +219,11 @@ static const struct mc_primitive_1side MC_PRIMITIVE_1SIDE_NULL =
 
 struct mc_shape_1side {
   struct htable_prim2mc prim2mc;
+
+  /* Per primitive results stored as a structure of arrays, i.e. the E and SE
+   * arrays of each channel. Built on demand once the MC weights of the
+   * estimator are final */
+  struct darray_double dense;
 };
 
 static INLINE void
@@ -164,6 +232,7 @@ mc_shape_1side_init
 {
   ASSERT(mc);
   htable_prim2mc_init(allocator, &mc->prim2mc);
+  darray_double_init(allocator, &mc->dense);
 }
 
 static INLINE void
@@ -171,22 +240,29 @@ mc_shape_1side_release(struct mc_shape_1side* mc)
 {
   ASSERT(mc);
   htable_prim2mc_release(&mc->prim2mc);
+  darray_double_release(&mc->dense);
 }
 
 static INLINE res_T
 mc_shape_1side_copy
   (struct mc_shape_1side* dst, const struct mc_shape_1side* src)
 {
+  res_T res = RES_OK;
   ASSERT(dst && src);
-  return htable_prim2mc_copy(&dst->prim2mc, &src->prim2mc);
+  res = htable_prim2mc_copy(&dst->prim2mc, &src->prim2mc);
+  if(res != RES_OK) return res;
+  return darray_double_copy(&dst->dense, &src->dense);
 }
 
 static INLINE res_T
 mc_shape_1side_copy_and_release
   (struct mc_shape_1side* dst, struct mc_shape_1side* src)
 {
+  res_T res = RES_OK;
   ASSERT(dst && src);
-  return htable_prim2mc_copy_and_release(&dst->prim2mc, &src->prim2mc);
+  res = htable_prim2mc_copy_and_release(&dst->prim2mc, &src->prim2mc);
+  if(res != RES_OK) return res;
+  return darray_double_copy_and_release(&dst->dense, &src->dense);
 }
 
 static INLINE res_T
@@ -227,11 +303,40 @@ error:
 #define HTABLE_DATA_FUNCTOR_COPY_AND_RELEASE mc_shape_1side_copy_and_release
 #include <rsys/hash_table.h>
 
+/* Number of MC data per bin of a flux map, i.e. its incoming and its absorbed
+ * flux */
+#define FLUX_MAP_BIN_DATA_COUNT 2
+
 struct mc_receiver_1side {
   MC_RECEIVER_DATA
   struct htable_shape2mc shape2mc;
+
+  /* Flux map of the receiver and the MC data of its bins, stored in row major
+   * order. The bins are allocated on the first binned hit */
+  struct ssol_flux_map flux_map;
+  struct darray_mc_data flux_map_bins;
 };
 
+static FINLINE size_t
+flux_map_bins_count(const struct ssol_flux_map* map)
+{
+  ASSERT(map);
+  return map->definition[0] * map->definition[1];
+}
+
+static FINLINE int
+flux_map_eq(const struct ssol_flux_map* a, const struct ssol_flux_map* b)
+{
+  ASSERT(a && b);
+  return a->domain == b->domain
+      && a->definition[0] == b->definition[0]
+      && a->definition[1] == b->definition[1]
+      && a->lower[0] == b->lower[0]
+      && a->lower[1] == b->lower[1]
+      && a->upper[0] == b->upper[0]
+      && a->upper[1] == b->upper[1];
+}
+
 static FINLINE void
 mc_receiver_1side_copy_mc_weights__
   (struct mc_receiver_1side* dst, const struct mc_receiver_1side* src)
@@ -265,6 +370,8 @@ mc_receiver_1side_init
   mc->absorbed_lost_in_atmosphere = MC_DATA_NULL;
   mc->absorbed_lost_in_field = MC_DATA_NULL;
   htable_shape2mc_init(allocator, &mc->shape2mc);
+  mc->flux_map = SSOL_FLUX_MAP_NULL;
+  darray_mc_data_init(allocator, &mc->flux_map_bins);
 }
 
 static INLINE void
@@ -272,14 +379,19 @@ mc_receiver_1side_release(struct mc_receiver_1side* mc)
 {
   ASSERT(mc);
   htable_shape2mc_release(&mc->shape2mc);
+  darray_mc_data_release(&mc->flux_map_bins);
 }
 
 static INLINE res_T
 mc_receiver_1side_copy
   (struct mc_receiver_1side* dst, const struct mc_receiver_1side* src)
 {
+  res_T res = RES_OK;
   ASSERT(dst && src);
   mc_receiver_1side_copy_mc_weights__(dst, src);
+  dst->flux_map = src->flux_map;
+  res = darray_mc_data_copy(&dst->flux_map_bins, &src->flux_map_bins);
+  if(res != RES_OK) return res;
   return htable_shape2mc_copy(&dst->shape2mc, &src->shape2mc);
 }
 
@@ -287,11 +399,34 @@ static INLINE res_T
 mc_receiver_1side_copy_and_release
   (struct mc_receiver_1side* dst, struct mc_receiver_1side* src)
 {
+  res_T res = RES_OK;
   ASSERT(dst && src);
   mc_receiver_1side_copy_mc_weights__(dst, src);
+  dst->flux_map = src->flux_map;
+  res = darray_mc_data_copy_and_release(&dst->flux_map_bins, &src->flux_map_bins);
+  if(res != RES_OK) return res;
   return htable_shape2mc_copy_and_release(&dst->shape2mc, &src->shape2mc);
 }
 
+/* Allocate the bins of the flux map if they are not already allocated */
+static INLINE res_T
+mc_receiver_1side_setup_flux_map
+  (struct mc_receiver_1side* mc,
+   const struct ssol_flux_map* map)
+{
+  res_T res = RES_OK;
+  ASSERT(mc && map && flux_map_bins_count(map));
+
+  if(darray_mc_data_size_get(&mc->flux_map_bins)) {
+    return flux_map_eq(&mc->flux_map, map) ? RES_OK : RES_BAD_ARG;
+  }
+  res = darray_mc_data_resize
+    (&mc->flux_map_bins, flux_map_bins_count(map) * FLUX_MAP_BIN_DATA_COUNT);
+  if(res != RES_OK) return res;
+  mc->flux_map = *map;
+  return RES_OK;
+}
+
 static INLINE res_T
 mc_receiver_1side_get_mc_shape
   (struct mc_receiver_1side* mc_rcv,
@@ -380,6 +515,30 @@ mc_receiver_copy_and_release
 #define HTABLE_DATA_FUNCTOR_COPY_AND_RELEASE mc_receiver_copy_and_release
 #include <rsys/hash_table.h>
 
+/*******************************************************************************
+ * Per blocking instance MC data
+ ******************************************************************************/
+struct mc_blocker {
+  struct mc_data absorbed_flux; /* In W */
+  struct mc_data hits; /* Number of hits */
+};
+
+static INLINE void
+mc_blocker_init(struct mem_allocator* allocator, struct mc_blocker* blocker)
+{
+  ASSERT(blocker);
+  (void)allocator;
+  blocker->absorbed_flux = MC_DATA_NULL;
+  blocker->hits = MC_DATA_NULL;
+}
+
+/* Define the htable_blocker data structure */
+#define HTABLE_NAME blocker
+#define HTABLE_KEY const struct ssol_instance*
+#define HTABLE_DATA struct mc_blocker
+#define HTABLE_DATA_FUNCTOR_INIT mc_blocker_init
+#include <rsys/hash_table.h>
+
 /*******************************************************************************
  * Per sampled instance MC data
  ******************************************************************************/
@@ -387,12 +546,35 @@ struct mc_sampled {
   /* Global data for this entity */
   struct mc_data cos_factor;
   struct mc_data shadowed;
+  struct mc_data blocked; /* Absorbed by the other non receivers */
+  struct mc_data missing;
+  struct mc_data extinguished_by_atmosphere;
+  struct mc_data other_absorbed;
+  struct mc_data absorbed_by_receivers;
   size_t nb_samples;
 
   /* By-receptor data for this entity */
   struct htable_receiver mc_rcvs;
+
+  /* By-blocker data for this entity */
+  struct htable_blocker mc_blockers;
 };
 
+static INLINE void
+mc_sampled_copy_mc_weights__
+  (struct mc_sampled* dst, const struct mc_sampled* src)
+{
+  ASSERT(dst && src);
+  dst->cos_factor = src->cos_factor;
+  dst->shadowed = src->shadowed;
+  dst->blocked = src->blocked;
+  dst->missing = src->missing;
+  dst->extinguished_by_atmosphere = src->extinguished_by_atmosphere;
+  dst->other_absorbed = src->other_absorbed;
+  dst->absorbed_by_receivers = src->absorbed_by_receivers;
+  dst->nb_samples = src->nb_samples;
+}
+
 static INLINE void
 mc_sampled_init
   (struct mem_allocator* allocator,
@@ -401,8 +583,14 @@ mc_sampled_init
   ASSERT(samp);
   samp->cos_factor = MC_DATA_NULL;
   samp->shadowed = MC_DATA_NULL;
+  samp->blocked = MC_DATA_NULL;
+  samp->missing = MC_DATA_NULL;
+  samp->extinguished_by_atmosphere = MC_DATA_NULL;
+  samp->other_absorbed = MC_DATA_NULL;
+  samp->absorbed_by_receivers = MC_DATA_NULL;
   samp->nb_samples = 0;
   htable_receiver_init(allocator, &samp->mc_rcvs);
+  htable_blocker_init(allocator, &samp->mc_blockers);
 }
 
 static INLINE void
@@ -410,26 +598,51 @@ mc_sampled_release(struct mc_sampled* samp)
 {
   ASSERT(samp);
   htable_receiver_release(&samp->mc_rcvs);
+  htable_blocker_release(&samp->mc_blockers);
 }
 
 static INLINE res_T
 mc_sampled_copy(struct mc_sampled* dst, const struct mc_sampled* src)
 {
+  res_T res = RES_OK;
   ASSERT(dst && src);
-  dst->cos_factor = src->cos_factor;
-  dst->shadowed = src->shadowed;
-  dst->nb_samples = src->nb_samples;
-  return htable_receiver_copy(&dst->mc_rcvs, &src->mc_rcvs);
+  mc_sampled_copy_mc_weights__(dst, src);
+  res = htable_receiver_copy(&dst->mc_rcvs, &src->mc_rcvs);
+  if(res != RES_OK) return res;
+  return htable_blocker_copy(&dst->mc_blockers, &src->mc_blockers);
 }
 
 static INLINE res_T
 mc_sampled_copy_and_release(struct mc_sampled* dst, struct mc_sampled* src)
 {
+  res_T res = RES_OK;
   ASSERT(dst && src);
-  dst->cos_factor = src->cos_factor;
-  dst->shadowed = src->shadowed;
-  dst->nb_samples = src->nb_samples;
-  return htable_receiver_copy_and_release(&dst->mc_rcvs, &src->mc_rcvs);
+  mc_sampled_copy_mc_weights__(dst, src);
+  res = htable_receiver_copy_and_release(&dst->mc_rcvs, &src->mc_rcvs);
+  if(res != RES_OK) return res;
+  return htable_blocker_copy_and_release(&dst->mc_blockers, &src->mc_blockers);
+}
+
+static INLINE res_T
+mc_sampled_get_mc_blocker
+  (struct mc_sampled* mc_samp,
+   const struct ssol_instance* inst,
+   struct mc_blocker** out_mc_blocker)
+{
+  struct mc_blocker* mc_blocker = NULL;
+  struct mc_blocker mc_blocker_null;
+  res_T res = RES_OK;
+  ASSERT(mc_samp && inst && out_mc_blocker);
+
+  mc_blocker = htable_blocker_find(&mc_samp->mc_blockers, &inst);
+  if(!mc_blocker) {
+    mc_blocker_init(NULL, &mc_blocker_null);
+    res = htable_blocker_set(&mc_samp->mc_blockers, &inst, &mc_blocker_null);
+    if(res != RES_OK) return res;
+    mc_blocker = htable_blocker_find(&mc_samp->mc_blockers, &inst);
+  }
+  *out_mc_blocker = mc_blocker;
+  return RES_OK;
 }
 
 static INLINE res_T
@@ -546,6 +759,13 @@ path_add_vertex(struct path* path, const double pos[3], const double weight)
 #define DARRAY_FUNCTOR_COPY_AND_RELEASE path_copy_and_release
 #include <rsys/dynamic_array.h>
 
+/*******************************************************************************
+ * Recorded hits
+ ******************************************************************************/
+#define DARRAY_NAME hit
+#define DARRAY_DATA struct ssol_hit
+#include <rsys/dynamic_array.h>
+
 /*******************************************************************************
  * Estimator data structure
  ******************************************************************************/
@@ -565,6 +785,11 @@ struct ssol_estimator {
   struct htable_sampled mc_sampled; /* Per sampled instance MC */
 
   struct darray_path paths; /* Tracked paths */
+  struct darray_hit hits; /* Recorded hits */
+  struct darray_tally_data tallies; /* Merged data of the scene tallies */
+  enum ssol_accounting accounting; /* Quantities estimated by the solve */
+  int stratified; /* Are the realisations stratified per sampled instance */
+  int mc_primitives_views; /* Are the per primitive views built */
 
   /* Overall area of the sampled instances. Actually this is not the area that
    * is effectively sampled since an instance may be sampled through a proxy
@@ -589,6 +814,35 @@ estimator_save_rng_state
   (struct ssol_estimator* estimator,
    const struct ssp_rng_proxy* proxy);
 
+/* Add the MC weights of `src' to the ones of `dst', including its per shape
+ * and per primitive estimations */
+extern LOCAL_SYM res_T
+accum_mc_receivers_1side
+  (struct mc_receiver_1side* dst,
+   struct mc_receiver_1side* src);
+
+/* Add the MC weights of `src' to the ones of `dst', including its per
+ * receiver estimations */
+extern LOCAL_SYM res_T
+accum_mc_sampled
+  (struct mc_sampled* dst,
+   struct mc_sampled* src);
+
+/* Compute the dense per primitive estimations of `shape' from the MC weights
+ * of `mc_shape1' estimated over `N' realisations */
+extern LOCAL_SYM res_T
+mc_shape_1side_setup_dense
+  (struct mc_shape_1side* mc_shape1,
+   const struct ssol_shape* shape,
+   const size_t N);
+
+/* Update the dense per primitive estimations of the receivers wrt their MC
+ * weights. They are computed if the primitives views of the estimator are
+ * enabled, and released otherwise */
+extern LOCAL_SYM res_T
+estimator_setup_mc_primitives
+  (struct ssol_estimator* estimator);
+
 static FINLINE res_T
 get_mc_receiver_1side
   (struct htable_receiver* receivers,
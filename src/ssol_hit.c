@@ -0,0 +1,299 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "ssol_c.h"
+#include "ssol_device_c.h"
+#include "ssol_estimator_c.h"
+
+#include <rsys/math.h>
+
+#include <math.h>
+#include <omp.h>
+
+/* The gaussian kernel is truncated at 3 standard deviations. Its weights are
+ * renormalised by the inverse of the integral of the truncated kernel */
+#define GAUSSIAN_SUPPORT 3.0
+#define GAUSSIAN_NORM (1.0 / (1.0 - 0.011108996538242306 /* exp(-4.5) */))
+
+/*******************************************************************************
+ * Helper functions
+ ******************************************************************************/
+static int
+check_kernel(const struct ssol_kernel* kernel)
+{
+  if(!kernel) return 0;
+  switch(kernel->type) {
+    case SSOL_KERNEL_BOX: return 1;
+    case SSOL_KERNEL_EPANECHNIKOV:
+    case SSOL_KERNEL_GAUSSIAN: return kernel->bandwidth > 0;
+    default: return 0;
+  }
+}
+
+static int
+check_flux_map(const struct ssol_flux_map* map)
+{
+  return map
+      && map->domain == SSOL_FLUX_MAP_LOCAL_XY
+      && map->definition[0] && map->definition[1]
+      && map->lower[0] < map->upper[0]
+      && map->lower[1] < map->upper[1];
+}
+
+/* Return the support radius of the kernel; 0 for the box kernel */
+static double
+kernel_support(const struct ssol_kernel* kernel)
+{
+  ASSERT(check_kernel(kernel));
+  switch(kernel->type) {
+    case SSOL_KERNEL_BOX: return 0;
+    case SSOL_KERNEL_EPANECHNIKOV: return kernel->bandwidth;
+    case SSOL_KERNEL_GAUSSIAN: return kernel->bandwidth * GAUSSIAN_SUPPORT;
+    default: FATAL("Unreachable code.\n"); break;
+  }
+  return 0;
+}
+
+/* Evaluate the 2D kernel for a squared distance `d2' */
+static double
+kernel_eval(const struct ssol_kernel* kernel, const double d2)
+{
+  const double h = kernel->bandwidth;
+  double k = 0;
+  ASSERT(check_kernel(kernel) && kernel->type != SSOL_KERNEL_BOX && d2 >= 0);
+  switch(kernel->type) {
+    case SSOL_KERNEL_EPANECHNIKOV:
+      if(d2 < h*h) k = 2.0 / (PI*h*h) * (1.0 - d2/(h*h));
+      break;
+    case SSOL_KERNEL_GAUSSIAN:
+      if(d2 < GAUSSIAN_SUPPORT*GAUSSIAN_SUPPORT*h*h) {
+        k = exp(-d2 / (2*h*h)) / (2*PI*h*h) * GAUSSIAN_NORM;
+      }
+      break;
+    default: FATAL("Unreachable code.\n"); break;
+  }
+  return k;
+}
+
+/* Clamp the real bin coordinate `u' in [0, n-1] */
+static FINLINE size_t
+bin_clamp(const double u, const size_t n)
+{
+  if(u <= 0) return 0;
+  if(u >= (double)(n-1)) return n-1;
+  return (size_t)u;
+}
+
+/* Splat the hits onto the bins of the rows [row_begin, row_end[ */
+static void
+splat_hits
+  (const struct ssol_hit* hits,
+   const size_t nhits,
+   const uint32_t id,
+   const enum ssol_side_flag side,
+   const int absorbed,
+   const struct ssol_flux_map* map,
+   const struct ssol_kernel* kernel,
+   const size_t row_begin,
+   const size_t row_end,
+   struct mc_data* bins)
+{
+  const double radius = kernel_support(kernel);
+  double size[2];
+  double bin_area;
+  size_t ihit;
+  ASSERT(hits && map && kernel && row_begin < row_end && bins);
+  ASSERT(row_end <= map->definition[1]);
+
+  size[0] = (map->upper[0] - map->lower[0]) / (double)map->definition[0];
+  size[1] = (map->upper[1] - map->lower[1]) / (double)map->definition[1];
+  bin_area = size[0] * size[1];
+
+  FOR_EACH(ihit, 0, nhits) {
+    const struct ssol_hit* hit = hits + ihit;
+    const double w = absorbed ? hit->absorbed_flux : hit->incoming_flux;
+    size_t x, y, x0, x1, y0, y1;
+
+    if(hit->instance != id || hit->side != (uint32_t)side) continue;
+
+    if(kernel->type == SSOL_KERNEL_BOX) {
+      double u[2];
+      u[0] = (hit->pos[0] - map->lower[0]) / size[0];
+      u[1] = (hit->pos[1] - map->lower[1]) / size[1];
+      if(u[0] < 0 || u[0] >= (double)map->definition[0]
+      || u[1] < 0 || u[1] >= (double)map->definition[1])
+        continue; /* The hit lies outside the map */
+      y = MMIN((size_t)u[1], map->definition[1]-1);
+      if(y < row_begin || y >= row_end) continue;
+      x = MMIN((size_t)u[0], map->definition[0]-1);
+      mc_data_add_weight
+        (bins + y*map->definition[0] + x, (size_t)hit->realisation, w/bin_area);
+      continue;
+    }
+
+    /* Discard the hits whose kernel does not overlap the map */
+    if(hit->pos[0] + radius < map->lower[0]
+    || hit->pos[0] - radius > map->upper[0]
+    || hit->pos[1] + radius < map->lower[1]
+    || hit->pos[1] - radius > map->upper[1])
+      continue;
+
+    /* Range of bins whose center may lie in the kernel support */
+    x0 = bin_clamp((hit->pos[0]-radius-map->lower[0])/size[0] - 0.5,
+      map->definition[0]);
+    x1 = bin_clamp((hit->pos[0]+radius-map->lower[0])/size[0] + 0.5,
+      map->definition[0]);
+    y0 = bin_clamp((hit->pos[1]-radius-map->lower[1])/size[1] - 0.5,
+      map->definition[1]);
+    y1 = bin_clamp((hit->pos[1]+radius-map->lower[1])/size[1] + 0.5,
+      map->definition[1]);
+    y0 = MMAX(y0, row_begin);
+    y1 = MMIN(y1, row_end-1);
+
+    for(y = y0; y <= y1; ++y) {
+      const double dy = map->lower[1] + ((double)y + 0.5)*size[1] - hit->pos[1];
+      FOR_EACH(x, x0, x1+1) {
+        const double dx =
+          map->lower[0] + ((double)x + 0.5)*size[0] - hit->pos[0];
+        const double k = kernel_eval(kernel, dx*dx + dy*dy);
+        if(k == 0) continue;
+        mc_data_add_weight
+          (bins + y*map->definition[0] + x, (size_t)hit->realisation, w*k);
+      }
+    }
+  }
+}
+
+/*******************************************************************************
+ * Exported functions
+ ******************************************************************************/
+res_T
+ssol_estimator_get_hits
+  (const struct ssol_estimator* estimator,
+   const struct ssol_hit** hits,
+   size_t* count)
+{
+  if(!estimator || !hits || !count) return RES_BAD_ARG;
+  *hits = darray_hit_cdata_get(&estimator->hits);
+  *count = darray_hit_size_get(&estimator->hits);
+  return RES_OK;
+}
+
+res_T
+ssol_estimator_write_hits(const struct ssol_estimator* estimator, FILE* stream)
+{
+  size_t nhits;
+  if(!estimator || !stream) return RES_BAD_ARG;
+  nhits = darray_hit_size_get(&estimator->hits);
+  if(!nhits) return RES_OK;
+  if(fwrite(darray_hit_cdata_get(&estimator->hits), sizeof(struct ssol_hit),
+    nhits, stream) != nhits) {
+    log_error(estimator->dev, "%s: could not write the recorded hits.\n",
+      FUNC_NAME);
+    return RES_IO_ERR;
+  }
+  return RES_OK;
+}
+
+res_T
+ssol_estimator_build_flux_map
+  (const struct ssol_estimator* estimator,
+   const struct ssol_instance* instance,
+   const enum ssol_side_flag side,
+   const enum ssol_mc_channel channel,
+   const struct ssol_flux_map* map,
+   const struct ssol_kernel* kernel,
+   struct ssol_image* image)
+{
+  struct ssol_image_layout layout = SSOL_IMAGE_LAYOUT_NULL;
+  struct darray_mc_data bins;
+  const struct ssol_hit* hits;
+  char* mem = NULL;
+  double N;
+  size_t nhits, nbins, nbands;
+  size_t x, y;
+  int64_t iband;
+  uint32_t id;
+  res_T res = RES_OK;
+
+  if(!estimator || !instance || !image || !check_flux_map(map)
+  || !check_kernel(kernel)
+  || (side != SSOL_FRONT && side != SSOL_BACK)
+  || (channel != SSOL_MC_INCOMING_FLUX && channel != SSOL_MC_ABSORBED_FLUX))
+    return RES_BAD_ARG;
+
+  darray_mc_data_init(estimator->dev->allocator, &bins);
+
+  nbins = flux_map_bins_count(map);
+  res = darray_mc_data_resize(&bins, nbins);
+  if(res != RES_OK) goto error;
+
+  res = ssol_image_setup
+    (image, map->definition[0], map->definition[1], SSOL_PIXEL_DOUBLE3);
+  if(res != RES_OK) goto error;
+
+  SSOL(instance_get_id(instance, &id));
+  hits = darray_hit_cdata_get(&estimator->hits);
+  nhits = darray_hit_size_get(&estimator->hits);
+
+  /* Each thread splats the whole list of hits onto its own band of rows. The
+   * bins are thus updated by only one thread and in the realisation order */
+  nbands = MMIN((size_t)estimator->dev->nthreads, map->definition[1]);
+  #pragma omp parallel for schedule(static, 1) \
+    num_threads(estimator->dev->nthreads)
+  for(iband = 0; iband < (int64_t)nbands; ++iband) {
+    const size_t row_begin = (size_t)iband * map->definition[1] / nbands;
+    const size_t row_end = (size_t)(iband+1) * map->definition[1] / nbands;
+    if(row_begin == row_end) continue;
+    splat_hits(hits, nhits, id, side, channel == SSOL_MC_ABSORBED_FLUX, map,
+      kernel, row_begin, row_end, darray_mc_data_data_get(&bins));
+  }
+
+  SSOL(image_get_layout(image, &layout));
+  SSOL(image_map(image, &mem));
+
+  N = (double)estimator->realisation_count;
+  FOR_EACH(y, 0, map->definition[1]) {
+    double* row = (double*)(mem + layout.offset + y*layout.row_pitch);
+    FOR_EACH(x, 0, map->definition[0]) {
+      struct mc_data* bin = darray_mc_data_data_get(&bins)
+        + y*map->definition[0] + x;
+      struct ssol_mc_result result = SSOL_MC_RESULT_NULL;
+      double* pixel = row + x*3;
+
+      if(N > 0) {
+        double weight, sqr_weight;
+        mc_data_flush(bin);
+        mc_data_get(bin, &weight, &sqr_weight);
+        result.E = weight / N;
+        result.V = sqr_weight/N - result.E*result.E;
+        result.V = result.V > 0 ? result.V : 0;
+        result.SE = sqrt(result.V / N);
+      }
+      pixel[0] = result.E;
+      pixel[1] = result.V;
+      pixel[2] = result.SE;
+    }
+  }
+  SSOL(image_unmap(image));
+
+exit:
+  darray_mc_data_release(&bins);
+  return res;
+error:
+  goto exit;
+}
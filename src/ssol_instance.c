@@ -80,8 +80,11 @@ ssol_object_instantiate
   instance->dev = dev;
   instance->object = object;
   instance->sample = 1;
+  instance->sampling_quota = 1;
+  instance->flux_map = SSOL_FLUX_MAP_NULL;
   d33_set_identity(instance->transform);
   d3_splat(instance->transform + 9, 0);
+  d33_set_identity(instance->normal_transform);
 
   /* Create the Star-3D instance to ray-trace */
   res = s3d_scene_instantiate(object->scn_rt, &instance->shape_rt);
@@ -140,6 +143,8 @@ ssol_instance_set_transform
     t[i] = (float) transform[i];
     instance->transform[i] = transform[i];
   }
+  /* The affine part of the transformation does not influence the normals */
+  d33_invtrans(instance->normal_transform, instance->transform);
 
   res = s3d_instance_set_transform(instance->shape_rt, t);
   if(res != RES_OK) goto error;
@@ -177,6 +182,34 @@ ssol_instance_is_receiver
   return RES_OK;
 }
 
+res_T
+ssol_instance_set_receiver_flux_map
+  (struct ssol_instance* instance,
+   const struct ssol_flux_map* map)
+{
+  if(!instance) return RES_BAD_ARG;
+  if(!map || !map->definition[0] || !map->definition[1]) {
+    instance->flux_map = SSOL_FLUX_MAP_NULL;
+    return RES_OK;
+  }
+  if((map->domain != SSOL_FLUX_MAP_UV && map->domain != SSOL_FLUX_MAP_LOCAL_XY)
+  || map->lower[0] >= map->upper[0]
+  || map->lower[1] >= map->upper[1])
+    return RES_BAD_ARG;
+  instance->flux_map = *map;
+  return RES_OK;
+}
+
+res_T
+ssol_instance_get_receiver_flux_map
+  (const struct ssol_instance* instance,
+   struct ssol_flux_map* map)
+{
+  if(!instance || !map) return RES_BAD_ARG;
+  *map = instance->flux_map;
+  return RES_OK;
+}
+
 res_T
 ssol_instance_sample
   (struct ssol_instance* instance,
@@ -187,6 +220,36 @@ ssol_instance_sample
   return RES_OK;
 }
 
+res_T
+ssol_instance_record_hits
+  (struct ssol_instance* instance,
+   const int record)
+{
+  if(!instance) return RES_BAD_ARG;
+  instance->record_hits = record;
+  return RES_OK;
+}
+
+res_T
+ssol_instance_absorb_all
+  (struct ssol_instance* instance,
+   const int absorb_all)
+{
+  if(!instance) return RES_BAD_ARG;
+  instance->absorb_all = absorb_all;
+  return RES_OK;
+}
+
+res_T
+ssol_instance_set_sampling_quota
+  (struct ssol_instance* instance,
+   const double quota)
+{
+  if(!instance || !(quota > 0)) return RES_BAD_ARG;
+  instance->sampling_quota = quota;
+  return RES_OK;
+}
+
 res_T
 ssol_instance_get_id(const struct ssol_instance* instance, uint32_t* id)
 {
@@ -17,6 +17,8 @@
 #ifndef SSOL_INSTANCE_C_H
 #define SSOL_INSTANCE_C_H
 
+#include "ssol.h"
+
 #include <rsys/free_list.h>
 #include <rsys/list.h>
 #include <rsys/ref_count.h>
@@ -27,9 +29,14 @@ struct ssol_instance {
   struct s3d_shape* shape_samp; /* Instantiated Star-3D shape to sample */
   double shape_rt_area, shape_samp_area;
   double transform[12]; /* Column major 4x3 affine transformation */
+  double normal_transform[9]; /* Inverse transpose of the linear transform */
   int receiver_mask; /* Combination of ssol_side_flag */
   int receiver_per_primitive; /* Enable the per primitive receiver */
+  struct ssol_flux_map flux_map; /* Receiver flux map */
+  int record_hits; /* Record the hits onto the receiver */
+  int absorb_all; /* The receiver sides are perfect absorbers */
   int sample; /* Define whether or not the instance should be sampled */
+  double sampling_quota; /* Relative #realisations of a stratified solve */
 
   struct fid id; /* Unique identifier */
 
@@ -17,15 +17,16 @@
 #include "ssol.h"
 #include "ssol_c.h"
 #include "ssol_device_c.h"
+#include "ssol_instance_c.h"
 #include "ssol_material_c.h"
+#include "ssol_shape_c.h"
+#include "ssol_slope_distribution_c.h"
 #include "ssol_spectrum_c.h"
 
 #include <rsys/double2.h>
 #include <rsys/double3.h>
 #include <rsys/double33.h>
 #include <rsys/float2.h>
-#include <rsys/float3.h>
-#include <rsys/float33.h>
 #include <rsys/ref_count.h>
 #include <rsys/rsys.h>
 #include <rsys/mem_allocator.h>
@@ -38,6 +39,14 @@
 /*******************************************************************************
  * Helper functions
  ******************************************************************************/
+static FINLINE int
+medium_is_gray(const struct ssol_medium* medium)
+{
+  ASSERT(medium);
+  return medium->extinction.type == SSOL_DATA_REAL
+      && medium->refractive_index.type == SSOL_DATA_REAL;
+}
+
 /* Define if the submitted ssol_data are *certainly* equals or not. Note that it
  * does not check explicitly the spectrum data since it would be too expensive;
  * it compares their checksum and that's why one cannot certify that the data
@@ -79,6 +88,143 @@ shade_normal_default
   d3_set(val, frag->Ns);
 }
 
+static FINLINE double
+mirror_get_reflectivity
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* frag,
+   const double wavelength)
+{
+  double val;
+  ASSERT(mtl && mtl->type == SSOL_MATERIAL_MIRROR);
+  if(mtl->uniform) {
+    return ssol_data_get_value
+      (&mtl->data.mirror.uniform_reflectivity, wavelength);
+  }
+  mtl->data.mirror.reflectivity(mtl->dev, mtl->buf, wavelength, frag, &val);
+  return val;
+}
+
+static FINLINE double
+mirror_get_roughness
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* frag,
+   const double wavelength)
+{
+  double val;
+  ASSERT(mtl && mtl->type == SSOL_MATERIAL_MIRROR);
+  if(mtl->uniform) {
+    return ssol_data_get_value
+      (&mtl->data.mirror.uniform_roughness, wavelength);
+  }
+  mtl->data.mirror.roughness(mtl->dev, mtl->buf, wavelength, frag, &val);
+  return val;
+}
+
+static FINLINE double
+matte_get_reflectivity
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* frag,
+   const double wavelength)
+{
+  double val;
+  ASSERT(mtl && mtl->type == SSOL_MATERIAL_MATTE);
+  if(mtl->uniform) {
+    return ssol_data_get_value
+      (&mtl->data.matte.uniform_reflectivity, wavelength);
+  }
+  mtl->data.matte.reflectivity(mtl->dev, mtl->buf, wavelength, frag, &val);
+  return val;
+}
+
+/* Return whether the data has the same value at the `count' wavelengths */
+static int
+data_is_constant
+  (const struct ssol_data* data,
+   const size_t count,
+   const double* wavelengths)
+{
+  double val;
+  size_t i;
+  ASSERT(data && count && wavelengths);
+
+  if(data->type == SSOL_DATA_REAL) return 1;
+  val = ssol_data_get_value(data, wavelengths[0]);
+  FOR_EACH(i, 1, count) {
+    if(ssol_data_get_value(data, wavelengths[i]) != val) return 0;
+  }
+  return 1;
+}
+
+/* Fetch a parameter of the material at `count' wavelengths for the same
+ * fragment. Rely on the batched getter of the parameter if it is defined */
+static void
+get_spectral_values
+  (const struct ssol_material* mtl,
+   ssol_shader_getter_T getter,
+   ssol_shader_batch_getter_T batch, /* May be NULL */
+   const struct ssol_data* uniform_value, /* Value of a uniform material */
+   const struct ssol_surface_fragment* frag,
+   const size_t count,
+   const double* wavelengths,
+   double* vals)
+{
+  size_t i;
+  ASSERT(mtl && frag && count <= SSOL_MAX_PATH_WAVELENGTHS);
+  ASSERT(wavelengths && vals);
+
+  if(mtl->uniform) {
+    FOR_EACH(i, 0, count) {
+      vals[i] = ssol_data_get_value(uniform_value, wavelengths[i]);
+    }
+  } else if(!batch) {
+    FOR_EACH(i, 0, count) {
+      getter(mtl->dev, mtl->buf, wavelengths[i], frag, vals + i);
+    }
+  } else {
+    struct ssol_surface_fragment frags[SSOL_MAX_PATH_WAVELENGTHS];
+    FOR_EACH(i, 0, count) frags[i] = *frag;
+    batch(mtl->dev, mtl->buf, count, wavelengths, frags, vals);
+  }
+}
+
+/* Return the shading objects of the calling thread */
+static FINLINE struct shading_pool*
+get_shading_pool(const struct ssol_material* mtl)
+{
+  const int ithread = omp_get_thread_num();
+  ASSERT(mtl && (unsigned)ithread < mtl->dev->nthreads);
+  return mtl->dev->shading_pools + ithread;
+}
+
+/* Define the partial derivatives of the fragment from the X and Y axis of the
+ * instance projected onto the surface. Unlike the implicit texture mapping of
+ * the shapes without texcoords, whose derivatives follow the edges of each
+ * triangle, this frame is continuous over the instance */
+static void
+fragment_setup_instance_frame
+  (struct ssol_surface_fragment* fragment,
+   const struct ssol_instance* instance)
+{
+  double tmp[3];
+  const double* X = instance->transform + 0; /* World space X axis */
+  const double* Y = instance->transform + 3; /* World space Y axis */
+  ASSERT(fragment && instance);
+
+  d3_sub(fragment->dPdu, X,
+    d3_muld(tmp, fragment->Ng, d3_dot(fragment->Ng, X)));
+  if(d3_normalize(fragment->dPdu, fragment->dPdu) <= 0) {
+    /* The X axis is aligned with the normal */
+    d3_sub(fragment->dPdu, Y,
+      d3_muld(tmp, fragment->Ng, d3_dot(fragment->Ng, Y)));
+    if(d3_normalize(fragment->dPdu, fragment->dPdu) <= 0) {
+      double basis[9];
+      d33_basis(basis, fragment->Ng);
+      d3_set(fragment->dPdu, basis + 0);
+    }
+  }
+  d3_cross(fragment->dPdv, fragment->Ng, fragment->dPdu);
+}
+
 static res_T
 create_dielectric_bsdf
   (const struct ssol_material* mtl,
@@ -87,8 +233,8 @@ create_dielectric_bsdf
    const struct ssol_medium* medium,
    struct ssf_bsdf** bsdf)
 {
+  struct shading_pool* pool = get_shading_pool(mtl);
   double eta_i, eta_t;
-  const int ithread = omp_get_thread_num();
   res_T res = RES_OK;
   ASSERT(mtl && fragment && mtl->type == SSOL_MATERIAL_DIELECTRIC);
   ASSERT(medium && bsdf);
@@ -103,16 +249,38 @@ create_dielectric_bsdf
   eta_i = ssol_data_get_value(&mtl->out_medium.refractive_index, wavelength);
   eta_t = ssol_data_get_value(&mtl->in_medium.refractive_index, wavelength);
 
-  #define CALL(Func) { res = Func; if(res != RES_OK) goto error; } (void)0
-  CALL(ssf_bsdf_create(&mtl->dev->bsdf_allocators[ithread],
-    &ssf_specular_dielectric_dielectric_interface, bsdf));
-  CALL(ssf_specular_dielectric_dielectric_interface_setup(*bsdf, eta_i, eta_t));
-  #undef CALL
+  res = ssf_specular_dielectric_dielectric_interface_setup
+    (pool->dielectric, eta_i, eta_t);
+  if(res != RES_OK) goto error;
+
+  SSF(bsdf_ref_get(pool->dielectric));
+  *bsdf = pool->dielectric;
+
+exit:
+  return res;
+error:
+  goto exit;
+}
+
+static res_T
+setup_matte_bsdf
+  (const struct ssol_material* mtl,
+   const double reflectivity,
+   struct ssf_bsdf** bsdf)
+{
+  struct shading_pool* pool = get_shading_pool(mtl);
+  res_T res;
+  ASSERT(mtl && mtl->type == SSOL_MATERIAL_MATTE && bsdf);
+
+  res = ssf_lambertian_reflection_setup(pool->lambertian, reflectivity);
+  if(res != RES_OK) goto error;
+
+  SSF(bsdf_ref_get(pool->lambertian));
+  *bsdf = pool->lambertian;
 
 exit:
   return res;
 error:
-  if(*bsdf) SSF(bsdf_ref_put(*bsdf)), bsdf = NULL;
   goto exit;
 }
 
@@ -123,110 +291,113 @@ create_matte_bsdf
    const double wavelength, /* In nanometer */
    struct ssf_bsdf** bsdf)
 {
-  double reflectivity;
-  const int ithread = omp_get_thread_num();
-  res_T res;
   ASSERT(mtl && fragment && mtl->type == SSOL_MATERIAL_MATTE);
-  ASSERT(bsdf);
+  return setup_matte_bsdf
+    (mtl, matte_get_reflectivity(mtl, fragment, wavelength), bsdf);
+}
 
-  /* Fetch material attribs */
-  mtl->data.matte.reflectivity
-    (mtl->dev, mtl->buf, wavelength, fragment, &reflectivity);
+/* Black BRDF used to render the absorbers */
+static res_T
+create_absorber_bsdf
+  (const struct ssol_material* mtl,
+   struct ssf_bsdf** bsdf)
+{
+  struct shading_pool* pool = get_shading_pool(mtl);
+  res_T res;
+  ASSERT(mtl && mtl->type == SSOL_MATERIAL_ABSORBER && bsdf);
 
-  /* Setup the BRDF */
-  res = ssf_bsdf_create
-    (&mtl->dev->bsdf_allocators[ithread], &ssf_lambertian_reflection, bsdf);
-  if(res != RES_OK) goto error;
-  res = ssf_lambertian_reflection_setup(*bsdf, reflectivity);
+  res = ssf_lambertian_reflection_setup(pool->lambertian, 0);
   if(res != RES_OK) goto error;
 
+  SSF(bsdf_ref_get(pool->lambertian));
+  *bsdf = pool->lambertian;
+
 exit:
   return res;
 error:
-  if(*bsdf) SSF(bsdf_ref_put(*bsdf)), bsdf = NULL;
   goto exit;
 }
 
 static res_T
-create_mirror_bsdf
+setup_mirror_bsdf
   (const struct ssol_material* mtl,
    const struct ssol_surface_fragment* fragment,
-   const double wavelength, /* In nanometer */
+   const double reflectivity,
+   const double roughness,
    const int rendering,
    struct ssf_bsdf** bsdf)
 {
-  struct ssf_fresnel* fresnel = NULL;
+  struct shading_pool* pool = get_shading_pool(mtl);
   struct ssf_microfacet_distribution* distrib = NULL;
-  double roughness;
-  double reflectivity;
-  const int ithread = omp_get_thread_num();
+  struct ssf_bsdf* brdf = NULL;
   res_T res;
-  ASSERT(mtl && fragment && mtl->type == SSOL_MATERIAL_MIRROR);
-  ASSERT(bsdf);
-
-  /* Fetch material attribs */
-  mtl->data.mirror.reflectivity
-    (mtl->dev, mtl->buf, wavelength, fragment, &reflectivity);
-  mtl->data.mirror.roughness
-    (mtl->dev, mtl->buf, wavelength, fragment, &roughness);
+  ASSERT(mtl && fragment && mtl->type == SSOL_MATERIAL_MIRROR && bsdf);
 
   /* Setup the fresnel term */
-  res = ssf_fresnel_create(mtl->dev->allocator, &ssf_fresnel_constant, &fresnel);
-  if(res != RES_OK) goto error;
-  res = ssf_fresnel_constant_setup(fresnel, reflectivity);
+  res = ssf_fresnel_constant_setup(pool->fresnel_constant, reflectivity);
   if(res != RES_OK) goto error;
 
   /* Setup the BRDF */
-  if(roughness == 0) { /* Purely specular reflection */
-    res = ssf_bsdf_create
-      (&mtl->dev->bsdf_allocators[ithread], &ssf_specular_reflection, bsdf);
-    if(res != RES_OK) goto error;
-    res = ssf_specular_reflection_setup(*bsdf, fresnel);
+  if(mtl->data.mirror.slopes) { /* Glossy reflection wrt tabulated slopes */
+    /* The roughness is ignored */
+    distrib = pool->slopes;
+    slope_microfacet_distribution_setup
+      (distrib, mtl->data.mirror.slopes, fragment->dPdu);
+  } else if(roughness == 0) { /* Purely specular reflection */
+    brdf = pool->specular;
+    res = ssf_specular_reflection_setup(brdf, pool->fresnel_constant);
     if(res != RES_OK) goto error;
   } else { /* Glossy reflection */
     switch(mtl->data.mirror.distrib) {
       /* Setup the microfacet distribution */
       case SSOL_MICROFACET_BECKMANN:
-        res = ssf_microfacet_distribution_create
-          (mtl->dev->allocator, &ssf_beckmann_distribution, &distrib);
-        if(res != RES_OK) goto error;
+        distrib = pool->beckmann;
         res = ssf_beckmann_distribution_setup(distrib, roughness);
         if(res != RES_OK) goto error;
         break;
       case SSOL_MICROFACET_PILLBOX:
-        res = ssf_microfacet_distribution_create
-          (mtl->dev->allocator, &ssf_pillbox_distribution, &distrib);
-        if(res != RES_OK) goto error;
+        distrib = pool->pillbox;
         res = ssf_pillbox_distribution_setup(distrib, roughness);
         if(res != RES_OK) goto error;
         break;
       default: FATAL("Unreachable code.\n"); break;
     }
+  }
 
+  if(distrib) {
     /* Microfacet2 is not well suited for rendering since it cannot be
      * evaluated and consequently it returns an invalid result for direct
      * lighting. */
-    if(rendering) {
-      res = ssf_bsdf_create
-        (&mtl->dev->bsdf_allocators[ithread], &ssf_microfacet_reflection, bsdf);
-    } else {
-      res = ssf_bsdf_create
-        (&mtl->dev->bsdf_allocators[ithread], &ssf_microfacet2_reflection, bsdf);
-    }
-    if(res != RES_OK) goto error;
-    res = ssf_microfacet_reflection_setup(*bsdf, fresnel, distrib);
+    brdf = rendering ? pool->microfacet : pool->microfacet2;
+    res = ssf_microfacet_reflection_setup
+      (brdf, pool->fresnel_constant, distrib);
     if(res != RES_OK) goto error;
   }
 
+  SSF(bsdf_ref_get(brdf));
+  *bsdf = brdf;
+
 exit:
-  if(fresnel) SSF(fresnel_ref_put(fresnel));
-  if(distrib) SSF(microfacet_distribution_ref_put(distrib));
   return res;
 error:
-  if(*bsdf) SSF(bsdf_ref_put(*bsdf)), bsdf = NULL;
   goto exit;
 }
 
+static res_T
+create_mirror_bsdf
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* fragment,
+   const double wavelength, /* In nanometer */
+   const int rendering,
+   struct ssf_bsdf** bsdf)
+{
+  ASSERT(mtl && fragment && mtl->type == SSOL_MATERIAL_MIRROR);
+  return setup_mirror_bsdf(mtl, fragment,
+    mirror_get_reflectivity(mtl, fragment, wavelength),
+    mirror_get_roughness(mtl, fragment, wavelength),
+    rendering, bsdf);
+}
+
 static res_T
 create_thin_dielectric_bsdf
   (const struct ssol_material* mtl,
@@ -234,11 +405,11 @@ create_thin_dielectric_bsdf
    const double wavelength, /* In nanometer */
    struct ssf_bsdf** bsdf)
 {
+  struct shading_pool* pool = get_shading_pool(mtl);
   double thickness;
   double absorption;
   double eta_i;
   double eta_t;
-  const int ithread = omp_get_thread_num();
   res_T res = RES_OK;
   ASSERT(mtl && fragment && mtl->type == SSOL_MATERIAL_THIN_DIELECTRIC);
   ASSERT(bsdf);
@@ -253,17 +424,16 @@ create_thin_dielectric_bsdf
   thickness = mtl->data.thin_dielectric.thickness;
 
   /* Setup the BxDF */
-  res = ssf_bsdf_create
-    (&mtl->dev->bsdf_allocators[ithread], &ssf_thin_specular_dielectric, bsdf);
-  if(res != RES_OK) goto error;
   res = ssf_thin_specular_dielectric_setup
-    (*bsdf, absorption, eta_i, eta_t, thickness);
+    (pool->thin_dielectric, absorption, eta_i, eta_t, thickness);
   if(res != RES_OK) goto error;
 
+  SSF(bsdf_ref_get(pool->thin_dielectric));
+  *bsdf = pool->thin_dielectric;
+
 exit:
   return res;
 error:
-  if(*bsdf) SSF(bsdf_ref_put(*bsdf)), bsdf = NULL;
   goto exit;
 }
 
@@ -296,6 +466,24 @@ check_shader_thin_differential(const struct ssol_thin_dielectric_shader* shader)
   return shader && shader->normal;
 }
 
+/* Check that the data lie in [lower, upper] */
+static INLINE int
+check_data
+  (const struct ssol_data* data,
+   const double lower,
+   const double upper)
+{
+  if(!data) return 0;
+  switch(data->type) {
+    case SSOL_DATA_REAL:
+      return lower <= data->value.real && data->value.real <= upper;
+    case SSOL_DATA_SPECTRUM:
+      return data->value.spectrum
+          && spectrum_check_data(data->value.spectrum, lower, upper);
+    default: return 0;
+  }
+}
+
 static INLINE int
 check_medium(const struct ssol_medium* medium)
 {
@@ -344,6 +532,16 @@ material_release(ref_T* ref)
   if(material->type == SSOL_MATERIAL_THIN_DIELECTRIC) {
     ssol_medium_clear(&material->data.thin_dielectric.slab_medium);
   }
+  if(material->type == SSOL_MATERIAL_MIRROR) {
+    ssol_data_clear(&material->data.mirror.uniform_reflectivity);
+    ssol_data_clear(&material->data.mirror.uniform_roughness);
+    if(material->data.mirror.slopes) {
+      SSOL(slope_distribution_ref_put(material->data.mirror.slopes));
+    }
+  }
+  if(material->type == SSOL_MATERIAL_MATTE) {
+    ssol_data_clear(&material->data.matte.uniform_reflectivity);
+  }
   ssol_medium_clear(&material->in_medium);
   ssol_medium_clear(&material->out_medium);
   ASSERT(dev && dev->allocator);
@@ -481,6 +679,7 @@ ssol_dielectric_setup
   ssol_medium_copy(&material->out_medium, outside_medium);
   ssol_medium_copy(&material->in_medium, inside_medium);
   material->normal = shader->normal;
+  material->normal_batch = shader->normal_batch;
   return RES_OK;
 }
 
@@ -496,9 +695,57 @@ ssol_mirror_setup
   || (unsigned)distrib >= SSOL_MICROFACET_DISTRIBUTIONS_COUNT__)
     return RES_BAD_ARG;
   material->normal = shader->normal;
+  material->normal_batch = shader->normal_batch;
+  material->uniform = 0;
   material->data.mirror.reflectivity = shader->reflectivity;
   material->data.mirror.roughness = shader->roughness;
+  material->data.mirror.reflectivity_batch = shader->reflectivity_batch;
+  material->data.mirror.roughness_batch = shader->roughness_batch;
+  material->data.mirror.distrib = distrib;
+  ssol_data_clear(&material->data.mirror.uniform_reflectivity);
+  ssol_data_clear(&material->data.mirror.uniform_roughness);
+  return RES_OK;
+}
+
+res_T
+ssol_mirror_setup_uniform
+  (struct ssol_material* material,
+   const struct ssol_data* reflectivity,
+   const struct ssol_data* roughness,
+   const enum ssol_microfacet_distribution distrib)
+{
+  if(!material
+  || material->type != SSOL_MATERIAL_MIRROR
+  || !check_data(reflectivity, 0, 1)
+  || !check_data(roughness, 0, 1)
+  || (unsigned)distrib >= SSOL_MICROFACET_DISTRIBUTIONS_COUNT__)
+    return RES_BAD_ARG;
+  material->normal = shade_normal_default;
+  material->normal_batch = NULL;
+  material->uniform = 1;
+  material->data.mirror.reflectivity = NULL;
+  material->data.mirror.roughness = NULL;
+  material->data.mirror.reflectivity_batch = NULL;
+  material->data.mirror.roughness_batch = NULL;
   material->data.mirror.distrib = distrib;
+  ssol_data_copy(&material->data.mirror.uniform_reflectivity, reflectivity);
+  ssol_data_copy(&material->data.mirror.uniform_roughness, roughness);
+  return RES_OK;
+}
+
+res_T
+ssol_mirror_set_slope_distribution
+  (struct ssol_material* material, struct ssol_slope_distribution* slopes)
+{
+  if(!material
+  || material->type != SSOL_MATERIAL_MIRROR
+  || (slopes && !slopes->definition[0]))
+    return RES_BAD_ARG;
+  if(slopes) SSOL(slope_distribution_ref_get(slopes));
+  if(material->data.mirror.slopes) {
+    SSOL(slope_distribution_ref_put(material->data.mirror.slopes));
+  }
+  material->data.mirror.slopes = slopes;
   return RES_OK;
 }
 
@@ -511,7 +758,28 @@ ssol_matte_setup
   || !check_shader_matte(shader))
     return RES_BAD_ARG;
   material->normal = shader->normal;
+  material->normal_batch = shader->normal_batch;
+  material->uniform = 0;
   material->data.matte.reflectivity = shader->reflectivity;
+  material->data.matte.reflectivity_batch = shader->reflectivity_batch;
+  ssol_data_clear(&material->data.matte.uniform_reflectivity);
+  return RES_OK;
+}
+
+res_T
+ssol_matte_setup_uniform
+  (struct ssol_material* material, const struct ssol_data* reflectivity)
+{
+  if(!material
+  || material->type != SSOL_MATERIAL_MATTE
+  || !check_data(reflectivity, 0, 1))
+    return RES_BAD_ARG;
+  material->normal = shade_normal_default;
+  material->normal_batch = NULL;
+  material->uniform = 1;
+  material->data.matte.reflectivity = NULL;
+  material->data.matte.reflectivity_batch = NULL;
+  ssol_data_copy(&material->data.matte.uniform_reflectivity, reflectivity);
   return RES_OK;
 }
 
@@ -535,6 +803,7 @@ ssol_thin_dielectric_setup
   ssol_medium_copy(&material->out_medium, outside_medium);
   ssol_medium_copy(&material->in_medium, outside_medium);
   material->normal = shader->normal;
+  material->normal_batch = shader->normal_batch;
   return RES_OK;
 }
 
@@ -545,6 +814,13 @@ ssol_material_create_virtual
   return ssol_material_create(dev, out_material, SSOL_MATERIAL_VIRTUAL);
 }
 
+res_T
+ssol_material_create_absorber
+  (struct ssol_device* dev, struct ssol_material** out_material)
+{
+  return ssol_material_create(dev, out_material, SSOL_MATERIAL_ABSORBER);
+}
+
 /*******************************************************************************
  * Local functions
  ******************************************************************************/
@@ -554,17 +830,15 @@ surface_fragment_setup
    const double pos[3],
    const double dir[3],
    const double normal[3],
+   const struct ssol_instance* instance,
+   const struct ssol_shape* shape,
    const struct s3d_primitive* primitive,
    const float uv[2])
 {
+  const struct triangle_frame* frame;
   struct s3d_attrib attr;
-  char has_texcoord, has_normal;
-  struct s3d_attrib uvs[3];
-  struct s3d_attrib P[3];
-  double duv1[2], duv2[2];
-  double dP1[3], dP2[3];
-  double det;
-  ASSERT(fragment && pos && dir && primitive && uv);
+  ASSERT(fragment && pos && dir && instance && shape && primitive && uv);
+  ASSERT(primitive->prim_id < darray_triangle_frame_size_get(&shape->frames));
 
   /* Assume that the submitted normal look forward the incoming dir */
   ASSERT(d3_dot(normal, dir) <= 0);
@@ -573,78 +847,38 @@ surface_fragment_setup
   d3_set(fragment->P, pos); /* Setup the surface position */
   d3_normalize(fragment->Ng, normal); /* Normalize the geometry normal */
 
-  /* Retrieve the position of the triangle vertices */
-  S3D(triangle_get_vertex_attrib(primitive, 0, S3D_POSITION, &P[0]));
-  S3D(triangle_get_vertex_attrib(primitive, 1, S3D_POSITION, &P[1]));
-  S3D(triangle_get_vertex_attrib(primitive, 2, S3D_POSITION, &P[2]));
-
   /* Retrieve the tex coord */
-  S3D(primitive_has_attrib(primitive, SSOL_TO_S3D_TEXCOORD, &has_texcoord));
-  if (!has_texcoord) {
+  if(!shape->has_texcoord) {
     d2_set_f2(fragment->uv, uv);
-    uvs[0].type = uvs[1].type = uvs[2].type = S3D_FLOAT2;
-    uvs[0].usage = uvs[1].usage = uvs[2].usage = SSOL_TO_S3D_TEXCOORD;
-    f2(uvs[0].value, 1, 0);
-    f2(uvs[1].value, 0, 1);
-    f2(uvs[2].value, 0, 0);
   } else {
     S3D(primitive_get_attrib(primitive, SSOL_TO_S3D_TEXCOORD, uv, &attr));
-    S3D(triangle_get_vertex_attrib(primitive, 0, SSOL_TO_S3D_TEXCOORD, &uvs[0]));
-    S3D(triangle_get_vertex_attrib(primitive, 1, SSOL_TO_S3D_TEXCOORD, &uvs[1]));
-    S3D(triangle_get_vertex_attrib(primitive, 2, SSOL_TO_S3D_TEXCOORD, &uvs[2]));
     ASSERT(attr.type == S3D_FLOAT2);
     d2_set_f2(fragment->uv, attr.value);
   }
 
-  /* Compute the partial derivatives. */
-  duv1[0] = uvs[1].value[0] - uvs[0].value[0];
-  duv1[1] = uvs[1].value[1] - uvs[0].value[1];
-  duv2[0] = uvs[2].value[0] - uvs[0].value[0];
-  duv2[1] = uvs[2].value[1] - uvs[0].value[1];
-  dP1[0] = P[1].value[0] - P[0].value[0];
-  dP1[1] = P[1].value[1] - P[0].value[1];
-  dP1[2] = P[1].value[2] - P[0].value[2];
-  dP2[0] = P[2].value[0] - P[0].value[0];
-  dP2[1] = P[2].value[1] - P[0].value[1];
-  dP2[2] = P[2].value[2] - P[0].value[2];
-  det = duv1[0]*duv2[1] - duv1[1]*duv2[0];
-  if(det == 0) { /* Handle zero determinant */
+  /* Transform the precomputed partial derivatives in world space */
+  frame = darray_triangle_frame_cdata_get(&shape->frames) + primitive->prim_id;
+  if(frame->degenerated) { /* Handle zero determinant */
     double basis[9];
     d33_basis(basis, fragment->Ng);
     d3_set(fragment->dPdu, basis + 0);
     d3_set(fragment->dPdv, basis + 3);
   } else {
-    double a[3], b[3];
-    d3_sub(fragment->dPdu, d3_muld(a, dP1, duv2[1]), d3_muld(b, dP2, duv1[1]));
-    d3_sub(fragment->dPdv, d3_muld(a, dP2, duv1[0]), d3_muld(b, dP1, duv2[0]));
-    d3_divd(fragment->dPdu, fragment->dPdu, det);
-    d3_divd(fragment->dPdv, fragment->dPdv, det);
+    d33_muld3(fragment->dPdu, instance->transform, frame->dPdu);
+    d33_muld3(fragment->dPdv, instance->transform, frame->dPdv);
   }
 
   /* Retrieve and normalize the shading normal in world space */
-  S3D(primitive_has_attrib(primitive, SSOL_TO_S3D_NORMAL, &has_normal));
-  if (!has_normal) {
+  if(!shape->has_normal) {
     d3_set(fragment->Ns, fragment->Ng);
   } else {
-    float transform[12];
-    float vec[3];
-
+    double N[3];
     S3D(primitive_get_attrib(primitive, SSOL_TO_S3D_NORMAL, uv, &attr));
     ASSERT(attr.type == S3D_FLOAT3);
-
-    S3D(primitive_get_transform(primitive, transform));
-    /* Check that transform is not "identity" */
-    if(!f3_eq(transform + 0, f3(vec, 1.f, 0.f, 0.f))
-    && !f3_eq(transform + 3, f3(vec, 0.f, 1.f, 0.f))
-    && !f3_eq(transform + 6, f3(vec, 0.f, 0.f, 1.f))) {
-      /* Transform the normal in world space, i.e. multiply it by the inverse
-       * transpose of the "object to world" primitive matrix. Since the affine
-       * part of the 3x4 transformation matrix does not influence the normal
-       * transformation, use the linear part only. */
-      f33_invtrans(transform, transform);
-      f33_mulf3(attr.value, transform, attr.value);
-    }
-    d3_set_f3(fragment->Ns, attr.value);
+    /* Transform the normal in world space, i.e. multiply it by the inverse
+     * transpose of the "object to world" matrix of the instance */
+    d3_set_f3(N, attr.value);
+    d33_muld3(fragment->Ns, instance->normal_transform, N);
     d3_normalize(fragment->Ns, fragment->Ns);
 
     /* Ensure that the fetched shading normal look forward the incoming dir */
@@ -654,6 +888,46 @@ surface_fragment_setup
   }
 }
 
+void
+material_setup_fragment
+  (const struct ssol_material* mtl,
+   struct ssol_surface_fragment* fragment,
+   const double pos[3],
+   const double dir[3],
+   const double normal[3],
+   const struct ssol_instance* instance,
+   const struct ssol_shape* shape,
+   const struct s3d_primitive* primitive,
+   const float uv[2])
+{
+  ASSERT(mtl && fragment && pos && dir && normal && instance && shape);
+  ASSERT(primitive && uv);
+
+  /* The per vertex normals define the shading normal while the tabulated
+   * slopes are oriented wrt the partial derivatives of the hit. Without
+   * texcoords, these derivatives follow the instance rather than the edges of
+   * the hit triangle, in order to orient the slopes consistently */
+  if(mtl->type == SSOL_MATERIAL_MIRROR && mtl->data.mirror.slopes) {
+    surface_fragment_setup
+      (fragment, pos, dir, normal, instance, shape, primitive, uv);
+    if(!shape->has_texcoord) fragment_setup_instance_frame(fragment, instance);
+    return;
+  }
+  if(!mtl->uniform || shape->has_normal) {
+    surface_fragment_setup
+      (fragment, pos, dir, normal, instance, shape, primitive, uv);
+    return;
+  }
+
+  ASSERT(d3_dot(normal, dir) <= 0);
+  *fragment = SSOL_SURFACE_FRAGMENT_NULL;
+  d3_set(fragment->dir, dir);
+  d3_set(fragment->P, pos);
+  d3_normalize(fragment->Ng, normal);
+  d3_set(fragment->Ns, fragment->Ng);
+  d2_set_f2(fragment->uv, uv);
+}
+
 void
 material_shade_normal
   (const struct ssol_material* mtl,
@@ -662,7 +936,31 @@ material_shade_normal
    double N[3])
 {
   ASSERT(mtl && frag && N);
-  mtl->normal(mtl->dev, mtl->buf, wavelength, frag, N);
+  if(mtl->uniform) {
+    d3_set(N, frag->Ns);
+  } else {
+    mtl->normal(mtl->dev, mtl->buf, wavelength, frag, N);
+  }
+}
+
+void
+material_shade_normals
+  (const struct ssol_material* mtl,
+   const size_t count,
+   const struct ssol_surface_fragment* frags,
+   const double* wavelengths,
+   double* N)
+{
+  size_t i;
+  ASSERT(mtl && (!count || (frags && wavelengths && N)));
+
+  if(!mtl->uniform && mtl->normal_batch) {
+    mtl->normal_batch(mtl->dev, mtl->buf, count, wavelengths, frags, N);
+  } else {
+    FOR_EACH(i, 0, count) {
+      material_shade_normal(mtl, frags + i, wavelengths[i], N + i*3);
+    }
+  }
 }
 
 res_T
@@ -678,6 +976,9 @@ material_create_bsdf
   ASSERT(mtl);
 
   switch(mtl->type) {
+    case SSOL_MATERIAL_ABSORBER:
+      res = create_absorber_bsdf(mtl, bsdf);
+      break;
     case SSOL_MATERIAL_DIELECTRIC:
       res = create_dielectric_bsdf
         (mtl, fragment, wavelength, medium, bsdf);
@@ -697,6 +998,117 @@ material_create_bsdf
   return res;
 }
 
+res_T
+material_create_spectral_bsdf
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* fragment,
+   const size_t count,
+   const double* wavelengths,
+   const struct ssol_medium* medium,
+   double* factors,
+   int* separable,
+   struct ssf_bsdf** bsdf)
+{
+  const struct ssol_medium* slab;
+  double roughness[SSOL_MAX_PATH_WAVELENGTHS];
+  int regular = 0; /* Use the regular BSDF of the hero wavelength */
+  size_t i;
+  res_T res = RES_OK;
+  ASSERT(mtl && fragment && count && count <= SSOL_MAX_PATH_WAVELENGTHS);
+  ASSERT(wavelengths && factors && separable && bsdf);
+
+  *separable = 1;
+  FOR_EACH(i, 0, count) factors[i] = 1;
+
+  switch(mtl->type) {
+    case SSOL_MATERIAL_ABSORBER: regular = 1; break;
+    case SSOL_MATERIAL_DIELECTRIC:
+      /* The sampled directions depend on the refractive indices */
+      *separable =
+         data_is_constant(&mtl->out_medium.refractive_index, count, wavelengths)
+      && data_is_constant(&mtl->in_medium.refractive_index, count, wavelengths);
+      regular = 1;
+      break;
+    case SSOL_MATERIAL_MATTE:
+      get_spectral_values(mtl, mtl->data.matte.reflectivity,
+        mtl->data.matte.reflectivity_batch,
+        &mtl->data.matte.uniform_reflectivity,
+        fragment, count, wavelengths, factors);
+      res = setup_matte_bsdf(mtl, 1, bsdf);
+      break;
+    case SSOL_MATERIAL_MIRROR:
+      /* The sampled directions depend on the roughness */
+      if(mtl->data.mirror.slopes) {
+        roughness[0] = 0; /* Unused by the tabulated slopes */
+      } else {
+        get_spectral_values(mtl, mtl->data.mirror.roughness,
+          mtl->data.mirror.roughness_batch,
+          &mtl->data.mirror.uniform_roughness,
+          fragment, count, wavelengths, roughness);
+        FOR_EACH(i, 1, count) if(roughness[i] != roughness[0]) break;
+        *separable = i == count;
+      }
+      if(!*separable) {
+        regular = 1;
+      } else {
+        get_spectral_values(mtl, mtl->data.mirror.reflectivity,
+          mtl->data.mirror.reflectivity_batch,
+          &mtl->data.mirror.uniform_reflectivity,
+          fragment, count, wavelengths, factors);
+        res = setup_mirror_bsdf(mtl, fragment, 1, roughness[0], 0, bsdf);
+      }
+      break;
+    case SSOL_MATERIAL_THIN_DIELECTRIC:
+      /* Both the directions and the weights depend on the slab properties */
+      slab = &mtl->data.thin_dielectric.slab_medium;
+      *separable =
+         data_is_constant(&mtl->out_medium.refractive_index, count, wavelengths)
+      && data_is_constant(&slab->refractive_index, count, wavelengths)
+      && data_is_constant(&slab->extinction, count, wavelengths);
+      regular = 1;
+      break;
+    case SSOL_MATERIAL_VIRTUAL: /* Nothing to shade */ break;
+    default: FATAL("Unreachable code\n"); break;
+  }
+  if(res == RES_OK && regular) {
+    res = material_create_bsdf(mtl, fragment, wavelengths[0], medium, 0, bsdf);
+  }
+  return res;
+}
+
+int
+material_is_glossy
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* fragment,
+   const double wavelength)
+{
+  ASSERT(mtl);
+  if(mtl->type != SSOL_MATERIAL_MIRROR) return 0;
+  if(mtl->data.mirror.slopes) return 1;
+  ASSERT(mtl->uniform || fragment);
+  return mirror_get_roughness(mtl, fragment, wavelength) > 0;
+}
+
+int
+material_is_gray(const struct ssol_material* mtl)
+{
+  ASSERT(mtl);
+  if(!medium_is_gray(&mtl->out_medium) || !medium_is_gray(&mtl->in_medium))
+    return 0;
+  switch(mtl->type) {
+    case SSOL_MATERIAL_MATTE:
+      return !mtl->uniform
+        || mtl->data.matte.uniform_reflectivity.type == SSOL_DATA_REAL;
+    case SSOL_MATERIAL_MIRROR:
+      return !mtl->uniform
+        || (mtl->data.mirror.uniform_reflectivity.type == SSOL_DATA_REAL
+         && mtl->data.mirror.uniform_roughness.type == SSOL_DATA_REAL);
+    case SSOL_MATERIAL_THIN_DIELECTRIC:
+      return medium_is_gray(&mtl->data.thin_dielectric.slab_medium);
+    default: return 1;
+  }
+}
+
 res_T
 material_get_next_medium
   (const struct ssol_material* mtl,
@@ -715,6 +1127,7 @@ material_get_next_medium
       }
       break;
     /* The material is not an interface between 2 media */
+    case SSOL_MATERIAL_ABSORBER:
     case SSOL_MATERIAL_MATTE:
     case SSOL_MATERIAL_MIRROR:
     case SSOL_MATERIAL_THIN_DIELECTRIC:
@@ -23,6 +23,8 @@ struct s3d_hit;
 struct s3d_primitive;
 struct ssf_bsdf;
 struct ssol_device;
+struct ssol_instance;
+struct ssol_shape;
 
 struct dielectric {
   int dummy;
@@ -30,12 +32,19 @@ struct dielectric {
 
 struct matte {
   ssol_shader_getter_T reflectivity;
+  ssol_shader_batch_getter_T reflectivity_batch; /* May be NULL */
+  struct ssol_data uniform_reflectivity; /* Used by uniform materials */
 };
 
 struct mirror {
   ssol_shader_getter_T reflectivity;
   ssol_shader_getter_T roughness;
+  ssol_shader_batch_getter_T reflectivity_batch; /* May be NULL */
+  ssol_shader_batch_getter_T roughness_batch; /* May be NULL */
+  struct ssol_data uniform_reflectivity; /* Used by uniform materials */
+  struct ssol_data uniform_roughness; /* Used by uniform materials */
   enum ssol_microfacet_distribution distrib;
+  struct ssol_slope_distribution* slopes; /* NULL <=> analytic distribution */
 };
 
 struct thin_dielectric {
@@ -47,6 +56,12 @@ struct ssol_material {
   enum ssol_material_type type;
 
   ssol_shader_getter_T normal;
+  ssol_shader_batch_getter_T normal_batch; /* May be NULL */
+
+  /* Define whether the material parameters vary over the surface or not. A
+   * uniform material has no shader: its parameters are ssol_data and its
+   * shading normal is the normal of the surface fragment */
+  int uniform;
 
   union {
     struct dielectric dielectric;
@@ -63,12 +78,31 @@ struct ssol_material {
   ref_T ref;
 };
 
+/* Setup the surface fragment of a hit onto the primitive of a shape
+ * instance. Rely on the per triangle frames precomputed by the shape */
 extern LOCAL_SYM void
 surface_fragment_setup
   (struct ssol_surface_fragment* fragment,
    const double pos[3],
    const double dir[3],
    const double normal[3],
+   const struct ssol_instance* instance, /* Instance of the primitive */
+   const struct ssol_shape* shape, /* Shape of the primitive */
+   const struct s3d_primitive* primitive,
+   const float uv[2]);
+
+/* Setup the surface fragment quantities required to shade `mtl'. Neither the
+ * texture coordinates nor the partial derivatives are computed for uniform
+ * materials, unless the primitive defines a per vertex normal */
+extern LOCAL_SYM void
+material_setup_fragment
+  (const struct ssol_material* mtl,
+   struct ssol_surface_fragment* fragment,
+   const double pos[3],
+   const double dir[3],
+   const double normal[3],
+   const struct ssol_instance* instance, /* Instance of the primitive */
+   const struct ssol_shape* shape, /* Shape of the primitive */
    const struct s3d_primitive* primitive,
    const float uv[2]);
 
@@ -79,6 +113,19 @@ material_shade_normal
    const double wavelength,
    double N[3]);
 
+/* Batched version of material_shade_normal. The normal of the i^th fragment
+ * is written in N[i*3 + 0..2]. Fall back to the scalar getter when the
+ * material has no batched one */
+extern LOCAL_SYM void
+material_shade_normals
+  (const struct ssol_material* mtl,
+   const size_t count, /* #fragments */
+   const struct ssol_surface_fragment* fragments,
+   const double* wavelengths, /* List of `count' wavelengths */
+   double* N); /* List of `count' normals */
+
+/* The returned BSDF is a shading object of the calling thread that is setup
+ * in place. It must be released before the next BSDF creation of the thread */
 extern LOCAL_SYM res_T
 material_create_bsdf
   (const struct ssol_material* mtl,
@@ -88,6 +135,38 @@ material_create_bsdf
    const int rendering, /* Is material used for rendering purposes */
    struct ssf_bsdf** bsdf); /* Bidirectional Scattering Distribution Function */
 
+/* Shade a fragment for a radiative path that carries `count' wavelengths, the
+ * first one being the hero wavelength. If the directions sampled by the BSDF
+ * do not depend on the wavelength, the material is `separable': the returned
+ * BSDF samples these directions and the flux scattered at the i^th wavelength
+ * is the weight of the sample times `factors[i]'. Otherwise the returned BSDF
+ * is the regular BSDF of the hero wavelength. Refer to material_create_bsdf
+ * for the lifetime of the BSDF */
+extern LOCAL_SYM res_T
+material_create_spectral_bsdf
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* fragment,
+   const size_t count, /* #wavelengths */
+   const double* wavelengths, /* List of `count' wavelengths in nanometer */
+   const struct ssol_medium* medium, /* Current medium */
+   double* factors, /* List of `count' per wavelength factors */
+   int* separable,
+   struct ssf_bsdf** bsdf);
+
+/* Return whether or not the material scatters the flux around the specular
+ * direction at the surface fragment, i.e. if it is a rough mirror. The
+ * fragment is only read by the mirrors whose roughness is a shader */
+extern LOCAL_SYM int
+material_is_glossy
+  (const struct ssol_material* mtl,
+   const struct ssol_surface_fragment* fragment, /* May be NULL if uniform */
+   const double wavelength); /* In nanometer */
+
+/* Return whether or not all the data of the material, i.e. the data of its
+ * media and of its uniform parameters, are real values */
+extern LOCAL_SYM int
+material_is_gray(const struct ssol_material* mtl);
+
 extern LOCAL_SYM res_T
 material_get_next_medium
   (const struct ssol_material* mtl,
@@ -21,17 +21,114 @@
 #include <rsys/double3.h>
 #include <star/s3d.h>
 
+#include <omp.h>
+
 #ifdef COMPILER_CL
   #pragma warning(push)
   #pragma warning(disable:4706) /* Assignment within a condition */
 #endif
 
+/*******************************************************************************
+ * Helper functions
+ ******************************************************************************/
+static res_T
+get_primitive_area
+  (const struct ssol_shape* shape,
+   const unsigned iprim,
+   double* area)
+{
+  struct s3d_attrib attr;
+  double v0[3], v1[3], v2[3], E0[3], E1[3], normal[3];
+  unsigned ids[3];
+  res_T res = RES_OK;
+  ASSERT(shape && area);
+
+  /* Retrieve the primitive indices */
+  res = s3d_mesh_get_triangle_indices(shape->shape_rt, iprim, ids);
+  if(res != RES_OK) return res;
+
+  /* Fetch the primitive vertices */
+  S3D(mesh_get_vertex_attrib(shape->shape_rt, ids[0], S3D_POSITION, &attr));
+  d3_set_f3(v0, attr.value);
+  S3D(mesh_get_vertex_attrib(shape->shape_rt, ids[1], S3D_POSITION, &attr));
+  d3_set_f3(v1, attr.value);
+  S3D(mesh_get_vertex_attrib(shape->shape_rt, ids[2], S3D_POSITION, &attr));
+  d3_set_f3(v2, attr.value);
+
+  /* Compute the primitive area */
+  d3_sub(E0, v1, v0);
+  d3_sub(E1, v2, v0);
+  d3_cross(normal, E0, E1);
+  *area = d3_len(normal) * 0.5;
+  return RES_OK;
+}
+
+/* Compute in parallel the per primitive estimations of `shape' from its MC
+ * weights. `mc_shape1' is NULL if no primitive of the shape was reached */
+static res_T
+get_mc_primitives
+  (const struct ssol_shape* shape,
+   const struct mc_shape_1side* mc_shape1,
+   const size_t N,
+   double* E[SSOL_MC_CHANNELS_COUNT__],
+   double* SE[SSOL_MC_CHANNELS_COUNT__])
+{
+  unsigned ntris;
+  int64_t i;
+  ATOMIC res = RES_OK;
+  ASSERT(shape && E && SE);
+
+  SSOL(shape_get_triangles_count(shape, &ntris));
+
+  #pragma omp parallel for schedule(static) num_threads(shape->dev->nthreads)
+  for(i = 0; i < (int64_t)ntris; ++i) {
+    const unsigned iprim = (unsigned)i;
+    const struct mc_primitive_1side* mc_prim1 = NULL;
+    double area = 1;
+    int ich;
+
+    if(ATOMIC_GET(&res) != RES_OK) continue; /* An error occured */
+
+    if(mc_shape1) { /* The lookup does not modify the hash table */
+      mc_prim1 = htable_prim2mc_find
+        ((struct htable_prim2mc*)&mc_shape1->prim2mc, &iprim);
+    }
+    if(mc_prim1) {
+      const res_T res_local = get_primitive_area(shape, iprim, &area);
+      if(res_local != RES_OK) {
+        ATOMIC_SET(&res, res_local);
+        continue;
+      }
+    }
+
+    FOR_EACH(ich, 0, SSOL_MC_CHANNELS_COUNT__) {
+      double e = 0, se = 0;
+      if(!E[ich] && !SE[ich]) continue;
+      if(mc_prim1) {
+        const struct mc_data* data;
+        double weight, sqr_weight, V;
+        data = mc_primitive_1side_get_channel(mc_prim1, (enum ssol_mc_channel)ich);
+        mc_data_get(data, &weight, &sqr_weight);
+        e = weight / (double)N;
+        V = sqr_weight / (double)N - e*e;
+        V = V > 0 ? V : 0;
+        se = sqrt(V / (double)N);
+        e /= area;
+        se /= area;
+      }
+      if(E[ich]) E[ich][iprim] = e;
+      if(SE[ich]) SE[ich][iprim] = se;
+    }
+  }
+  return (res_T)res;
+}
+
 /*******************************************************************************
  * Exported functions
  ******************************************************************************/
 res_T
 ssol_estimator_get_mc_receiver
-  (struct ssol_estimator* estimator,
+  (const struct ssol_estimator* estimator,
    const struct ssol_instance* instance,
    const enum ssol_side_flag side,
    struct ssol_mc_receiver* rcv)
@@ -45,7 +142,9 @@ ssol_estimator_get_mc_receiver
 
   memset(rcv, 0, sizeof(rcv[0]));
 
-  mc_rcv = htable_receiver_find(&estimator->mc_receivers, &instance);
+  /* The lookup does not modify the hash table */
+  mc_rcv = htable_receiver_find
+    ((struct htable_receiver*)&estimator->mc_receivers, &instance);
   if(!mc_rcv) {
     /* The receiver has no MC estimation */
     return RES_OK;
@@ -54,7 +153,7 @@ ssol_estimator_get_mc_receiver
   mc_rcv1 = side == SSOL_FRONT ? &mc_rcv->front : &mc_rcv->back;
   #define SETUP_MC_RESULT(Name) {                                              \
     const double N = (double)estimator->realisation_count;                     \
-    struct mc_data* data = &mc_rcv1->Name;                                     \
+    const struct mc_data* data = &mc_rcv1->Name;                               \
     double weight, sqr_weight;                                                 \
     mc_data_get(data, &weight, &sqr_weight);                                   \
     rcv->Name.E = weight / N;                                                  \
@@ -84,7 +183,7 @@ ssol_estimator_get_mc_receiver
 
 res_T
 ssol_mc_receiver_get_mc_shape
-  (struct ssol_mc_receiver* rcv,
+  (const struct ssol_mc_receiver* rcv,
    const struct ssol_shape* shape,
    struct ssol_mc_shape* mc)
 {
@@ -94,14 +193,14 @@ ssol_mc_receiver_get_mc_shape
   if(!object_has_shape(rcv->instance__->object, shape)) return RES_BAD_ARG;
   mc_rcv1 = rcv->mc__;
   mc->N__ = rcv->N__;
-  mc->mc__ = htable_shape2mc_find(&mc_rcv1->shape2mc, &shape);
+  mc->mc__ = mc_rcv1 ? htable_shape2mc_find(&mc_rcv1->shape2mc, &shape) : NULL;
   mc->shape__ = shape;
   return RES_OK;
 }
 
 res_T
 ssol_mc_shape_get_mc_primitive
-  (struct ssol_mc_shape* shape,
+  (const struct ssol_mc_shape* shape,
    const unsigned i,
    struct ssol_mc_primitive* prim)
 {
@@ -124,36 +223,15 @@ ssol_mc_shape_get_mc_primitive
     MC_SETUP_ALL;
     #undef SETUP_MC_RESULT
   } else {
-    struct s3d_attrib attr;
-    struct s3d_shape* s3d_shape;
-    double v0[3], v1[3], v2[3], E0[3], E1[3], normal[3];
     double area;
-    unsigned ids[3];
     res_T res = RES_OK;
 
-    s3d_shape = shape->shape__->shape_rt;
-
-    /* Retrieve the primitive indices */
-    res = s3d_mesh_get_triangle_indices(s3d_shape, i, ids);
+    res = get_primitive_area(shape->shape__, i, &area);
     if(res != RES_OK) return res;
 
-    /* Fetch the primitive vertices */
-    S3D(mesh_get_vertex_attrib(s3d_shape, ids[0], S3D_POSITION, &attr));
-    d3_set_f3(v0, attr.value);
-    S3D(mesh_get_vertex_attrib(s3d_shape, ids[1], S3D_POSITION, &attr));
-    d3_set_f3(v1, attr.value);
-    S3D(mesh_get_vertex_attrib(s3d_shape, ids[2], S3D_POSITION, &attr));
-    d3_set_f3(v2, attr.value);
-
-    /* Compute the primitive area */
-    d3_sub(E0, v1, v0);
-    d3_sub(E1, v2, v0);
-    d3_cross(normal, E0, E1);
-    area = d3_len(normal) * 0.5;
-
     #define SETUP_MC_RESULT(Name) {                                            \
       const double N = (double)shape->N__;                                     \
-      struct mc_data* data = &mc_prim1->Name;                                  \
+      const struct mc_data* data = &mc_prim1->Name;                            \
       double weight, sqr_weight;                                               \
       mc_data_get(data, &weight, &sqr_weight);                                 \
       prim->Name.E = weight / N;                                               \
@@ -172,6 +250,211 @@ ssol_mc_shape_get_mc_primitive
   return RES_OK;
 }
 
+res_T
+ssol_mc_shape_get_mc_primitives
+  (const struct ssol_mc_shape* shape,
+   struct ssol_mc_primitives* prims)
+{
+  if(!shape || !prims) return RES_BAD_ARG;
+  return get_mc_primitives
+    (shape->shape__, shape->mc__, shape->N__, prims->E, prims->SE);
+}
+
+res_T
+ssol_mc_receiver_get_mc_primitives
+  (const struct ssol_mc_receiver* rcv,
+   struct ssol_mc_primitives* prims)
+{
+  const struct darray_shaded_shape* sshapes;
+  struct mc_receiver_1side* mc_rcv1;
+  size_t ishape, nshapes;
+  size_t offset = 0;
+  res_T res = RES_OK;
+
+  if(!rcv || !prims || !rcv->instance__) return RES_BAD_ARG;
+
+  mc_rcv1 = rcv->mc__;
+  sshapes = &rcv->instance__->object->shaded_shapes;
+  nshapes = darray_shaded_shape_size_get(sshapes);
+
+  FOR_EACH(ishape, 0, nshapes) {
+    const struct ssol_shape* shape;
+    struct mc_shape_1side* mc_shape1 = NULL;
+    double* E[SSOL_MC_CHANNELS_COUNT__];
+    double* SE[SSOL_MC_CHANNELS_COUNT__];
+    unsigned ntris;
+    int ich;
+
+    shape = darray_shaded_shape_cdata_get(sshapes)[ishape].shape;
+    if(mc_rcv1) mc_shape1 = htable_shape2mc_find(&mc_rcv1->shape2mc, &shape);
+
+    /* Offset the output arrays to the first primitive of the shape */
+    FOR_EACH(ich, 0, SSOL_MC_CHANNELS_COUNT__) {
+      E[ich] = prims->E[ich] ? prims->E[ich] + offset : NULL;
+      SE[ich] = prims->SE[ich] ? prims->SE[ich] + offset : NULL;
+    }
+
+    res = get_mc_primitives(shape, mc_shape1, rcv->N__, E, SE);
+    if(res != RES_OK) return res;
+
+    SSOL(shape_get_triangles_count(shape, &ntris));
+    offset += ntris;
+  }
+  return RES_OK;
+}
+
+res_T
+ssol_estimator_build_mc_primitives_views(struct ssol_estimator* estimator)
+{
+  res_T res = RES_OK;
+  if(!estimator) return RES_BAD_ARG;
+
+  estimator->mc_primitives_views = 1;
+  res = estimator_setup_mc_primitives(estimator);
+  if(res != RES_OK) {
+    res_T res_release;
+    /* Release the views already built. This cannot fail */
+    estimator->mc_primitives_views = 0;
+    res_release = estimator_setup_mc_primitives(estimator);
+    ASSERT(res_release == RES_OK);
+    (void)res_release;
+  }
+  return res;
+}
+
+res_T
+ssol_mc_shape_get_mc_primitives_view
+  (const struct ssol_mc_shape* shape,
+   struct ssol_mc_primitives_view* view)
+{
+  const struct mc_shape_1side* mc_shape1;
+  unsigned ntris;
+  int ich;
+
+  if(!shape || !view) return RES_BAD_ARG;
+
+  *view = SSOL_MC_PRIMITIVES_VIEW_NULL;
+  SSOL(shape_get_triangles_count(shape->shape__, &ntris));
+  view->count = ntris;
+
+  mc_shape1 = shape->mc__;
+  if(!mc_shape1) return RES_OK; /* No estimation */
+
+  /* The dense per primitive estimations are built on demand */
+  if(darray_double_size_get(&mc_shape1->dense)
+  != (size_t)ntris * 2 * SSOL_MC_CHANNELS_COUNT__)
+    return RES_BAD_OP;
+  FOR_EACH(ich, 0, SSOL_MC_CHANNELS_COUNT__) {
+    const double* dense = darray_double_cdata_get(&mc_shape1->dense);
+    view->E[ich] = dense + (size_t)(2*ich + 0) * ntris;
+    view->SE[ich] = dense + (size_t)(2*ich + 1) * ntris;
+  }
+  return RES_OK;
+}
+
+res_T
+ssol_mc_receiver_get_flux_map
+  (const struct ssol_mc_receiver* rcv,
+   const enum ssol_mc_channel channel,
+   struct ssol_image* image)
+{
+  struct ssol_image_layout layout = SSOL_IMAGE_LAYOUT_NULL;
+  const struct mc_receiver_1side* mc_rcv1;
+  const struct ssol_flux_map* map;
+  const struct mc_data* bins = NULL;
+  char* mem = NULL;
+  double bin_area;
+  size_t x, y;
+  res_T res = RES_OK;
+
+  if(!rcv || !image || !rcv->instance__
+  || (channel != SSOL_MC_INCOMING_FLUX && channel != SSOL_MC_ABSORBED_FLUX))
+    return RES_BAD_ARG;
+
+  mc_rcv1 = rcv->mc__;
+  if(mc_rcv1 && darray_mc_data_size_get(&mc_rcv1->flux_map_bins)) {
+    map = &mc_rcv1->flux_map;
+    bins = darray_mc_data_cdata_get(&mc_rcv1->flux_map_bins);
+  } else { /* No hit was binned */
+    map = &rcv->instance__->flux_map;
+  }
+  if(!flux_map_bins_count(map)) return RES_BAD_ARG;
+
+  res = ssol_image_setup
+    (image, map->definition[0], map->definition[1], SSOL_PIXEL_DOUBLE3);
+  if(res != RES_OK) return res;
+  SSOL(image_get_layout(image, &layout));
+  SSOL(image_map(image, &mem));
+
+  bin_area = (map->upper[0] - map->lower[0]) / (double)map->definition[0]
+           * (map->upper[1] - map->lower[1]) / (double)map->definition[1];
+
+  FOR_EACH(y, 0, map->definition[1]) {
+    double* row = (double*)(mem + layout.offset + y*layout.row_pitch);
+    FOR_EACH(x, 0, map->definition[0]) {
+      struct ssol_mc_result result = SSOL_MC_RESULT_NULL;
+      double* pixel = row + x*3;
+
+      if(bins) {
+        const double N = (double)rcv->N__;
+        const size_t ibin = y * map->definition[0] + x;
+        double weight, sqr_weight;
+        mc_data_get(bins + ibin*FLUX_MAP_BIN_DATA_COUNT
+          + (channel == SSOL_MC_ABSORBED_FLUX), &weight, &sqr_weight);
+        result.E = weight / N;
+        result.V = sqr_weight/N - result.E*result.E;
+        result.V = result.V > 0 ? result.V : 0;
+        result.SE = sqrt(result.V / N);
+        result.E /= bin_area;
+        result.V /= bin_area*bin_area;
+        result.SE /= bin_area;
+      }
+      pixel[0] = result.E;
+      pixel[1] = result.V;
+      pixel[2] = result.SE;
+    }
+  }
+  SSOL(image_unmap(image));
+  return RES_OK;
+}
+
+/*******************************************************************************
+ * Local functions
+ ******************************************************************************/
+res_T
+mc_shape_1side_setup_dense
+  (struct mc_shape_1side* mc_shape1,
+   const struct ssol_shape* shape,
+   const size_t N)
+{
+  double* E[SSOL_MC_CHANNELS_COUNT__];
+  double* SE[SSOL_MC_CHANNELS_COUNT__];
+  double* dense;
+  unsigned ntris;
+  int ich;
+  res_T res = RES_OK;
+  ASSERT(mc_shape1 && shape);
+
+  SSOL(shape_get_triangles_count(shape, &ntris));
+  res = darray_double_resize
+    (&mc_shape1->dense, (size_t)ntris * 2 * SSOL_MC_CHANNELS_COUNT__);
+  if(res != RES_OK) goto error;
+
+  dense = darray_double_data_get(&mc_shape1->dense);
+  FOR_EACH(ich, 0, SSOL_MC_CHANNELS_COUNT__) {
+    E[ich] = dense + (size_t)(2*ich + 0) * ntris;
+    SE[ich] = dense + (size_t)(2*ich + 1) * ntris;
+  }
+  res = get_mc_primitives(shape, mc_shape1, N, E, SE);
+  if(res != RES_OK) goto error;
+
+exit:
+  return res;
+error:
+  darray_double_clear(&mc_shape1->dense);
+  goto exit;
+}
+
 #ifdef COMPILER_CL
   #pragma warning(pop)
 #endif
@@ -0,0 +1,386 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "ssol_c.h"
+#include "ssol_device_c.h"
+#include "ssol_instance_c.h"
+#include "ssol_ranst_instance.h"
+#include "ssol_scene_c.h"
+
+#include <rsys/algorithm.h>
+#include <rsys/dynamic_array_double.h>
+#include <rsys/dynamic_array_size_t.h>
+#include <rsys/mem_allocator.h>
+#include <rsys/ref_count.h>
+
+#include <star/s3d.h>
+#include <star/ssp.h>
+
+/* Instance to sample and its dedicated Star-3D sampling view */
+struct instance_sampler {
+  const struct ssol_instance* instance;
+  struct s3d_scene_view* view;
+};
+
+static INLINE void
+instance_sampler_init
+  (struct mem_allocator* allocator, struct instance_sampler* sampler)
+{
+  ASSERT(sampler);
+  (void)allocator;
+  sampler->instance = NULL;
+  sampler->view = NULL;
+}
+
+static INLINE void
+instance_sampler_release(struct instance_sampler* sampler)
+{
+  ASSERT(sampler);
+  if(sampler->view) S3D(scene_view_ref_put(sampler->view));
+}
+
+static INLINE res_T
+instance_sampler_copy
+  (struct instance_sampler* dst, const struct instance_sampler* src)
+{
+  ASSERT(dst && src);
+  instance_sampler_release(dst);
+  dst->instance = src->instance;
+  dst->view = src->view;
+  if(dst->view) S3D(scene_view_ref_get(dst->view));
+  return RES_OK;
+}
+
+static INLINE res_T
+instance_sampler_copy_and_release
+  (struct instance_sampler* dst, struct instance_sampler* src)
+{
+  ASSERT(dst && src);
+  instance_sampler_release(dst);
+  dst->instance = src->instance;
+  dst->view = src->view;
+  src->view = NULL;
+  return RES_OK;
+}
+
+/* Declare the dynamic array of instance samplers */
+#define DARRAY_NAME instance_sampler
+#define DARRAY_DATA struct instance_sampler
+#define DARRAY_FUNCTOR_INIT instance_sampler_init
+#define DARRAY_FUNCTOR_RELEASE instance_sampler_release
+#define DARRAY_FUNCTOR_COPY instance_sampler_copy
+#define DARRAY_FUNCTOR_COPY_AND_RELEASE instance_sampler_copy_and_release
+#include <rsys/dynamic_array.h>
+
+struct ranst_instance {
+  struct darray_instance_sampler samplers;
+  struct darray_double areas; /* Per instance area of the sampling shape */
+  struct darray_double cumul; /* Cumulative selection probabilities */
+  struct darray_double rcp_pdfs; /* Per instance area / selection probability */
+  /* Per instance index of the realisation following its stratum. Empty if
+   * the distribution is not stratified */
+  struct darray_size_t strata;
+
+  ref_T ref;
+  struct mem_allocator* allocator;
+};
+
+/*******************************************************************************
+ * Helper functions
+ ******************************************************************************/
+/* Comparison used to find the first cumulative probability greater than the
+ * key, i.e. the upper bound of the key */
+static int
+cmp_upper(const void* key, const void* base)
+{
+  const double k = *(const double*)key;
+  const double b = *(const double*)base;
+  return k < b ? -1 : +1;
+}
+
+static int
+cmp_upper_size_t(const void* key, const void* base)
+{
+  const size_t k = *(const size_t*)key;
+  const size_t b = *(const size_t*)base;
+  return k < b ? -1 : +1;
+}
+
+static void
+ranst_instance_release(ref_T* ref)
+{
+  struct ranst_instance* ran;
+  ASSERT(ref);
+  ran = CONTAINER_OF(ref, struct ranst_instance, ref);
+  darray_instance_sampler_release(&ran->samplers);
+  darray_double_release(&ran->areas);
+  darray_double_release(&ran->cumul);
+  darray_double_release(&ran->rcp_pdfs);
+  darray_size_t_release(&ran->strata);
+  MEM_RM(ran->allocator, ran);
+}
+
+static res_T
+create_instance_sampler
+  (struct ssol_scene* scn,
+   const struct ssol_instance* inst,
+   struct instance_sampler* sampler)
+{
+  struct s3d_scene* s3d_scn = NULL;
+  res_T res = RES_OK;
+  ASSERT(scn && inst && sampler);
+
+  res = s3d_scene_create(scn->dev->s3d, &s3d_scn);
+  if(res != RES_OK) goto error;
+  res = s3d_scene_attach_shape(s3d_scn, inst->shape_samp);
+  if(res != RES_OK) goto error;
+  res = s3d_scene_view_create(s3d_scn, S3D_SAMPLE, &sampler->view);
+  if(res != RES_OK) goto error;
+  sampler->instance = inst;
+
+exit:
+  if(s3d_scn) S3D(scene_ref_put(s3d_scn));
+  return res;
+error:
+  goto exit;
+}
+
+/*******************************************************************************
+ * Local functions
+ ******************************************************************************/
+res_T
+ranst_instance_create(struct ssol_scene* scn, struct ranst_instance** out_ran)
+{
+  struct htable_instance_iterator it, end;
+  struct ranst_instance* ran = NULL;
+  size_t i, n;
+  res_T res = RES_OK;
+
+  if(!scn || !out_ran) return RES_BAD_ARG;
+
+  ran = MEM_CALLOC(scn->dev->allocator, 1, sizeof(struct ranst_instance));
+  if(!ran) {
+    res = RES_MEM_ERR;
+    goto error;
+  }
+  ref_init(&ran->ref);
+  ran->allocator = scn->dev->allocator;
+  darray_instance_sampler_init(ran->allocator, &ran->samplers);
+  darray_double_init(ran->allocator, &ran->areas);
+  darray_double_init(ran->allocator, &ran->cumul);
+  darray_double_init(ran->allocator, &ran->rcp_pdfs);
+  darray_size_t_init(ran->allocator, &ran->strata);
+
+  n = htable_instance_size_get(&scn->instances_samp);
+  if(!n) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+  res = darray_instance_sampler_resize(&ran->samplers, n);
+  if(res != RES_OK) goto error;
+  res = darray_double_resize(&ran->areas, n);
+  if(res != RES_OK) goto error;
+  res = darray_double_resize(&ran->cumul, n);
+  if(res != RES_OK) goto error;
+  res = darray_double_resize(&ran->rcp_pdfs, n);
+  if(res != RES_OK) goto error;
+
+  i = 0;
+  htable_instance_begin(&scn->instances_samp, &it);
+  htable_instance_end(&scn->instances_samp, &end);
+  while(!htable_instance_iterator_eq(&it, &end)) {
+    const struct ssol_instance* inst = *htable_instance_iterator_data_get(&it);
+    htable_instance_iterator_next(&it);
+
+    res = create_instance_sampler
+      (scn, inst, darray_instance_sampler_data_get(&ran->samplers) + i);
+    if(res != RES_OK) goto error;
+    darray_double_data_get(&ran->areas)[i] = inst->shape_samp_area;
+    ++i;
+  }
+
+  /* Select the instances wrt their area */
+  res = ranst_instance_setup(ran, darray_double_cdata_get(&ran->areas));
+  if(res != RES_OK) goto error;
+
+exit:
+  *out_ran = ran;
+  return res;
+error:
+  if(ran) {
+    ranst_instance_ref_put(ran);
+    ran = NULL;
+  }
+  goto exit;
+}
+
+res_T
+ranst_instance_ref_get(struct ranst_instance* ran)
+{
+  if(!ran) return RES_BAD_ARG;
+  ref_get(&ran->ref);
+  return RES_OK;
+}
+
+res_T
+ranst_instance_ref_put(struct ranst_instance* ran)
+{
+  if(!ran) return RES_BAD_ARG;
+  ref_put(&ran->ref, ranst_instance_release);
+  return RES_OK;
+}
+
+size_t
+ranst_instance_get_count(const struct ranst_instance* ran)
+{
+  ASSERT(ran);
+  return darray_instance_sampler_size_get(&ran->samplers);
+}
+
+const struct ssol_instance*
+ranst_instance_get_instance(const struct ranst_instance* ran, const size_t i)
+{
+  ASSERT(ran && i < ranst_instance_get_count(ran));
+  return darray_instance_sampler_cdata_get(&ran->samplers)[i].instance;
+}
+
+double
+ranst_instance_get_area(const struct ranst_instance* ran, const size_t i)
+{
+  ASSERT(ran && i < ranst_instance_get_count(ran));
+  return darray_double_cdata_get(&ran->areas)[i];
+}
+
+res_T
+ranst_instance_setup(struct ranst_instance* ran, const double* weights)
+{
+  const double* areas;
+  double* cumul;
+  double* rcp_pdfs;
+  double sum = 0;
+  size_t i, n;
+
+  if(!ran || !weights) return RES_BAD_ARG;
+
+  n = ranst_instance_get_count(ran);
+  FOR_EACH(i, 0, n) {
+    if(weights[i] < 0) return RES_BAD_ARG;
+    sum += weights[i];
+  }
+  if(sum <= 0) return RES_BAD_ARG;
+
+  areas = darray_double_cdata_get(&ran->areas);
+  cumul = darray_double_data_get(&ran->cumul);
+  rcp_pdfs = darray_double_data_get(&ran->rcp_pdfs);
+  FOR_EACH(i, 0, n) {
+    const double proba = weights[i] / sum;
+    cumul[i] = (i ? cumul[i-1] : 0) + proba;
+    rcp_pdfs[i] = proba > 0 ? areas[i] / proba : 0;
+  }
+  cumul[n-1] = 1; /* Handle numerical inaccuracies */
+  darray_size_t_clear(&ran->strata);
+  return RES_OK;
+}
+
+res_T
+ranst_instance_stratify(struct ranst_instance* ran, const size_t nrealisations)
+{
+  const double* areas;
+  const double* cumul;
+  double* rcp_pdfs;
+  size_t* strata;
+  size_t i, n, nstrata = 0;
+  size_t nfree; /* #realisations distributed wrt the probabilities */
+  size_t end = 0;
+  size_t rounded_prev = 0;
+  res_T res = RES_OK;
+
+  if(!ran) return RES_BAD_ARG;
+
+  n = ranst_instance_get_count(ran);
+  cumul = darray_double_cdata_get(&ran->cumul);
+  FOR_EACH(i, 0, n) {
+    nstrata += cumul[i] > (i ? cumul[i-1] : 0);
+  }
+  if(nrealisations < nstrata) return RES_BAD_ARG;
+  nfree = nrealisations - nstrata;
+
+  res = darray_size_t_resize(&ran->strata, n);
+  if(res != RES_OK) return res;
+
+  /* Each stratum gets one realisation and its share of the remaining ones.
+   * The cumulative rounding ensures that the strata sizes sum to the number
+   * of realisations */
+  areas = darray_double_cdata_get(&ran->areas);
+  rcp_pdfs = darray_double_data_get(&ran->rcp_pdfs);
+  strata = darray_size_t_data_get(&ran->strata);
+  FOR_EACH(i, 0, n) {
+    const size_t rounded = (size_t)((double)nfree * cumul[i] + 0.5);
+    size_t size = 0;
+    if(cumul[i] > (i ? cumul[i-1] : 0)) {
+      size = 1 + rounded - rounded_prev;
+      rcp_pdfs[i] = areas[i] * (double)nrealisations / (double)size;
+    }
+    rounded_prev = rounded;
+    end += size;
+    strata[i] = end;
+  }
+  ASSERT(end == nrealisations);
+  return RES_OK;
+}
+
+double
+ranst_instance_get
+  (const struct ranst_instance* ran,
+   const size_t irealisation,
+   struct ssp_rng* rng,
+   struct s3d_primitive* prim,
+   float uv[2])
+{
+  const struct instance_sampler* sampler;
+  size_t i, n;
+  ASSERT(ran && rng && prim && uv);
+
+  n = ranst_instance_get_count(ran);
+  if(darray_size_t_size_get(&ran->strata)) {
+    /* Find the stratum of the realisation */
+    const size_t* strata = darray_size_t_cdata_get(&ran->strata);
+    const size_t* found;
+    ASSERT(irealisation < strata[n-1]);
+    found = search_lower_bound
+      (&irealisation, strata, n, sizeof(size_t), cmp_upper_size_t);
+    ASSERT(found);
+    i = (size_t)(found - strata);
+  } else {
+    /* Randomly select the instance */
+    const double* cumul = darray_double_cdata_get(&ran->cumul);
+    const double* found;
+    const double r = ssp_rng_canonical(rng);
+    found = search_lower_bound(&r, cumul, n, sizeof(double), cmp_upper);
+    i = found ? (size_t)(found - cumul) : n-1;
+  }
+  ASSERT(darray_double_cdata_get(&ran->rcp_pdfs)[i] > 0);
+
+  sampler = darray_instance_sampler_cdata_get(&ran->samplers) + i;
+  S3D(scene_view_sample
+    (sampler->view,
+     ssp_rng_canonical_float(rng),
+     ssp_rng_canonical_float(rng),
+     ssp_rng_canonical_float(rng),
+     prim, uv));
+  return darray_double_cdata_get(&ran->rcp_pdfs)[i];
+}
@@ -0,0 +1,94 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SSOL_RANST_INSTANCE_H
+#define SSOL_RANST_INSTANCE_H
+
+#include <rsys/rsys.h>
+
+/* External types */
+struct s3d_primitive;
+struct ssol_instance;
+struct ssol_scene;
+struct ssp_rng;
+
+/* Random variate state of the starting point of the radiative paths. An
+ * instance is first selected wrt its probability and a point is then uniformly
+ * sampled onto its sampling shape */
+struct ranst_instance;
+
+/* Create the distribution of the instances sampled by `scn', i.e. the
+ * instances registered by its Star-3D sampling views. By default the
+ * instances are selected wrt their area */
+extern LOCAL_SYM res_T
+ranst_instance_create
+  (struct ssol_scene* scn,
+   struct ranst_instance** ran);
+
+extern LOCAL_SYM res_T
+ranst_instance_ref_get
+  (struct ranst_instance* ran);
+
+extern LOCAL_SYM res_T
+ranst_instance_ref_put
+  (struct ranst_instance* ran);
+
+extern LOCAL_SYM size_t
+ranst_instance_get_count
+  (const struct ranst_instance* ran);
+
+extern LOCAL_SYM const struct ssol_instance*
+ranst_instance_get_instance
+  (const struct ranst_instance* ran,
+   const size_t i); /* In [0, ranst_instance_get_count[ */
+
+/* Area of the sampling shape of the i^th instance */
+extern LOCAL_SYM double
+ranst_instance_get_area
+  (const struct ranst_instance* ran,
+   const size_t i); /* In [0, ranst_instance_get_count[ */
+
+/* Define the selection probability of the instances from `weights', i.e. one
+ * positive or null weight per instance. The weights are normalised. Reset the
+ * stratification, if any */
+extern LOCAL_SYM res_T
+ranst_instance_setup
+  (struct ranst_instance* ran,
+   const double* weights);
+
+/* Deterministically split `nrealisations' realisations over the instances
+ * proportionally to their selection probability. Each instance whose
+ * probability is not null gets at least one realisation. Return RES_BAD_ARG if
+ * there are less realisations than such instances */
+extern LOCAL_SYM res_T
+ranst_instance_stratify
+  (struct ranst_instance* ran,
+   const size_t nrealisations);
+
+/* Sample a point and return the inverse of its probability density wrt the
+ * area, i.e. the area of the instance divided by its selection probability.
+ * Once stratified, the instance is the one of the stratum of the realisation
+ * and its selection probability is the size of the stratum divided by the
+ * overall number of realisations */
+extern LOCAL_SYM double
+ranst_instance_get
+  (const struct ranst_instance* ran,
+   const size_t irealisation, /* Only used by the stratified distribution */
+   struct ssp_rng* rng,
+   struct s3d_primitive* prim,
+   float uv[2]);
+
+#endif /* SSOL_RANST_INSTANCE_H */
@@ -20,16 +20,23 @@
 #include <star/ssp.h>
 
 #include <rsys/double33.h>
+#include <rsys/dynamic_array_double.h>
 #include <rsys/math.h>
 #include <rsys/mem_allocator.h>
 #include <rsys/rsys.h>
 #include <rsys/ref_count.h>
 
+#include <math.h>
+
 /*******************************************************************************
  * Distributions types for wavelengths
  ******************************************************************************/
 struct ran_piecewise_wl_state {
   struct ssp_ranst_piecewise_linear* spectrum;
+  /* Inverse CDF used by the stratified sampling */
+  struct darray_double wavelengths;
+  struct darray_double intensities;
+  struct darray_double cumul; /* Normalised cumulative of the intensities */
 };
 
 struct ran_dirac_wl_state {
@@ -70,8 +77,13 @@ distrib_sun_wl_release(ref_T* ref)
     case WL_DIRAC:
       break;
     case WL_PIECEWISE:
-      SSP(ranst_piecewise_linear_ref_put(ran->state.piecewise.spectrum));
-      ran->state.piecewise.spectrum = NULL;
+      if(ran->state.piecewise.spectrum) {
+        SSP(ranst_piecewise_linear_ref_put(ran->state.piecewise.spectrum));
+        ran->state.piecewise.spectrum = NULL;
+      }
+      darray_double_release(&ran->state.piecewise.wavelengths);
+      darray_double_release(&ran->state.piecewise.intensities);
+      darray_double_release(&ran->state.piecewise.cumul);
       break;
     default: FATAL("Unreachable code\n"); break;
   }
@@ -91,6 +103,77 @@ ran_piecewise_get
   return ssp_ranst_piecewise_linear_get(ran->state.piecewise.spectrum, rng);
 }
 
+/* Invert the CDF of the piecewise linear distribution for `u' in [0, 1[ */
+static double
+ran_piecewise_invert(const struct ranst_sun_wl* ran, const double u)
+{
+  const double* wls;
+  const double* intensities;
+  const double* cumul;
+  double f0, f1, width, m, t;
+  size_t lo, hi;
+  ASSERT(ran && ran->type == WL_PIECEWISE && u >= 0 && u < 1);
+
+  wls = darray_double_cdata_get(&ran->state.piecewise.wavelengths);
+  intensities = darray_double_cdata_get(&ran->state.piecewise.intensities);
+  cumul = darray_double_cdata_get(&ran->state.piecewise.cumul);
+
+  /* Find the interval [lo, lo+1] such that cumul[lo] <= u < cumul[lo+1] */
+  lo = 0;
+  hi = darray_double_size_get(&ran->state.piecewise.cumul) - 1;
+  while(hi - lo > 1) {
+    const size_t mid = (lo + hi) / 2;
+    if(cumul[mid] <= u) lo = mid; else hi = mid;
+  }
+
+  /* Solve f0*t + (f1-f0)*t^2/(2*width) = m wrt t in [0, width], with m the
+   * remaining mass into the interval in the unit of the intensities */
+  f0 = intensities[lo];
+  f1 = intensities[lo+1];
+  width = wls[lo+1] - wls[lo];
+  m = (u - cumul[lo]) / (cumul[lo+1] - cumul[lo]) * 0.5 * (f0 + f1) * width;
+  if(m <= 0) return wls[lo];
+  t = 2 * m / (f0 + sqrt(f0*f0 + 2*(f1 - f0)*m/width));
+  return wls[lo] + MMIN(MMAX(t, 0), width);
+}
+
+static res_T
+ran_piecewise_setup_cumul
+  (struct ranst_sun_wl* ran,
+   const double* wavelengths,
+   const double* intensities,
+   const size_t sz)
+{
+  struct ran_piecewise_wl_state* state;
+  double* cumul;
+  size_t i;
+  res_T res = RES_OK;
+  ASSERT(ran && ran->type == WL_PIECEWISE && wavelengths && intensities);
+  ASSERT(sz > 1);
+
+  state = &ran->state.piecewise;
+  res = darray_double_resize(&state->wavelengths, sz);
+  if(res != RES_OK) return res;
+  res = darray_double_resize(&state->intensities, sz);
+  if(res != RES_OK) return res;
+  res = darray_double_resize(&state->cumul, sz);
+  if(res != RES_OK) return res;
+
+  cumul = darray_double_data_get(&state->cumul);
+  cumul[0] = 0;
+  FOR_EACH(i, 0, sz) {
+    darray_double_data_get(&state->wavelengths)[i] = wavelengths[i];
+    darray_double_data_get(&state->intensities)[i] = intensities[i];
+    if(i) {
+      cumul[i] = cumul[i-1] + 0.5 * (intensities[i-1] + intensities[i])
+        * (wavelengths[i] - wavelengths[i-1]);
+    }
+  }
+  if(cumul[sz-1] <= 0) return RES_BAD_ARG;
+  FOR_EACH(i, 1, sz) cumul[i] /= cumul[sz-1];
+  return RES_OK;
+}
+
 /*******************************************************************************
  * Dirac distribution
  ******************************************************************************/
@@ -151,6 +234,31 @@ ranst_sun_wl_get(const struct ranst_sun_wl* ran, struct ssp_rng* rng)
   return ran->get(ran, rng);
 }
 
+size_t
+ranst_sun_wl_get_stratified
+  (const struct ranst_sun_wl* ran,
+   struct ssp_rng* rng,
+   const size_t count,
+   double* wavelengths)
+{
+  double u0;
+  size_t i;
+  ASSERT(ran && rng && count && wavelengths);
+
+  if(ran->type == WL_DIRAC) {
+    wavelengths[0] = ran->state.dirac.wavelength;
+    return 1;
+  }
+
+  u0 = ssp_rng_canonical(rng);
+  FOR_EACH(i, 0, count) {
+    double u = u0 + (double)i / (double)count;
+    if(u >= 1) u -= 1;
+    wavelengths[i] = ran_piecewise_invert(ran, u);
+  }
+  return count;
+}
+
 res_T
 ranst_sun_wl_setup
   (struct ranst_sun_wl* ran,
@@ -169,6 +277,11 @@ ranst_sun_wl_setup
   } else {
     ran->type = WL_PIECEWISE;
     ran->get = &ran_piecewise_get;
+    darray_double_init(ran->allocator, &ran->state.piecewise.wavelengths);
+    darray_double_init(ran->allocator, &ran->state.piecewise.intensities);
+    darray_double_init(ran->allocator, &ran->state.piecewise.cumul);
+    res = ran_piecewise_setup_cumul(ran, wavelengths, intensities, sz);
+    if(res != RES_OK) goto error;
     res = ssp_ranst_piecewise_linear_create
       (ran->allocator, &ran->state.piecewise.spectrum);
     if(res != RES_OK) goto error;
@@ -42,6 +42,18 @@ ranst_sun_wl_get
   (const struct ranst_sun_wl* ran,
    struct ssp_rng* rng);
 
+/* Sample `count' wavelengths that stratify the distribution from a single
+ * random number, i.e. the i^th one inverts the CDF at the canonical number
+ * u0 + i/count modulo 1. Each one is thus distributed wrt the distribution.
+ * Return the number of sampled wavelengths, i.e. 1 for a single wavelength
+ * distribution */
+extern LOCAL_SYM size_t
+ranst_sun_wl_get_stratified
+  (const struct ranst_sun_wl* ran,
+   struct ssp_rng* rng,
+   const size_t count,
+   double* wavelengths); /* List of `count' sampled wavelengths */
+
 extern LOCAL_SYM res_T
 ranst_sun_wl_setup
   (struct ranst_sun_wl* ran,
@@ -33,6 +33,8 @@
 #include <rsys/mem_allocator.h>
 #include <rsys/rsys.h>
 
+#include <limits.h>
+
 /*******************************************************************************
  * Helper functions
  ******************************************************************************/
@@ -49,12 +51,93 @@ scene_release(ref_T* ref)
   if(scene->scn_samp) S3D(scene_ref_put(scene->scn_samp));
   if(scene->sun) SSOL(sun_ref_put(scene->sun));
   if(scene->atmosphere) SSOL(atmosphere_ref_put(scene->atmosphere));
+  if(scene->objective.receiver)
+    SSOL(instance_ref_put(scene->objective.receiver));
   htable_instance_release(&scene->instances_rt);
   htable_instance_release(&scene->instances_samp);
+  darray_tally_release(&scene->tallies);
+  darray_medium_release(&scene->media);
+  htable_material_media_release(&scene->mtl_media);
   MEM_RM(dev->allocator, scene);
   SSOL(device_ref_put(dev));
 }
 
+/* Return the index of the interned medium certainly equal to `medium'. Intern
+ * it if there is no such medium. The list of interned media is expected to be
+ * short and is thus linearly searched */
+static res_T
+intern_medium
+  (struct ssol_scene* scn,
+   const struct ssol_medium* medium,
+   unsigned* id)
+{
+  const struct ssol_medium* media;
+  size_t i, n;
+  res_T res = RES_OK;
+  ASSERT(scn && medium && id);
+
+  media = darray_medium_cdata_get(&scn->media);
+  n = darray_medium_size_get(&scn->media);
+  FOR_EACH(i, 0, n) {
+    if(media_ceq(media + i, medium)) break;
+  }
+  if(i == n) {
+    ASSERT(n < UINT_MAX);
+    res = darray_medium_push_back(&scn->media, medium);
+    if(res != RES_OK) return res;
+  }
+  *id = (unsigned)i;
+  return RES_OK;
+}
+
+static res_T
+intern_material_media(struct ssol_scene* scn, const struct ssol_material* mtl)
+{
+  struct material_media media;
+  res_T res = RES_OK;
+  ASSERT(scn && mtl);
+
+  if(mtl->type != SSOL_MATERIAL_DIELECTRIC
+  && mtl->type != SSOL_MATERIAL_THIN_DIELECTRIC)
+    return RES_OK; /* The material is not an interface between media */
+  if(htable_material_media_find(&scn->mtl_media, &mtl))
+    return RES_OK; /* The material media are already interned */
+
+  res = intern_medium(scn, &mtl->in_medium, &media.in);
+  if(res != RES_OK) return res;
+  res = intern_medium(scn, &mtl->out_medium, &media.out);
+  if(res != RES_OK) return res;
+  return htable_material_media_set(&scn->mtl_media, &mtl, &media);
+}
+
+/* Return whether or not a radiative path can be redirected by the instance,
+ * i.e. if one of its shaded shapes has a material that is neither virtual nor
+ * an absorber */
+static INLINE int
+material_redirects_flux(const struct ssol_material* mtl)
+{
+  ASSERT(mtl);
+  return mtl->type != SSOL_MATERIAL_VIRTUAL
+      && mtl->type != SSOL_MATERIAL_ABSORBER;
+}
+
+static int
+instance_redirects_flux(const struct ssol_instance* inst)
+{
+  const struct shaded_shape* sshapes;
+  size_t i, n;
+  ASSERT(inst);
+
+  n = darray_shaded_shape_size_get(&inst->object->shaded_shapes);
+  sshapes = darray_shaded_shape_cdata_get(&inst->object->shaded_shapes);
+  FOR_EACH(i, 0, n) {
+    if(material_redirects_flux(sshapes[i].mtl_front)
+    || material_redirects_flux(sshapes[i].mtl_back))
+      return 1;
+  }
+  return 0;
+}
+
 /*******************************************************************************
  * Exported ssol_scene functions
  ******************************************************************************/
@@ -77,6 +160,15 @@ ssol_scene_create
   }
   htable_instance_init(dev->allocator, &scene->instances_rt);
   htable_instance_init(dev->allocator, &scene->instances_samp);
+  darray_tally_init(dev->allocator, &scene->tallies);
+  darray_medium_init(dev->allocator, &scene->media);
+  htable_material_media_init(dev->allocator, &scene->mtl_media);
+  scene->accounting = SSOL_ACCOUNTING_FULL;
+  scene->nsplits = 1;
+  scene->nwavelengths = 1;
+  scene->npilots = 0;
+  scene->objective = SSOL_ADAPTIVE_OBJECTIVE_DEFAULT;
+  scene->stratification = SSOL_STRATIFICATION_NONE;
   SSOL(device_ref_get(dev));
   scene->dev = dev;
   ref_init(&scene->ref);
@@ -236,6 +328,8 @@ ssol_scene_clear(struct ssol_scene* scene)
   S3D(scene_clear(scene->scn_rt));
   S3D(scene_clear(scene->scn_samp));
   ssol_medium_clear(&scene->air);
+  darray_medium_clear(&scene->media);
+  htable_material_media_clear(&scene->mtl_media);
   if(scene->sun) SSOL(scene_detach_sun(scene, scene->sun));
   if(scene->atmosphere) SSOL(scene_detach_atmosphere(scene, scene->atmosphere));
   return RES_OK;
@@ -340,6 +434,158 @@ error:
   goto exit;
 }
 
+res_T
+ssol_scene_add_tally
+  (struct ssol_scene* scn,
+   const struct ssol_tally* tally,
+   size_t* id)
+{
+  size_t itally;
+  res_T res = RES_OK;
+
+  if(!scn || !tally || !tally->sizeof_data || !tally->merge)
+    return RES_BAD_ARG;
+
+  itally = darray_tally_size_get(&scn->tallies);
+  res = darray_tally_push_back(&scn->tallies, tally);
+  if(res != RES_OK) return res;
+  if(id) *id = itally;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_clear_tallies(struct ssol_scene* scn)
+{
+  if(!scn) return RES_BAD_ARG;
+  darray_tally_clear(&scn->tallies);
+  return RES_OK;
+}
+
+res_T
+ssol_scene_set_accounting
+  (struct ssol_scene* scn,
+   const enum ssol_accounting accounting)
+{
+  if(!scn || (unsigned)accounting >= SSOL_ACCOUNTING_COUNT__)
+    return RES_BAD_ARG;
+  scn->accounting = accounting;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_get_accounting
+  (const struct ssol_scene* scn,
+   enum ssol_accounting* accounting)
+{
+  if(!scn || !accounting) return RES_BAD_ARG;
+  *accounting = scn->accounting;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_set_glossy_splitting(struct ssol_scene* scn, const size_t nsplits)
+{
+  if(!scn || !nsplits) return RES_BAD_ARG;
+  scn->nsplits = nsplits;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_get_glossy_splitting(const struct ssol_scene* scn, size_t* nsplits)
+{
+  if(!scn || !nsplits) return RES_BAD_ARG;
+  *nsplits = scn->nsplits;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_set_path_wavelengths(struct ssol_scene* scn, const size_t count)
+{
+  if(!scn || !count || count > SSOL_MAX_PATH_WAVELENGTHS) return RES_BAD_ARG;
+  scn->nwavelengths = count;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_get_path_wavelengths(const struct ssol_scene* scn, size_t* count)
+{
+  if(!scn || !count) return RES_BAD_ARG;
+  *count = scn->nwavelengths;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_set_adaptive_sampling(struct ssol_scene* scn, const size_t npilots)
+{
+  if(!scn) return RES_BAD_ARG;
+  scn->npilots = npilots;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_get_adaptive_sampling(const struct ssol_scene* scn, size_t* npilots)
+{
+  if(!scn || !npilots) return RES_BAD_ARG;
+  *npilots = scn->npilots;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_set_adaptive_objective
+  (struct ssol_scene* scn,
+   const struct ssol_adaptive_objective* objective)
+{
+  struct ssol_adaptive_objective obj;
+
+  if(!scn || !objective
+  || (unsigned)objective->quantity >= SSOL_ADAPTIVE_QUANTITY_COUNT__)
+    return RES_BAD_ARG;
+
+  obj = *objective;
+  if(obj.quantity == SSOL_ADAPTIVE_ABSORBED_BY_RECEIVERS) {
+    obj.receiver = NULL;
+  } else if(!obj.receiver
+         || (obj.side != SSOL_FRONT && obj.side != SSOL_BACK)) {
+    return RES_BAD_ARG;
+  }
+
+  if(obj.receiver) SSOL(instance_ref_get(obj.receiver));
+  if(scn->objective.receiver) SSOL(instance_ref_put(scn->objective.receiver));
+  scn->objective = obj;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_get_adaptive_objective
+  (const struct ssol_scene* scn,
+   struct ssol_adaptive_objective* objective)
+{
+  if(!scn || !objective) return RES_BAD_ARG;
+  *objective = scn->objective;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_set_stratification
+  (struct ssol_scene* scn,
+   const enum ssol_stratification stratification)
+{
+  if(!scn || (unsigned)stratification >= SSOL_STRATIFICATION_COUNT__)
+    return RES_BAD_ARG;
+  scn->stratification = stratification;
+  return RES_OK;
+}
+
+res_T
+ssol_scene_get_stratification
+  (const struct ssol_scene* scn,
+   enum ssol_stratification* stratification)
+{
+  if(!scn || !stratification) return RES_BAD_ARG;
+  *stratification = scn->stratification;
+  return RES_OK;
+}
+
 /*******************************************************************************
  * Local functions
  ******************************************************************************/
@@ -432,6 +678,55 @@ error:
   goto exit;
 }
 
+res_T
+scene_compute_receivers_reach_aabb
+  (struct ssol_scene* scn,
+   float lower[3],
+   float upper[3])
+{
+  struct htable_instance_iterator it, end;
+  struct s3d_scene* s3d_scn = NULL;
+  struct s3d_scene_view* view = NULL;
+  int is_empty = 1;
+  res_T res = RES_OK;
+  ASSERT(scn && lower && upper);
+
+  /* Gather the instantiated RT shapes in a dedicated Star-3D scene */
+  res = s3d_scene_create(scn->dev->s3d, &s3d_scn);
+  if(res != RES_OK) goto error;
+
+  htable_instance_begin(&scn->instances_rt, &it);
+  htable_instance_end(&scn->instances_rt, &end);
+  while(!htable_instance_iterator_eq(&it, &end)) {
+    struct ssol_instance* inst = *htable_instance_iterator_data_get(&it);
+    htable_instance_iterator_next(&it);
+
+    if(!inst->receiver_mask && !instance_redirects_flux(inst))
+      continue;
+
+    res = s3d_scene_attach_shape(s3d_scn, inst->shape_rt);
+    if(res != RES_OK) goto error;
+    is_empty = 0;
+  }
+
+  if(is_empty) {
+    f3_splat(lower, FLT_MAX);
+    f3_splat(upper,-FLT_MAX);
+  } else {
+    res = s3d_scene_view_create(s3d_scn, S3D_GET_PRIMITIVE, &view);
+    if(res != RES_OK) goto error;
+    res = s3d_scene_view_get_aabb(view, lower, upper);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  if(view) S3D(scene_view_ref_put(view));
+  if(s3d_scn) S3D(scene_ref_put(s3d_scn));
+  return res;
+error:
+  goto exit;
+}
+
 /*******************************************************************************
  * Local miscellaneous functions
  ******************************************************************************/
@@ -535,6 +830,81 @@ hit_filter_function
   return 0;
 }
 
+res_T
+scene_setup_media(struct ssol_scene* scn)
+{
+  struct htable_instance_iterator it, end;
+  res_T res = RES_OK;
+  ASSERT(scn);
+
+  darray_medium_clear(&scn->media);
+  htable_material_media_clear(&scn->mtl_media);
+
+  res = intern_medium(scn, &scn->air, &scn->air_id);
+  if(res != RES_OK) goto error;
+
+  htable_instance_begin(&scn->instances_rt, &it);
+  htable_instance_end(&scn->instances_rt, &end);
+  while(!htable_instance_iterator_eq(&it, &end)) {
+    struct ssol_instance* inst = *htable_instance_iterator_data_get(&it);
+    const struct shaded_shape* sshapes;
+    size_t i, n;
+    htable_instance_iterator_next(&it);
+
+    sshapes = darray_shaded_shape_cdata_get(&inst->object->shaded_shapes);
+    n = darray_shaded_shape_size_get(&inst->object->shaded_shapes);
+    FOR_EACH(i, 0, n) {
+      res = intern_material_media(scn, sshapes[i].mtl_front);
+      if(res != RES_OK) goto error;
+      res = intern_material_media(scn, sshapes[i].mtl_back);
+      if(res != RES_OK) goto error;
+    }
+  }
+
+exit:
+  return res;
+error:
+  darray_medium_clear(&scn->media);
+  htable_material_media_clear(&scn->mtl_media);
+  goto exit;
+}
+
+void
+scene_setup_gray(struct ssol_scene* scn)
+{
+  struct htable_instance_iterator it, end;
+  ASSERT(scn && scn->sun && scn->sun->spectrum);
+
+  scn->is_gray = 0;
+  scn->gray_wavelength = 0;
+
+  if(darray_double_size_get(&scn->sun->spectrum->wavelengths) != 1
+  || scn->air.extinction.type != SSOL_DATA_REAL
+  || scn->air.refractive_index.type != SSOL_DATA_REAL)
+    return;
+
+  htable_instance_begin(&scn->instances_rt, &it);
+  htable_instance_end(&scn->instances_rt, &end);
+  while(!htable_instance_iterator_eq(&it, &end)) {
+    struct ssol_instance* inst = *htable_instance_iterator_data_get(&it);
+    const struct shaded_shape* sshapes;
+    size_t i, n;
+    htable_instance_iterator_next(&it);
+
+    sshapes = darray_shaded_shape_cdata_get(&inst->object->shaded_shapes);
+    n = darray_shaded_shape_size_get(&inst->object->shaded_shapes);
+    FOR_EACH(i, 0, n) {
+      if(!material_is_gray(sshapes[i].mtl_front)
+      || !material_is_gray(sshapes[i].mtl_back))
+        return;
+    }
+  }
+
+  scn->is_gray = 1;
+  scn->gray_wavelength =
+    darray_double_cdata_get(&scn->sun->spectrum->wavelengths)[0];
+}
+
 res_T
 scene_check(const struct ssol_scene* scene, const char* caller)
 {
@@ -17,6 +17,9 @@
 #ifndef SSOL_SCENE_C_H
 #define SSOL_SCENE_C_H
 
+#include "ssol_tally_c.h"
+
+#include <rsys/dynamic_array.h>
 #include <rsys/hash_table.h>
 #include <rsys/ref_count.h>
 #include <rsys/rsys.h>
@@ -29,6 +32,61 @@ struct ssol_instance;
 #define HTABLE_DATA struct ssol_instance*
 #include <rsys/hash_table.h>
 
+struct ssol_material;
+
+/* Identifiers of the interned media on both sides of a material */
+struct material_media {
+  unsigned in; /* Medium on the front side of the material */
+  unsigned out; /* Medium on the back side of the material */
+};
+
+/* Define the htable_material_media data structure */
+#define HTABLE_NAME material_media
+#define HTABLE_KEY const struct ssol_material*
+#define HTABLE_DATA struct material_media
+#include <rsys/hash_table.h>
+
+static INLINE void
+medium_init(struct mem_allocator* allocator, struct ssol_medium* medium)
+{
+  ASSERT(medium);
+  (void)allocator;
+  *medium = SSOL_MEDIUM_VACUUM;
+}
+
+static INLINE void
+medium_release(struct ssol_medium* medium)
+{
+  ASSERT(medium);
+  ssol_medium_clear(medium);
+}
+
+static INLINE res_T
+medium_copy(struct ssol_medium* dst, const struct ssol_medium* src)
+{
+  ASSERT(dst && src);
+  ssol_medium_copy(dst, src);
+  return RES_OK;
+}
+
+static INLINE res_T
+medium_copy_and_release(struct ssol_medium* dst, struct ssol_medium* src)
+{
+  ASSERT(dst && src);
+  ssol_medium_copy(dst, src);
+  ssol_medium_clear(src);
+  return RES_OK;
+}
+
+/* Define the darray_medium data structure */
+#define DARRAY_NAME medium
+#define DARRAY_DATA struct ssol_medium
+#define DARRAY_FUNCTOR_INIT medium_init
+#define DARRAY_FUNCTOR_RELEASE medium_release
+#define DARRAY_FUNCTOR_COPY medium_copy
+#define DARRAY_FUNCTOR_COPY_AND_RELEASE medium_copy_and_release
+#include <rsys/dynamic_array.h>
+
 /* Forward declarations */
 struct s3d_hit;
 struct s3d_scene;
@@ -51,6 +109,27 @@ struct ssol_scene {
   struct ssol_atmosphere* atmosphere; /* Atmosphere of the scene */
   struct ssol_medium air; /* Defined according to atmosphere's properties */
 
+  /* Media interned by the solve setup. The radiative paths refer to them by
+   * their index, i.e. they neither copy them nor compare their data */
+  struct darray_medium media;
+  struct htable_material_media mtl_media; /* Media of the dielectrics */
+  unsigned air_id; /* Index of the air into the interned media */
+
+  /* Define whether the sun emits at a single wavelength and all the data of
+   * the media and materials are real values. The radiative paths then
+   * neither sample a wavelength nor look up spectral data. Set by the solve
+   * setup */
+  int is_gray;
+  double gray_wavelength; /* Wavelength of the sun in the gray case */
+
+  struct darray_tally tallies; /* Tallies evaluated by the solves */
+  enum ssol_accounting accounting; /* Quantities estimated by the solves */
+  size_t nsplits; /* #sub-paths sampled at the first glossy bounce */
+  size_t nwavelengths; /* #wavelengths carried by a radiative path */
+  size_t npilots; /* #pilot realisations of the adaptive sampling */
+  struct ssol_adaptive_objective objective; /* Of the adaptive sampling */
+  enum ssol_stratification stratification;
+
   struct ssol_device* dev;
   ref_T ref;
 };
@@ -63,6 +142,46 @@ scene_create_s3d_views
    struct s3d_scene_view** view_rt,
    struct s3d_scene_view** view_samp);
 
+/* Compute the bounding box of the receivers and of the instances with a non
+ * virtual and non absorbing material, i.e. of the geometry that can bring a
+ * radiative path onto a receiver. The box is empty, i.e. lower > upper, if there is no such
+ * geometry */
+extern LOCAL_SYM res_T
+scene_compute_receivers_reach_aabb
+  (struct ssol_scene* scn,
+   float lower[3],
+   float upper[3]);
+
+/* Intern the air and the media of the dielectric materials of the scene.
+ * Media that are certainly equal share the same index */
+extern LOCAL_SYM res_T
+scene_setup_media(struct ssol_scene* scn);
+
+/* Define whether or not the solve of the scene is gray, i.e. whether it can
+ * skip the wavelength sampling and the spectral data lookups */
+extern LOCAL_SYM void
+scene_setup_gray(struct ssol_scene* scn);
+
+static FINLINE const struct ssol_medium*
+scene_get_medium(const struct ssol_scene* scn, const unsigned id)
+{
+  ASSERT(scn && id < darray_medium_size_get(&scn->media));
+  return darray_medium_cdata_get(&scn->media) + id;
+}
+
+/* Return the interned media of a dielectric or thin dielectric material */
+static FINLINE const struct material_media*
+scene_get_material_media
+  (struct ssol_scene* scn,
+   const struct ssol_material* mtl)
+{
+  const struct material_media* media;
+  ASSERT(scn && mtl);
+  media = htable_material_media_find(&scn->mtl_media, &mtl);
+  ASSERT(media);
+  return media;
+}
+
 extern LOCAL_SYM res_T
 scene_check
   (const struct ssol_scene* scene,
@@ -810,6 +810,71 @@ quadric_setup_s3d_shape_samp
   return RES_OK;
 }
 
+/* Compute the per triangle frames of the shape to ray-trace. Triangles without
+ * texture coordinates use the implicit (1,0), (0,1), (0,0) mapping */
+static res_T
+shape_setup_frames(struct ssol_shape* shape)
+{
+  unsigned itri, ntris;
+  res_T res = RES_OK;
+  ASSERT(shape);
+
+  darray_triangle_frame_clear(&shape->frames);
+  res = s3d_mesh_get_triangles_count(shape->shape_rt, &ntris);
+  if(res != RES_OK) goto error;
+  res = darray_triangle_frame_resize(&shape->frames, ntris);
+  if(res != RES_OK) goto error;
+
+  FOR_EACH(itri, 0, ntris) {
+    struct triangle_frame* frame;
+    double P[3][3];
+    double uvs[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 0}};
+    double duv1[2], duv2[2];
+    double dP1[3], dP2[3];
+    double det;
+    unsigned ids[3];
+    int i;
+
+    frame = darray_triangle_frame_data_get(&shape->frames) + itri;
+    res = s3d_mesh_get_triangle_indices(shape->shape_rt, itri, ids);
+    if(res != RES_OK) goto error;
+    FOR_EACH(i, 0, 3) {
+      res = shape_fetched_raw_vertex_attrib(shape, ids[i], SSOL_POSITION, P[i]);
+      if(res != RES_OK) goto error;
+      if(shape->has_texcoord) {
+        res = shape_fetched_raw_vertex_attrib
+          (shape, ids[i], SSOL_TEXCOORD, uvs[i]);
+        if(res != RES_OK) goto error;
+      }
+    }
+
+    duv1[0] = uvs[1][0] - uvs[0][0];
+    duv1[1] = uvs[1][1] - uvs[0][1];
+    duv2[0] = uvs[2][0] - uvs[0][0];
+    duv2[1] = uvs[2][1] - uvs[0][1];
+    d3_sub(dP1, P[1], P[0]);
+    d3_sub(dP2, P[2], P[0]);
+    det = duv1[0]*duv2[1] - duv1[1]*duv2[0];
+    frame->degenerated = det == 0;
+    if(frame->degenerated) {
+      d3_splat(frame->dPdu, 0);
+      d3_splat(frame->dPdv, 0);
+    } else {
+      double a[3], b[3];
+      d3_sub(frame->dPdu, d3_muld(a, dP1, duv2[1]), d3_muld(b, dP2, duv1[1]));
+      d3_sub(frame->dPdv, d3_muld(a, dP2, duv1[0]), d3_muld(b, dP1, duv2[0]));
+      d3_divd(frame->dPdu, frame->dPdu, det);
+      d3_divd(frame->dPdv, frame->dPdv, det);
+    }
+  }
+
+exit:
+  return res;
+error:
+  darray_triangle_frame_clear(&shape->frames);
+  goto exit;
+}
+
 static res_T
 shape_create
   (struct ssol_device* dev,
@@ -832,6 +897,7 @@ shape_create
   SSOL(device_ref_get(dev));
   shape->dev = dev;
   shape->type = type;
+  darray_triangle_frame_init(dev->allocator, &shape->frames);
   ref_init(&shape->ref);
 
   /* Create the s3d_shape to ray-trace */
@@ -1253,6 +1319,7 @@ shape_release(ref_T* ref)
   ASSERT(dev && dev->allocator);
   if(shape->shape_rt) S3D(shape_ref_put(shape->shape_rt));
   if(shape->shape_samp) S3D(shape_ref_put(shape->shape_samp));
+  darray_triangle_frame_release(&shape->frames);
   MEM_RM(dev->allocator, shape);
   SSOL(device_ref_put(dev));
 }
@@ -1446,6 +1513,34 @@ punched_shape_project_point
   d3_normalize(N_quadric, N_quadric);
 }
 
+void
+shape_world_to_local
+  (const struct ssol_shape* shape,
+   const double transform[12],
+   const double pos[3],
+   double pos_local[3])
+{
+  double R[9]; /* Local to world rotation matrix */
+  double R_invtrans[9]; /* Inverse transpose of R */
+  double T[3]; /* Local to world translation vector */
+  ASSERT(shape && transform && pos && pos_local);
+
+  /* Compute the local to world transformation */
+  if(shape->type != SHAPE_PUNCHED) {
+    d33_set(R, transform);
+    d3_set(T, transform + 9);
+  } else {
+    d33_muld33(R, transform, shape->transform);
+    d33_muld3(T, transform, shape->transform+9);
+    d3_add(T, T, transform + 9);
+  }
+  d33_invtrans(R_invtrans, R);
+
+  /* Transform pos in local space */
+  d3_sub(pos_local, pos, T);
+  d3_muld33(pos_local, pos_local, R_invtrans);
+}
+
 double
 shape_trace_ray
   (struct ssol_shape* shape,
@@ -1690,6 +1785,12 @@ ssol_punched_surface_setup
     upper, shape->shape_samp, &shape->shape_samp_area);
   if(res != RES_OK) goto error;
 
+  /* Precompute the per triangle frames of the quadric mesh */
+  shape->has_texcoord = 1;
+  shape->has_normal = 0;
+  res = shape_setup_frames(shape);
+  if(res != RES_OK) goto error;
+
 exit:
   darray_double_release(&coords);
   darray_size_t_release(&ids);
@@ -1710,6 +1811,8 @@ ssol_mesh_setup
 {
   struct s3d_vertex_data attrs[SSOL_ATTRIBS_COUNT__];
   void (*get_position)(const unsigned ivert, float position[3], void* data) = NULL;
+  int has_texcoord = 0;
+  int has_normal = 0;
   res_T res = RES_OK;
   unsigned i;
 
@@ -1741,10 +1844,12 @@ ssol_mesh_setup
       case SSOL_NORMAL:
         attrs[i].usage = SSOL_TO_S3D_NORMAL;
         attrs[i].type = S3D_FLOAT3;
+        has_normal = 1;
         break;
       case SSOL_TEXCOORD:
         attrs[i].usage = SSOL_TO_S3D_TEXCOORD;
         attrs[i].type = S3D_FLOAT2;
+        has_texcoord = 1;
         break;
       default: FATAL("Unreachable code.\n"); break;
     }
@@ -1762,6 +1867,12 @@ ssol_mesh_setup
   if(res != RES_OK) goto error;
   shape->shape_samp_area = shape->shape_rt_area;
 
+  /* Precompute the per triangle frames of the mesh */
+  shape->has_texcoord = has_texcoord;
+  shape->has_normal = has_normal;
+  res = shape_setup_frames(shape);
+  if(res != RES_OK) goto error;
+
 exit:
   return res;
 error:
@@ -19,6 +19,7 @@
 
 #include "ssol.h"
 
+#include <rsys/dynamic_array.h>
 #include <rsys/ref_count.h>
 
 enum shape_type {
@@ -64,12 +65,27 @@ union private_data {
   struct priv_hemisphere_data hemisphere;
 };
 
+/* Partial derivatives of the position of a triangle wrt its texture
+ * coordinates, in object space. They are constant over the triangle */
+struct triangle_frame {
+  double dPdu[3];
+  double dPdv[3];
+  int degenerated; /* The texture coordinates of the triangle are degenerated */
+};
+
+#define DARRAY_NAME triangle_frame
+#define DARRAY_DATA struct triangle_frame
+#include <rsys/dynamic_array.h>
+
 struct ssol_shape {
   enum shape_type type;
   enum ssol_quadric_type quadric_type; /* Defined if type is SHAPE_PUNCHED */
 
   struct s3d_shape* shape_rt; /* Star-3D shape to ray-trace */
   struct s3d_shape* shape_samp; /* Star-3D shape to sample */
+  struct darray_triangle_frame frames; /* Per triangle frame of shape_rt */
+  int has_texcoord; /* Does shape_rt define per vertex texture coordinates */
+  int has_normal; /* Does shape_rt define per vertex normals */
   union private_data private_data;
   double transform[12];
   double shape_rt_area, shape_samp_area;
@@ -96,6 +112,15 @@ punched_shape_project_point
    double pos_quadric[3], /* World space position onto the quadric */
    double N_quadric[3]); /* World space normal onto the quadric */
 
+/* Transform pos in the local space of the shape, i.e. the quadric space of a
+ * punched surface or the object space of a mesh */
+extern LOCAL_SYM void
+shape_world_to_local
+  (const struct ssol_shape* shape,
+   const double transform[12], /* Object to world space transformation */
+   const double pos[3], /* World space position */
+   double pos_local[3]); /* Local space position */
+
 /* Return the hit distance of the ray wrt the punched surface. >= FLT_MAX if
  * the ray does not intersect the quadric */
 extern LOCAL_SYM double
@@ -0,0 +1,452 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "ssol_device_c.h"
+#include "ssol_slope_distribution_c.h"
+
+#include <rsys/double3.h>
+#include <rsys/double33.h>
+#include <rsys/mem_allocator.h>
+#include <rsys/ref_count.h>
+
+#include <star/ssf.h>
+#include <star/ssp.h>
+
+#include <math.h>
+
+/* Data of a microfacet distribution of the slope_microfacet_distribution
+ * type */
+struct slope_microfacet {
+  const struct ssol_slope_distribution* slopes;
+  double tangent[3];
+};
+
+/*******************************************************************************
+ * Helper functions
+ ******************************************************************************/
+static void
+slope_distribution_release(ref_T* ref)
+{
+  struct ssol_device* dev;
+  struct ssol_slope_distribution* slopes =
+    CONTAINER_OF(ref, struct ssol_slope_distribution, ref);
+  ASSERT(ref);
+  dev = slopes->dev;
+  ASSERT(dev && dev->allocator);
+  darray_double_release(&slopes->probas);
+  darray_size_t_release(&slopes->aliases);
+  darray_double_release(&slopes->densities);
+  MEM_RM(dev->allocator, slopes);
+  SSOL(device_ref_put(dev));
+}
+
+/* Build the alias table of the `n' bins whose weights are stored in `probas'
+ * with the method of Vose, i.e. in O(n) */
+static res_T
+setup_alias_table
+  (struct mem_allocator* allocator,
+   struct darray_double* probas_table,
+   struct darray_size_t* aliases_table,
+   const double sum) /* Sum of the weights */
+{
+  struct darray_size_t work; /* Small bins first, then large ones */
+  double* probas;
+  size_t* aliases;
+  size_t* bins;
+  size_t i, n, nsmall, ilarge;
+  res_T res = RES_OK;
+  ASSERT(allocator && probas_table && aliases_table && sum > 0);
+
+  darray_size_t_init(allocator, &work);
+
+  n = darray_double_size_get(probas_table);
+  res = darray_size_t_resize(aliases_table, n);
+  if(res != RES_OK) goto error;
+  res = darray_size_t_resize(&work, n);
+  if(res != RES_OK) goto error;
+
+  probas = darray_double_data_get(probas_table);
+  aliases = darray_size_t_data_get(aliases_table);
+  bins = darray_size_t_data_get(&work);
+
+  /* Scale the weights such as their mean is 1 and sort the bins in the work
+   * list wrt to this mean */
+  nsmall = 0;
+  ilarge = n;
+  FOR_EACH(i, 0, n) {
+    probas[i] *= (double)n / sum;
+    aliases[i] = i;
+    if(probas[i] < 1) {
+      bins[nsmall++] = i;
+    } else {
+      bins[--ilarge] = i;
+    }
+  }
+
+  /* Fill the small bins with the excess of the large ones */
+  while(nsmall && ilarge < n) {
+    const size_t small = bins[--nsmall];
+    const size_t large = bins[ilarge];
+    aliases[small] = large;
+    probas[large] -= 1 - probas[small];
+    if(probas[large] < 1) { /* The large bin becomes small */
+      ++ilarge;
+      bins[nsmall++] = large;
+    }
+  }
+
+  /* Remaining bins are full, up to numerical inaccuracies */
+  while(nsmall) probas[bins[--nsmall]] = 1;
+  while(ilarge < n) probas[bins[ilarge++]] = 1;
+
+exit:
+  darray_size_t_release(&work);
+  return res;
+error:
+  goto exit;
+}
+
+/* Return the normalised density of the slope `s' */
+static FINLINE double
+slope_distribution_eval
+  (const struct ssol_slope_distribution* slopes,
+   const double s[2])
+{
+  double u, v;
+  size_t x, y;
+  ASSERT(slopes && s);
+
+  u = (s[0] + slopes->max_slope[0]) / slopes->bin_size[0];
+  v = (s[1] + slopes->max_slope[1]) / slopes->bin_size[1];
+  if(u < 0 || v < 0) return 0;
+  x = (size_t)u;
+  y = (size_t)v;
+  if(x >= slopes->definition[0] || y >= slopes->definition[1]) return 0;
+  return darray_double_cdata_get(&slopes->densities)
+    [y*slopes->definition[0] + x];
+}
+
+/* Sample a slope. Return its normalised density */
+static FINLINE double
+slope_distribution_sample
+  (const struct ssol_slope_distribution* slopes,
+   struct ssp_rng* rng,
+   double s[2])
+{
+  const size_t n = darray_double_size_get(&slopes->probas);
+  double u;
+  size_t i;
+  ASSERT(slopes && rng && s && n);
+
+  /* Draw a bin from the alias table */
+  u = ssp_rng_canonical(rng) * (double)n;
+  i = MMIN((size_t)u, n-1);
+  if(u - (double)i >= darray_double_cdata_get(&slopes->probas)[i]) {
+    i = darray_size_t_cdata_get(&slopes->aliases)[i];
+  }
+
+  /* Uniformly sample a slope into the bin */
+  s[0] = -slopes->max_slope[0] + slopes->bin_size[0]
+    * ((double)(i % slopes->definition[0]) + ssp_rng_canonical(rng));
+  s[1] = -slopes->max_slope[1] + slopes->bin_size[1]
+    * ((double)(i / slopes->definition[0]) + ssp_rng_canonical(rng));
+  return darray_double_cdata_get(&slopes->densities)[i];
+}
+
+/* Define the tangent frame of the slopes around the normal `N' */
+static void
+slope_microfacet_frame
+  (const struct slope_microfacet* microfacet,
+   const double N[3],
+   double T[3],
+   double B[3])
+{
+  double tmp[3];
+  ASSERT(microfacet && N && T && B);
+
+  d3_sub(T, microfacet->tangent,
+    d3_muld(tmp, N, d3_dot(N, microfacet->tangent)));
+  if(d3_normalize(T, T) <= 0) { /* The tangent is aligned with the normal */
+    double basis[9];
+    d33_basis(basis, N);
+    d3_set(T, basis + 0);
+  }
+  d3_cross(B, N, T);
+}
+
+/*******************************************************************************
+ * Slope microfacet distribution
+ ******************************************************************************/
+static res_T
+slope_microfacet_init(struct mem_allocator* allocator, void* data)
+{
+  struct slope_microfacet* microfacet = data;
+  ASSERT(data);
+  (void)allocator;
+  microfacet->slopes = NULL;
+  d3_splat(microfacet->tangent, 0);
+  return RES_OK;
+}
+
+static void
+slope_microfacet_release(void* data)
+{
+  (void)data;
+}
+
+/* The microfacet normal of the slope `s' is (-s[0], -s[1], 1) normalised in
+ * the tangent frame. Its solid angle density is the slope density divided by
+ * cos^3, with cos the cosine between the normals */
+static void
+slope_microfacet_sample
+  (void* data,
+   struct ssp_rng* rng,
+   const double N[3],
+   double wh[3],
+   double* pdf)
+{
+  const struct slope_microfacet* microfacet = data;
+  double T[3], B[3], tmp[3];
+  double s[2];
+  double density, cos_wh;
+  ASSERT(data && rng && N && wh && microfacet->slopes);
+
+  density = slope_distribution_sample(microfacet->slopes, rng, s);
+  cos_wh = 1.0 / sqrt(1 + s[0]*s[0] + s[1]*s[1]);
+
+  slope_microfacet_frame(microfacet, N, T, B);
+  d3_muld(wh, N, cos_wh);
+  d3_add(wh, wh, d3_muld(tmp, T, -s[0]*cos_wh));
+  d3_add(wh, wh, d3_muld(tmp, B, -s[1]*cos_wh));
+  if(pdf) *pdf = density / (cos_wh*cos_wh*cos_wh);
+}
+
+/* Return the slope density of the microfacet normal `wh' and the cosine
+ * between `wh' and the normal */
+static double
+slope_microfacet_density
+  (const struct slope_microfacet* microfacet,
+   const double N[3],
+   const double wh[3],
+   double* cos_wh)
+{
+  double T[3], B[3];
+  double s[2];
+  ASSERT(microfacet && N && wh && cos_wh && microfacet->slopes);
+
+  *cos_wh = d3_dot(N, wh);
+  if(*cos_wh <= 0) return 0;
+  slope_microfacet_frame(microfacet, N, T, B);
+  s[0] = -d3_dot(T, wh) / *cos_wh;
+  s[1] = -d3_dot(B, wh) / *cos_wh;
+  return slope_distribution_eval(microfacet->slopes, s);
+}
+
+static double
+slope_microfacet_eval(void* data, const double N[3], const double wh[3])
+{
+  double cos_wh, density;
+  density = slope_microfacet_density(data, N, wh, &cos_wh);
+  return density ? density / (cos_wh*cos_wh*cos_wh*cos_wh) : 0;
+}
+
+static double
+slope_microfacet_pdf(void* data, const double N[3], const double wh[3])
+{
+  double cos_wh, density;
+  density = slope_microfacet_density(data, N, wh, &cos_wh);
+  return density ? density / (cos_wh*cos_wh*cos_wh) : 0;
+}
+
+/*******************************************************************************
+ * Exported functions
+ ******************************************************************************/
+res_T
+ssol_slope_distribution_create
+  (struct ssol_device* dev, struct ssol_slope_distribution** out_slopes)
+{
+  struct ssol_slope_distribution* slopes = NULL;
+  res_T res = RES_OK;
+
+  if(!dev || !out_slopes) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  slopes = MEM_CALLOC
+    (dev->allocator, 1, sizeof(struct ssol_slope_distribution));
+  if(!slopes) {
+    res = RES_MEM_ERR;
+    goto error;
+  }
+
+  SSOL(device_ref_get(dev));
+  slopes->dev = dev;
+  ref_init(&slopes->ref);
+  darray_double_init(dev->allocator, &slopes->probas);
+  darray_size_t_init(dev->allocator, &slopes->aliases);
+  darray_double_init(dev->allocator, &slopes->densities);
+
+exit:
+  if(out_slopes) *out_slopes = slopes;
+  return res;
+error:
+  if(slopes) {
+    SSOL(slope_distribution_ref_put(slopes));
+    slopes = NULL;
+  }
+  goto exit;
+}
+
+res_T
+ssol_slope_distribution_ref_get(struct ssol_slope_distribution* slopes)
+{
+  if(!slopes) return RES_BAD_ARG;
+  ref_get(&slopes->ref);
+  return RES_OK;
+}
+
+res_T
+ssol_slope_distribution_ref_put(struct ssol_slope_distribution* slopes)
+{
+  if(!slopes) return RES_BAD_ARG;
+  ref_put(&slopes->ref, slope_distribution_release);
+  return RES_OK;
+}
+
+res_T
+ssol_slope_distribution_setup
+  (struct ssol_slope_distribution* slopes,
+   void (*get)(const size_t ix, const size_t iy, double* density, void* ctx),
+   const size_t definition[2],
+   const double max_slope[2],
+   void* ctx)
+{
+  /* The tables are built aside and replace the current ones on success only:
+   * the slopes may already be used by a mirror */
+  struct darray_double densities;
+  struct darray_double probas;
+  struct darray_size_t aliases;
+  double* dens;
+  double bin_size[2];
+  double sum = 0;
+  double rcp_norm;
+  size_t i, x, y, n;
+  res_T res = RES_OK;
+
+  if(!slopes || !get || !definition || !max_slope
+  || !definition[0] || !definition[1]
+  || !(max_slope[0] > 0) || !(max_slope[1] > 0))
+    return RES_BAD_ARG;
+
+  darray_double_init(slopes->dev->allocator, &densities);
+  darray_double_init(slopes->dev->allocator, &probas);
+  darray_size_t_init(slopes->dev->allocator, &aliases);
+
+  n = definition[0] * definition[1];
+  res = darray_double_resize(&densities, n);
+  if(res != RES_OK) goto error;
+
+  /* Fetch the densities of the bins */
+  dens = darray_double_data_get(&densities);
+  FOR_EACH(y, 0, definition[1]) {
+    FOR_EACH(x, 0, definition[0]) {
+      double* density = dens + y*definition[0] + x;
+      get(x, y, density, ctx);
+      if(!(*density >= 0) || *density == INF) {
+        res = RES_BAD_ARG;
+        goto error;
+      }
+      sum += *density;
+    }
+  }
+  if(!(sum > 0)) {
+    res = RES_BAD_ARG;
+    goto error;
+  }
+
+  /* Setup the alias table from the bin weights */
+  res = darray_double_copy(&probas, &densities);
+  if(res != RES_OK) goto error;
+  res = setup_alias_table(slopes->dev->allocator, &probas, &aliases, sum);
+  if(res != RES_OK) goto error;
+
+  /* Normalise the densities over the slope domain */
+  bin_size[0] = 2 * max_slope[0] / (double)definition[0];
+  bin_size[1] = 2 * max_slope[1] / (double)definition[1];
+  rcp_norm = 1.0 / (sum * bin_size[0] * bin_size[1]);
+  FOR_EACH(i, 0, n) dens[i] *= rcp_norm;
+
+  /* Commit the new tables. Their memory is reserved first in order to keep the
+   * current tables untouched on allocation error; the copies then succeed */
+  res = darray_double_reserve(&slopes->densities, n);
+  if(res != RES_OK) goto error;
+  res = darray_double_reserve(&slopes->probas, n);
+  if(res != RES_OK) goto error;
+  res = darray_size_t_reserve(&slopes->aliases, n);
+  if(res != RES_OK) goto error;
+  res = darray_double_copy(&slopes->densities, &densities);
+  ASSERT(res == RES_OK);
+  res = darray_double_copy(&slopes->probas, &probas);
+  ASSERT(res == RES_OK);
+  res = darray_size_t_copy(&slopes->aliases, &aliases);
+  ASSERT(res == RES_OK);
+
+  slopes->definition[0] = definition[0];
+  slopes->definition[1] = definition[1];
+  slopes->max_slope[0] = max_slope[0];
+  slopes->max_slope[1] = max_slope[1];
+  slopes->bin_size[0] = bin_size[0];
+  slopes->bin_size[1] = bin_size[1];
+
+exit:
+  darray_double_release(&densities);
+  darray_double_release(&probas);
+  darray_size_t_release(&aliases);
+  return res;
+error:
+  goto exit;
+}
+
+/*******************************************************************************
+ * Local functions
+ ******************************************************************************/
+const struct ssf_microfacet_distribution_type slope_microfacet_distribution = {
+  slope_microfacet_init,
+  slope_microfacet_release,
+  slope_microfacet_sample,
+  slope_microfacet_eval,
+  slope_microfacet_pdf,
+  sizeof(struct slope_microfacet),
+  ALIGNOF(struct slope_microfacet)
+};
+
+void
+slope_microfacet_distribution_setup
+  (struct ssf_microfacet_distribution* distrib,
+   const struct ssol_slope_distribution* slopes,
+   const double tangent[3])
+{
+  struct slope_microfacet* microfacet;
+  void* data;
+  ASSERT(distrib && slopes && tangent && slopes->definition[0]);
+
+  SSF(microfacet_distribution_get_data(distrib, &data));
+  microfacet = data;
+  microfacet->slopes = slopes;
+  d3_set(microfacet->tangent, tangent);
+}
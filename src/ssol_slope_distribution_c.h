@@ -0,0 +1,59 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef SSOL_SLOPE_DISTRIBUTION_C_H
+#define SSOL_SLOPE_DISTRIBUTION_C_H
+
+#include <rsys/dynamic_array_double.h>
+#include <rsys/dynamic_array_size_t.h>
+#include <rsys/ref_count.h>
+
+struct ssf_microfacet_distribution;
+struct ssf_microfacet_distribution_type;
+
+struct ssol_slope_distribution {
+  size_t definition[2]; /* #bins along the 2 slope axes */
+  double max_slope[2]; /* The slopes lie in [-max_slope, max_slope] */
+  double bin_size[2];
+
+  /* Alias table of the bins: a bin drawn uniformly is kept with its
+   * probability and is replaced by its alias otherwise */
+  struct darray_double probas;
+  struct darray_size_t aliases;
+  struct darray_double densities; /* Normalised density of the bins */
+
+  struct ssol_device* dev;
+  ref_T ref;
+};
+
+/* Star-SF microfacet distribution whose microfacet slopes are distributed wrt
+ * a ssol_slope_distribution. The shading pools own one instance of it */
+extern LOCAL_SYM const struct ssf_microfacet_distribution_type
+slope_microfacet_distribution;
+
+/* Bind the slopes to a microfacet distribution of the
+ * slope_microfacet_distribution type. The first slope axis is aligned with the
+ * `tangent' direction projected onto the plane of the sampled normal. The
+ * alias table of the slopes is used as is, i.e. the setup neither preprocesses
+ * the slopes nor allocates memory */
+extern LOCAL_SYM void
+slope_microfacet_distribution_setup
+  (struct ssf_microfacet_distribution* distrib,
+   const struct ssol_slope_distribution* slopes,
+   const double tangent[3]);
+
+#endif /* SSOL_SLOPE_DISTRIBUTION_C_H */
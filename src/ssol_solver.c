@@ -27,11 +27,14 @@
 #include "ssol_sun_c.h"
 #include "ssol_material_c.h"
 #include "ssol_instance_c.h"
+#include "ssol_ranst_instance.h"
 #include "ssol_ranst_sun_dir.h"
 #include "ssol_ranst_sun_wl.h"
+#include "ssol_solver_c.h"
 
 #include <rsys/float2.h>
 #include <rsys/float3.h>
+#include <rsys/double2.h>
 #include <rsys/double3.h>
 #include <rsys/mem_allocator.h>
 #include <rsys/ref_count.h>
@@ -44,11 +47,49 @@
 #include <limits.h>
 #include <omp.h>
 
+/* Number of independent random sequences of a worker. Its realisations are
+ * interleaved over as many blocks, each block consuming its own sequence
+ * whatever the thread that runs it. The random sequences of a worker, and thus
+ * its estimates, do not depend on its number of threads: the number of blocks
+ * is fixed and large enough to feed many threads with a balanced load */
+#define NBLOCKS_PER_WORKER 1024
+
+/* Number of consecutive random numbers reserved to a block before it jumps to
+ * its next range of random numbers */
+#define RNG_BUCKET_SIZE 1000000
+
 /*******************************************************************************
  * Thread context
  ******************************************************************************/
+/* Identifier of a flux map bin. The bin is not referenced by its address
+ * since the MC receivers of a thread context are lazily registered into a hash
+ * table whose entries can be moved by the registration of other receivers */
+struct flux_map_bin_id {
+  const struct ssol_instance* inst;
+  enum ssol_side_flag side;
+  size_t ibin; /* Index of the bin in the flux map */
+};
+
+/* Declare the list of the flux map bins updated by a realisation */
+#define DARRAY_NAME flux_map_bin_id
+#define DARRAY_DATA struct flux_map_bin_id
+#include <rsys/dynamic_array.h>
+
+/* Extinction of an interned medium at the wavelength of its last lookup for
+ * a given wavelength slot of the radiative paths */
+struct extinction {
+  double wavelength; /* < 0 <=> no lookup yet */
+  double k_ext;
+};
+
+/* Declare the per interned medium and per wavelength slot cache of
+ * extinctions */
+#define DARRAY_NAME extinction
+#define DARRAY_DATA struct extinction
+#include <rsys/dynamic_array.h>
+
 struct thread_context {
-  struct ssp_rng* rng;
+  struct ssp_rng* rng; /* RNG of the block being run. Not owned */
   struct mc_data cos_factor;
   struct mc_data absorbed_by_receivers;
   struct mc_data shadowed;
@@ -58,6 +99,13 @@ struct thread_context {
   struct htable_receiver mc_rcvs;
   struct htable_sampled mc_samps;
   struct darray_path paths; /* paths */
+  /* Flux map bins updated by the current realisation */
+  struct darray_flux_map_bin_id flux_map_bins;
+  struct darray_hit hits; /* Recorded hits */
+  size_t first_hit; /* Index of the first hit of the current realisation */
+  struct darray_tally_data tallies; /* Per thread tally data */
+  struct darray_tally_hit tally_hits; /* Hits of the current realisation */
+  struct darray_extinction extinctions; /* Per medium and slot extinction */
   size_t realisation_count;
 };
 
@@ -65,10 +113,14 @@ static void
 thread_context_release(struct thread_context* ctx)
 {
   ASSERT(ctx);
-  if(ctx->rng) SSP(rng_ref_put(ctx->rng));
   htable_receiver_release(&ctx->mc_rcvs);
   htable_sampled_release(&ctx->mc_samps);
   darray_path_release(&ctx->paths);
+  darray_flux_map_bin_id_release(&ctx->flux_map_bins);
+  darray_hit_release(&ctx->hits);
+  darray_tally_data_release(&ctx->tallies);
+  darray_tally_hit_release(&ctx->tally_hits);
+  darray_extinction_release(&ctx->extinctions);
 }
 
 static res_T
@@ -79,6 +131,11 @@ thread_context_init(struct mem_allocator* allocator, struct thread_context* ctx)
   htable_receiver_init(allocator, &ctx->mc_rcvs);
   htable_sampled_init(allocator, &ctx->mc_samps);
   darray_path_init(allocator, &ctx->paths);
+  darray_flux_map_bin_id_init(allocator, &ctx->flux_map_bins);
+  darray_hit_init(allocator, &ctx->hits);
+  darray_tally_data_init(allocator, &ctx->tallies);
+  darray_tally_hit_init(allocator, &ctx->tally_hits);
+  darray_extinction_init(allocator, &ctx->extinctions);
   return RES_OK;
 }
 
@@ -103,6 +160,17 @@ thread_context_copy
   if(res != RES_OK) return res;
   res = darray_path_copy(&dst->paths, &src->paths);
   if(res != RES_OK) return res;
+  res = darray_flux_map_bin_id_copy(&dst->flux_map_bins, &src->flux_map_bins);
+  if(res != RES_OK) return res;
+  res = darray_hit_copy(&dst->hits, &src->hits);
+  if(res != RES_OK) return res;
+  dst->first_hit = src->first_hit;
+  res = darray_tally_data_copy(&dst->tallies, &src->tallies);
+  if(res != RES_OK) return res;
+  res = darray_tally_hit_copy(&dst->tally_hits, &src->tally_hits);
+  if(res != RES_OK) return res;
+  res = darray_extinction_copy(&dst->extinctions, &src->extinctions);
+  if(res != RES_OK) return res;
   return RES_OK;
 }
 
@@ -110,23 +178,39 @@ static void
 thread_context_clear(struct thread_context* ctx)
 {
   ASSERT(ctx);
-  if(ctx->rng) SSP(rng_ref_put(ctx->rng));
+  ctx->rng = NULL;
   htable_receiver_clear(&ctx->mc_rcvs);
   htable_sampled_clear(&ctx->mc_samps);
   darray_path_clear(&ctx->paths);
+  darray_flux_map_bin_id_clear(&ctx->flux_map_bins);
+  darray_hit_clear(&ctx->hits);
+  ctx->first_hit = 0;
+  darray_tally_data_clear(&ctx->tallies);
+  darray_tally_hit_clear(&ctx->tally_hits);
+  darray_extinction_clear(&ctx->extinctions);
 }
 
 static res_T
 thread_context_setup
   (struct thread_context* ctx,
-   struct ssp_rng_proxy* rng_proxy,
-   const size_t ithread)
+   const struct darray_tally* tallies,
+   const size_t nmedia) /* #interned media */
 {
+  struct extinction* extinctions;
+  size_t i;
   res_T res = RES_OK;
-  ASSERT(rng_proxy && ctx);
+  ASSERT(ctx && tallies);
   thread_context_clear(ctx);
-  res = ssp_rng_proxy_create_rng(rng_proxy, ithread, &ctx->rng);
+  res = tallies_setup(&ctx->tallies, tallies);
   if(res != RES_OK) goto error;
+  res = darray_extinction_resize
+    (&ctx->extinctions, nmedia * SSOL_MAX_PATH_WAVELENGTHS);
+  if(res != RES_OK) goto error;
+  extinctions = darray_extinction_data_get(&ctx->extinctions);
+  FOR_EACH(i, 0, nmedia * SSOL_MAX_PATH_WAVELENGTHS) {
+    extinctions[i].wavelength = -1;
+    extinctions[i].k_ext = 0;
+  }
 exit:
   return res;
 error:
@@ -134,6 +218,30 @@ error:
   goto exit;
 }
 
+/* Discard the MC results of the context while keeping its RNG */
+static res_T
+thread_context_reset
+  (struct thread_context* ctx,
+   const struct darray_tally* tallies)
+{
+  ASSERT(ctx && tallies);
+  ctx->cos_factor = MC_DATA_NULL;
+  ctx->absorbed_by_receivers = MC_DATA_NULL;
+  ctx->shadowed = MC_DATA_NULL;
+  ctx->missing = MC_DATA_NULL;
+  ctx->extinguished_by_atmosphere = MC_DATA_NULL;
+  ctx->other_absorbed = MC_DATA_NULL;
+  htable_receiver_clear(&ctx->mc_rcvs);
+  htable_sampled_clear(&ctx->mc_samps);
+  darray_path_clear(&ctx->paths);
+  darray_flux_map_bin_id_clear(&ctx->flux_map_bins);
+  darray_hit_clear(&ctx->hits);
+  ctx->first_hit = 0;
+  darray_tally_hit_clear(&ctx->tally_hits);
+  ctx->realisation_count = 0;
+  return tallies_setup(&ctx->tallies, tallies);
+}
+
 /* Declare the container of the per thread contexts */
 #define DARRAY_NAME thread_ctx
 #define DARRAY_DATA struct thread_context
@@ -142,9 +250,96 @@ error:
 #define DARRAY_FUNCTOR_COPY thread_context_copy
 #include <rsys/dynamic_array.h>
 
+/*******************************************************************************
+ * Per block random sequences
+ ******************************************************************************/
+struct block_rngs {
+  struct ssp_rng_proxy* proxy;
+  struct ssp_rng* rngs[NBLOCKS_PER_WORKER];
+};
+
+static void
+block_rngs_init(struct block_rngs* blocks)
+{
+  ASSERT(blocks);
+  memset(blocks, 0, sizeof(blocks[0]));
+}
+
+static void
+block_rngs_release(struct block_rngs* blocks)
+{
+  size_t i;
+  ASSERT(blocks);
+  FOR_EACH(i, 0, NBLOCKS_PER_WORKER) {
+    if(blocks->rngs[i]) SSP(rng_ref_put(blocks->rngs[i]));
+  }
+  if(blocks->proxy) SSP(rng_proxy_ref_put(blocks->proxy));
+  block_rngs_init(blocks);
+}
+
+/* Create the random sequences of the blocks of the worker `iworker'. The
+ * random numbers generated from `rng_state' are split in consecutive ranges of
+ * nworkers*NBLOCKS_PER_WORKER buckets. The RNG proxy of the worker only
+ * manages its own NBLOCKS_PER_WORKER buckets of each range: each worker uses
+ * the same random sequences whatever its number of threads */
+static res_T
+block_rngs_setup
+  (struct block_rngs* blocks,
+   struct mem_allocator* allocator,
+   const struct ssp_rng* rng_state,
+   const size_t nworkers,
+   const size_t iworker)
+{
+  struct ssp_rng_proxy_create2_args args = SSP_RNG_PROXY_CREATE2_ARGS_NULL;
+  const size_t sequence_size = (size_t)NBLOCKS_PER_WORKER * RNG_BUCKET_SIZE;
+  size_t i;
+  res_T res = RES_OK;
+  ASSERT(blocks && allocator && rng_state && iworker < nworkers);
+  ASSERT(nworkers <= SIZE_MAX / sequence_size);
+
+  block_rngs_release(blocks);
+  args.rng = rng_state;
+  args.sequence_offset = iworker * sequence_size;
+  args.sequence_size = sequence_size;
+  args.sequence_pitch = nworkers * sequence_size;
+  args.nbuckets = NBLOCKS_PER_WORKER;
+  res = ssp_rng_proxy_create2(allocator, &args, &blocks->proxy);
+  if(res != RES_OK) goto error;
+  FOR_EACH(i, 0, NBLOCKS_PER_WORKER) {
+    res = ssp_rng_proxy_create_rng(blocks->proxy, i, &blocks->rngs[i]);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  return res;
+error:
+  block_rngs_release(blocks);
+  goto exit;
+}
+
+/* Return the first realisation of the block `iblock' that is greater than or
+ * equal to `begin'. The realisation `i' belongs to the block
+ * i % NBLOCKS_PER_WORKER: any range of realisations, e.g. a batch of a
+ * checkpointed simulation, is thus spread over all the blocks and hence over
+ * all the threads */
+static FINLINE int64_t
+block_get_first(const int64_t begin, const int64_t iblock)
+{
+  const int64_t i = begin - begin % NBLOCKS_PER_WORKER + iblock;
+  ASSERT(begin >= 0 && iblock >= 0 && iblock < NBLOCKS_PER_WORKER);
+  return i < begin ? i + NBLOCKS_PER_WORKER : i;
+}
+
 /*******************************************************************************
  * Random walk point
  ******************************************************************************/
+/* MC weights of a radiative path at a given wavelength */
+struct weights {
+  double flux;
+  double if_no_atm_loss;
+  double if_no_field_loss;
+};
+
 struct point {
   const struct ssol_instance* inst;
   const struct shaded_shape* sshape;
@@ -165,6 +360,9 @@ struct point {
   /* Set once */
   double initial_flux; /* the initial flux*/
   double cos_factor; /* local cos at the starting point */
+  /* Cos factor of the sampled instance, i.e. regardless of its sampling
+   * probability */
+  double samp_cos_factor;
   /* outgoing weights at previous hit */
   double prev_outgoing_flux;
   double prev_outgoing_if_no_atm_loss;
@@ -178,6 +376,14 @@ struct point {
   double outgoing_if_no_atm_loss;
   double outgoing_if_no_field_loss;
   enum ssol_side_flag side;
+  /* Wavelengths carried by the path and their MC weights. The first one is
+   * the hero wavelength `wl' that drives the sampling of the directions. The
+   * aforementioned weights are the mean of the per wavelength ones */
+  size_t nwls;
+  double wls[SSOL_MAX_PATH_WAVELENGTHS];
+  struct weights prev_outgoing_wls[SSOL_MAX_PATH_WAVELENGTHS];
+  struct weights incoming_wls[SSOL_MAX_PATH_WAVELENGTHS];
+  struct weights outgoing_wls[SSOL_MAX_PATH_WAVELENGTHS];
 };
 
 #define POINT_NULL__ {                                                         \
@@ -193,8 +399,9 @@ struct point {
   NULL, /* Material */                                                         \
   0, 0, /* tmp values */                                                       \
   0,  /* Energy loss */                                                        \
-  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* MC weights */                            \
-  SSOL_FRONT /* Side */                                                        \
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* MC weights */                         \
+  SSOL_FRONT, /* Side */                                                       \
+  0, {0}, {{0, 0, 0}}, {{0, 0, 0}}, {{0, 0, 0}} /* Per wavelength data */      \
 }
 static const struct point POINT_NULL = POINT_NULL__;
 
@@ -204,19 +411,92 @@ point_get_material(const struct point* pt)
   return pt->side == SSOL_FRONT ? pt->sshape->mtl_front : pt->sshape->mtl_back;
 }
 
+/* Compute the mean of the `n' per wavelength weights */
+static FINLINE void
+weights_mean
+  (const struct weights* w,
+   const size_t n,
+   double* flux,
+   double* if_no_atm_loss,
+   double* if_no_field_loss)
+{
+  size_t i;
+  ASSERT(w && n && flux && if_no_atm_loss && if_no_field_loss);
+  *flux = *if_no_atm_loss = *if_no_field_loss = 0;
+  FOR_EACH(i, 0, n) {
+    *flux += w[i].flux;
+    *if_no_atm_loss += w[i].if_no_atm_loss;
+    *if_no_field_loss += w[i].if_no_field_loss;
+  }
+  *flux /= (double)n;
+  *if_no_atm_loss /= (double)n;
+  *if_no_field_loss /= (double)n;
+}
+
+/* Scale the outgoing weights of the previous point */
+static FINLINE void
+point_scale_prev_outgoing(struct point* pt, const double factor)
+{
+  size_t i;
+  ASSERT(pt);
+  FOR_EACH(i, 0, pt->nwls) {
+    pt->prev_outgoing_wls[i].flux *= factor;
+    pt->prev_outgoing_wls[i].if_no_atm_loss *= factor;
+    pt->prev_outgoing_wls[i].if_no_field_loss *= factor;
+  }
+  pt->prev_outgoing_flux *= factor;
+  pt->prev_outgoing_if_no_atm_loss *= factor;
+  pt->prev_outgoing_if_no_field_loss *= factor;
+}
+
+/* The outgoing weights of the point become the ones of the previous point */
+static FINLINE void
+point_forward_outgoing(struct point* pt)
+{
+  size_t i;
+  ASSERT(pt);
+  FOR_EACH(i, 0, pt->nwls) pt->prev_outgoing_wls[i] = pt->outgoing_wls[i];
+  pt->prev_outgoing_flux = pt->outgoing_flux;
+  pt->prev_outgoing_if_no_atm_loss = pt->outgoing_if_no_atm_loss;
+  pt->prev_outgoing_if_no_field_loss = pt->outgoing_if_no_field_loss;
+}
+
+/* Only keep the hero wavelength of the path, e.g. when the scattered
+ * directions depend on the wavelength. Since the hero wavelength is
+ * distributed wrt the sun spectrum, its weights alone remain an unbiased
+ * estimate. The flux that they do not share with the mean weights is
+ * balanced in the energy that the path has still to dissipate */
+static FINLINE void
+point_keep_hero_wavelength(struct point* pt)
+{
+  ASSERT(pt && pt->nwls > 1);
+  pt->energy_loss += pt->prev_outgoing_wls[0].flux - pt->prev_outgoing_flux;
+  pt->nwls = 1;
+  pt->prev_outgoing_flux = pt->prev_outgoing_wls[0].flux;
+  pt->prev_outgoing_if_no_atm_loss = pt->prev_outgoing_wls[0].if_no_atm_loss;
+  pt->prev_outgoing_if_no_field_loss =
+    pt->prev_outgoing_wls[0].if_no_field_loss;
+  pt->incoming_flux = pt->incoming_wls[0].flux;
+  pt->incoming_if_no_atm_loss = pt->incoming_wls[0].if_no_atm_loss;
+  pt->incoming_if_no_field_loss = pt->incoming_wls[0].if_no_field_loss;
+}
+
 static res_T
 point_init
   (struct point* pt,
+   const size_t irealisation,
    struct ssol_scene* scn,
    struct htable_sampled* sampled,
    struct s3d_scene_view* view_samp,
+   const struct ranst_instance* ran_inst, /* May be NULL */
    struct s3d_scene_view* view_rt,
    struct ranst_sun_dir* ran_sun_dir,
    struct ranst_sun_wl* ran_sun_wl,
    struct ssp_rng* rng,
-   struct ssol_medium* current_medium,
+   unsigned* current_medium, /* Index of an interned medium */
    int* is_lit)
 {
+  struct weights w0_wl;
   struct s3d_attrib attr;
   struct s3d_hit hit;
   struct ray_data ray_data = RAY_DATA_NULL;
@@ -226,20 +506,28 @@ point_init
   double sun0_sun_cos;
   double surface_proxy_cos;
   double cos_ratio;
+  double rcp_pdf; /* Inverse of the probability density of the sampled point */
   double w0;
   float dir[3], pos[3], range[2] = { 0, FLT_MAX };
-  size_t id;
+  size_t i, id;
   res_T res = RES_OK;
   ASSERT(pt && scn && sampled && view_samp && view_rt);
   ASSERT(ran_sun_dir && ran_sun_wl && rng && is_lit);
 
-  /* Sample a point into the scene view */
-  S3D(scene_view_sample
-    (view_samp,
-     ssp_rng_canonical_float(rng),
-     ssp_rng_canonical_float(rng),
-     ssp_rng_canonical_float(rng),
-     &pt->prim, pt->uv));
+  if(!ran_inst) {
+    /* Sample a point into the scene view, i.e. wrt the area */
+    S3D(scene_view_sample
+      (view_samp,
+       ssp_rng_canonical_float(rng),
+       ssp_rng_canonical_float(rng),
+       ssp_rng_canonical_float(rng),
+       &pt->prim, pt->uv));
+    rcp_pdf = scn->sampled_area_proxy;
+  } else {
+    /* Sample an instance wrt its selection probability, then a point onto it */
+    rcp_pdf = ranst_instance_get
+      (ran_inst, irealisation, rng, &pt->prim, pt->uv);
+  }
 
   /* Retrieve the position of the sampled point */
   S3D(primitive_get_attrib(&pt->prim, S3D_POSITION, pt->uv, &attr));
@@ -260,8 +548,18 @@ point_init
   /* Sample a sun direction */
   ranst_sun_dir_get(ran_sun_dir, rng, pt->dir);
 
-  /* Sample a wavelength */
-  pt->wl = ranst_sun_wl_get(ran_sun_wl, rng);
+  /* Sample the wavelengths, unless the sun of a gray scene emits at only one */
+  if(scn->is_gray) {
+    pt->nwls = 1;
+    pt->wls[0] = scn->gray_wavelength;
+  } else if(scn->nwavelengths == 1) {
+    pt->nwls = 1;
+    pt->wls[0] = ranst_sun_wl_get(ran_sun_wl, rng);
+  } else {
+    pt->nwls = ranst_sun_wl_get_stratified
+      (ran_sun_wl, rng, scn->nwavelengths, pt->wls);
+  }
+  pt->wl = pt->wls[0];
 
   if(pt->sshape->shape->type != SHAPE_PUNCHED) {
     d3_set(N, pt->N);
@@ -287,14 +585,17 @@ point_init
   surface_proxy_cos =
     (pt->sshape->shape->type == SHAPE_MESH) ? 1 : fabs(d3_dot(pt->N, N));
   cos_ratio = fabs(surface_sun_cos / (surface_proxy_cos * sun0_sun_cos));
-  w0 = scn->sun->dni * scn->sampled_area_proxy * cos_ratio;
-  pt->cos_factor = scn->sampled_area_proxy / scn->sampled_area
+  w0 = scn->sun->dni * rcp_pdf * cos_ratio;
+  pt->cos_factor = rcp_pdf / scn->sampled_area
     * surface_sun0_cos / surface_proxy_cos;
+  pt->samp_cos_factor = pt->cos_factor * scn->sampled_area_proxy / rcp_pdf;
   pt->energy_loss = w0;
   pt->initial_flux = w0;
   pt->prev_outgoing_flux = w0;
   pt->prev_outgoing_if_no_atm_loss = w0;
   pt->prev_outgoing_if_no_field_loss = w0;
+  w0_wl.flux = w0_wl.if_no_atm_loss = w0_wl.if_no_field_loss = w0;
+  FOR_EACH(i, 0, pt->nwls) pt->prev_outgoing_wls[i] = w0_wl;
   pt->survivor_score = 0;
   d3_set(pt->N, N);
   ASSERT(d3_dot(pt->N, pt->dir) <= 0);
@@ -310,14 +611,15 @@ point_init
     case SSOL_MATERIAL_DIELECTRIC:
     case SSOL_MATERIAL_THIN_DIELECTRIC:
       /* TODO: check sampled face role!!! */
-      ssol_medium_copy(current_medium,
-        (pt->side == SSOL_FRONT) ?
-        &pt->material->in_medium : &pt->material->out_medium);
+      *current_medium = (pt->side == SSOL_FRONT)
+        ? scene_get_material_media(scn, pt->material)->in
+        : scene_get_material_media(scn, pt->material)->out;
       break;
+    case SSOL_MATERIAL_ABSORBER:
     case SSOL_MATERIAL_MATTE:
     case SSOL_MATERIAL_MIRROR:
     case SSOL_MATERIAL_VIRTUAL:
-      ssol_medium_copy(current_medium, &scn->air);
+      *current_medium = scn->air_id;
       break;
     default: FATAL("Unreachable code\n"); break;
   }
@@ -397,6 +699,7 @@ point_update_from_hit
   }
 
   pt->prim = hit->prim;
+  f2_set(pt->uv, hit->uv);
 
   /* Define the primitive side on which the point lies */
   if(d3_dot(pt->dir, pt->N) < 0) {
@@ -416,22 +719,47 @@ point_is_receiver(const struct point* pt)
   return (pt->inst->receiver_mask & (int)pt->side) != 0;
 }
 
+/* Setup the surface fragment of the point. It is computed once per bounce and
+ * then shared by the glossiness test and the shading of the point */
+static FINLINE void
+point_setup_fragment
+  (const struct point* pt,
+   struct ssol_surface_fragment* frag)
+{
+  ASSERT(pt && frag);
+  material_setup_fragment(pt->material, frag, pt->pos, pt->dir, pt->N,
+    pt->inst, pt->sshape->shape, &pt->prim, pt->uv);
+}
+
+static FINLINE int
+point_is_glossy
+  (const struct point* pt,
+   const struct ssol_surface_fragment* frag)
+{
+  ASSERT(pt && frag);
+  return material_is_glossy(pt->material, frag, pt->wl);
+}
+
 static FINLINE res_T
 point_shade
   (struct point* pt,
-   const struct ssol_medium* in_medium,
-   struct ssol_medium* out_medium,
+   struct ssol_scene* scn,
+   const struct ssol_surface_fragment* frag, /* Fragment of the point */
+   const unsigned in_medium, /* Index of an interned medium */
+   unsigned* out_medium,
    struct ssp_rng* rng,
    double dir[3])
 {
   struct ssol_material* mtl;
-  struct ssol_surface_fragment frag;
   struct ssf_bsdf* bsdf = NULL;
+  double factors[SSOL_MAX_PATH_WAVELENGTHS];
   double propagated = 0;
   double wi[3], N[3], pdf;
+  size_t i;
   int type = 0;
+  int separable = 1;
   res_T res;
-  ASSERT(pt && in_medium && out_medium && rng && dir);
+  ASSERT(pt && scn && frag && out_medium && rng && dir);
 
   /* TODO ensure that if `prim' was sampled, then the surface fragment setup
    * remains valid in *all* situations, i.e. even though the point primitive
@@ -444,16 +772,25 @@ point_shade
    * punched surfaces, no attrib is defined on both representation.
    * Consequently, it seems that there is no specific work to do to ensure the
    * `surface_fragment_setup' consistency. */
-  surface_fragment_setup(&frag, pt->pos, pt->dir, pt->N, &pt->prim, pt->uv);
-
-  /* Shade the surface fragment */
   mtl = point_get_material(pt);
 
-  res = material_create_bsdf(mtl, &frag, pt->wl, in_medium, 0, &bsdf);
+  /* Shade the surface fragment */
+  if(pt->nwls == 1) {
+    factors[0] = 1;
+    res = material_create_bsdf
+      (mtl, frag, pt->wl, scene_get_medium(scn, in_medium), 0, &bsdf);
+  } else {
+    res = material_create_spectral_bsdf(mtl, frag, pt->nwls, pt->wls,
+      scene_get_medium(scn, in_medium), factors, &separable, &bsdf);
+  }
   if(res != RES_OK) goto error;
+  if(!separable) {
+    point_keep_hero_wavelength(pt);
+    factors[0] = 1;
+  }
 
   /* Perturbe the normal */
-  material_shade_normal(mtl, &frag, pt->wl, N);
+  material_shade_normal(mtl, frag, pt->wl, N);
 
   /* By convention, Star-SF assumes that incoming and reflected
    * directions point outward the surface => negate incoming dir */
@@ -468,22 +805,45 @@ point_shade
 
     /* Due to the perturbed normal, the sampled direction may point in the
      * wrong direction wrt the sampled BSDF component. */
-    cos_dir_Ng = d3_dot(frag.Ng, dir);
+    cos_dir_Ng = d3_dot(frag->Ng, dir);
     if((cos_dir_Ng > 0 && (type & SSF_TRANSMISSION))
     || (cos_dir_Ng < 0 && (type & SSF_REFLECTION))) {
       propagated = 0;
     }
   }
-  pt->kabs_at_pt = (1 - propagated);
-  pt->outgoing_flux = pt->incoming_flux * propagated;
-  pt->outgoing_if_no_atm_loss = pt->incoming_if_no_atm_loss * propagated;
-  pt->outgoing_if_no_field_loss = point_is_receiver(pt)
-    ? pt->incoming_if_no_field_loss*propagated : pt->incoming_if_no_field_loss;
 
-  if(type & SSF_TRANSMISSION) {
-    material_get_next_medium(mtl, in_medium, out_medium);
+  /* Modulate the weights of each wavelength */
+  FOR_EACH(i, 0, pt->nwls) {
+    const struct weights* in = pt->incoming_wls + i;
+    struct weights* out = pt->outgoing_wls + i;
+    const double prop = propagated * factors[i];
+    out->flux = in->flux * prop;
+    out->if_no_atm_loss = in->if_no_atm_loss * prop;
+    out->if_no_field_loss = point_is_receiver(pt)
+      ? in->if_no_field_loss * prop : in->if_no_field_loss;
+  }
+  weights_mean(pt->outgoing_wls, pt->nwls, &pt->outgoing_flux,
+    &pt->outgoing_if_no_atm_loss, &pt->outgoing_if_no_field_loss);
+
+  /* Absorptivity of the point wrt the mean weights */
+  if(pt->nwls == 1) {
+    pt->kabs_at_pt = 1 - propagated;
+  } else if(pt->incoming_flux > 0) {
+    pt->kabs_at_pt = 1 - pt->outgoing_flux / pt->incoming_flux;
   } else {
-    ssol_medium_copy(out_medium, in_medium);
+    pt->kabs_at_pt = 1;
+  }
+
+  *out_medium = in_medium;
+  if((type & SSF_TRANSMISSION) && mtl->type == SSOL_MATERIAL_DIELECTRIC) {
+    /* The dielectric is an interface between 2 media */
+    const struct material_media* media = scene_get_material_media(scn, mtl);
+    if(in_medium == media->out) {
+      *out_medium = media->in;
+    } else {
+      ASSERT(in_medium == media->in);
+      *out_medium = media->out;
+    }
   }
 
 exit:
@@ -496,14 +856,37 @@ error:
 static FINLINE void
 point_hit_virtual
   (struct point* pt,
-   const struct ssol_medium* in_medium,
-   struct ssol_medium* out_medium)
+   const unsigned in_medium,
+   unsigned* out_medium)
 {
+  size_t i;
+  FOR_EACH(i, 0, pt->nwls) pt->outgoing_wls[i] = pt->incoming_wls[i];
   pt->kabs_at_pt = 0;
   pt->outgoing_flux = pt->incoming_flux;
   pt->outgoing_if_no_atm_loss = pt->incoming_if_no_atm_loss;
   pt->outgoing_if_no_field_loss = pt->incoming_if_no_field_loss;
-  ssol_medium_copy(out_medium, in_medium);
+  *out_medium = in_medium;
+}
+
+/* The whole incoming flux is absorbed by an absorber material or by a
+ * perfectly absorbing receiver */
+static FINLINE void
+point_hit_absorber
+  (struct point* pt,
+   const unsigned in_medium,
+   unsigned* out_medium)
+{
+  size_t i;
+  FOR_EACH(i, 0, pt->nwls) {
+    pt->outgoing_wls[i].flux = 0;
+    pt->outgoing_wls[i].if_no_atm_loss = 0;
+    pt->outgoing_wls[i].if_no_field_loss = 0;
+  }
+  pt->kabs_at_pt = 1;
+  pt->outgoing_flux = 0;
+  pt->outgoing_if_no_atm_loss = 0;
+  pt->outgoing_if_no_field_loss = 0;
+  *out_medium = in_medium;
 }
 
 static FINLINE int32_t
@@ -557,6 +940,75 @@ check_energy_conservation
     FATAL("error: the energy conservation property is not verified\n");
 }
 
+/* Return the extinction of the interned medium at the wavelength `wl' carried
+ * by the `iwl'^th slot of the path. The extinction is looked up only if the
+ * thread did not already fetch it for this slot at this wavelength, i.e. once
+ * per medium, per slot and per realisation */
+static FINLINE double
+get_extinction
+  (struct thread_context* ctx,
+   const struct ssol_scene* scn,
+   const unsigned imedium,
+   const size_t iwl,
+   const double wl)
+{
+  struct extinction* ext;
+  ASSERT(ctx && scn && wl >= 0 && iwl < SSOL_MAX_PATH_WAVELENGTHS);
+  ASSERT((imedium+1) * SSOL_MAX_PATH_WAVELENGTHS
+    <= darray_extinction_size_get(&ctx->extinctions));
+
+  if(scn->is_gray) { /* No spectral data */
+    ASSERT(scene_get_medium(scn, imedium)->extinction.type == SSOL_DATA_REAL);
+    return scene_get_medium(scn, imedium)->extinction.value.real;
+  }
+
+  ext = darray_extinction_data_get(&ctx->extinctions)
+    + imedium * SSOL_MAX_PATH_WAVELENGTHS + iwl;
+  if(ext->wavelength != wl) {
+    ext->wavelength = wl;
+    ext->k_ext = ssol_data_get_value
+      (&scene_get_medium(scn, imedium)->extinction, wl);
+  }
+  return ext->k_ext;
+}
+
+/* Setup the incoming weights of the point from the outgoing weights of the
+ * previous one, wrt the extinction of the medium along the `distance' that
+ * separates them */
+static void
+point_setup_incoming
+  (struct point* pt,
+   struct thread_context* ctx,
+   const struct ssol_scene* scn,
+   const unsigned in_medium, /* Index of an interned medium */
+   const double distance)
+{
+  const int in_atm = in_medium == scn->air_id;
+  size_t i;
+  ASSERT(pt && ctx && scn);
+
+  FOR_EACH(i, 0, pt->nwls) {
+    const struct weights* prev = pt->prev_outgoing_wls + i;
+    struct weights* in = pt->incoming_wls + i;
+    double trans = 1;
+
+    if(distance > 0) {
+      const double k_ext = get_extinction(ctx, scn, in_medium, i, pt->wls[i]);
+      ASSERT(0 <= k_ext && k_ext <= 1);
+      if(k_ext > 0) {
+        trans = exp(-k_ext * distance);
+      }
+    }
+    in->flux = prev->flux * trans;
+    in->if_no_atm_loss = in_atm
+      ? prev->if_no_atm_loss : prev->if_no_atm_loss * trans;
+    in->if_no_field_loss = !in_atm
+      ? prev->if_no_field_loss : prev->if_no_field_loss * trans;
+  }
+  weights_mean(pt->incoming_wls, pt->nwls, &pt->incoming_flux,
+    &pt->incoming_if_no_atm_loss, &pt->incoming_if_no_field_loss);
+}
+
 /* Compute an empirical length of the path segment coming from/going to the
  * infinite, wrt the scene bounding box */
 static INLINE double
@@ -569,6 +1021,80 @@ compute_infinite_path_segment_extend(struct s3d_scene_view* view)
   return MMAX(size[0], MMAX(size[1], size[2])) * 0.75;
 }
 
+/* Bounding box of the geometry that can bring a radiative path onto a
+ * receiver. It is used by the receiver only accounting to end the paths that
+ * cannot reach a receiver anymore */
+struct reach_aabb {
+  float lower[3];
+  float upper[3];
+};
+
+static res_T
+reach_aabb_setup(struct reach_aabb* aabb, struct ssol_scene* scn)
+{
+  float size[3], extend;
+  int i;
+  res_T res = RES_OK;
+  ASSERT(aabb && scn);
+
+  res = scene_compute_receivers_reach_aabb(scn, aabb->lower, aabb->upper);
+  if(res != RES_OK) return res;
+  if(aabb->lower[0] > aabb->upper[0]) return RES_OK; /* Empty AABB */
+
+  /* Slightly enlarge the AABB to handle numerical inaccuracies */
+  f3_sub(size, aabb->upper, aabb->lower);
+  extend = MMAX(size[0], MMAX(size[1], size[2])) * 1.e-4f + 1.e-6f;
+  FOR_EACH(i, 0, 3) {
+    aabb->lower[i] -= extend;
+    aabb->upper[i] += extend;
+  }
+  return RES_OK;
+}
+
+/* Clip the range of the ray to the reach AABB. Return 0 if the ray does not
+ * intersect it, i.e. if the radiative path cannot reach a receiver anymore */
+static INLINE int
+reach_aabb_clip_ray
+  (const struct reach_aabb* aabb,
+   const float org[3],
+   const float dir[3],
+   float range[2])
+{
+  float t0 = range[0];
+  float t1 = range[1];
+  int i;
+  ASSERT(aabb && org && dir && range);
+
+  if(aabb->lower[0] > aabb->upper[0]) return 0; /* Empty AABB */
+
+  FOR_EACH(i, 0, 3) {
+    float t_lower, t_upper;
+    if(dir[i] == 0) {
+      if(org[i] < aabb->lower[i] || org[i] > aabb->upper[i]) return 0;
+      continue;
+    }
+    t_lower = (aabb->lower[i] - org[i]) / dir[i];
+    t_upper = (aabb->upper[i] - org[i]) / dir[i];
+    t0 = MMAX(t0, MMIN(t_lower, t_upper));
+    t1 = MMIN(t1, MMAX(t_lower, t_upper));
+    if(t0 > t1) return 0;
+  }
+  range[1] = t1;
+  return 1;
+}
+
+/* State of a radiative path at the glossy bounce where it is forked. Each
+ * sub-path is traced from this state */
+struct split_point {
+  struct point pt;
+  unsigned in_medium;
+  struct s3d_hit hit;
+  float org[3], dir[3], range[2];
+  size_t depth;
+  size_t roulette_interval;
+  int hit_a_receiver;
+};
+
 static INLINE res_T
 path_register_and_clear
   (struct darray_path* paths,
@@ -588,68 +1114,70 @@ path_register_and_clear
 }
 
 static res_T
-accum_mc_receivers_1side
-  (struct mc_receiver_1side* dst,
-   struct mc_receiver_1side* src)
+update_mc_flux_map
+  (const struct point* pt,
+   const size_t irealisation,
+   struct mc_receiver_1side* mc_rcv1,
+   struct thread_context* thread_ctx)
 {
-  struct htable_shape2mc_iterator it_shape, end_shape;
+  const struct ssol_flux_map* map;
+  struct flux_map_bin_id bin_id;
+  struct mc_data* bin;
+  struct s3d_attrib attr;
+  double coords[3];
+  double u, v;
+  size_t i, j;
+  char has_texcoord;
   res_T res = RES_OK;
-  ASSERT(dst && src);
+  ASSERT(pt && mc_rcv1 && thread_ctx);
 
-  #define ACCUM_ALL {                                                          \
-    ACCUM_WEIGHT(incoming_flux);                                               \
-    ACCUM_WEIGHT(incoming_if_no_atm_loss);                                     \
-    ACCUM_WEIGHT(incoming_lost_in_field);                                      \
-    ACCUM_WEIGHT(incoming_lost_in_atmosphere);                                 \
-    ACCUM_WEIGHT(incoming_if_no_field_loss);                                   \
-    ACCUM_WEIGHT(absorbed_flux);                                               \
-    ACCUM_WEIGHT(absorbed_if_no_atm_loss);                                     \
-    ACCUM_WEIGHT(absorbed_if_no_field_loss);                                   \
-    ACCUM_WEIGHT(absorbed_lost_in_field);                                      \
-    ACCUM_WEIGHT(absorbed_lost_in_atmosphere);                                 \
-  } (void)0
-
-  #define ACCUM_WEIGHT(Name) mc_data_accum(&dst->Name, &src->Name)
-  ACCUM_ALL;
-  #undef ACCUM_WEIGHT
+  map = &pt->inst->flux_map;
+  ASSERT(flux_map_bins_count(map));
 
-  /* Merge the per shape MC */
-  htable_shape2mc_begin(&src->shape2mc, &it_shape);
-  htable_shape2mc_end(&src->shape2mc, &end_shape);
-  while(!htable_shape2mc_iterator_eq(&it_shape, &end_shape)) {
-    struct htable_prim2mc_iterator it_prim, end_prim;
-    const struct ssol_shape* shape = *htable_shape2mc_iterator_key_get(&it_shape);
-    struct mc_shape_1side* mc_shape1_src;
-    struct mc_shape_1side* mc_shape1_dst;
-
-    mc_shape1_src = htable_shape2mc_iterator_data_get(&it_shape);
-
-    res = mc_receiver_1side_get_mc_shape(dst, shape, &mc_shape1_dst);
-    if(res != RES_OK) goto error;
+  /* Retrieve the point coordinates in the mapped domain */
+  switch(map->domain) {
+    case SSOL_FLUX_MAP_UV:
+      S3D(primitive_has_attrib(&pt->prim, SSOL_TO_S3D_TEXCOORD, &has_texcoord));
+      if(!has_texcoord) {
+        d2_set_f2(coords, pt->uv);
+      } else {
+        S3D(primitive_get_attrib
+          (&pt->prim, SSOL_TO_S3D_TEXCOORD, pt->uv, &attr));
+        d2_set_f2(coords, attr.value);
+      }
+      break;
+    case SSOL_FLUX_MAP_LOCAL_XY:
+      shape_world_to_local
+        (pt->sshape->shape, pt->inst->transform, pt->pos, coords);
+      break;
+    default: FATAL("Unreachable code.\n"); break;
+  }
 
-    /* Merge the per primitive MC */
-    htable_prim2mc_begin(&mc_shape1_src->prim2mc, &it_prim);
-    htable_prim2mc_end(&mc_shape1_src->prim2mc, &end_prim);
-    while(!htable_prim2mc_iterator_eq(&it_prim, &end_prim)) {
-      const unsigned iprim = *htable_prim2mc_iterator_key_get(&it_prim);
-      struct mc_primitive_1side* mc_prim1_src;
-      struct mc_primitive_1side* mc_prim1_dst;
+  u = (coords[0] - map->lower[0]) / (map->upper[0] - map->lower[0]);
+  v = (coords[1] - map->lower[1]) / (map->upper[1] - map->lower[1]);
+  if(u < 0 || u >= 1 || v < 0 || v >= 1) return RES_OK; /* Out of the map */
 
-      mc_prim1_src = htable_prim2mc_iterator_data_get(&it_prim);
+  i = MMIN((size_t)(u * (double)map->definition[0]), map->definition[0]-1);
+  j = MMIN((size_t)(v * (double)map->definition[1]), map->definition[1]-1);
 
-      res = mc_shape_1side_get_mc_primitive(mc_shape1_dst, iprim, &mc_prim1_dst);
-      if(res != RES_OK) goto error;
+  res = mc_receiver_1side_setup_flux_map(mc_rcv1, map);
+  if(res != RES_OK) goto error;
 
-      #define ACCUM_WEIGHT(Name) \
-        mc_data_accum(&mc_prim1_dst->Name, &mc_prim1_src->Name)
-      ACCUM_ALL;
-      #undef ACCUM_WEIGHT
+  bin_id.inst = pt->inst;
+  bin_id.side = pt->side;
+  bin_id.ibin = j * map->definition[0] + i;
+  bin = darray_mc_data_data_get(&mc_rcv1->flux_map_bins)
+      + bin_id.ibin * FLUX_MAP_BIN_DATA_COUNT;
 
-      htable_prim2mc_iterator_next(&it_prim);
-    }
-    htable_shape2mc_iterator_next(&it_shape);
+  /* Register the bins first updated by the realisation in order to apply them
+   * the factor of the realisation */
+  if(bin[0].irealisation != irealisation) {
+    res = darray_flux_map_bin_id_push_back(&thread_ctx->flux_map_bins, &bin_id);
+    if(res != RES_OK) goto error;
   }
-  #undef ACCUM_ALL
+
+  mc_data_add_weight(bin + 0, irealisation, pt->incoming_flux);
+  mc_data_add_weight(bin + 1, irealisation, pt->incoming_flux * pt->kabs_at_pt);
 
 exit:
   return res;
@@ -658,48 +1186,87 @@ error:
 }
 
 static res_T
-accum_mc_sampled(struct mc_sampled* dst, struct mc_sampled* src)
+record_hit
+  (const struct point* pt,
+   const size_t irealisation,
+   struct thread_context* thread_ctx)
 {
-  struct htable_receiver_iterator it, end;
-  struct mc_receiver mc_rcv_null;
-  res_T res = RES_OK;
-  ASSERT(dst && src);
-
-  mc_receiver_init(NULL, &mc_rcv_null);
-
-  #define ACCUM_WEIGHT(Name) mc_data_accum(&dst->Name, &src->Name)
-  ACCUM_WEIGHT(cos_factor);
-  ACCUM_WEIGHT(shadowed);
-  #undef ACCUM_WEIGHT
-
-  dst->nb_samples += src->nb_samples;
-
-  /* dst->by_receiver += src->by_receiver; */
-  htable_receiver_begin(&src->mc_rcvs, &it);
-  htable_receiver_end(&src->mc_rcvs, &end);
-  while(!htable_receiver_iterator_eq(&it, &end)) {
-    struct mc_receiver* src_mc_rcv = htable_receiver_iterator_data_get(&it);
-    const struct ssol_instance* inst = *htable_receiver_iterator_key_get(&it);
-    struct mc_receiver* dst_mc_rcv = htable_receiver_find(&dst->mc_rcvs, &inst);
-    htable_receiver_iterator_next(&it);
+  struct ssol_hit hit;
+  double pos[3];
+  uint32_t id;
+  ASSERT(pt && thread_ctx);
+
+  SSOL(instance_get_id(pt->inst, &id));
+  shape_world_to_local(pt->sshape->shape, pt->inst->transform, pt->pos, pos);
+
+  hit.realisation = (uint64_t)irealisation;
+  f3_set_d3(hit.pos, pos);
+  hit.incoming_flux = (float)pt->incoming_flux;
+  hit.absorbed_flux = (float)(pt->incoming_flux * pt->kabs_at_pt);
+  hit.instance = id;
+  hit.side = (uint32_t)pt->side;
+  return darray_hit_push_back(&thread_ctx->hits, &hit);
+}
 
-    if(!dst_mc_rcv) {
-      res = htable_receiver_set(&dst->mc_rcvs, &inst, &mc_rcv_null);
-      if(res != RES_OK) goto error;
-      dst_mc_rcv = htable_receiver_find(&dst->mc_rcvs, &inst);
-    }
+static res_T
+register_tally_hit
+  (const struct point* pt,
+   const double dir_in[3], /* Incoming direction */
+   const size_t depth,
+   const size_t irealisation,
+   struct thread_context* thread_ctx)
+{
+  struct ssol_tally_hit hit;
+  uint32_t id;
+  ASSERT(pt && dir_in && thread_ctx);
+
+  SSOL(instance_get_id(pt->inst, &id));
+  hit.realisation = irealisation;
+  hit.depth = depth;
+  hit.instance = id;
+  hit.side = pt->side;
+  hit.primitive = pt->prim.prim_id;
+  d3_set(hit.pos, pt->pos);
+  d3_set(hit.dir, dir_in);
+  d3_set(hit.normal, pt->N);
+  d2_set_f2(hit.uv, pt->uv);
+  hit.wavelength = pt->wl;
+  hit.incoming_flux = pt->incoming_flux;
+  hit.absorbed_flux = pt->incoming_flux * pt->kabs_at_pt;
+  return darray_tally_hit_push_back(&thread_ctx->tally_hits, &hit);
+}
 
-    if(inst->receiver_mask & (int)SSOL_FRONT) {
-      res = accum_mc_receivers_1side(&dst_mc_rcv->front, &src_mc_rcv->front);
-      if(res != RES_OK) goto error;
+/* Submit to the tallies the hits and the path of a terminated realisation */
+static res_T
+flush_tallies
+  (const struct ssol_tally_path* path,
+   struct thread_context* thread_ctx)
+{
+  const struct ssol_tally_hit* hits;
+  size_t itally, ihit, ntallies, nhits;
+  res_T res = RES_OK;
+  ASSERT(path && thread_ctx);
+
+  ntallies = darray_tally_data_size_get(&thread_ctx->tallies);
+  hits = darray_tally_hit_cdata_get(&thread_ctx->tally_hits);
+  nhits = darray_tally_hit_size_get(&thread_ctx->tally_hits);
+  FOR_EACH(itally, 0, ntallies) {
+    struct tally_data* tally =
+      darray_tally_data_data_get(&thread_ctx->tallies) + itally;
+    if(tally->desc.hit) {
+      FOR_EACH(ihit, 0, nhits) {
+        res = tally->desc.hit(tally->data, hits + ihit, tally->desc.context);
+        if(res != RES_OK) goto error;
+      }
     }
-    if(inst->receiver_mask & (int)SSOL_BACK) {
-      res = accum_mc_receivers_1side(&dst_mc_rcv->back, &src_mc_rcv->back);
+    if(tally->desc.path_end) {
+      res = tally->desc.path_end(tally->data, path, tally->desc.context);
       if(res != RES_OK) goto error;
     }
   }
+
 exit:
-  mc_receiver_release(&mc_rcv_null);
+  darray_tally_hit_clear(&thread_ctx->tally_hits);
   return res;
 error:
   goto exit;
@@ -708,17 +1275,41 @@ error:
 static res_T
 update_mc
   (struct point* pt,
+   const double dir_in[3], /* Incoming direction */
+   const size_t depth, /* Number of non virtual surfaces hit before pt */
    const size_t irealisation,
+   const int receivers_only, /* Only accumulate the incoming/absorbed flux */
    struct thread_context* thread_ctx)
 {
   struct mc_receiver_1side* mc_rcv1 = NULL;
   struct mc_receiver_1side* mc_samp_x_rcv1 = NULL;
+  double absorbed;
+  double absorbed_if_no_atm_loss;
+  double absorbed_if_no_field_loss;
   res_T res = RES_OK;
-  ASSERT(pt && thread_ctx && point_is_receiver(pt));
+  ASSERT(pt && dir_in && thread_ctx && point_is_receiver(pt));
+
+  /* The absorptivity of a path that carries several wavelengths differs per
+   * weight. Since the point is a receiver, each weight scattered by the point
+   * is reduced by its absorption */
+  absorbed = pt->incoming_flux * pt->kabs_at_pt;
+  if(pt->nwls == 1) {
+    absorbed_if_no_atm_loss = pt->incoming_if_no_atm_loss * pt->kabs_at_pt;
+    absorbed_if_no_field_loss = pt->incoming_if_no_field_loss * pt->kabs_at_pt;
+  } else {
+    absorbed_if_no_atm_loss =
+      pt->incoming_if_no_atm_loss - pt->outgoing_if_no_atm_loss;
+    absorbed_if_no_field_loss =
+      pt->incoming_if_no_field_loss - pt->outgoing_if_no_field_loss;
+  }
 
   #define ACCUM_WEIGHT(Name, W)\
     mc_data_add_weight(&thread_ctx->Name, irealisation, W)
   ACCUM_WEIGHT(absorbed_by_receivers, pt->incoming_flux - pt->outgoing_flux);
+  /* Also accumulated by the receiver only accounting since it drives the
+   * adaptive sampling of the instances */
+  mc_data_add_weight(&pt->mc_samp->absorbed_by_receivers, irealisation,
+    pt->incoming_flux - pt->outgoing_flux);
   pt->energy_loss -= (pt->incoming_flux - pt->outgoing_flux);
   #undef ACCUM_WEIGHT
 
@@ -734,20 +1325,24 @@ update_mc
       pt->incoming_if_no_field_loss - pt->incoming_flux);                      \
     ACCUM_WEIGHT(incoming_lost_in_atmosphere,                                  \
       pt->incoming_if_no_atm_loss - pt->incoming_flux);                        \
-    ACCUM_WEIGHT(absorbed_flux, pt->incoming_flux * pt->kabs_at_pt);           \
-    ACCUM_WEIGHT(absorbed_if_no_atm_loss,                                      \
-      pt->incoming_if_no_atm_loss * pt->kabs_at_pt);                           \
-    ACCUM_WEIGHT(absorbed_if_no_field_loss,                                    \
-      pt->incoming_if_no_field_loss * pt->kabs_at_pt);                         \
+    ACCUM_WEIGHT(absorbed_flux, absorbed);                                     \
+    ACCUM_WEIGHT(absorbed_if_no_atm_loss, absorbed_if_no_atm_loss);            \
+    ACCUM_WEIGHT(absorbed_if_no_field_loss, absorbed_if_no_field_loss);        \
     ACCUM_WEIGHT(absorbed_lost_in_field,                                       \
-      (pt->incoming_if_no_field_loss - pt->incoming_flux) * pt->kabs_at_pt);   \
+      absorbed_if_no_field_loss - absorbed);                                   \
     ACCUM_WEIGHT(absorbed_lost_in_atmosphere,                                  \
-      (pt->incoming_if_no_atm_loss - pt->incoming_flux) * pt->kabs_at_pt);     \
+      absorbed_if_no_atm_loss - absorbed);                                     \
+  } (void)0
+  #define ACCUM_FLUX {                                                         \
+    ACCUM_WEIGHT(incoming_flux, pt->incoming_flux);                            \
+    ACCUM_WEIGHT(absorbed_flux, pt->incoming_flux * pt->kabs_at_pt);           \
   } (void)0
+  #define ACCUM                                                                \
+    if(receivers_only) { ACCUM_FLUX; } else { ACCUM_ALL; } (void)0
 
   #define ACCUM_WEIGHT(Name, W) \
     mc_data_add_weight(&mc_rcv1->Name, irealisation, W)
-  ACCUM_ALL;
+  ACCUM;
   #undef ACCUM_WEIGHT
 
   /* Per-sampled/receiver MC accumulation */
@@ -757,7 +1352,7 @@ update_mc
 
   #define ACCUM_WEIGHT(Name, W) \
     mc_data_add_weight(&mc_samp_x_rcv1->Name, irealisation, W)
-  ACCUM_ALL;
+  ACCUM;
   #undef ACCUM_WEIGHT
 
   /* Per primitive receiver MC accumulation */
@@ -773,11 +1368,31 @@ update_mc
 
     #define ACCUM_WEIGHT(Name, W) \
       mc_data_add_weight(&mc_prim1->Name, irealisation, W)
-    ACCUM_ALL;
+    ACCUM;
     #undef ACCUM_WEIGHT
   }
+  #undef ACCUM
+  #undef ACCUM_FLUX
   #undef ACCUM_ALL
 
+  /* Receiver flux map accumulation */
+  if(flux_map_bins_count(&pt->inst->flux_map)) {
+    res = update_mc_flux_map(pt, irealisation, mc_rcv1, thread_ctx);
+    if(res != RES_OK) goto error;
+  }
+
+  /* Hit recording */
+  if(pt->inst->record_hits) {
+    res = record_hit(pt, irealisation, thread_ctx);
+    if(res != RES_OK) goto error;
+  }
+
+  /* Tally hits are submitted once the realisation is terminated */
+  if(darray_tally_data_size_get(&thread_ctx->tallies)) {
+    res = register_tally_hit(pt, dir_in, depth, irealisation, thread_ctx);
+    if(res != RES_OK) goto error;
+  }
+
 exit:
   return res;
 error:
@@ -810,6 +1425,9 @@ apply_factor_mc
 {
   struct htable_receiver_iterator r_it, r_end;
   struct htable_sampled_iterator s_it, s_end;
+  struct htable_blocker_iterator b_it, b_end;
+  const struct flux_map_bin_id* bin_ids;
+  size_t i, n;
 
   /* Cancel global MC estimations */
   mc_data_apply_factor(&thread_ctx->cos_factor, irealisation, factor);
@@ -835,6 +1453,41 @@ apply_factor_mc
       apply_factor_mc_receiver_1side(&mc_rcv->back, irealisation, factor);
     }
   }
+  /* Cancel flux map MC estimations */
+  n = darray_flux_map_bin_id_size_get(&thread_ctx->flux_map_bins);
+  bin_ids = darray_flux_map_bin_id_cdata_get(&thread_ctx->flux_map_bins);
+  FOR_EACH(i, 0, n) {
+    struct mc_receiver* mc_rcv;
+    struct mc_receiver_1side* mc_rcv1;
+    struct mc_data* bin;
+
+    mc_rcv = htable_receiver_find(&thread_ctx->mc_rcvs, &bin_ids[i].inst);
+    ASSERT(mc_rcv);
+    mc_rcv1 = bin_ids[i].side == SSOL_FRONT ? &mc_rcv->front : &mc_rcv->back;
+    bin = darray_mc_data_data_get(&mc_rcv1->flux_map_bins)
+        + bin_ids[i].ibin * FLUX_MAP_BIN_DATA_COUNT;
+    mc_data_apply_factor(bin + 0, irealisation, factor);
+    mc_data_apply_factor(bin + 1, irealisation, factor);
+  }
+  /* Cancel the hits recorded by the realisation */
+  if(factor == 0) {
+    while(darray_hit_size_get(&thread_ctx->hits) > thread_ctx->first_hit) {
+      darray_hit_pop_back(&thread_ctx->hits);
+    }
+    darray_tally_hit_clear(&thread_ctx->tally_hits);
+  } else {
+    struct ssol_hit* hits = darray_hit_data_get(&thread_ctx->hits);
+    struct ssol_tally_hit* tally_hits =
+      darray_tally_hit_data_get(&thread_ctx->tally_hits);
+    FOR_EACH(i, thread_ctx->first_hit, darray_hit_size_get(&thread_ctx->hits)) {
+      hits[i].incoming_flux = (float)(hits[i].incoming_flux * factor);
+      hits[i].absorbed_flux = (float)(hits[i].absorbed_flux * factor);
+    }
+    FOR_EACH(i, 0, darray_tally_hit_size_get(&thread_ctx->tally_hits)) {
+      tally_hits[i].incoming_flux *= factor;
+      tally_hits[i].absorbed_flux *= factor;
+    }
+  }
   /* Cancel sampled instance MC estimations */
   htable_sampled_begin(&thread_ctx->mc_samps, &s_it);
   htable_sampled_end(&thread_ctx->mc_samps, &s_end);
@@ -844,8 +1497,24 @@ apply_factor_mc
 
     mc_data_apply_factor(&mc_samp->cos_factor, irealisation, factor);
     mc_data_apply_factor(&mc_samp->shadowed, irealisation, factor);
+    mc_data_apply_factor(&mc_samp->blocked, irealisation, factor);
+    mc_data_apply_factor(&mc_samp->missing, irealisation, factor);
+    mc_data_apply_factor
+      (&mc_samp->extinguished_by_atmosphere, irealisation, factor);
+    mc_data_apply_factor(&mc_samp->other_absorbed, irealisation, factor);
+    mc_data_apply_factor(&mc_samp->absorbed_by_receivers, irealisation, factor);
+
+    /* Apply the factor to the per blocker estimations */
+    htable_blocker_begin(&mc_samp->mc_blockers, &b_it);
+    htable_blocker_end(&mc_samp->mc_blockers, &b_end);
+    while(!htable_blocker_iterator_eq(&b_it, &b_end)) {
+      struct mc_blocker* mc_blocker = htable_blocker_iterator_data_get(&b_it);
+      htable_blocker_iterator_next(&b_it);
+      mc_data_apply_factor(&mc_blocker->absorbed_flux, irealisation, factor);
+      mc_data_apply_factor(&mc_blocker->hits, irealisation, factor);
+    }
 
-    /* dst->by_receiver += src->by_receiver; */
+    /* Apply the factor to the per receiver estimations */
     htable_receiver_begin(&mc_samp->mc_rcvs, &r_it);
     htable_receiver_end(&mc_samp->mc_rcvs, &r_end);
     while(!htable_receiver_iterator_eq(&r_it, &r_end)) {
@@ -876,35 +1545,58 @@ trace_radiative_path
    struct thread_context* thread_ctx,
    struct ssol_scene* scn,
    struct s3d_scene_view* view_samp,
+   const struct ranst_instance* ran_inst, /* May be NULL */
    struct s3d_scene_view* view_rt,
    struct ranst_sun_dir* ran_sun_dir,
    struct ranst_sun_wl* ran_sun_wl,
-   const struct ssol_path_tracker* tracker) /* May be NULL */
+   const struct ssol_path_tracker* tracker, /* May be NULL */
+   const struct reach_aabb* reach) /* NULL <=> full accounting */
 {
   struct path path;
-  struct ssol_medium in_medium = SSOL_MEDIUM_VACUUM;
-  struct ssol_medium out_medium = SSOL_MEDIUM_VACUUM;
+  struct path split_path; /* Path up to the split point */
+  struct split_point split;
+  unsigned in_medium = 0; /* Index of the interned medium */
+  unsigned out_medium = 0; /* Index of the interned medium */
   struct s3d_hit hit = S3D_HIT_NULL;
   struct point pt = POINT_NULL;
+  const struct ssol_instance* samp_inst = NULL;
   float org[3], dir[3], range[2] = { 0, FLT_MAX };
   size_t depth = 0;
   size_t roulette_interval, typical_max_depth;
+  size_t max_depth = 0; /* Maximum depth of the sub-paths */
+  size_t nreplays = 0; /* #sub-paths still to trace from the split point */
+  size_t first_path = 0;
+  double missing_flux = 0;
   int is_lit = 0;
+  int is_split = 0;
   int hit_a_receiver = 0;
+  int receiver_hit = 0; /* Was a receiver hit by any sub-path */
   int killed_by_roulette = 0;
+  const int full = reach == NULL;
   res_T res = RES_OK;
   ASSERT(thread_ctx && scn && view_samp && view_rt && ran_sun_dir && ran_sun_wl);
 
-  if(tracker) path_init(scn->dev->allocator, &path);
+  split.in_medium = 0;
+  if(tracker) {
+    path_init(scn->dev->allocator, &path);
+    path_init(scn->dev->allocator, &split_path);
+    first_path = darray_path_size_get(&thread_ctx->paths);
+  }
+
+  /* No flux map bin is updated and no hit is recorded yet by the realisation */
+  darray_flux_map_bin_id_clear(&thread_ctx->flux_map_bins);
+  thread_ctx->first_hit = darray_hit_size_get(&thread_ctx->hits);
+  darray_tally_hit_clear(&thread_ctx->tally_hits);
 
   typical_max_depth = 16; /* This one could come through scn */
   roulette_interval = 4 * typical_max_depth; /* First roulette */
 
   /* Find a new starting point of the radiative random walk */
-  res = point_init(&pt, scn, &thread_ctx->mc_samps,
-    view_samp, view_rt, ran_sun_dir, ran_sun_wl, thread_ctx->rng,
+  res = point_init(&pt, irealisation, scn, &thread_ctx->mc_samps,
+    view_samp, ran_inst, view_rt, ran_sun_dir, ran_sun_wl, thread_ctx->rng,
     &in_medium, &is_lit);
   if(res != RES_OK) goto error;
+  samp_inst = pt.inst;
 
   if(tracker) {
     /* Add the first point of the starting segment */
@@ -925,8 +1617,10 @@ trace_radiative_path
   #define ACCUM_WEIGHT(Res, W) mc_data_add_weight(&Res, irealisation, W)
 
   if(!is_lit) { /* The starting point is not lit */
-    ACCUM_WEIGHT(pt.mc_samp->shadowed, pt.initial_flux);
-    ACCUM_WEIGHT(thread_ctx->shadowed, pt.initial_flux);
+    if(full) {
+      ACCUM_WEIGHT(pt.mc_samp->shadowed, pt.initial_flux);
+      ACCUM_WEIGHT(thread_ctx->shadowed, pt.initial_flux);
+    }
     pt.energy_loss -= pt.initial_flux;
     if(tracker) path.type = SSOL_PATH_SHADOW;
   } else {
@@ -937,47 +1631,84 @@ trace_radiative_path
     hit.distance = 0; /* first loop has no atmospheric extinction */
 
     for(;;) { /* Here we go for the radiative random walk */
-      const int in_atm = media_ceq(&in_medium, &scn->air);
+      const int in_atm = in_medium == scn->air_id;
       const int hit_receiver = point_is_receiver(&pt);
       const int hit_virtual = pt.material->type == SSOL_MATERIAL_VIRTUAL;
+      const int hit_absorber = pt.material->type == SSOL_MATERIAL_ABSORBER
+        || (hit_receiver && pt.inst->absorb_all);
+      struct ssol_surface_fragment frag;
+      double dir_in[3];
       int last_segment = 0;
       int weight_is_zero = 0;
       struct ray_data ray_data = RAY_DATA_NULL;
-      double trans = 1;
 
-      /* Compute medium extinction along the incoming segment. */
-      if(hit.distance > 0) {
-        const double k_ext = ssol_data_get_value(&in_medium.extinction, pt.wl);
-        ASSERT(0 <= k_ext && k_ext <= 1);
-        if(k_ext > 0) {
-          trans = exp(-k_ext * hit.distance);
+      /* The fragment of the shaded point is computed once per bounce */
+      if(!hit_virtual && !hit_absorber) point_setup_fragment(&pt, &frag);
+
+      /* Fork the path at its first glossy bounce. Its weights are divided by
+       * the number of sub-paths successively traced from this point, so that
+       * they share the flux of the path */
+      if(!is_split && scn->nsplits > 1 && !hit_virtual && !hit_absorber
+      && point_is_glossy(&pt, &frag)) {
+        point_scale_prev_outgoing(&pt, 1.0 / (double)scn->nsplits);
+        split.pt = pt;
+        split.in_medium = in_medium;
+        split.hit = hit;
+        f3_set(split.org, org);
+        f3_set(split.dir, dir);
+        f2_set(split.range, range);
+        split.depth = depth;
+        split.roulette_interval = roulette_interval;
+        split.hit_a_receiver = hit_a_receiver;
+        if(tracker) {
+          res = path_copy(&split_path, &path);
+          if(res != RES_OK) goto error;
         }
+        nreplays = scn->nsplits - 1;
+        is_split = 1;
       }
-      pt.incoming_flux = pt.prev_outgoing_flux * trans;
-      pt.incoming_if_no_atm_loss = in_atm ?
-        pt.prev_outgoing_if_no_atm_loss : pt.prev_outgoing_if_no_atm_loss * trans;
-      pt.incoming_if_no_field_loss = (!in_atm) ?
-        pt.prev_outgoing_if_no_field_loss : pt.prev_outgoing_if_no_field_loss * trans;
+
+      /* Compute medium extinction along the incoming segment. */
+      point_setup_incoming
+        (&pt, thread_ctx, scn, in_medium, hit.distance);
 
       /* Compute interaction with material */
-      if(hit_virtual) {
-        point_hit_virtual(&pt, &in_medium, &out_medium);
+      d3_set(dir_in, pt.dir);
+      if(hit_absorber) {
+        /* No shading: the path ends onto the absorber */
+        point_hit_absorber(&pt, in_medium, &out_medium);
+      } else if(hit_virtual) {
+        point_hit_virtual(&pt, in_medium, &out_medium);
       } else {
         /* Modulate the point weights wrt its scattering functions and generate
          * an outgoing direction and set out_medium accordingly */
-        res = point_shade(&pt, &in_medium, &out_medium, thread_ctx->rng, pt.dir);
+        res = point_shade
+          (&pt, scn, &frag, in_medium, &out_medium, thread_ctx->rng, pt.dir);
         if(res != RES_OK) goto error;
       }
 
       /* If receiver update MC results */
       if(hit_receiver) {
         hit_a_receiver = 1;
-        res = update_mc(&pt, irealisation, thread_ctx);
+        res = update_mc(&pt, dir_in, depth, irealisation, !full, thread_ctx);
         if(res != RES_OK) goto error;
+      } else if(full) {
+        const double absorbed = pt.incoming_flux * pt.kabs_at_pt;
+        ACCUM_WEIGHT(thread_ctx->other_absorbed, absorbed);
+        if(pt.inst == samp_inst) {
+          ACCUM_WEIGHT(pt.mc_samp->other_absorbed, absorbed);
+        } else {
+          /* The flux is blocked by another instance */
+          struct mc_blocker* mc_blocker;
+          res = mc_sampled_get_mc_blocker(pt.mc_samp, pt.inst, &mc_blocker);
+          if(res != RES_OK) goto error;
+          ACCUM_WEIGHT(pt.mc_samp->blocked, absorbed);
+          ACCUM_WEIGHT(mc_blocker->absorbed_flux, absorbed);
+          ACCUM_WEIGHT(mc_blocker->hits, 1);
+        }
+        pt.energy_loss -= absorbed;
       } else {
-        ACCUM_WEIGHT(thread_ctx->other_absorbed,
-          pt.incoming_flux * pt.kabs_at_pt);
-        pt.energy_loss -= (pt.incoming_flux * pt.kabs_at_pt);
+        pt.energy_loss -= pt.incoming_flux * pt.kabs_at_pt;
       }
 
       /* Stop the radiative random walk if no more flux */
@@ -1008,7 +1739,11 @@ trace_radiative_path
         ray_data.discard_virtual_materials = 0;
         ray_data.reversed_ray = 0;
         ray_data.dst = FLT_MAX;
-        S3D(scene_view_trace_ray(view_rt, org, dir, range, &ray_data, &hit));
+        if(reach && !reach_aabb_clip_ray(reach, org, dir, range)) {
+          hit = S3D_HIT_NULL; /* The ray cannot reach a receiver anymore */
+        } else {
+          S3D(scene_view_trace_ray(view_rt, org, dir, range, &ray_data, &hit));
+        }
         if(S3D_HIT_NONE(&hit)) { /* The ray is lost! */
           /* Add the  point of the last path segment going to the infinite */
           if(tracker && tracker->infinite_ray_length > 0) {
@@ -1024,7 +1759,7 @@ trace_radiative_path
            * and not `in_medium' - against the atmosphere since it is actually
            * the medium in which the ray was traced; at this step, `in_medium' is
            * still the medium of the previous path segment. */
-          if(!media_ceq(&out_medium, &scn->air)) {
+          if(out_medium != scn->air_id) {
             log_error(scn->dev, "Inconsistent medium description.\n");
             res = RES_BAD_OP;
             goto error;
@@ -1038,19 +1773,55 @@ trace_radiative_path
        * a non-virtual material is hit or no further hit can be found. */
       if(weight_is_zero || last_segment || !hit_virtual) {
         const double absorbed = pt.prev_outgoing_flux - pt.incoming_flux;
-        if(in_atm) {
+        if(!full) {
+          /* Do not account for the extinction */
+        } else if(in_atm) {
           ACCUM_WEIGHT(thread_ctx->extinguished_by_atmosphere, absorbed);
+          ACCUM_WEIGHT(pt.mc_samp->extinguished_by_atmosphere, absorbed);
         } else {
           ACCUM_WEIGHT(thread_ctx->other_absorbed, absorbed);
+          ACCUM_WEIGHT(pt.mc_samp->other_absorbed, absorbed);
         }
         pt.energy_loss -= absorbed;
 
         if(weight_is_zero || last_segment) {
-          break;
+          /* Register the remaining flux as missing */
+          if(full) {
+            ACCUM_WEIGHT(thread_ctx->missing, pt.outgoing_flux);
+            ACCUM_WEIGHT(pt.mc_samp->missing, pt.outgoing_flux);
+          }
+          pt.energy_loss -= pt.outgoing_flux;
+          missing_flux += pt.outgoing_flux;
+          max_depth = MMAX(max_depth, depth);
+          receiver_hit |= hit_a_receiver;
+
+          if(tracker) {
+            path.type = hit_a_receiver ? SSOL_PATH_SUCCESS : SSOL_PATH_MISSING;
+          }
+          if(!nreplays) break;
+
+          /* Trace the next sub-path from the split point */
+          if(tracker) {
+            res = path_register_and_clear(&thread_ctx->paths, &path);
+            if(res != RES_OK) goto error;
+            res = path_copy(&path, &split_path);
+            if(res != RES_OK) goto error;
+          }
+          split.pt.energy_loss = pt.energy_loss;
+          split.pt.survivor_score = pt.survivor_score;
+          pt = split.pt;
+          in_medium = split.in_medium;
+          hit = split.hit;
+          f3_set(org, split.org);
+          f3_set(dir, split.dir);
+          f2_set(range, split.range);
+          depth = split.depth;
+          roulette_interval = split.roulette_interval;
+          hit_a_receiver = split.hit_a_receiver;
+          --nreplays;
+          continue;
         }
-        pt.prev_outgoing_flux = pt.outgoing_flux;
-        pt.prev_outgoing_if_no_atm_loss = pt.outgoing_if_no_atm_loss;
-        pt.prev_outgoing_if_no_field_loss = pt.outgoing_if_no_field_loss;
+        point_forward_outgoing(&pt);
       }
 
       depth += !hit_virtual;
@@ -1070,6 +1841,10 @@ trace_radiative_path
         } else {
           cancel_mc(thread_ctx, irealisation);
           killed_by_roulette = 1;
+          if(tracker) { /* Discard the sub-paths already registered */
+            res = darray_path_resize(&thread_ctx->paths, first_path);
+            if(res != RES_OK) goto error;
+          }
           goto exit; /* break is not enough */
         }
       }
@@ -1082,24 +1857,18 @@ trace_radiative_path
         if (res != RES_OK) goto error;
       }
 
-      ssol_medium_copy(&in_medium, &out_medium);
-    }
-    /* Register the remaining flux as missing */
-    ACCUM_WEIGHT(thread_ctx->missing, pt.outgoing_flux);
-    pt.energy_loss -= pt.outgoing_flux;
-
-
-    if(tracker) {
-      path.type = hit_a_receiver ? SSOL_PATH_SUCCESS : SSOL_PATH_MISSING;
+      in_medium = out_medium;
     }
   }
   /* Now that the sample ends successfully, record MC weights */
-  ACCUM_WEIGHT(pt.mc_samp->cos_factor, pt.cos_factor);
+  ACCUM_WEIGHT(pt.mc_samp->cos_factor, pt.samp_cos_factor);
   ACCUM_WEIGHT(thread_ctx->cos_factor, pt.cos_factor);
   #undef ACCUM_WEIGHT
 
-  /* Check conservation of energy at the realisation level */
-  ASSERT(((double)depth*DBL_EPSILON*10)*pt.initial_flux >= fabs(pt.energy_loss));
+  /* Check conservation of energy at the realisation level. The mean of the
+   * per wavelength weights adds its own rounding errors */
+  ASSERT(((double)((max_depth+1)*scn->nsplits*scn->nwavelengths)
+    *DBL_EPSILON*10)*pt.initial_flux >= fabs(pt.energy_loss));
 
   /* this realisation accounts for many that where canceled */
   if(pt.survivor_score) {
@@ -1107,6 +1876,19 @@ trace_radiative_path
     apply_factor_mc(thread_ctx, irealisation, factor);
   }
 
+  if(darray_tally_data_size_get(&thread_ctx->tallies)) {
+    struct ssol_tally_path tally_path;
+    const double factor = (double)(1 << pt.survivor_score);
+    tally_path.realisation = irealisation;
+    tally_path.depth = max_depth;
+    tally_path.wavelength = pt.wl;
+    tally_path.initial_flux = pt.initial_flux * factor;
+    tally_path.missing_flux = missing_flux * factor;
+    tally_path.receiver_hit = receiver_hit;
+    res = flush_tallies(&tally_path, thread_ctx);
+    if(res != RES_OK) goto error;
+  }
+
 exit:
   if(tracker && !killed_by_roulette) {
     res_T tmp_res = path_register_and_clear(&thread_ctx->paths, &path);
@@ -1115,9 +1897,10 @@ exit:
       goto error;
     }
   }
-  ssol_medium_clear(&in_medium);
-  ssol_medium_clear(&out_medium);
-  if(tracker) path_release(&path);
+  if(tracker) {
+    path_release(&path);
+    path_release(&split_path);
+  }
   return res;
 error:
   if (tracker) {
@@ -1127,50 +1910,301 @@ error:
 }
 
 /*******************************************************************************
- * Exported functions
+ * Solver
+ ******************************************************************************/
+struct solver {
+  struct s3d_scene_view* view_rt;
+  struct s3d_scene_view* view_samp;
+  struct ranst_sun_dir* ran_sun_dir;
+  struct ranst_sun_wl* ran_sun_wl;
+  struct ranst_instance* ran_inst; /* May be NULL */
+  struct reach_aabb reach_aabb;
+  const struct reach_aabb* reach; /* NULL <=> no receiver reach culling */
+  struct ssol_path_tracker tracker;
+  const struct ssol_path_tracker* path_tracker; /* NULL <=> no path tracking */
+  struct darray_thread_ctx thread_ctxs;
+  struct block_rngs blocks;
+  size_t nworkers;
+  size_t iworker;
+  int64_t nrealisations; /* Number of realisations of the worker */
+  int64_t nrun; /* Number of realisations run since the last gathering */
+  int64_t nfailures; /* Number of failures since the last gathering */
+
+  struct ssol_scene* scn;
+  ref_T ref;
+};
+
+static void
+solver_release(ref_T* ref)
+{
+  struct solver* solver;
+  struct ssol_scene* scn;
+  ASSERT(ref);
+  solver = CONTAINER_OF(ref, struct solver, ref);
+  scn = solver->scn;
+  darray_thread_ctx_release(&solver->thread_ctxs);
+  block_rngs_release(&solver->blocks);
+  if(solver->view_rt) S3D(scene_view_ref_put(solver->view_rt));
+  if(solver->view_samp) S3D(scene_view_ref_put(solver->view_samp));
+  if(solver->ran_sun_dir) ranst_sun_dir_ref_put(solver->ran_sun_dir);
+  if(solver->ran_sun_wl) ranst_sun_wl_ref_put(solver->ran_sun_wl);
+  if(solver->ran_inst) ranst_instance_ref_put(solver->ran_inst);
+  MEM_RM(scn->dev->allocator, solver);
+  SSOL(scene_ref_put(scn));
+}
+
+/* Return the pilot estimate of the quantity of the adaptive objective */
+static const struct mc_data*
+mc_sampled_get_objective
+  (struct mc_sampled* mc_samp,
+   const struct ssol_adaptive_objective* objective)
+{
+  const struct ssol_instance* rcv;
+  const struct mc_receiver* mc_rcv;
+  const struct mc_receiver_1side* mc_rcv1;
+  ASSERT(mc_samp && objective);
+
+  if(objective->quantity == SSOL_ADAPTIVE_ABSORBED_BY_RECEIVERS)
+    return &mc_samp->absorbed_by_receivers;
+
+  rcv = objective->receiver;
+  mc_rcv = htable_receiver_find(&mc_samp->mc_rcvs, &rcv);
+  if(!mc_rcv) return NULL; /* No path of the instance reached the receiver */
+  mc_rcv1 = objective->side == SSOL_FRONT ? &mc_rcv->front : &mc_rcv->back;
+  switch(objective->quantity) {
+    case SSOL_ADAPTIVE_RECEIVER_INCOMING: return &mc_rcv1->incoming_flux;
+    case SSOL_ADAPTIVE_RECEIVER_ABSORBED: return &mc_rcv1->absorbed_flux;
+    default: FATAL("Unreachable code.\n"); break;
+  }
+  return NULL;
+}
+
+static res_T
+check_adaptive_objective
+  (struct ssol_scene* scn,
+   const struct ssol_adaptive_objective* objective)
+{
+  struct ssol_instance** pinst;
+  uint32_t id;
+  ASSERT(scn && objective);
+
+  if(objective->quantity == SSOL_ADAPTIVE_ABSORBED_BY_RECEIVERS)
+    return RES_OK;
+
+  SSOL(instance_get_id(objective->receiver, &id));
+  pinst = htable_instance_find(&scn->instances_rt, &id);
+  if(!pinst || *pinst != objective->receiver
+  || !(objective->receiver->receiver_mask & (int)objective->side)) {
+    log_error(scn->dev,
+      "%s: the receiver of the adaptive objective is not a %s receiver "
+      "of the scene.\n", FUNC_NAME,
+      objective->side == SSOL_FRONT ? "front" : "back");
+    return RES_BAD_ARG;
+  }
+  return RES_OK;
+}
+
+/* Adapt the probability to sample the instances. Pilot realisations first
+ * sample the instances wrt their area in order to estimate, per instance, the
+ * second moment of the quantity of the adaptive objective, i.e. the flux
+ * absorbed by the receivers or the flux reaching a given receiver side. The
+ * variance of this quantity is minimised by sampling each instance
+ * proportionally to its area times the square root of its moment. This
+ * allocation is mixed with the area based one to ensure that all the instances
+ * remain sampled, i.e. that the estimates remain unbiased. The results of the
+ * pilot realisations are then discarded */
+static res_T
+adapt_instance_sampling(struct solver* solver, const int64_t npilots)
+{
+  /* Ratio of the area based allocation in the adapted one */
+  const double defensive_ratio = 0.1;
+  struct ssol_scene* scn;
+  struct darray_thread_ctx* thread_ctxs;
+  struct darray_double weights;
+  double sum_weights = 0;
+  double sum_areas = 0;
+  size_t iinst, ninsts;
+  int64_t iblock;
+  int ithread, nthreads;
+  ATOMIC mt_res = RES_OK;
+  res_T res = RES_OK;
+  ASSERT(solver && npilots > 0 && solver->ran_inst);
+
+  scn = solver->scn;
+  thread_ctxs = &solver->thread_ctxs;
+  darray_double_init(scn->dev->allocator, &weights);
+  nthreads = (int)darray_thread_ctx_size_get(thread_ctxs);
+
+  res = check_adaptive_objective(scn, &scn->objective);
+  if(res != RES_OK) goto error;
+
+  /* The pilot realisations are not submitted to the tallies */
+  FOR_EACH(ithread, 0, nthreads) {
+    struct thread_context* ctx;
+    ctx = darray_thread_ctx_data_get(thread_ctxs) + ithread;
+    darray_tally_data_clear(&ctx->tallies);
+  }
+
+  /* The pilots are distributed over the blocks and consume their random
+   * sequences before the realisations of the worker */
+  #pragma omp parallel for schedule(dynamic)
+  for(iblock = 0; iblock < NBLOCKS_PER_WORKER; ++iblock) {
+    struct thread_context* thread_ctx;
+    int64_t i;
+
+    thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + omp_get_thread_num();
+    thread_ctx->rng = solver->blocks.rngs[iblock];
+    for(i = iblock; i < npilots; i += NBLOCKS_PER_WORKER) {
+      res_T res_local;
+      if(ATOMIC_GET(&mt_res) != RES_OK) break; /* An error occured */
+      res_local = trace_radiative_path((size_t)i, thread_ctx, scn,
+        solver->view_samp, NULL, solver->view_rt, solver->ran_sun_dir,
+        solver->ran_sun_wl, NULL, solver->reach);
+      if(res_local == RES_BAD_OP) {
+        cancel_mc(thread_ctx, (size_t)i); /* Simply discard the pilot */
+      } else if(res_local != RES_OK) {
+        ATOMIC_SET(&mt_res, res_local);
+      }
+    }
+  }
+  if(mt_res != RES_OK) {
+    res = (res_T)mt_res;
+    goto error;
+  }
+
+  ninsts = ranst_instance_get_count(solver->ran_inst);
+  res = darray_double_resize(&weights, ninsts);
+  if(res != RES_OK) goto error;
+
+  /* Per instance optimal weight */
+  FOR_EACH(iinst, 0, ninsts) {
+    const struct ssol_instance* inst;
+    const double area = ranst_instance_get_area(solver->ran_inst, iinst);
+    struct mc_data flux = MC_DATA_NULL;
+    size_t nsamples = 0;
+    double moment = 0;
+
+    inst = ranst_instance_get_instance(solver->ran_inst, iinst);
+    FOR_EACH(ithread, 0, nthreads) {
+      struct thread_context* ctx;
+      struct mc_sampled* mc_samp;
+      const struct mc_data* data;
+      ctx = darray_thread_ctx_data_get(thread_ctxs) + ithread;
+      mc_samp = htable_sampled_find(&ctx->mc_samps, &inst);
+      if(!mc_samp) continue; /* The instance was not sampled by the thread */
+      data = mc_sampled_get_objective(mc_samp, &scn->objective);
+      if(data) mc_data_accum(&flux, data);
+      nsamples += mc_samp->nb_samples;
+    }
+    if(nsamples) {
+      double weight, sqr_weight;
+      mc_data_get(&flux, &weight, &sqr_weight);
+      moment = sqr_weight / (double)nsamples;
+    }
+    darray_double_data_get(&weights)[iinst] = area * sqrt(moment);
+    sum_weights += area * sqrt(moment);
+    sum_areas += area;
+  }
+
+  /* Keep the area based allocation if no flux reached the objective */
+  if(sum_weights > 0) {
+    FOR_EACH(iinst, 0, ninsts) {
+      const double area = ranst_instance_get_area(solver->ran_inst, iinst);
+      double* w = darray_double_data_get(&weights) + iinst;
+      *w = (1 - defensive_ratio) * (*w / sum_weights)
+         + defensive_ratio * (area / sum_areas);
+    }
+    res = ranst_instance_setup
+      (solver->ran_inst, darray_double_cdata_get(&weights));
+    if(res != RES_OK) goto error;
+  }
+
+  /* Discard the results of the pilot realisations */
+  FOR_EACH(ithread, 0, nthreads) {
+    struct thread_context* ctx;
+    ctx = darray_thread_ctx_data_get(thread_ctxs) + ithread;
+    res = thread_context_reset(ctx, &scn->tallies);
+    if(res != RES_OK) goto error;
+  }
+
+exit:
+  darray_double_release(&weights);
+  return res;
+error:
+  goto exit;
+}
+
+/* Select the instances proportionally to their sampling quota */
+static res_T
+setup_instance_quotas(struct ssol_scene* scn, struct ranst_instance* ran_inst)
+{
+  struct darray_double quotas;
+  size_t iinst, ninsts;
+  res_T res = RES_OK;
+  ASSERT(scn && ran_inst);
+
+  darray_double_init(scn->dev->allocator, &quotas);
+
+  ninsts = ranst_instance_get_count(ran_inst);
+  res = darray_double_resize(&quotas, ninsts);
+  if(res != RES_OK) goto error;
+  FOR_EACH(iinst, 0, ninsts) {
+    const struct ssol_instance* inst;
+    inst = ranst_instance_get_instance(ran_inst, iinst);
+    darray_double_data_get(&quotas)[iinst] = inst->sampling_quota;
+  }
+  res = ranst_instance_setup(ran_inst, darray_double_cdata_get(&quotas));
+  if(res != RES_OK) goto error;
+
+exit:
+  darray_double_release(&quotas);
+  return res;
+error:
+  goto exit;
+}
+
+/*******************************************************************************
+ * Local functions
  ******************************************************************************/
 res_T
-ssol_solve
+solver_create
   (struct ssol_scene* scn,
    const struct ssp_rng* rng_state,
    const size_t realisations_count,
-   const size_t max_failed_count,
    const struct ssol_path_tracker* path_tracker,
-   struct ssol_estimator** out_estimator)
+   const size_t nworkers,
+   const size_t iworker,
+   struct solver** out_solver)
 {
-  struct htable_receiver_iterator r_it, r_end;
-  struct htable_sampled_iterator s_it, s_end;
-  struct s3d_scene_view* view_rt = NULL;
-  struct s3d_scene_view* view_samp = NULL;
-  struct ranst_sun_dir* ran_sun_dir = NULL;
-  struct ranst_sun_wl* ran_sun_wl = NULL;
-  struct darray_thread_ctx thread_ctxs;
-  struct ssol_estimator* estimator = NULL;
-  struct ssol_path_tracker tracker;
-  struct ssp_rng_proxy* rng_proxy = NULL;
-  int64_t nrealisations = 0;
-  int64_t max_failures = 0;
+  struct solver* solver = NULL;
   int nthreads = 0;
   int i = 0;
-  ATOMIC mt_res = RES_OK;
-  ATOMIC nfailures = 0;
-  res_T res;
-  ASSERT(nrealisations <= INT_MAX);
+  res_T res = RES_OK;
 
-  if(!scn || !rng_state || !realisations_count || !out_estimator)
+  if(!scn || !rng_state || !out_solver || iworker >= nworkers
+  || realisations_count < nworkers
+  || nworkers > SIZE_MAX / ((size_t)NBLOCKS_PER_WORKER * RNG_BUCKET_SIZE))
     return RES_BAD_ARG;
 
-  darray_thread_ctx_init(scn->dev->allocator, &thread_ctxs);
-
   /* CL compiler supports OpenMP parallel loop whose indices are signed. The
    * following line ensures that the unsigned number of realisations does not
    * overflow the realisation index. */
-  if(realisations_count > INT64_MAX || max_failed_count > INT64_MAX) {
-    res = RES_BAD_ARG;
-    goto error;
-  }
-  nrealisations = (int64_t)realisations_count;
-  max_failures = (int64_t)max_failed_count;
+  if(realisations_count > INT64_MAX || scn->npilots > INT64_MAX)
+    return RES_BAD_ARG;
+
+  solver = MEM_CALLOC(scn->dev->allocator, 1, sizeof(struct solver));
+  if(!solver) return RES_MEM_ERR;
+  ref_init(&solver->ref);
+  SSOL(scene_ref_get(scn));
+  solver->scn = scn;
+  darray_thread_ctx_init(scn->dev->allocator, &solver->thread_ctxs);
+  block_rngs_init(&solver->blocks);
+  solver->nworkers = nworkers;
+  solver->iworker = iworker;
+
+  /* Number of realisations devoted to the worker */
+  solver->nrealisations = (int64_t)(realisations_count / nworkers);
+  if(iworker < realisations_count % nworkers) ++solver->nrealisations;
   nthreads = (int)scn->dev->nthreads;
 
   res = scene_check(scn, FUNC_NAME);
@@ -1182,79 +2216,214 @@ ssol_solve
   else
     ssol_data_copy(&scn->air.extinction, &SSOL_MEDIUM_VACUUM.extinction);
 
+  /* Intern the media traversed by the radiative paths */
+  res = scene_setup_media(scn);
+  if(res != RES_OK) goto error;
+  scene_setup_gray(scn);
+
   /* Create data structures shared by all threads */
-  res = scene_create_s3d_views(scn, &view_rt, &view_samp);
+  res = scene_create_s3d_views(scn, &solver->view_rt, &solver->view_samp);
   if(res != RES_OK) goto error;
-  res = sun_create_direction_distribution(scn->sun, &ran_sun_dir);
+  res = sun_create_direction_distribution(scn->sun, &solver->ran_sun_dir);
   if(res != RES_OK) goto error;
-  res = sun_create_wavelength_distribution(scn->sun, &ran_sun_wl);
+  res = sun_create_wavelength_distribution(scn->sun, &solver->ran_sun_wl);
   if(res != RES_OK) goto error;
+  if(scn->accounting == SSOL_ACCOUNTING_RECEIVERS) {
+    res = reach_aabb_setup(&solver->reach_aabb, scn);
+    if(res != RES_OK) goto error;
+    solver->reach = &solver->reach_aabb;
+  }
 
-  /* Create a RNG proxy from the submitted RNG state */
-  res = ssp_rng_proxy_create_from_rng
-    (scn->dev->allocator, rng_state, scn->dev->nthreads, &rng_proxy);
+  /* Create the independent random sequences of the blocks of the worker */
+  res = solver_reseed(solver, rng_state);
   if(res != RES_OK) goto error;
 
-  /* Create the estimator */
-  res = estimator_create(scn->dev, scn, &estimator);
-  if (res != RES_OK) goto error;
-
   /* Create per thread data structures */
-  res = darray_thread_ctx_resize(&thread_ctxs, scn->dev->nthreads);
+  res = darray_thread_ctx_resize(&solver->thread_ctxs, scn->dev->nthreads);
   if(res != RES_OK) goto error;
   FOR_EACH(i, 0, nthreads) {
-    struct thread_context* ctx = darray_thread_ctx_data_get(&thread_ctxs)+i;
-    res = thread_context_setup(ctx, rng_proxy, (size_t)i);
+    struct thread_context* ctx;
+    ctx = darray_thread_ctx_data_get(&solver->thread_ctxs) + i;
+    res = thread_context_setup
+      (ctx, &scn->tallies, darray_medium_size_get(&scn->media));
     if(res != RES_OK) goto error;
   }
 
   /* Setup the path tracker */
   if(path_tracker) {
-    tracker = *path_tracker;
-    if(tracker.sun_ray_length < 0 || tracker.infinite_ray_length < 0) {
-      const double extend = compute_infinite_path_segment_extend(view_rt);
-      if(tracker.sun_ray_length < 0) tracker.sun_ray_length = extend;
-      if(tracker.infinite_ray_length < 0) tracker.infinite_ray_length = extend;
+    solver->tracker = *path_tracker;
+    if(solver->tracker.sun_ray_length < 0
+    || solver->tracker.infinite_ray_length < 0) {
+      const double extend =
+        compute_infinite_path_segment_extend(solver->view_rt);
+      if(solver->tracker.sun_ray_length < 0)
+        solver->tracker.sun_ray_length = extend;
+      if(solver->tracker.infinite_ray_length < 0)
+        solver->tracker.infinite_ray_length = extend;
     }
-    path_tracker = &tracker;
+    solver->path_tracker = &solver->tracker;
   }
 
-  /* Launch the parallel MC estimation */
-  #pragma omp parallel for schedule(static)
-  for(i = 0; i < nrealisations; ++i) {
-    struct thread_context* thread_ctx;
-    const int ithread = omp_get_thread_num();
-    res_T res_local;
-
-    if(ATOMIC_GET(&mt_res) != RES_OK) continue; /* An error occured */
+  if(scn->npilots || scn->stratification != SSOL_STRATIFICATION_NONE) {
+    res = ranst_instance_create(scn, &solver->ran_inst);
+    if(res != RES_OK) goto error;
+  }
 
-    /* Fetch per thread data */
-    thread_ctx = darray_thread_ctx_data_get(&thread_ctxs) + ithread;
+  /* Adapt the sampling of the instances from pilot realisations */
+  if(scn->npilots) {
+    res = adapt_instance_sampling(solver, (int64_t)scn->npilots);
+    if(res != RES_OK) goto error;
+  } else if(scn->stratification == SSOL_STRATIFICATION_QUOTA) {
+    res = setup_instance_quotas(scn, solver->ran_inst);
+    if(res != RES_OK) goto error;
+  }
 
-    /* Execute a MC experiment */
-    res_local = trace_radiative_path((size_t)i, thread_ctx,
-      scn, view_samp, view_rt, ran_sun_dir, ran_sun_wl, path_tracker);
-    if(res_local != RES_OK) {
-      /* Cancel partial MC results */
-      cancel_mc(thread_ctx, (size_t)i);
+  /* Split the realisations of the worker over the sampled instances */
+  if(scn->stratification != SSOL_STRATIFICATION_NONE) {
+    res = ranst_instance_stratify
+      (solver->ran_inst, (size_t)solver->nrealisations);
+    if(res != RES_OK) {
+      log_error(scn->dev,
+        "%s: not enough realisations to stratify the %lu sampled instances.\n",
+        FUNC_NAME, (unsigned long)ranst_instance_get_count(solver->ran_inst));
+      goto error;
     }
-    if(res_local == RES_BAD_OP) {
-      if(ATOMIC_INCR(&nfailures) >= max_failures) {
-        log_error(scn->dev, "Too many unexpected radiative paths.\n");
+  }
+
+exit:
+  *out_solver = solver;
+  return res;
+error:
+  if(solver) {
+    solver_ref_put(solver);
+    solver = NULL;
+  }
+  goto exit;
+}
+
+res_T
+solver_ref_get(struct solver* solver)
+{
+  if(!solver) return RES_BAD_ARG;
+  ref_get(&solver->ref);
+  return RES_OK;
+}
+
+res_T
+solver_ref_put(struct solver* solver)
+{
+  if(!solver) return RES_BAD_ARG;
+  ref_put(&solver->ref, solver_release);
+  return RES_OK;
+}
+
+size_t
+solver_get_realisations_count(const struct solver* solver)
+{
+  ASSERT(solver);
+  return (size_t)solver->nrealisations;
+}
+
+res_T
+solver_reseed(struct solver* solver, const struct ssp_rng* rng_state)
+{
+  ASSERT(solver && rng_state);
+  return block_rngs_setup(&solver->blocks, solver->scn->dev->allocator,
+    rng_state, solver->nworkers, solver->iworker);
+}
+
+res_T
+solver_run
+  (struct solver* solver,
+   const size_t begin,
+   const size_t end,
+   const size_t max_failed_count)
+{
+  struct darray_thread_ctx* thread_ctxs;
+  struct ssol_scene* scn;
+  int64_t max_failures = 0;
+  int64_t iblock = 0;
+  ATOMIC mt_res = RES_OK;
+  ATOMIC nfailures = 0;
+  ASSERT(solver && begin <= end && end <= (size_t)solver->nrealisations);
+
+  if(max_failed_count > INT64_MAX) return RES_BAD_ARG;
+  max_failures = (int64_t)max_failed_count;
+  nfailures = (ATOMIC)solver->nfailures;
+  thread_ctxs = &solver->thread_ctxs;
+  scn = solver->scn;
+
+  /* Launch the parallel MC estimation. The blocks are dynamically distributed
+   * over the threads to balance their load. Each block runs its realisations
+   * that are in [begin, end[ */
+  #pragma omp parallel for schedule(dynamic)
+  for(iblock = 0; iblock < NBLOCKS_PER_WORKER; ++iblock) {
+    struct thread_context* thread_ctx;
+    const int ithread = omp_get_thread_num();
+    int64_t irealisation;
+
+    /* Fetch per thread data and the random sequence of the block */
+    thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + ithread;
+    thread_ctx->rng = solver->blocks.rngs[iblock];
+
+    irealisation = block_get_first((int64_t)begin, iblock);
+    for(; irealisation < (int64_t)end; irealisation += NBLOCKS_PER_WORKER) {
+      res_T res_local;
+
+      if(ATOMIC_GET(&mt_res) != RES_OK) break; /* An error occured */
+
+      /* Execute a MC experiment */
+      res_local = trace_radiative_path((size_t)irealisation, thread_ctx, scn,
+        solver->view_samp, solver->ran_inst, solver->view_rt,
+        solver->ran_sun_dir, solver->ran_sun_wl, solver->path_tracker,
+        solver->reach);
+      if(res_local != RES_OK) {
+        /* Cancel partial MC results */
+        cancel_mc(thread_ctx, (size_t)irealisation);
+      }
+      if(res_local == RES_BAD_OP) {
+        if(ATOMIC_INCR(&nfailures) >= max_failures) {
+          log_error(scn->dev, "Too many unexpected radiative paths.\n");
+          ATOMIC_SET(&mt_res, res_local);
+        }
+      } else if(res_local != RES_OK) {
         ATOMIC_SET(&mt_res, res_local);
       }
-    } else if(res_local != RES_OK) {
-      ATOMIC_SET(&mt_res, res_local);
+      if(res_local != RES_OK) continue;
+      thread_ctx->realisation_count++;
     }
-    if(res_local != RES_OK) continue;
-    thread_ctx->realisation_count++;
   }
-  estimator->failed_count = (size_t)nfailures;
+  solver->nfailures = (int64_t)nfailures;
+  solver->nrun += (int64_t)(end - begin);
+  return (res_T)mt_res;
+}
+
+res_T
+solver_gather(struct solver* solver, struct ssol_estimator** out_estimator)
+{
+  struct htable_receiver_iterator r_it, r_end;
+  struct htable_sampled_iterator s_it, s_end;
+  struct darray_thread_ctx* thread_ctxs;
+  struct ssol_estimator* estimator = NULL;
+  struct ssol_scene* scn;
+  int nthreads = 0;
+  int i = 0;
+  res_T res = RES_OK;
+  ASSERT(solver && out_estimator);
+
+  thread_ctxs = &solver->thread_ctxs;
+  scn = solver->scn;
+  nthreads = (int)darray_thread_ctx_size_get(thread_ctxs);
+
+  /* Create the estimator */
+  res = estimator_create(scn->dev, scn, &estimator);
+  if (res != RES_OK) goto error;
+  estimator->failed_count = (size_t)solver->nfailures;
 
   /* Merge per thread global MC estimations */
   FOR_EACH(i, 0, nthreads) {
     struct thread_context* thread_ctx;
-    thread_ctx = darray_thread_ctx_data_get(&thread_ctxs)+i;
+    thread_ctx = darray_thread_ctx_data_get(thread_ctxs)+i;
     #define ACCUM_WEIGHT(Name) \
       mc_data_accum(&estimator->Name, &thread_ctx->Name)
     ACCUM_WEIGHT(cos_factor);
@@ -1279,7 +2448,7 @@ ssol_solve
       struct thread_context* thread_ctx;
       struct mc_receiver* mc_rcv_thread;
 
-      thread_ctx = darray_thread_ctx_data_get(&thread_ctxs) + i;
+      thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + i;
       mc_rcv_thread = htable_receiver_find(&thread_ctx->mc_rcvs, &inst);
       if(!mc_rcv_thread) continue; /* Receiver was not visited in this thread */
 
@@ -1306,7 +2475,7 @@ ssol_solve
       struct thread_context* thread_ctx;
       struct mc_sampled* mc_samp_thread;
 
-      thread_ctx = darray_thread_ctx_data_get(&thread_ctxs) + i;
+      thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + i;
       mc_samp_thread = htable_sampled_find(&thread_ctx->mc_samps, &inst);
       if(!mc_samp_thread) continue; /* Instance was not sampled in this thread */
 
@@ -1316,12 +2485,12 @@ ssol_solve
   }
 
   /* Merge per thread tracked paths */
-  if(path_tracker) {
+  if(solver->path_tracker) {
     FOR_EACH(i, 0, nthreads) {
       struct thread_context* thread_ctx;
       size_t ipath, npaths;
 
-      thread_ctx = darray_thread_ctx_data_get(&thread_ctxs) + i;
+      thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + i;
       npaths = darray_path_size_get(&thread_ctx->paths);
       FOR_EACH(ipath, 0, npaths) {
         struct path* path;
@@ -1332,25 +2501,53 @@ ssol_solve
     }
   }
 
+  /* Merge per thread recorded hits. A realisation is run by only one thread:
+   * its hits remain contiguous */
+  FOR_EACH(i, 0, nthreads) {
+    struct thread_context* thread_ctx;
+    size_t nhits_thread, nhits;
+
+    thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + i;
+    nhits_thread = darray_hit_size_get(&thread_ctx->hits);
+    if(!nhits_thread) continue;
+
+    nhits = darray_hit_size_get(&estimator->hits);
+    res = darray_hit_resize(&estimator->hits, nhits + nhits_thread);
+    if(res != RES_OK) goto error;
+    memcpy(darray_hit_data_get(&estimator->hits) + nhits,
+      darray_hit_cdata_get(&thread_ctx->hits),
+      nhits_thread * sizeof(struct ssol_hit));
+  }
+
+  /* Merge per thread tally data */
+  FOR_EACH(i, 0, nthreads) {
+    struct thread_context* thread_ctx;
+    thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + i;
+    res = tallies_merge(&estimator->tallies, &thread_ctx->tallies);
+    if(res != RES_OK) goto error;
+  }
+
   estimator->sampled_area = scn->sampled_area;
 
-  res = estimator_save_rng_state(estimator, rng_proxy);
+  res = estimator_save_rng_state(estimator, solver->blocks.proxy);
   if(res != RES_OK) goto error;
 
-  if(mt_res != RES_OK) res = (res_T)mt_res;
-
   #ifndef NDEBUG
-  check_energy_conservation(scn, estimator, nrealisations);
+  if(!solver->reach) check_energy_conservation(scn, estimator, solver->nrun);
   #endif
 
+  /* Discard the gathered results */
+  FOR_EACH(i, 0, nthreads) {
+    struct thread_context* thread_ctx;
+    thread_ctx = darray_thread_ctx_data_get(thread_ctxs) + i;
+    res = thread_context_reset(thread_ctx, &scn->tallies);
+    if(res != RES_OK) goto error;
+  }
+  solver->nrun = 0;
+  solver->nfailures = 0;
+
 exit:
-  darray_thread_ctx_release(&thread_ctxs);
-  if(view_rt) S3D(scene_view_ref_put(view_rt));
-  if(view_samp) S3D(scene_view_ref_put(view_samp));
-  if(ran_sun_dir) ranst_sun_dir_ref_put(ran_sun_dir);
-  if(ran_sun_wl) ranst_sun_wl_ref_put(ran_sun_wl);
-  if(rng_proxy) SSP(rng_proxy_ref_put(rng_proxy));
-  if(out_estimator) *out_estimator = estimator;
+  *out_estimator = estimator;
   return res;
 error:
   if(estimator) {
@@ -1360,3 +2557,63 @@ error:
   goto exit;
 }
 
+/*******************************************************************************
+ * Exported functions
+ ******************************************************************************/
+res_T
+ssol_solve
+  (struct ssol_scene* scn,
+   const struct ssp_rng* rng_state,
+   const size_t realisations_count,
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* path_tracker,
+   struct ssol_estimator** out_estimator)
+{
+  return ssol_solve_partition(scn, rng_state, realisations_count,
+    max_failed_count, path_tracker, 1, 0, out_estimator);
+}
+
+res_T
+ssol_solve_partition
+  (struct ssol_scene* scn,
+   const struct ssp_rng* rng_state,
+   const size_t realisations_count,
+   const size_t max_failed_count,
+   const struct ssol_path_tracker* path_tracker,
+   const size_t nworkers,
+   const size_t iworker,
+   struct ssol_estimator** out_estimator)
+{
+  struct ssol_estimator* estimator = NULL;
+  struct solver* solver = NULL;
+  res_T res_run = RES_OK;
+  res_T res = RES_OK;
+
+  if(!scn || !rng_state || !out_estimator || iworker >= nworkers
+  || realisations_count < nworkers
+  || max_failed_count > INT64_MAX)
+    return RES_BAD_ARG;
+
+  res = solver_create(scn, rng_state, realisations_count, path_tracker,
+    nworkers, iworker, &solver);
+  if(res != RES_OK) goto error;
+
+  res_run = solver_run
+    (solver, 0, solver_get_realisations_count(solver), max_failed_count);
+
+  res = solver_gather(solver, &estimator);
+  if(res != RES_OK) goto error;
+
+  if(res_run != RES_OK) res = res_run;
+
+exit:
+  if(solver) solver_ref_put(solver);
+  if(out_estimator) *out_estimator = estimator;
+  return res;
+error:
+  if(estimator) {
+    SSOL(estimator_ref_put(estimator));
+    estimator = NULL;
+  }
+  goto exit;
+}
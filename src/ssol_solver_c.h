@@ -0,0 +1,85 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SSOL_SOLVER_C_H
+#define SSOL_SOLVER_C_H
+
+#include <rsys/rsys.h>
+
+/* External types */
+struct ssol_estimator;
+struct ssol_path_tracker;
+struct ssol_scene;
+struct ssp_rng;
+
+/* Simulation of the realisations of a worker. The scene is set up once on
+ * creation, i.e. its media, its Star-3D views, its sun distributions, the
+ * pilot realisations of the adaptive sampling and the stratification of the
+ * instances. Its realisations can then be run in several ranges whose results
+ * are gathered in estimators */
+struct solver;
+
+/* Set up the simulation of the worker `iworker' out of `nworkers' workers
+ * sharing `realisations_count' realisations */
+extern LOCAL_SYM res_T
+solver_create
+  (struct ssol_scene* scn,
+   const struct ssp_rng* rng_state,
+   const size_t realisations_count, /* Overall number of realisations */
+   const struct ssol_path_tracker* tracker, /* May be NULL */
+   const size_t nworkers,
+   const size_t iworker, /* In [0, nworkers[ */
+   struct solver** solver);
+
+extern LOCAL_SYM res_T
+solver_ref_get
+  (struct solver* solver);
+
+extern LOCAL_SYM res_T
+solver_ref_put
+  (struct solver* solver);
+
+/* Number of realisations devoted to the worker */
+extern LOCAL_SYM size_t
+solver_get_realisations_count
+  (const struct solver* solver);
+
+/* Restart the random sequences of the worker from `rng_state'. The
+ * realisations run afterwards do not depend on the previous ones */
+extern LOCAL_SYM res_T
+solver_reseed
+  (struct solver* solver,
+   const struct ssp_rng* rng_state);
+
+/* Run the realisations of the worker whose index is in [begin, end[. Return
+ * RES_BAD_OP if the number of failed realisations since the last gathering
+ * reaches `max_failed_count' */
+extern LOCAL_SYM res_T
+solver_run
+  (struct solver* solver,
+   const size_t begin,
+   const size_t end, /* In [begin, solver_get_realisations_count] */
+   const size_t max_failed_count);
+
+/* Create an estimator with the results of the realisations run since the
+ * previous gathering and discard them from the solver. Its RNG state is the
+ * current state of the random sequences of the worker */
+extern LOCAL_SYM res_T
+solver_gather
+  (struct solver* solver,
+   struct ssol_estimator** estimator);
+
+#endif /* SSOL_SOLVER_C_H */
@@ -18,12 +18,16 @@
 #include "ssol_spectrum_c.h"
 #include "ssol_device_c.h"
 
-#include <rsys/algorithm.h>
 #include <rsys/hash.h>
 #include <rsys/math.h>
 #include <rsys/mem_allocator.h>
 #include <rsys/ref_count.h>
 
+/* #cells of the lookup grid per smallest interval between 2 wavelengths */
+#define GRID_CELLS_PER_INTERVAL 2
+/* Maximum #cells of the lookup grid unless the spectrum has more intervals */
+#define GRID_MAX_CELLS 65536
+
 /*******************************************************************************
  * Helper functions
  ******************************************************************************/
@@ -37,18 +41,55 @@ spectrum_release(ref_T* ref)
   ASSERT(dev && dev->allocator);
   darray_double_release(&spectrum->wavelengths);
   darray_double_release(&spectrum->intensities);
+  darray_size_t_release(&spectrum->grid);
   MEM_RM(dev->allocator, spectrum);
   SSOL(device_ref_put(dev));
 }
 
-static int
-eq_dbl(const void* key, const void* base)
+static res_T
+spectrum_setup_grid(struct ssol_spectrum* spectrum)
 {
-  const double k = *(const double*) key;
-  const double b = *(const double*) base;
-  if(k > b) return +1;
-  if(k < b) return -1;
-  return 0;
+  const double* wls;
+  size_t* cells;
+  double range;
+  double min_step;
+  double ideal;
+  size_t icell, ncells, iwl, sz;
+  res_T res = RES_OK;
+  ASSERT(spectrum);
+
+  darray_size_t_clear(&spectrum->grid);
+  sz = darray_double_size_get(&spectrum->wavelengths);
+  if(sz < 2) return RES_OK; /* The spectrum is constant */
+
+  wls = darray_double_cdata_get(&spectrum->wavelengths);
+  range = wls[sz-1] - wls[0];
+  ASSERT(range > 0);
+
+  /* Size the cells wrt the smallest interval so that a cell overlaps few
+   * wavelengths even though the spectrum is irregularly sampled. The #cells is
+   * capped: the lookup then relies on a binary search into the cell */
+  min_step = range;
+  FOR_EACH(iwl, 1, sz) min_step = MMIN(min_step, wls[iwl] - wls[iwl-1]);
+  ideal = range / min_step * GRID_CELLS_PER_INTERVAL;
+  ncells = (sz - 1) * GRID_CELLS_PER_INTERVAL;
+  if(ideal > (double)ncells) {
+    ncells = MMAX(ncells, (size_t)MMIN(ideal, (double)GRID_MAX_CELLS));
+  }
+
+  res = darray_size_t_resize(&spectrum->grid, ncells);
+  if(res != RES_OK) return res;
+  cells = darray_size_t_data_get(&spectrum->grid);
+
+  iwl = 0;
+  FOR_EACH(icell, 0, ncells) {
+    const double lower = wls[0] + range * (double)icell / (double)ncells;
+    while(iwl < sz-1 && wls[iwl] < lower) ++iwl;
+    cells[icell] = iwl;
+  }
+  spectrum->grid_lower = wls[0];
+  spectrum->grid_rcp_step = (double)ncells / range;
+  return RES_OK;
 }
 
 /*******************************************************************************
@@ -60,26 +101,48 @@ spectrum_interpolate
 {
   const double* wls;
   const double* ints;
-  const double* next;
   double slope;
   double intensity;
-  size_t id_next, sz;
+  double u;
+  size_t id_next, icell, ncells, sz;
+  size_t lo, hi;
   ASSERT(spectrum);
 
   sz = darray_double_size_get(&spectrum->wavelengths);
   wls = darray_double_cdata_get(&spectrum->wavelengths);
   ints = darray_double_cdata_get(&spectrum->intensities);
-  next = search_lower_bound(&wavelength, wls, sz, sizeof(double), &eq_dbl);
-  if(!next) { /* Clamp to upper bound */
+  if(wavelength <= wls[0]) { /* Clamp to lower bound */
+    return ints[0];
+  }
+  if(wavelength > wls[sz-1]) { /* Clamp to upper bound */
     return ints[sz-1];
   }
 
-  id_next = (size_t)(next - wls);
-  if(!id_next) { /* Clamp to lower bound */
-    return ints[0];
+  /* Look for the first wavelength not less than the submitted one. It lies
+   * between the indices stored by the grid cell of the submitted wavelength and
+   * by the next cell, in which it is binary searched. The index is then
+   * adjusted both ways to handle the numerical inaccuracy of the cell
+   * computation; the search is thus as exact as a global binary search */
+  ncells = darray_size_t_size_get(&spectrum->grid);
+  ASSERT(sz > 1 && ncells);
+  u = (wavelength - spectrum->grid_lower) * spectrum->grid_rcp_step;
+  icell = MMIN((size_t)u, ncells-1);
+  lo = darray_size_t_cdata_get(&spectrum->grid)[icell];
+  hi = icell + 1 < ncells
+    ? darray_size_t_cdata_get(&spectrum->grid)[icell+1] : sz-1;
+  while(lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if(wls[mid] < wavelength) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
   }
+  id_next = lo;
+  while(id_next > 1 && wls[id_next-1] >= wavelength) --id_next;
+  while(wls[id_next] < wavelength) ++id_next;
 
-  ASSERT(id_next); /* because spectrum_includes_point */
+  ASSERT(id_next && id_next < sz);
   ASSERT(wls[id_next] >= wls[id_next - 1]);
 
   slope = (ints[id_next] - ints[id_next-1]) / (wls[id_next] - wls[id_next-1]);
@@ -135,6 +198,7 @@ ssol_spectrum_create
   ref_init(&spectrum->ref);
   darray_double_init(dev->allocator, &spectrum->wavelengths);
   darray_double_init(dev->allocator, &spectrum->intensities);
+  darray_size_t_init(dev->allocator, &spectrum->grid);
 
 exit:
   if(out_spectrum) *out_spectrum = spectrum;
@@ -200,12 +264,16 @@ ssol_spectrum_setup
   spectrum->checksum[0] = hash_fnv64(wavelengths, nwlens*sizeof(double));
   spectrum->checksum[1] = hash_fnv64(intensities, nwlens*sizeof(double));
 
+  res = spectrum_setup_grid(spectrum);
+  if(res != RES_OK) goto error;
+
 exit:
   return res;
 error:
   if(spectrum) {
     darray_double_clear(&spectrum->wavelengths);
     darray_double_clear(&spectrum->intensities);
+    darray_size_t_clear(&spectrum->grid);
     spectrum->checksum[0] = 0;
     spectrum->checksum[1] = 0;
   }
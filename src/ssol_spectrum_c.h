@@ -19,12 +19,20 @@
 
 #include <rsys/ref_count.h>
 #include <rsys/dynamic_array_double.h>
+#include <rsys/dynamic_array_size_t.h>
 
 struct ssol_spectrum {
   struct darray_double wavelengths;
   struct darray_double intensities;
   uint64_t checksum[2];
 
+  /* Uniform grid over the range of the wavelengths. Each cell stores the index
+   * of the first wavelength that is not less than the cell lower bound, i.e.
+   * it is a starting point of the wavelength lookup */
+  struct darray_size_t grid;
+  double grid_lower; /* Lower bound of the grid */
+  double grid_rcp_step; /* Reciprocal of the size of a grid cell */
+
   struct ssol_device* dev;
   ref_T ref;
 };
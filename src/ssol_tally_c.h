@@ -0,0 +1,195 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef SSOL_TALLY_C_H
+#define SSOL_TALLY_C_H
+
+#include "ssol.h"
+
+#include <rsys/dynamic_array.h>
+#include <rsys/mem_allocator.h>
+
+/* Declare the dynamic array of tally descriptors */
+#define DARRAY_NAME tally
+#define DARRAY_DATA struct ssol_tally
+#include <rsys/dynamic_array.h>
+
+/* Declare the dynamic array of pending tally hits */
+#define DARRAY_NAME tally_hit
+#define DARRAY_DATA struct ssol_tally_hit
+#include <rsys/dynamic_array.h>
+
+/* Data of a tally */
+struct tally_data {
+  struct ssol_tally desc;
+  void* data; /* Allocated and initialised by tally_data_setup */
+  struct mem_allocator* allocator;
+};
+
+static INLINE void
+tally_data_init(struct mem_allocator* allocator, struct tally_data* tally)
+{
+  ASSERT(allocator && tally);
+  tally->desc = SSOL_TALLY_NULL;
+  tally->data = NULL;
+  tally->allocator = allocator;
+}
+
+static INLINE void
+tally_data_release(struct tally_data* tally)
+{
+  ASSERT(tally);
+  if(!tally->data) return;
+  if(tally->desc.release) tally->desc.release(tally->data, tally->desc.context);
+  MEM_RM(tally->allocator, tally->data);
+  tally->data = NULL;
+}
+
+static INLINE res_T
+tally_data_setup(struct tally_data* tally, const struct ssol_tally* desc)
+{
+  res_T res = RES_OK;
+  ASSERT(tally && desc && desc->sizeof_data && desc->merge);
+
+  tally_data_release(tally);
+  tally->data = MEM_CALLOC(tally->allocator, 1, desc->sizeof_data);
+  if(!tally->data) return RES_MEM_ERR;
+  tally->desc = *desc;
+  if(desc->init) {
+    res = desc->init(tally->data, desc->context);
+    if(res != RES_OK) {
+      MEM_RM(tally->allocator, tally->data);
+      tally->data = NULL;
+    }
+  }
+  return res;
+}
+
+static INLINE res_T
+tally_data_merge(struct tally_data* dst, const struct tally_data* src)
+{
+  ASSERT(dst && src && dst->data && src->data);
+  ASSERT(dst->desc.merge == src->desc.merge);
+  return dst->desc.merge(dst->data, src->data, dst->desc.context);
+}
+
+/* The copy is a fresh tally in which the source data are merged */
+static INLINE res_T
+tally_data_copy(struct tally_data* dst, const struct tally_data* src)
+{
+  res_T res = RES_OK;
+  ASSERT(dst && src);
+  tally_data_release(dst);
+  if(!src->data) return RES_OK;
+  res = tally_data_setup(dst, &src->desc);
+  if(res != RES_OK) return res;
+  return tally_data_merge(dst, src);
+}
+
+static INLINE res_T
+tally_data_copy_and_release(struct tally_data* dst, struct tally_data* src)
+{
+  ASSERT(dst && src);
+  tally_data_release(dst);
+  dst->desc = src->desc;
+  dst->data = src->data;
+  src->data = NULL;
+  return RES_OK;
+}
+
+static FINLINE int
+tally_eq(const struct ssol_tally* a, const struct ssol_tally* b)
+{
+  ASSERT(a && b);
+  return a->sizeof_data == b->sizeof_data
+      && a->init == b->init
+      && a->release == b->release
+      && a->hit == b->hit
+      && a->path_end == b->path_end
+      && a->merge == b->merge
+      && a->write == b->write
+      && a->read == b->read
+      && a->context == b->context;
+}
+
+/* Declare the dynamic array of tally data */
+#define DARRAY_NAME tally_data
+#define DARRAY_DATA struct tally_data
+#define DARRAY_FUNCTOR_INIT tally_data_init
+#define DARRAY_FUNCTOR_RELEASE tally_data_release
+#define DARRAY_FUNCTOR_COPY tally_data_copy
+#define DARRAY_FUNCTOR_COPY_AND_RELEASE tally_data_copy_and_release
+#include <rsys/dynamic_array.h>
+
+/* Allocate and initialise the data of the `descs' tallies */
+static INLINE res_T
+tallies_setup
+  (struct darray_tally_data* tallies,
+   const struct darray_tally* descs)
+{
+  size_t i, n;
+  res_T res = RES_OK;
+  ASSERT(tallies && descs);
+
+  n = darray_tally_size_get(descs);
+  darray_tally_data_clear(tallies);
+  res = darray_tally_data_resize(tallies, n);
+  if(res != RES_OK) return res;
+  FOR_EACH(i, 0, n) {
+    res = tally_data_setup(darray_tally_data_data_get(tallies) + i,
+      darray_tally_cdata_get(descs) + i);
+    if(res != RES_OK) {
+      darray_tally_data_clear(tallies);
+      return res;
+    }
+  }
+  return RES_OK;
+}
+
+static INLINE int
+tallies_eq
+  (const struct darray_tally_data* a, const struct darray_tally_data* b)
+{
+  size_t i, n;
+  ASSERT(a && b);
+  n = darray_tally_data_size_get(a);
+  if(n != darray_tally_data_size_get(b)) return 0;
+  FOR_EACH(i, 0, n) {
+    if(!tally_eq(&darray_tally_data_cdata_get(a)[i].desc,
+                 &darray_tally_data_cdata_get(b)[i].desc))
+      return 0;
+  }
+  return 1;
+}
+
+/* Merge the `src' tally data into the `dst' ones */
+static INLINE res_T
+tallies_merge
+  (struct darray_tally_data* dst, const struct darray_tally_data* src)
+{
+  size_t i, n;
+  res_T res = RES_OK;
+  ASSERT(dst && src && tallies_eq(dst, src));
+  n = darray_tally_data_size_get(dst);
+  FOR_EACH(i, 0, n) {
+    res = tally_data_merge(darray_tally_data_data_get(dst) + i,
+      darray_tally_data_cdata_get(src) + i);
+    if(res != RES_OK) return res;
+  }
+  return RES_OK;
+}
+
+#endif /* SSOL_TALLY_C_H */
@@ -0,0 +1,240 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 10000
+#define DNI 1000
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_instance* sky;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* full;
+  struct ssol_estimator* lean;
+  struct ssol_estimator* lean2;
+  struct ssol_mc_global global_full;
+  struct ssol_mc_global global_lean;
+  struct ssol_mc_receiver rcv_full;
+  struct ssol_mc_receiver rcv_lean;
+  struct ssol_mc_sampled samp_full;
+  struct ssol_mc_sampled samp_lean;
+  enum ssol_accounting accounting;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double transform3[12]; /* 3x4 column major matrix */
+  double dir[3];
+  FILE* stream;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  d33_set_identity(transform3);
+  d3_splat(transform3 + 9, 0);
+  transform3[11] = 100; /* +100 offset along Z axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 1) == RES_OK);
+  CHK(ssol_instance_sample(target, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  /* Virtual non receiver instance that cannot redirect the flux */
+  CHK(ssol_object_instantiate(t_object, &sky) == RES_OK);
+  CHK(ssol_instance_set_transform(sky, transform3) == RES_OK);
+  CHK(ssol_instance_sample(sky, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, sky) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  CHK(ssol_scene_get_accounting(NULL, &accounting) == RES_BAD_ARG);
+  CHK(ssol_scene_get_accounting(scene, NULL) == RES_BAD_ARG);
+  CHK(ssol_scene_get_accounting(scene, &accounting) == RES_OK);
+  CHK(accounting == SSOL_ACCOUNTING_FULL);
+  CHK(ssol_scene_set_accounting(NULL, SSOL_ACCOUNTING_RECEIVERS)
+    == RES_BAD_ARG);
+  CHK(ssol_scene_set_accounting(scene, SSOL_ACCOUNTING_COUNT__)
+    == RES_BAD_ARG);
+
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &full) == RES_OK);
+
+  CHK(ssol_scene_set_accounting(scene, SSOL_ACCOUNTING_RECEIVERS) == RES_OK);
+  CHK(ssol_scene_get_accounting(scene, &accounting) == RES_OK);
+  CHK(accounting == SSOL_ACCOUNTING_RECEIVERS);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &lean) == RES_OK);
+
+  /* The receiver fluxes are the same */
+  CHK(ssol_estimator_get_mc_receiver
+    (full, target, SSOL_FRONT, &rcv_full) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (lean, target, SSOL_FRONT, &rcv_lean) == RES_OK);
+  printf("Incoming flux = %g +/- %g; receivers only: %g +/- %g\n",
+    rcv_full.incoming_flux.E, rcv_full.incoming_flux.SE,
+    rcv_lean.incoming_flux.E, rcv_lean.incoming_flux.SE);
+  CHK(rcv_lean.incoming_flux.E > 0);
+  CHK(eq_eps(rcv_lean.incoming_flux.E, rcv_full.incoming_flux.E,
+    rcv_full.incoming_flux.E * 1.e-6));
+  CHK(eq_eps(rcv_lean.incoming_flux.SE, rcv_full.incoming_flux.SE,
+    rcv_full.incoming_flux.SE * 1.e-6));
+  CHK(eq_eps(rcv_lean.absorbed_flux.E, rcv_full.absorbed_flux.E,
+    rcv_full.absorbed_flux.E * 1.e-6));
+
+  /* The energy balance is not estimated */
+  CHK(rcv_lean.incoming_if_no_atm_loss.E == 0);
+  CHK(rcv_lean.incoming_if_no_field_loss.E == 0);
+  CHK(rcv_lean.absorbed_if_no_atm_loss.E == 0);
+  CHK(ssol_estimator_get_mc_global(full, &global_full) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(lean, &global_lean) == RES_OK);
+  CHK(global_full.missing.E > 0);
+  CHK(global_lean.missing.E == 0);
+  CHK(global_lean.shadowed.E == 0);
+  CHK(global_lean.other_absorbed.E == 0);
+  CHK(global_lean.extinguished_by_atmosphere.E == 0);
+  CHK(eq_eps(global_lean.cos_factor.E, global_full.cos_factor.E, 1.e-6));
+  CHK(eq_eps(global_lean.absorbed_by_receivers.E,
+    global_full.absorbed_by_receivers.E,
+    global_full.absorbed_by_receivers.E * 1.e-6));
+  CHK(ssol_estimator_get_mc_sampled(full, heliostat, &samp_full) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled(lean, heliostat, &samp_lean) == RES_OK);
+  CHK(samp_lean.missing.E == 0);
+  CHK(eq_eps(samp_lean.absorbed_by_receivers.E,
+    samp_full.absorbed_by_receivers.E,
+    samp_full.absorbed_by_receivers.E * 1.e-6));
+
+  /* Estimators of different accountings cannot be merged */
+  CHK(ssol_estimator_merge(full, lean) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(lean, full) == RES_BAD_ARG);
+
+  /* The accounting is serialized with the estimator */
+  CHK(ssol_scene_set_accounting(scene, SSOL_ACCOUNTING_FULL) == RES_OK);
+  CHK(stream = tmpfile());
+  CHK(ssol_estimator_write(lean, stream) == RES_OK);
+  rewind(stream);
+  CHK(ssol_estimator_read(scene, stream, &lean2) == RES_OK);
+  CHK(fclose(stream) == 0);
+  CHK(ssol_estimator_merge(full, lean2) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(lean2, lean) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (lean2, target, SSOL_FRONT, &rcv_full) == RES_OK);
+  CHK(eq_eps(rcv_full.incoming_flux.E, rcv_lean.incoming_flux.E,
+    rcv_lean.incoming_flux.E * 1.e-6));
+
+  CHK(ssol_estimator_ref_put(full) == RES_OK);
+  CHK(ssol_estimator_ref_put(lean) == RES_OK);
+  CHK(ssol_estimator_ref_put(lean2) == RES_OK);
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_instance_ref_put(sky) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
@@ -0,0 +1,277 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 10000
+#define DNI 1000
+#define NPILOTS 1000
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* heliostat2;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator;
+  struct ssol_estimator* adaptive;
+  struct ssol_mc_global global;
+  struct ssol_mc_global global_adaptive;
+  struct ssol_mc_receiver rcv;
+  struct ssol_mc_receiver rcv_adaptive;
+  struct ssol_mc_sampled samp;
+  struct ssol_mc_sampled samp_adaptive;
+  struct ssol_mc_sampled samp2_adaptive;
+  struct ssol_mc_receiver rcv2;
+  struct ssol_mc_receiver rcv2_adaptive;
+  struct ssol_adaptive_objective objective;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double transform3[12]; /* 3x4 column major matrix */
+  double dir[3];
+  size_t npilots;
+  size_t count;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  d33_set_identity(transform3);
+  d3_splat(transform3 + 9, 0);
+  transform3[10] = 10; /* +10 offset along Y axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  /* Heliostat whose reflected flux misses the secondary */
+  CHK(ssol_object_instantiate(m_object, &heliostat2) == RES_OK);
+  CHK(ssol_instance_set_transform(heliostat2, transform3) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat2) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_instance_sample(secondary, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_instance_sample(target, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  CHK(ssol_scene_get_adaptive_sampling(NULL, &npilots) == RES_BAD_ARG);
+  CHK(ssol_scene_get_adaptive_sampling(scene, NULL) == RES_BAD_ARG);
+  CHK(ssol_scene_get_adaptive_sampling(scene, &npilots) == RES_OK);
+  CHK(npilots == 0);
+  CHK(ssol_scene_set_adaptive_sampling(NULL, NPILOTS) == RES_BAD_ARG);
+
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+
+  CHK(ssol_scene_set_adaptive_sampling(scene, NPILOTS) == RES_OK);
+  CHK(ssol_scene_get_adaptive_sampling(scene, &npilots) == RES_OK);
+  CHK(npilots == NPILOTS);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &adaptive) == RES_OK);
+
+  /* The pilot realisations are not registered */
+  CHK(ssol_estimator_get_realisation_count(adaptive, &count) == RES_OK);
+  CHK(count == N);
+
+  /* The adaptive sampling does not bias the estimates */
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &rcv) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (adaptive, target, SSOL_FRONT, &rcv_adaptive) == RES_OK);
+  printf("Incoming flux = %g +/- %g; adaptive: %g +/- %g\n",
+    rcv.incoming_flux.E, rcv.incoming_flux.SE,
+    rcv_adaptive.incoming_flux.E, rcv_adaptive.incoming_flux.SE);
+  CHK(rcv.incoming_flux.E > 0);
+  CHK(eq_eps(rcv.incoming_flux.E, rcv_adaptive.incoming_flux.E,
+    3 * (rcv.incoming_flux.SE + rcv_adaptive.incoming_flux.SE)));
+
+  /* The samples are reallocated onto the heliostat that reaches the target,
+   * reducing the variance of the receiver flux */
+  CHK(rcv_adaptive.incoming_flux.SE < rcv.incoming_flux.SE * 0.5);
+  CHK(ssol_estimator_get_mc_sampled(estimator, heliostat, &samp) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled
+    (adaptive, heliostat, &samp_adaptive) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled
+    (adaptive, heliostat2, &samp2_adaptive) == RES_OK);
+  CHK(samp_adaptive.nb_samples > samp.nb_samples);
+  CHK(samp2_adaptive.nb_samples > 0);
+  CHK(eq_eps(samp.cos_factor.E, samp_adaptive.cos_factor.E,
+    3 * (samp.cos_factor.SE + samp_adaptive.cos_factor.SE) + 1.e-6));
+
+  /* The energy balance remains unbiased */
+  CHK(ssol_estimator_get_mc_global(estimator, &global) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(adaptive, &global_adaptive) == RES_OK);
+  CHK(eq_eps(global.missing.E, global_adaptive.missing.E,
+    3 * (global.missing.SE + global_adaptive.missing.SE)));
+
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+  CHK(ssol_estimator_ref_put(adaptive) == RES_OK);
+
+  CHK(ssol_scene_get_adaptive_objective(NULL, &objective) == RES_BAD_ARG);
+  CHK(ssol_scene_get_adaptive_objective(scene, NULL) == RES_BAD_ARG);
+  CHK(ssol_scene_get_adaptive_objective(scene, &objective) == RES_OK);
+  CHK(objective.quantity == SSOL_ADAPTIVE_ABSORBED_BY_RECEIVERS);
+  CHK(objective.receiver == NULL);
+
+  objective.quantity = SSOL_ADAPTIVE_RECEIVER_INCOMING;
+  CHK(ssol_scene_set_adaptive_objective(NULL, &objective) == RES_BAD_ARG);
+  CHK(ssol_scene_set_adaptive_objective(scene, NULL) == RES_BAD_ARG);
+  CHK(ssol_scene_set_adaptive_objective(scene, &objective) == RES_BAD_ARG);
+  objective.receiver = heliostat2;
+  objective.side = SSOL_FRONT | SSOL_BACK;
+  CHK(ssol_scene_set_adaptive_objective(scene, &objective) == RES_BAD_ARG);
+  objective.quantity = SSOL_ADAPTIVE_QUANTITY_COUNT__;
+  objective.side = SSOL_FRONT;
+  CHK(ssol_scene_set_adaptive_objective(scene, &objective) == RES_BAD_ARG);
+
+  /* The second heliostat receives the sun flux that it entirely reflects. It
+   * thus does not contribute to the overall absorbed flux and its samples are
+   * limited to the area based share of the allocation */
+  CHK(ssol_instance_set_receiver(heliostat2, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled(estimator, heliostat2, &samp) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, heliostat2, SSOL_FRONT, &rcv2) == RES_OK);
+
+  /* Whereas it drives the allocation of the samples when its incoming flux is
+   * the objective of the adaptive sampling */
+  objective.quantity = SSOL_ADAPTIVE_RECEIVER_INCOMING;
+  CHK(ssol_scene_set_adaptive_objective(scene, &objective) == RES_OK);
+  objective = SSOL_ADAPTIVE_OBJECTIVE_DEFAULT;
+  CHK(ssol_scene_get_adaptive_objective(scene, &objective) == RES_OK);
+  CHK(objective.quantity == SSOL_ADAPTIVE_RECEIVER_INCOMING);
+  CHK(objective.receiver == heliostat2);
+  CHK(objective.side == SSOL_FRONT);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &adaptive) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled
+    (adaptive, heliostat2, &samp2_adaptive) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (adaptive, heliostat2, SSOL_FRONT, &rcv2_adaptive) == RES_OK);
+  printf("Heliostat2 samples = %lu; adaptive: %lu\n",
+    (unsigned long)samp.nb_samples, (unsigned long)samp2_adaptive.nb_samples);
+  CHK(samp2_adaptive.nb_samples > 5 * samp.nb_samples);
+  CHK(eq_eps(rcv2.incoming_flux.E, rcv2_adaptive.incoming_flux.E,
+    3 * (rcv2.incoming_flux.SE + rcv2_adaptive.incoming_flux.SE)));
+  CHK(rcv2_adaptive.incoming_flux.SE < rcv2.incoming_flux.SE);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+  CHK(ssol_estimator_ref_put(adaptive) == RES_OK);
+
+  /* The receiver of the objective must be a receiver side of the scene */
+  objective.side = SSOL_BACK;
+  CHK(ssol_scene_set_adaptive_objective(scene, &objective) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_BAD_ARG);
+  objective.receiver = secondary;
+  objective.side = SSOL_FRONT;
+  CHK(ssol_scene_set_adaptive_objective(scene, &objective) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_BAD_ARG);
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(heliostat2) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
@@ -0,0 +1,358 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#include <string.h>
+
+#define N 4000
+#define DNI 1000
+#define FILENAME "test_ssol_checkpoint.ckpt"
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+/* Tally counting the radiative paths */
+static res_T
+count_path(void* data, const struct ssol_tally_path* path, void* context)
+{
+  CHK(data && path && !context);
+  *(size_t*)data += 1;
+  return RES_OK;
+}
+
+/* Tally registering, per realisation, the tally data of the thread that ran
+ * it. The threads have their own copy of the tally data */
+static const void* realisation_threads[N];
+
+static res_T
+record_thread(void* data, const struct ssol_tally_path* path, void* context)
+{
+  CHK(data && path && !context);
+  CHK(path->realisation < N);
+  realisation_threads[path->realisation] = data;
+  return RES_OK;
+}
+
+/* Return the number of threads that ran the realisations [begin, end[ */
+static size_t
+count_threads(const size_t begin, const size_t end)
+{
+  size_t i, j, n = 0;
+  CHK(begin < end && end <= N);
+  FOR_EACH(i, begin, end) {
+    if(!realisation_threads[i]) continue;
+    for(j = begin; j < i && realisation_threads[j] != realisation_threads[i];
+      ++j);
+    n += j == i;
+  }
+  return n;
+}
+
+static res_T
+merge_count(void* dst, const void* src, void* context)
+{
+  CHK(dst && src && !context);
+  *(size_t*)dst += *(const size_t*)src;
+  return RES_OK;
+}
+
+static res_T
+write_count(const void* data, FILE* stream, void* context)
+{
+  CHK(data && stream && !context);
+  return fwrite(data, sizeof(size_t), 1, stream) == 1 ? RES_OK : RES_IO_ERR;
+}
+
+static res_T
+read_count(void* data, FILE* stream, void* context)
+{
+  CHK(data && stream && !context);
+  return fread(data, sizeof(size_t), 1, stream) == 1 ? RES_OK : RES_IO_ERR;
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator1;
+  struct ssol_estimator* estimator2;
+  struct ssol_checkpoint checkpoint = SSOL_CHECKPOINT_NULL;
+  struct ssol_tally tally = SSOL_TALLY_NULL;
+  struct ssol_mc_global mc_global1;
+  struct ssol_mc_global mc_global2;
+  struct ssol_mc_receiver mc_rcv1;
+  struct ssol_mc_receiver mc_rcv2;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double dir[3];
+  const void* ptr;
+  size_t count;
+  size_t nthreads;
+  size_t i;
+  FILE* fp;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_instance_set_receiver(heliostat, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  #define SOLVE ssol_solve_checkpointed
+  CHK(SOLVE(scene, rng, N, 0, NULL, NULL, &estimator1) == RES_BAD_ARG);
+  CHK(SOLVE(scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_BAD_ARG);
+  checkpoint.filename = FILENAME;
+  CHK(SOLVE(scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_BAD_ARG);
+  checkpoint.realisations_period = N/4;
+  CHK(SOLVE(NULL, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_BAD_ARG);
+  CHK(SOLVE(scene, NULL, N, 0, NULL, &checkpoint, &estimator1) == RES_BAD_ARG);
+  CHK(SOLVE(scene, rng, 0, 0, NULL, &checkpoint, &estimator1) == RES_BAD_ARG);
+  CHK(SOLVE(scene, rng, N, 0, NULL, &checkpoint, NULL) == RES_BAD_ARG);
+  CHK(SOLVE(scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_OK);
+  #undef SOLVE
+
+  CHK(ssol_estimator_get_realisation_count(estimator1, &count) == RES_OK);
+  CHK(count == N);
+
+  /* The checkpoint file stores the state of the simulation before its last
+   * batch. Restart the simulation from it: the resulting estimations must be
+   * the same as the ones of the whole simulation */
+  #define RESTART ssol_solve_restart
+  CHK(RESTART(NULL, 0, NULL, &checkpoint, &estimator2) == RES_BAD_ARG);
+  CHK(RESTART(scene, 0, NULL, NULL, &estimator2) == RES_BAD_ARG);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, NULL) == RES_BAD_ARG);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, &estimator2) == RES_OK);
+
+  CHK(ssol_estimator_get_realisation_count(estimator2, &count) == RES_OK);
+  CHK(count == N);
+  CHK(ssol_estimator_get_mc_global(estimator1, &mc_global1) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(estimator2, &mc_global2) == RES_OK);
+  print_global(&mc_global1);
+  CHK(eq_eps(mc_global1.missing.E, mc_global2.missing.E, 1.e-6));
+  CHK(eq_eps(mc_global1.shadowed.E, mc_global2.shadowed.E, 1.e-6));
+  CHK(eq_eps(mc_global1.cos_factor.E, mc_global2.cos_factor.E, 1.e-6));
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator1, target, SSOL_FRONT, &mc_rcv1) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator2, target, SSOL_FRONT, &mc_rcv2) == RES_OK);
+  CHK(eq_eps(mc_rcv1.incoming_flux.E, mc_rcv2.incoming_flux.E, 1.e-6));
+  CHK(eq_eps(mc_rcv1.incoming_flux.SE, mc_rcv2.incoming_flux.SE, 1.e-6));
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+
+  /* Time based checkpoint */
+  checkpoint.realisations_period = 0;
+  checkpoint.time_period = 1.e-9;
+  CHK(ssol_solve_checkpointed
+    (scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_OK);
+  CHK(ssol_estimator_get_realisation_count(estimator1, &count) == RES_OK);
+  CHK(count == N);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, &estimator2) == RES_OK);
+  CHK(ssol_estimator_get_realisation_count(estimator2, &count) == RES_OK);
+  CHK(count == N);
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+
+  /* Realisations and time based checkpoint: the snapshot is written on the
+   * period that elapses first */
+  checkpoint.realisations_period = N/4;
+  checkpoint.time_period = 3600;
+  CHK(ssol_solve_checkpointed
+    (scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_OK);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, &estimator2) == RES_OK);
+  CHK(ssol_estimator_get_realisation_count(estimator2, &count) == RES_OK);
+  CHK(count == N);
+  CHK(ssol_estimator_get_mc_global(estimator1, &mc_global1) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(estimator2, &mc_global2) == RES_OK);
+  CHK(eq_eps(mc_global1.missing.E, mc_global2.missing.E, 1.e-6));
+  CHK(eq_eps(mc_global1.cos_factor.E, mc_global2.cos_factor.E, 1.e-6));
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+
+  /* The simulation is set up once: a stratified simulation can be run in
+   * batches that have less realisations than strata */
+  CHK(ssol_scene_set_stratification(scene, SSOL_STRATIFICATION_AREA) == RES_OK);
+  checkpoint.realisations_period = 1;
+  checkpoint.time_period = -1;
+  CHK(ssol_solve_checkpointed
+    (scene, rng, 16, 0, NULL, &checkpoint, &estimator1) == RES_OK);
+  CHK(ssol_estimator_get_realisation_count(estimator1, &count) == RES_OK);
+  CHK(count == 16);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, &estimator2) == RES_OK);
+  CHK(ssol_estimator_get_realisation_count(estimator2, &count) == RES_OK);
+  CHK(count == 16);
+  CHK(ssol_estimator_get_mc_global(estimator1, &mc_global1) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(estimator2, &mc_global2) == RES_OK);
+  CHK(eq_eps(mc_global1.cos_factor.E, mc_global2.cos_factor.E, 1.e-6));
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+  CHK(ssol_scene_set_stratification(scene, SSOL_STRATIFICATION_NONE) == RES_OK);
+
+  /* The tally data are saved in the snapshots */
+  tally.sizeof_data = sizeof(size_t);
+  tally.path_end = count_path;
+  tally.merge = merge_count;
+  CHK(ssol_scene_add_tally(scene, &tally, NULL) == RES_OK);
+  checkpoint.realisations_period = N/4;
+  CHK(ssol_solve_checkpointed
+    (scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_BAD_ARG);
+  CHK(ssol_scene_clear_tallies(scene) == RES_OK);
+  tally.write = write_count;
+  tally.read = read_count;
+  CHK(ssol_scene_add_tally(scene, &tally, NULL) == RES_OK);
+  CHK(ssol_solve_checkpointed
+    (scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_OK);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, &estimator2) == RES_OK);
+  CHK(ssol_estimator_get_tally(estimator1, 0, &ptr) == RES_OK);
+  CHK(*(const size_t*)ptr == N);
+  CHK(ssol_estimator_get_tally(estimator2, 0, &ptr) == RES_OK);
+  CHK(*(const size_t*)ptr == N);
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+  CHK(ssol_scene_clear_tallies(scene) == RES_OK);
+
+  /* The realisations of a batch are spread over the threads. Since the
+   * threads dynamically share the work, only check that a batch is not run by
+   * a single thread */
+  tally.path_end = record_thread;
+  CHK(ssol_scene_add_tally(scene, &tally, NULL) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator1) == RES_OK);
+  nthreads = count_threads(0, N);
+  CHK(nthreads > 0);
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  memset(realisation_threads, 0, sizeof(realisation_threads));
+  checkpoint.realisations_period = N/4;
+  checkpoint.time_period = -1;
+  CHK(ssol_solve_checkpointed
+    (scene, rng, N, 0, NULL, &checkpoint, &estimator1) == RES_OK);
+  FOR_EACH(i, 0, 4) {
+    CHK(nthreads == 1 || count_threads(i*N/4, (i+1)*N/4) > 1);
+  }
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  CHK(ssol_scene_clear_tallies(scene) == RES_OK);
+
+  /* Invalid checkpoint file */
+  CHK(fp = fopen(FILENAME, "wb"));
+  CHK(fwrite("SSOL\001\000\000\000", 1, 8, fp) == 8);
+  CHK(fclose(fp) == 0);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, &estimator2) != RES_OK);
+  CHK(remove(FILENAME) == 0);
+  CHK(RESTART(scene, 0, NULL, &checkpoint, &estimator2) == RES_IO_ERR);
+  #undef RESTART
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
@@ -29,6 +29,24 @@ get_wlen(const size_t i, double* wlen, double* data, void* ctx)
   (void)ctx;
 }
 
+/* Wavelengths tightly sampled at first and then increasingly spaced out. The
+ * intensity is linear so that its interpolation is exact */
+static double
+irregular_wlen(const size_t i)
+{
+  return i < 64 ? 1 + (double)i*1.e-3 : 1.063 + (double)((i-63)*(i-63));
+}
+
+static void
+get_irregular_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  CHK(wlen != NULL);
+  CHK(data != NULL);
+  *wlen = irregular_wlen(i);
+  *data = 2 * *wlen;
+  (void)ctx;
+}
+
 int
 main(int argc, char** argv)
 {
@@ -75,6 +93,21 @@ main(int argc, char** argv)
   CHK(ssol_data_get_value(&data, 10) == 11);
   CHK(ssol_data_get_value(&data, 10.1) == 11);
 
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_irregular_wlen, 256, NULL) == RES_OK);
+  CHK(ssol_data_set_spectrum(&data, spectrum) == &data);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  FOR_EACH(i, 0, 255) {
+    const double wl0 = irregular_wlen(i);
+    const double wl1 = irregular_wlen(i+1);
+    const double wl = 0.5 * (wl0 + wl1);
+    CHK(eq_eps(ssol_data_get_value(&data, wl0), 2 * wl0, 1.e-9 * wl0) == 1);
+    CHK(eq_eps(ssol_data_get_value(&data, wl), 2 * wl, 1.e-9 * wl) == 1);
+    CHK(eq_eps(ssol_data_get_value(&data, wl1 - 1.e-4 * (wl1 - wl0)),
+      2 * (wl1 - 1.e-4 * (wl1 - wl0)), 1.e-9 * wl1) == 1);
+  }
+  CHK(ssol_data_get_value(&data, 1.e6) == 2 * irregular_wlen(255));
+
   CHK(ssol_device_ref_put(dev) == RES_OK);
   ssol_data_clear(&data);
 
@@ -137,6 +137,7 @@ setup_cornell_box(struct ssol_device* dev, struct ssol_scene* scn)
 
   shader.normal = get_shader_normal;
   shader.reflectivity = get_shader_reflectivity;
+  shader.normal_batch = get_shader_normal_batch;
   CHK(ssol_material_create_matte(dev, &mtl) == RES_OK);
   CHK(ssol_matte_setup(mtl, &shader) == RES_OK);
 
@@ -0,0 +1,488 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N1 1000
+#define N2 3000
+#define DNI 1000
+#define NWORKERS 4
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+static res_T
+stream_send(const void* data, const size_t size, void* ctx)
+{
+  return fwrite(data, 1, size, ctx) == size ? RES_OK : RES_IO_ERR;
+}
+
+static res_T
+stream_receive(void* data, const size_t size, void* ctx)
+{
+  return fread(data, 1, size, ctx) == size ? RES_OK : RES_IO_ERR;
+}
+
+static double
+merged_E(const double E1, const double E2)
+{
+  return (E1 * N1 + E2 * N2) / (double)(N1 + N2);
+}
+
+static double
+merged_SE(const double E1, const double SE1, const double E2, const double SE2)
+{
+  /* Retrieve the sum of the squared weights of each run from its E and SE */
+  const double N = (double)(N1 + N2);
+  const double sum2_1 = (SE1*SE1 * N1 + E1*E1) * N1;
+  const double sum2_2 = (SE2*SE2 * N2 + E2*E2) * N2;
+  const double E = merged_E(E1, E2);
+  return sqrt(MMAX((sum2_1 + sum2_2) / N - E*E, 0) / N);
+}
+
+static int
+eq_rel(const double a, const double b)
+{
+  return eq_eps(a, b, MMAX(fabs(b), 1) * 1.e-6);
+}
+
+static void
+get_primitive_E
+  (const struct ssol_estimator* estimator,
+   struct ssol_instance* target,
+   struct ssol_shape* shape,
+   double E[2])
+{
+  struct ssol_mc_receiver mc_rcv;
+  struct ssol_mc_shape mc_shape;
+  struct ssol_mc_primitive mc_prim;
+  unsigned i;
+
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  CHK(ssol_mc_receiver_get_mc_shape(&mc_rcv, shape, &mc_shape) == RES_OK);
+  FOR_EACH(i, 0, 2) {
+    CHK(ssol_mc_shape_get_mc_primitive(&mc_shape, i, &mc_prim) == RES_OK);
+    E[i] = mc_prim.incoming_flux.E;
+  }
+}
+
+/* Check that the bulk and zero-copy readouts of the per primitive estimations
+ * match the ones returned per primitive */
+static void
+check_mc_primitives
+  (const struct ssol_estimator* estimator,
+   struct ssol_instance* target,
+   struct ssol_shape* shape)
+{
+  struct ssol_mc_receiver mc_rcv;
+  struct ssol_mc_shape mc_shape;
+  struct ssol_mc_primitive mc_prim;
+  struct ssol_mc_primitives prims = SSOL_MC_PRIMITIVES_NULL;
+  struct ssol_mc_primitives rcv_prims = SSOL_MC_PRIMITIVES_NULL;
+  struct ssol_mc_primitives_view view = SSOL_MC_PRIMITIVES_VIEW_NULL;
+  struct ssol_mc_primitives_view view2 = SSOL_MC_PRIMITIVES_VIEW_NULL;
+  double E[2], SE[2], rcv_E[2], abs_E[2];
+  unsigned i;
+
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  CHK(ssol_mc_receiver_get_mc_shape(&mc_rcv, shape, &mc_shape) == RES_OK);
+
+  prims.E[SSOL_MC_INCOMING_FLUX] = E;
+  prims.SE[SSOL_MC_INCOMING_FLUX] = SE;
+  prims.E[SSOL_MC_ABSORBED_FLUX] = abs_E;
+  CHK(ssol_mc_shape_get_mc_primitives(NULL, &prims) == RES_BAD_ARG);
+  CHK(ssol_mc_shape_get_mc_primitives(&mc_shape, NULL) == RES_BAD_ARG);
+  CHK(ssol_mc_shape_get_mc_primitives(&mc_shape, &prims) == RES_OK);
+
+  rcv_prims.E[SSOL_MC_INCOMING_FLUX] = rcv_E;
+  CHK(ssol_mc_receiver_get_mc_primitives(NULL, &rcv_prims) == RES_BAD_ARG);
+  CHK(ssol_mc_receiver_get_mc_primitives(&mc_rcv, NULL) == RES_BAD_ARG);
+  CHK(ssol_mc_receiver_get_mc_primitives(&mc_rcv, &rcv_prims) == RES_OK);
+
+  CHK(ssol_mc_shape_get_mc_primitives_view(NULL, &view) == RES_BAD_ARG);
+  CHK(ssol_mc_shape_get_mc_primitives_view(&mc_shape, NULL) == RES_BAD_ARG);
+  CHK(ssol_mc_shape_get_mc_primitives_view(&mc_shape, &view) == RES_OK);
+  CHK(ssol_mc_shape_get_mc_primitives_view(&mc_shape, &view2) == RES_OK);
+  CHK(view.count == 2);
+  CHK(view.E[SSOL_MC_INCOMING_FLUX] == view2.E[SSOL_MC_INCOMING_FLUX]);
+
+  FOR_EACH(i, 0, 2) {
+    CHK(ssol_mc_shape_get_mc_primitive(&mc_shape, i, &mc_prim) == RES_OK);
+    CHK(eq_rel(E[i], mc_prim.incoming_flux.E));
+    CHK(eq_rel(SE[i], mc_prim.incoming_flux.SE));
+    CHK(eq_rel(abs_E[i], mc_prim.absorbed_flux.E));
+    CHK(eq_rel(rcv_E[i], mc_prim.incoming_flux.E));
+    CHK(eq_rel(view.E[SSOL_MC_INCOMING_FLUX][i], mc_prim.incoming_flux.E));
+    CHK(eq_rel(view.SE[SSOL_MC_INCOMING_FLUX][i], mc_prim.incoming_flux.SE));
+    CHK(eq_rel(view.E[SSOL_MC_ABSORBED_FLUX][i], mc_prim.absorbed_flux.E));
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_scene* scene2;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_instance* target2;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator1;
+  struct ssol_estimator* estimator2;
+  struct ssol_estimator* estimator3;
+  struct ssol_estimator* estimator4;
+  struct ssol_estimator* workers[NWORKERS];
+  struct ssol_channel channel = SSOL_CHANNEL_NULL;
+  struct ssol_mc_global mc_global1;
+  struct ssol_mc_global mc_global2;
+  struct ssol_mc_global mc_global;
+  struct ssol_mc_receiver mc_rcv1;
+  struct ssol_mc_receiver mc_rcv2;
+  struct ssol_mc_receiver mc_rcv;
+  struct ssol_mc_shape mc_shape;
+  struct ssol_mc_primitives_view view;
+  struct ssol_mc_sampled sampled1;
+  struct ssol_mc_sampled sampled2;
+  struct ssol_mc_sampled sampled;
+  double prim_E1[2], prim_E2[2], prim_E[2];
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double dir[3];
+  const struct ssp_rng* rng_state1;
+  const struct ssp_rng* rng_state4;
+  enum ssp_rng_type rng_type1, rng_type4;
+  FILE* stream;
+  size_t count, npaths1, npaths2;
+  size_t iworker;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  /* Primary and secondary mirrors are sampled as well as the target; the
+   * estimations are thus noisy and differ from one run to another */
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_instance_set_receiver(heliostat, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  /* Same geometry, but another target instance */
+  CHK(ssol_scene_create(dev, &scene2) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target2) == RES_OK);
+  CHK(ssol_instance_set_transform(target2, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target2, SSOL_FRONT, 1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene2, heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene2, secondary) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene2, target2) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene2, sun) == RES_OK);
+
+  CHK(ssol_solve
+    (scene, rng, N1, 0, &SSOL_PATH_TRACKER_DEFAULT, &estimator1) == RES_OK);
+  CHK(ssol_solve
+    (scene, rng, N2, 0, &SSOL_PATH_TRACKER_DEFAULT, &estimator2) == RES_OK);
+  CHK(ssol_solve(scene2, rng, N1, 0, NULL, &estimator3) == RES_OK);
+
+  CHK(ssol_estimator_get_tracked_paths_count(estimator1, &npaths1) == RES_OK);
+  CHK(ssol_estimator_get_tracked_paths_count(estimator2, &npaths2) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(estimator1, &mc_global1) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(estimator2, &mc_global2) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator1, target, SSOL_FRONT, &mc_rcv1) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator2, target, SSOL_FRONT, &mc_rcv2) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled(estimator1, heliostat, &sampled1) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled(estimator2, heliostat, &sampled2) == RES_OK);
+  get_primitive_E(estimator1, target, square, prim_E1);
+  get_primitive_E(estimator2, target, square, prim_E2);
+
+  /* The per primitive views are built on demand */
+  CHK(ssol_mc_receiver_get_mc_shape(&mc_rcv1, square, &mc_shape) == RES_OK);
+  CHK(ssol_mc_shape_get_mc_primitives_view(&mc_shape, &view) == RES_BAD_OP);
+  CHK(ssol_estimator_build_mc_primitives_views(NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_build_mc_primitives_views(estimator1) == RES_OK);
+  check_mc_primitives(estimator1, target, square);
+
+  CHK(ssol_estimator_merge(NULL, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(estimator1, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(NULL, estimator2) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(estimator1, estimator1) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(estimator1, estimator3) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(estimator3, estimator1) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(estimator1, estimator2) == RES_OK);
+
+  CHK(ssol_estimator_get_realisation_count(estimator1, &count) == RES_OK);
+  CHK(count == N1 + N2);
+  CHK(ssol_estimator_get_failed_count(estimator1, &count) == RES_OK);
+  CHK(count == 0);
+  CHK(ssol_estimator_get_tracked_paths_count(estimator1, &count) == RES_OK);
+  CHK(count == npaths1 + npaths2);
+
+  /* The source estimator is left unchanged */
+  CHK(ssol_estimator_get_realisation_count(estimator2, &count) == RES_OK);
+  CHK(count == N2);
+
+  CHK(ssol_estimator_get_mc_global(estimator1, &mc_global) == RES_OK);
+  print_global(&mc_global);
+  #define CHK_MERGED(Dst, Src1, Src2) {                                        \
+    CHK(eq_rel((Dst).E, merged_E((Src1).E, (Src2).E)));                        \
+    CHK(eq_rel((Dst).SE,                                                       \
+      merged_SE((Src1).E, (Src1).SE, (Src2).E, (Src2).SE)));                   \
+  } (void)0
+  CHK_MERGED(mc_global.cos_factor, mc_global1.cos_factor, mc_global2.cos_factor);
+  CHK_MERGED(mc_global.shadowed, mc_global1.shadowed, mc_global2.shadowed);
+  CHK_MERGED(mc_global.missing, mc_global1.missing, mc_global2.missing);
+  CHK_MERGED(mc_global.absorbed_by_receivers,
+    mc_global1.absorbed_by_receivers, mc_global2.absorbed_by_receivers);
+
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator1, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  print_rcv(&mc_rcv);
+  CHK_MERGED(mc_rcv.incoming_flux, mc_rcv1.incoming_flux, mc_rcv2.incoming_flux);
+  CHK_MERGED(mc_rcv.absorbed_flux, mc_rcv1.absorbed_flux, mc_rcv2.absorbed_flux);
+
+  CHK(ssol_estimator_get_mc_sampled(estimator1, heliostat, &sampled) == RES_OK);
+  CHK(sampled.nb_samples == sampled1.nb_samples + sampled2.nb_samples);
+  CHK_MERGED(sampled.cos_factor, sampled1.cos_factor, sampled2.cos_factor);
+  CHK_MERGED(sampled.shadowed, sampled1.shadowed, sampled2.shadowed);
+  #undef CHK_MERGED
+
+  get_primitive_E(estimator1, target, square, prim_E);
+  CHK(eq_rel(prim_E[0], merged_E(prim_E1[0], prim_E2[0])));
+  CHK(eq_rel(prim_E[1], merged_E(prim_E1[1], prim_E2[1])));
+  check_mc_primitives(estimator1, target, square); /* Updated views */
+
+  /* Serialize the merged estimator and read it back */
+  CHK(stream = tmpfile());
+  CHK(ssol_estimator_write(NULL, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_write(estimator1, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_write(NULL, stream) == RES_BAD_ARG);
+  CHK(ssol_estimator_write(estimator1, stream) == RES_OK);
+  rewind(stream);
+  CHK(ssol_estimator_read(NULL, stream, &estimator4) == RES_BAD_ARG);
+  CHK(ssol_estimator_read(scene, NULL, &estimator4) == RES_BAD_ARG);
+  CHK(ssol_estimator_read(scene, stream, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_read(scene2, stream, &estimator4) == RES_BAD_ARG);
+  rewind(stream);
+  CHK(ssol_estimator_read(scene, stream, &estimator4) == RES_OK);
+  CHK(fclose(stream) == 0);
+
+  CHK(ssol_estimator_get_realisation_count(estimator4, &count) == RES_OK);
+  CHK(count == N1 + N2);
+  CHK(ssol_estimator_get_failed_count(estimator4, &count) == RES_OK);
+  CHK(count == 0);
+  CHK(ssol_estimator_get_tracked_paths_count(estimator4, &count) == RES_OK);
+  CHK(count == 0);
+
+  CHK(ssol_estimator_get_mc_global(estimator4, &mc_global2) == RES_OK);
+  CHK(mc_global2.cos_factor.E == mc_global.cos_factor.E);
+  CHK(mc_global2.cos_factor.SE == mc_global.cos_factor.SE);
+  CHK(mc_global2.shadowed.E == mc_global.shadowed.E);
+  CHK(mc_global2.missing.E == mc_global.missing.E);
+  CHK(mc_global2.absorbed_by_receivers.E == mc_global.absorbed_by_receivers.E);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator4, target, SSOL_FRONT, &mc_rcv2) == RES_OK);
+  CHK(mc_rcv2.incoming_flux.E == mc_rcv.incoming_flux.E);
+  CHK(mc_rcv2.incoming_flux.SE == mc_rcv.incoming_flux.SE);
+  CHK(mc_rcv2.absorbed_flux.E == mc_rcv.absorbed_flux.E);
+  CHK(ssol_estimator_get_mc_sampled(estimator4, heliostat, &sampled2) == RES_OK);
+  CHK(sampled2.nb_samples == sampled.nb_samples);
+  CHK(sampled2.cos_factor.E == sampled.cos_factor.E);
+  CHK(sampled2.shadowed.E == sampled.shadowed.E);
+  get_primitive_E(estimator4, target, square, prim_E2);
+  CHK(prim_E2[0] == prim_E[0]);
+  CHK(prim_E2[1] == prim_E[1]);
+
+  CHK(ssol_estimator_get_rng_state(estimator1, &rng_state1) == RES_OK);
+  CHK(ssol_estimator_get_rng_state(estimator4, &rng_state4) == RES_OK);
+  CHK(ssp_rng_get_type(rng_state1, &rng_type1) == RES_OK);
+  CHK(ssp_rng_get_type(rng_state4, &rng_type4) == RES_OK);
+  CHK(rng_type1 == rng_type4);
+  CHK(ssol_estimator_ref_put(estimator4) == RES_OK);
+
+  /* Invalid data */
+  CHK(stream = tmpfile());
+  CHK(fwrite("SSOX\001\000\000\000", 1, 8, stream) == 8);
+  rewind(stream);
+  CHK(ssol_estimator_read(scene, stream, &estimator4) == RES_BAD_ARG);
+  CHK(fclose(stream) == 0);
+
+  /* Distribute a simulation over several workers. The estimators of the
+   * workers are transferred through a stream that acts as a pipe */
+  CHK(ssol_solve_partition(scene, rng, N1, 0, NULL, 0, 0, &workers[0])
+    == RES_BAD_ARG);
+  CHK(ssol_solve_partition(scene, rng, N1, 0, NULL, NWORKERS, NWORKERS,
+    &workers[0]) == RES_BAD_ARG);
+  CHK(ssol_solve_partition(scene, rng, NWORKERS-1, 0, NULL, NWORKERS, 0,
+    &workers[0]) == RES_BAD_ARG);
+  CHK(ssol_solve_partition(NULL, rng, N1, 0, NULL, NWORKERS, 0, &workers[0])
+    == RES_BAD_ARG);
+  CHK(ssol_solve_partition(scene, rng, N1, 0, NULL, NWORKERS, 0, NULL)
+    == RES_BAD_ARG);
+
+  CHK(stream = tmpfile());
+  channel.send = stream_send;
+  channel.receive = stream_receive;
+  channel.context = stream;
+  FOR_EACH(iworker, 0, NWORKERS) {
+    struct ssol_estimator* worker;
+    CHK(ssol_solve_partition(scene, rng, N1+N2+1, 0, NULL, NWORKERS, iworker,
+      &worker) == RES_OK);
+    CHK(ssol_estimator_get_realisation_count(worker, &count) == RES_OK);
+    CHK(count == (N1+N2+1)/NWORKERS + (iworker < (N1+N2+1)%NWORKERS));
+    CHK(ssol_estimator_send(NULL, &channel) == RES_BAD_ARG);
+    CHK(ssol_estimator_send(worker, NULL) == RES_BAD_ARG);
+    CHK(ssol_estimator_send(worker, &channel) == RES_OK);
+    CHK(ssol_estimator_ref_put(worker) == RES_OK);
+  }
+  rewind(stream);
+  CHK(ssol_estimator_receive(NULL, &channel, &workers[0]) == RES_BAD_ARG);
+  CHK(ssol_estimator_receive(scene, NULL, &workers[0]) == RES_BAD_ARG);
+  CHK(ssol_estimator_receive(scene, &channel, NULL) == RES_BAD_ARG);
+  FOR_EACH(iworker, 0, NWORKERS) {
+    CHK(ssol_estimator_receive(scene, &channel, &workers[iworker]) == RES_OK);
+  }
+  CHK(fclose(stream) == 0);
+
+  /* Workers use independent random sequences */
+  CHK(ssol_estimator_get_mc_global(workers[0], &mc_global1) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(workers[1], &mc_global2) == RES_OK);
+  CHK(mc_global1.missing.E != mc_global2.missing.E);
+
+  /* Reduce the worker estimators */
+  FOR_EACH(iworker, 1, NWORKERS) {
+    CHK(ssol_estimator_merge(workers[0], workers[iworker]) == RES_OK);
+    CHK(ssol_estimator_ref_put(workers[iworker]) == RES_OK);
+  }
+  CHK(ssol_estimator_get_realisation_count(workers[0], &count) == RES_OK);
+  CHK(count == N1 + N2 + 1);
+
+  /* Compare the reduced results with the ones of the single run */
+  CHK(ssol_estimator_get_mc_global(workers[0], &mc_global2) == RES_OK);
+  CHK(eq_eps(mc_global2.missing.E, mc_global.missing.E,
+    4 * sqrt(mc_global2.missing.SE*mc_global2.missing.SE
+           + mc_global.missing.SE*mc_global.missing.SE)));
+  CHK(ssol_estimator_get_mc_receiver
+    (workers[0], target, SSOL_FRONT, &mc_rcv2) == RES_OK);
+  CHK(eq_eps(mc_rcv2.incoming_flux.E, mc_rcv.incoming_flux.E,
+    4 * sqrt(mc_rcv2.incoming_flux.SE*mc_rcv2.incoming_flux.SE
+           + mc_rcv.incoming_flux.SE*mc_rcv.incoming_flux.SE)));
+  CHK(ssol_estimator_ref_put(workers[0]) == RES_OK);
+
+  CHK(ssol_estimator_ref_put(estimator1) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator3) == RES_OK);
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_instance_ref_put(target2) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_scene_ref_put(scene2) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
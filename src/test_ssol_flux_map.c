@@ -0,0 +1,286 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double2.h>
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 10000
+#define DNI 1000
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+/* Return the integral of the flux map, i.e. the flux received by the mapped
+ * domain */
+static double
+integrate_flux_map
+  (const struct ssol_mc_receiver* rcv,
+   const enum ssol_mc_channel channel,
+   struct ssol_image* image,
+   const struct ssol_flux_map* map)
+{
+  struct ssol_image_layout layout;
+  char* mem;
+  double sum = 0;
+  size_t x, y;
+
+  CHK(ssol_mc_receiver_get_flux_map(rcv, channel, image) == RES_OK);
+  CHK(ssol_image_get_layout(image, &layout) == RES_OK);
+  CHK(layout.width == map->definition[0]);
+  CHK(layout.height == map->definition[1]);
+  CHK(layout.pixel_format == SSOL_PIXEL_DOUBLE3);
+
+  CHK(ssol_image_map(image, &mem) == RES_OK);
+  FOR_EACH(y, 0, layout.height) {
+    const double* row = (const double*)
+      (mem + layout.offset + y*layout.row_pitch);
+    FOR_EACH(x, 0, layout.width) {
+      const double* pixel = row + x*3;
+      CHK(pixel[0] >= 0);
+      CHK(pixel[1] >= 0);
+      CHK(pixel[2] >= 0);
+      sum += pixel[0];
+    }
+  }
+  CHK(ssol_image_unmap(image) == RES_OK);
+
+  return sum
+    * (map->upper[0] - map->lower[0]) / (double)map->definition[0]
+    * (map->upper[1] - map->lower[1]) / (double)map->definition[1];
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator;
+  struct ssol_estimator* estimator2;
+  struct ssol_image* image;
+  struct ssol_flux_map map = SSOL_FLUX_MAP_NULL;
+  struct ssol_flux_map map2;
+  struct ssol_mc_receiver mc_rcv;
+  struct ssol_mc_receiver mc_rcv2;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double dir[3];
+  double flux, flux2;
+  FILE* stream;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+  CHK(ssol_image_create(dev, &image) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  #define SET ssol_instance_set_receiver_flux_map
+  #define GET ssol_instance_get_receiver_flux_map
+  CHK(GET(NULL, &map2) == RES_BAD_ARG);
+  CHK(GET(target, NULL) == RES_BAD_ARG);
+  CHK(GET(target, &map2) == RES_OK);
+  CHK(map2.definition[0] == 0 && map2.definition[1] == 0);
+
+  map.domain = SSOL_FLUX_MAP_LOCAL_XY;
+  map.definition[0] = 1;
+  map.definition[1] = 1;
+  d2(map.lower, -1, -1);
+  d2(map.upper, 1, -1);
+  CHK(SET(NULL, &map) == RES_BAD_ARG);
+  CHK(SET(target, &map) == RES_BAD_ARG);
+  d2(map.upper, 1, 1);
+  CHK(SET(target, &map) == RES_OK);
+  CHK(GET(target, &map2) == RES_OK);
+  CHK(map2.domain == SSOL_FLUX_MAP_LOCAL_XY);
+  CHK(map2.definition[0] == 1 && map2.definition[1] == 1);
+  CHK(d2_eq(map2.lower, map.lower) && d2_eq(map2.upper, map.upper));
+  CHK(SET(target, NULL) == RES_OK);
+  CHK(GET(target, &map2) == RES_OK);
+  CHK(map2.definition[0] == 0 && map2.definition[1] == 0);
+
+  /* No flux map */
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  CHK(ssol_mc_receiver_get_flux_map
+    (&mc_rcv, SSOL_MC_INCOMING_FLUX, image) == RES_BAD_ARG);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  /* The single bin of a map covering the whole receiver integrates its flux */
+  CHK(SET(target, &map) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  printf("Incoming flux = %g +/- %g\n",
+    mc_rcv.incoming_flux.E, mc_rcv.incoming_flux.SE);
+  CHK(mc_rcv.incoming_flux.E > 0);
+
+  #define GET_MAP ssol_mc_receiver_get_flux_map
+  CHK(GET_MAP(NULL, SSOL_MC_INCOMING_FLUX, image) == RES_BAD_ARG);
+  CHK(GET_MAP(&mc_rcv, SSOL_MC_INCOMING_FLUX, NULL) == RES_BAD_ARG);
+  CHK(GET_MAP(&mc_rcv, SSOL_MC_INCOMING_IF_NO_ATM_LOSS, image) == RES_BAD_ARG);
+  #undef GET_MAP
+
+  flux = integrate_flux_map(&mc_rcv, SSOL_MC_INCOMING_FLUX, image, &map);
+  CHK(eq_eps(flux, mc_rcv.incoming_flux.E, mc_rcv.incoming_flux.E*1.e-6));
+  flux = integrate_flux_map(&mc_rcv, SSOL_MC_ABSORBED_FLUX, image, &map);
+  CHK(eq_eps(flux, mc_rcv.absorbed_flux.E, mc_rcv.incoming_flux.E*1.e-6));
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  /* A finer map integrates the same flux */
+  map.definition[0] = 16;
+  map.definition[1] = 8;
+  CHK(SET(target, &map) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  flux = integrate_flux_map(&mc_rcv, SSOL_MC_INCOMING_FLUX, image, &map);
+  CHK(eq_eps(flux, mc_rcv.incoming_flux.E, mc_rcv.incoming_flux.E*1.e-6));
+
+  /* The flux map is serialized with the estimator */
+  CHK(stream = tmpfile());
+  CHK(ssol_estimator_write(estimator, stream) == RES_OK);
+  rewind(stream);
+  CHK(ssol_estimator_read(scene, stream, &estimator2) == RES_OK);
+  CHK(fclose(stream) == 0);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator2, target, SSOL_FRONT, &mc_rcv2) == RES_OK);
+  flux2 = integrate_flux_map(&mc_rcv2, SSOL_MC_INCOMING_FLUX, image, &map);
+  CHK(eq_eps(flux, flux2, flux*1.e-6));
+
+  /* The flux maps are merged */
+  CHK(ssol_estimator_merge(estimator2, estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator2, target, SSOL_FRONT, &mc_rcv2) == RES_OK);
+  flux2 = integrate_flux_map(&mc_rcv2, SSOL_MC_INCOMING_FLUX, image, &map);
+  CHK(eq_eps(flux, flux2, flux*1.e-6));
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  /* A map covering half of the receiver integrates a part of its flux */
+  map.upper[0] = 0;
+  CHK(SET(target, &map) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  flux = integrate_flux_map(&mc_rcv, SSOL_MC_INCOMING_FLUX, image, &map);
+  CHK(flux <= mc_rcv.incoming_flux.E * (1 + 1.e-6));
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+  #undef SET
+  #undef GET
+
+  CHK(ssol_image_ref_put(image) == RES_OK);
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
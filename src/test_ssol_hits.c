@@ -0,0 +1,320 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double2.h>
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#include <string.h>
+
+#define N 10000
+#define FILENAME "test_ssol_hits.bin"
+#define DNI 1000
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+/* Return the integral of the flux map reconstructed from the recorded hits */
+static double
+integrate_hits
+  (const struct ssol_estimator* estimator,
+   const struct ssol_instance* target,
+   const struct ssol_flux_map* map,
+   const struct ssol_kernel* kernel,
+   struct ssol_image* image)
+{
+  struct ssol_image_layout layout;
+  char* mem;
+  double sum = 0;
+  size_t x, y;
+
+  CHK(ssol_estimator_build_flux_map(estimator, target, SSOL_FRONT,
+    SSOL_MC_INCOMING_FLUX, map, kernel, image) == RES_OK);
+  CHK(ssol_image_get_layout(image, &layout) == RES_OK);
+  CHK(layout.width == map->definition[0]);
+  CHK(layout.height == map->definition[1]);
+  CHK(layout.pixel_format == SSOL_PIXEL_DOUBLE3);
+
+  CHK(ssol_image_map(image, &mem) == RES_OK);
+  FOR_EACH(y, 0, layout.height) {
+    const double* row = (const double*)
+      (mem + layout.offset + y*layout.row_pitch);
+    FOR_EACH(x, 0, layout.width) {
+      const double* pixel = row + x*3;
+      CHK(pixel[0] >= 0);
+      CHK(pixel[1] >= 0);
+      CHK(pixel[2] >= 0);
+      sum += pixel[0];
+    }
+  }
+  CHK(ssol_image_unmap(image) == RES_OK);
+
+  return sum
+    * (map->upper[0] - map->lower[0]) / (double)map->definition[0]
+    * (map->upper[1] - map->lower[1]) / (double)map->definition[1];
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator;
+  struct ssol_estimator* estimator2;
+  struct ssol_image* image;
+  struct ssol_flux_map map = SSOL_FLUX_MAP_NULL;
+  struct ssol_kernel kernel = SSOL_KERNEL_DEFAULT;
+  struct ssol_mc_receiver mc_rcv;
+  const struct ssol_hit* hits;
+  const struct ssol_hit* hits2;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double dir[3];
+  double sum, flux, flux2;
+  size_t i, count, count2;
+  FILE* fp;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+  CHK(ssol_image_create(dev, &image) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  CHK(ssol_instance_record_hits(NULL, 1) == RES_BAD_ARG);
+
+  /* No hit is recorded by default */
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_hits(NULL, &hits, &count) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_hits(estimator, NULL, &count) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_hits(estimator, &hits, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_hits(estimator, &hits, &count) == RES_OK);
+  CHK(count == 0);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  CHK(ssol_instance_record_hits(target, 1) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  CHK(ssol_estimator_get_hits(estimator, &hits, &count) == RES_OK);
+  CHK(count > 0);
+
+  /* The recorded hits sum up to the incoming flux of the receiver */
+  sum = 0;
+  FOR_EACH(i, 0, count) {
+    CHK(hits[i].realisation < N);
+    CHK(i == 0 || hits[i-1].realisation <= hits[i].realisation);
+    CHK(hits[i].side == SSOL_FRONT);
+    CHK(hits[i].absorbed_flux <= hits[i].incoming_flux);
+    sum += hits[i].incoming_flux;
+  }
+  printf("Incoming flux = %g +/- %g; hits = %g\n",
+    mc_rcv.incoming_flux.E, mc_rcv.incoming_flux.SE, sum/N);
+  CHK(eq_eps(sum/N, mc_rcv.incoming_flux.E, mc_rcv.incoming_flux.E*1.e-4));
+
+  /* Check the flux map reconstruction arguments */
+  map.domain = SSOL_FLUX_MAP_LOCAL_XY;
+  map.definition[0] = 1;
+  map.definition[1] = 1;
+  d2(map.lower, -1, -1);
+  d2(map.upper, 1, 1);
+  #define BUILD ssol_estimator_build_flux_map
+  #define IN SSOL_MC_INCOMING_FLUX
+  CHK(BUILD(NULL, target, SSOL_FRONT, IN, &map, &kernel, image) == RES_BAD_ARG);
+  CHK(BUILD(estimator, NULL, SSOL_FRONT, IN, &map, &kernel, image)
+    == RES_BAD_ARG);
+  CHK(BUILD(estimator, target, SSOL_FRONT, SSOL_MC_INCOMING_IF_NO_ATM_LOSS,
+    &map, &kernel, image) == RES_BAD_ARG);
+  CHK(BUILD(estimator, target, SSOL_FRONT, IN, NULL, &kernel, image)
+    == RES_BAD_ARG);
+  CHK(BUILD(estimator, target, SSOL_FRONT, IN, &map, NULL, image)
+    == RES_BAD_ARG);
+  CHK(BUILD(estimator, target, SSOL_FRONT, IN, &map, &kernel, NULL)
+    == RES_BAD_ARG);
+  map.domain = SSOL_FLUX_MAP_UV;
+  CHK(BUILD(estimator, target, SSOL_FRONT, IN, &map, &kernel, image)
+    == RES_BAD_ARG);
+  map.domain = SSOL_FLUX_MAP_LOCAL_XY;
+  kernel.type = SSOL_KERNEL_GAUSSIAN;
+  CHK(BUILD(estimator, target, SSOL_FRONT, IN, &map, &kernel, image)
+    == RES_BAD_ARG);
+  kernel.type = SSOL_KERNEL_BOX;
+  #undef BUILD
+  #undef IN
+
+  /* A single bin covering the receiver integrates all the hits */
+  flux = integrate_hits(estimator, target, &map, &kernel, image);
+  CHK(eq_eps(flux, sum/N, sum/N*1.e-4));
+
+  /* Smoothed flux maps whose domain covers the kernel supports integrate the
+   * same flux */
+  map.definition[0] = 128;
+  map.definition[1] = 128;
+  d2(map.lower, -3, -3);
+  d2(map.upper, 3, 3);
+  kernel.type = SSOL_KERNEL_EPANECHNIKOV;
+  kernel.bandwidth = 0.5;
+  flux = integrate_hits(estimator, target, &map, &kernel, image);
+  CHK(eq_eps(flux, sum/N, sum/N*1.e-2));
+  kernel.type = SSOL_KERNEL_GAUSSIAN;
+  kernel.bandwidth = 0.25;
+  flux = integrate_hits(estimator, target, &map, &kernel, image);
+  CHK(eq_eps(flux, sum/N, sum/N*1.e-2));
+
+  /* Write the hits as a raw list */
+  CHK(ssol_estimator_write_hits(NULL, stdout) == RES_BAD_ARG);
+  CHK(ssol_estimator_write_hits(estimator, NULL) == RES_BAD_ARG);
+  CHK(fp = fopen(FILENAME, "wb"));
+  CHK(ssol_estimator_write_hits(estimator, fp) == RES_OK);
+  CHK(fclose(fp) == 0);
+  CHK(fp = fopen(FILENAME, "rb"));
+  CHK(fseek(fp, 0, SEEK_END) == 0);
+  CHK((size_t)ftell(fp) == count * sizeof(struct ssol_hit));
+  CHK(fclose(fp) == 0);
+  CHK(remove(FILENAME) == 0);
+
+  /* The hits are appended on merge */
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator2) == RES_OK);
+  CHK(ssol_estimator_get_hits(estimator2, &hits, &count2) == RES_OK);
+  CHK(ssol_estimator_merge(estimator, estimator2) == RES_OK);
+  CHK(ssol_estimator_get_hits(estimator, &hits, &i) == RES_OK);
+  CHK(i == count + count2);
+  CHK(hits[count].realisation >= N);
+  kernel.type = SSOL_KERNEL_BOX;
+  map.definition[0] = 1;
+  map.definition[1] = 1;
+  d2(map.lower, -1, -1);
+  d2(map.upper, 1, 1);
+  flux2 = integrate_hits(estimator, target, &map, &kernel, image);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  CHK(eq_eps(flux2, mc_rcv.incoming_flux.E, mc_rcv.incoming_flux.E*1.e-4));
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+
+  /* The hits are serialized with the estimator */
+  CHK(fp = tmpfile());
+  CHK(ssol_estimator_write(estimator, fp) == RES_OK);
+  rewind(fp);
+  CHK(ssol_estimator_read(scene, fp, &estimator2) == RES_OK);
+  CHK(fclose(fp) == 0);
+  CHK(ssol_estimator_get_hits(estimator2, &hits2, &count2) == RES_OK);
+  CHK(count2 == i);
+  CHK(!memcmp(hits, hits2, count2 * sizeof(struct ssol_hit)));
+  CHK(integrate_hits(estimator2, target, &map, &kernel, image) == flux2);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  CHK(ssol_image_ref_put(image) == RES_OK);
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
@@ -111,6 +111,10 @@ main(int argc, char** argv)
   CHK(ssol_instance_sample(instance, 0) == RES_OK);
   CHK(ssol_instance_sample(instance, 1) == RES_OK);
 
+  CHK(ssol_instance_absorb_all(NULL, 1) == RES_BAD_ARG);
+  CHK(ssol_instance_absorb_all(instance, 1) == RES_OK);
+  CHK(ssol_instance_absorb_all(instance, 0) == RES_OK);
+
   CHK(ssol_instance_get_shaded_shapes_count(NULL, NULL) == RES_BAD_ARG);
   CHK(ssol_instance_get_shaded_shapes_count(instance, NULL) == RES_BAD_ARG);
   CHK(ssol_instance_get_shaded_shapes_count(NULL, &n) == RES_BAD_ARG);
@@ -0,0 +1,262 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+
+#define REFLECTIVITY 0.9
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 10000
+#define DNI 1000
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+static void
+check_blockers
+  (const struct ssol_estimator* estimator,
+   struct ssol_instance* instances[],
+   const size_t ninstances,
+   const struct ssol_instance* sampled,
+   const struct ssol_mc_sampled* mc_samp)
+{
+  struct ssol_mc_blocker blocker;
+  double sum = 0;
+  size_t i;
+
+  FOR_EACH(i, 0, ninstances) {
+    CHK(ssol_estimator_get_mc_sampled_x_blocker
+      (estimator, sampled, instances[i], &blocker) == RES_OK);
+    CHK(blocker.absorbed_flux.E >= 0);
+    CHK(blocker.hits.E >= 0);
+    CHK((blocker.absorbed_flux.E == 0) == (blocker.hits.E == 0));
+    if(instances[i] == sampled) CHK(blocker.absorbed_flux.E == 0);
+    sum += blocker.absorbed_flux.E;
+  }
+  CHK(eq_eps(sum, mc_samp->blocked.E, 1.e-6*MMAX(sum, 1)));
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* instances[3];
+  struct ssol_instance* heliostat;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator;
+  struct ssol_estimator* estimator2;
+  struct ssol_mc_global mc_global;
+  struct ssol_mc_sampled mc_samp;
+  struct ssol_mc_sampled mc_samp2;
+  struct ssol_mc_sampled sum;
+  struct ssol_mc_blocker blocker;
+  struct ssol_mc_blocker blocker2;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double dir[3];
+  size_t i;
+  FILE* stream;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  /* Lossy mirrors: the secondary reflector absorbs a part of the flux
+   * reflected by the heliostat */
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity_2;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_instance_sample(target, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+  instances[0] = heliostat;
+  instances[1] = secondary;
+  instances[2] = target;
+
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(estimator, &mc_global) == RES_OK);
+
+  #define GET ssol_estimator_get_mc_sampled_x_blocker
+  CHK(GET(NULL, heliostat, secondary, &blocker) == RES_BAD_ARG);
+  CHK(GET(estimator, NULL, secondary, &blocker) == RES_BAD_ARG);
+  CHK(GET(estimator, heliostat, NULL, &blocker) == RES_BAD_ARG);
+  CHK(GET(estimator, heliostat, secondary, NULL) == RES_BAD_ARG);
+  CHK(GET(estimator, target, secondary, &blocker) == RES_BAD_ARG);
+  CHK(GET(estimator, heliostat, secondary, &blocker) == RES_OK);
+  CHK(blocker.absorbed_flux.E > 0);
+  CHK(blocker.hits.E > 0 && blocker.hits.E <= 1);
+  #undef GET
+
+  /* The losses of the sampled instances sum up to the global ones */
+  memset(&sum, 0, sizeof(sum));
+  FOR_EACH(i, 0, 2) {
+    CHK(ssol_estimator_get_mc_sampled(estimator, instances[i], &mc_samp)
+      == RES_OK);
+    check_blockers(estimator, instances, 3, instances[i], &mc_samp);
+    #define ADD(Name) sum.Name.E += mc_samp.Name.E
+    ADD(shadowed);
+    ADD(blocked);
+    ADD(missing);
+    ADD(extinguished_by_atmosphere);
+    ADD(other_absorbed);
+    ADD(absorbed_by_receivers);
+    #undef ADD
+  }
+  #define CHK_SUM(Dst, Src) CHK(eq_eps(Dst, Src, 1.e-6*MMAX(Src, 1)))
+  CHK_SUM(sum.shadowed.E, mc_global.shadowed.E);
+  CHK_SUM(sum.missing.E, mc_global.missing.E);
+  CHK_SUM(sum.extinguished_by_atmosphere.E,
+    mc_global.extinguished_by_atmosphere.E);
+  CHK_SUM(sum.blocked.E + sum.other_absorbed.E, mc_global.other_absorbed.E);
+  CHK_SUM(sum.absorbed_by_receivers.E, mc_global.absorbed_by_receivers.E);
+  #undef CHK_SUM
+
+  /* The flux reflected by the heliostat is partly blocked by the secondary */
+  CHK(ssol_estimator_get_mc_sampled(estimator, heliostat, &mc_samp) == RES_OK);
+  CHK(mc_samp.blocked.E > 0);
+  CHK(mc_samp.other_absorbed.E > 0);
+
+  /* Serialize the estimator and read it back */
+  CHK(stream = tmpfile());
+  CHK(ssol_estimator_write(estimator, stream) == RES_OK);
+  rewind(stream);
+  CHK(ssol_estimator_read(scene, stream, &estimator2) == RES_OK);
+  CHK(fclose(stream) == 0);
+  CHK(ssol_estimator_get_mc_sampled(estimator2, heliostat, &mc_samp2)
+    == RES_OK);
+  CHK(mc_samp2.blocked.E == mc_samp.blocked.E);
+  CHK(mc_samp2.blocked.SE == mc_samp.blocked.SE);
+  CHK(mc_samp2.missing.E == mc_samp.missing.E);
+  CHK(mc_samp2.other_absorbed.E == mc_samp.other_absorbed.E);
+  CHK(mc_samp2.absorbed_by_receivers.E == mc_samp.absorbed_by_receivers.E);
+  CHK(ssol_estimator_get_mc_sampled_x_blocker
+    (estimator, heliostat, secondary, &blocker) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled_x_blocker
+    (estimator2, heliostat, secondary, &blocker2) == RES_OK);
+  CHK(blocker2.absorbed_flux.E == blocker.absorbed_flux.E);
+  CHK(blocker2.absorbed_flux.SE == blocker.absorbed_flux.SE);
+  CHK(blocker2.hits.E == blocker.hits.E);
+
+  /* Merging an estimator with itself keeps the expectations */
+  CHK(ssol_estimator_merge(estimator2, estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled(estimator2, heliostat, &mc_samp2)
+    == RES_OK);
+  CHK(eq_eps(mc_samp2.blocked.E, mc_samp.blocked.E, 1.e-6));
+  CHK(eq_eps(mc_samp2.other_absorbed.E, mc_samp.other_absorbed.E, 1.e-6));
+  CHK(ssol_estimator_get_mc_sampled_x_blocker
+    (estimator2, heliostat, secondary, &blocker2) == RES_OK);
+  CHK(eq_eps(blocker2.absorbed_flux.E, blocker.absorbed_flux.E, 1.e-6));
+  CHK(eq_eps(blocker2.hits.E, blocker.hits.E, 1.e-6));
+  check_blockers(estimator2, instances, 3, heliostat, &mc_samp2);
+
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
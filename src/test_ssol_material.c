@@ -113,10 +113,103 @@ test_matte(struct ssol_device* dev)
   matte.normal = get_shader_normal;
   matte.reflectivity = NULL;
   CHK(ssol_matte_setup(material, &matte) == RES_BAD_ARG);
+  matte.reflectivity = get_shader_reflectivity;
+
+  /* The batched getters are optional but do not replace the scalar ones */
+  matte.normal_batch = get_shader_normal_batch;
+  CHK(ssol_matte_setup(material, &matte) == RES_OK);
+  matte.normal = NULL;
+  CHK(ssol_matte_setup(material, &matte) == RES_BAD_ARG);
 
   CHK(ssol_material_ref_put(material) == RES_OK);
 }
 
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  const double wavelengths[2] = { 400, 800 };
+  const double reflectivities[2] = { 0.9, 0.8 };
+  CHK(i < 2);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = reflectivities[i];
+}
+
+static void
+test_uniform(struct ssol_device* dev)
+{
+  struct ssol_mirror_shader mirror = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_matte_shader matte = SSOL_MATTE_SHADER_NULL;
+  struct ssol_data reflectivity = SSOL_DATA_NULL__;
+  struct ssol_data roughness = SSOL_DATA_NULL__;
+  struct ssol_spectrum* spectrum;
+  struct ssol_material* material;
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 2, NULL) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &material) == RES_OK);
+  ssol_data_set_real(&reflectivity, 0.9);
+  ssol_data_set_real(&roughness, 0.01);
+  CHK(ssol_mirror_setup_uniform(NULL, &reflectivity, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_BAD_ARG);
+  CHK(ssol_mirror_setup_uniform(material, NULL, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_BAD_ARG);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, NULL,
+    SSOL_MICROFACET_BECKMANN) == RES_BAD_ARG);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, &roughness,
+    SSOL_MICROFACET_DISTRIBUTIONS_COUNT__) == RES_BAD_ARG);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, &roughness,
+    SSOL_MICROFACET_PILLBOX) == RES_OK);
+
+  ssol_data_set_real(&reflectivity, 1.1);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_BAD_ARG);
+  ssol_data_set_real(&reflectivity, 0.9);
+  ssol_data_set_real(&roughness, -0.1);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_BAD_ARG);
+  ssol_data_set_real(&roughness, 0);
+
+  /* Spectral reflectivity */
+  ssol_data_set_spectrum(&reflectivity, spectrum);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_OK);
+
+  /* Back to a shaded mirror */
+  mirror.normal = get_shader_normal;
+  mirror.reflectivity = get_shader_reflectivity;
+  mirror.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(material, &mirror, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_ref_put(material) == RES_OK);
+
+  CHK(ssol_material_create_matte(dev, &material) == RES_OK);
+  CHK(ssol_matte_setup_uniform(NULL, &reflectivity) == RES_BAD_ARG);
+  CHK(ssol_matte_setup_uniform(material, NULL) == RES_BAD_ARG);
+  CHK(ssol_matte_setup_uniform(material, &reflectivity) == RES_OK);
+  ssol_data_set_real(&reflectivity, -1);
+  CHK(ssol_matte_setup_uniform(material, &reflectivity) == RES_BAD_ARG);
+  ssol_data_set_real(&reflectivity, 0.5);
+  CHK(ssol_matte_setup_uniform(material, &reflectivity) == RES_OK);
+  matte.normal = get_shader_normal;
+  matte.reflectivity = get_shader_reflectivity;
+  CHK(ssol_matte_setup(material, &matte) == RES_OK);
+  CHK(ssol_material_ref_put(material) == RES_OK);
+
+  /* Uniform materials cannot be setup from another material type */
+  CHK(ssol_material_create_virtual(dev, &material) == RES_OK);
+  CHK(ssol_matte_setup_uniform(material, &reflectivity) == RES_BAD_ARG);
+  CHK(ssol_mirror_setup_uniform(material, &reflectivity, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_BAD_ARG);
+  CHK(ssol_material_ref_put(material) == RES_OK);
+
+  ssol_data_clear(&reflectivity);
+  ssol_data_clear(&roughness);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+}
+
 static void
 test_thin_dielectric(struct ssol_device* dev)
 {
@@ -269,6 +362,23 @@ test_virtual(struct ssol_device* dev)
   CHK(ssol_material_ref_put(material) == RES_OK);
 }
 
+static void
+test_absorber(struct ssol_device* dev)
+{
+  struct ssol_material* material;
+  enum ssol_material_type type;
+
+  CHK(ssol_material_create_absorber(NULL, NULL) == RES_BAD_ARG);
+  CHK(ssol_material_create_absorber(NULL, &material) == RES_BAD_ARG);
+  CHK(ssol_material_create_absorber(dev, NULL) == RES_BAD_ARG);
+  CHK(ssol_material_create_absorber(dev, &material) == RES_OK);
+
+  CHK(ssol_material_get_type(material, &type) == RES_OK);
+  CHK(type == SSOL_MATERIAL_ABSORBER);
+
+  CHK(ssol_material_ref_put(material) == RES_OK);
+}
+
 int
 main(int argc, char** argv)
 {
@@ -283,9 +393,11 @@ main(int argc, char** argv)
 
   test_mirror(dev);
   test_matte(dev);
+  test_uniform(dev);
   test_thin_dielectric(dev);
   test_dielectric(dev);
   test_virtual(dev);
+  test_absorber(dev);
 
   CHK(ssol_device_ref_put(dev) == RES_OK);
 
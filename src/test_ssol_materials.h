@@ -34,6 +34,21 @@ get_shader_normal
   FOR_EACH(i, 0, 3) val[i] = frag->Ns[i];
 }
 
+static INLINE void
+get_shader_normal_batch
+  (struct ssol_device* dev,
+   struct ssol_param_buffer* buf,
+   const size_t count,
+   const double* wavelengths,
+   const struct ssol_surface_fragment* frags,
+   double* vals)
+{
+  size_t i;
+  FOR_EACH(i, 0, count) {
+    get_shader_normal(dev, buf, wavelengths[i], frags + i, vals + i*3);
+  }
+}
+
 static INLINE void
 get_shader_reflectivity
   (struct ssol_device* dev,
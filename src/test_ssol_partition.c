@@ -0,0 +1,243 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 5000
+#define DNI 1000
+#define NWORKERS 3
+
+/* Scene whose objects are created in the same order on each device. The
+ * instances thus have the same identifiers whatever the device, allowing to
+ * read on a device the estimators computed on another one */
+struct scene {
+  struct ssol_device* dev;
+  struct ssol_shape* square;
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_scene* scene;
+};
+
+static res_T
+stream_send(const void* data, const size_t size, void* ctx)
+{
+  return fwrite(data, 1, size, ctx) == size ? RES_OK : RES_IO_ERR;
+}
+
+static res_T
+stream_receive(void* data, const size_t size, void* ctx)
+{
+  return fread(data, 1, size, ctx) == size ? RES_OK : RES_IO_ERR;
+}
+
+static void
+scene_create
+  (struct mem_allocator* allocator,
+   const unsigned nthreads,
+   struct scene* scn)
+{
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_data reflectivity = SSOL_DATA_NULL__;
+  struct ssol_data roughness = SSOL_DATA_NULL__;
+  double transform[12]; /* 3x4 column major matrix */
+  double dir[3];
+
+  /* The target faces the mirror */
+  d33_splat(transform, 0);
+  d3_splat(transform + 9, 0);
+  d33_rotation_pitch(transform, PI); /* flip faces: invert normal */
+  transform[9] = 2; /* +2 offset along X axis */
+  transform[11] = 2; /* +2 offset along Z axis */
+
+  CHK(ssol_device_create(NULL, allocator, nthreads, 0, &scn->dev) == RES_OK);
+
+  CHK(ssol_sun_create_pillbox(scn->dev, &scn->sun) == RES_OK);
+  CHK(ssol_sun_set_direction(scn->sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_pillbox_set_half_angle(scn->sun, 0.05) == RES_OK);
+  CHK(ssol_sun_set_dni(scn->sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(scn->dev, &scn->square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(scn->square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(scn->dev, &scn->m_mtl) == RES_OK);
+  ssol_data_set_real(&reflectivity, 0.9);
+  ssol_data_set_real(&roughness, 0.1);
+  CHK(ssol_mirror_setup_uniform(scn->m_mtl, &reflectivity, &roughness,
+    SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(scn->dev, &scn->v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(scn->dev, &scn->m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape
+    (scn->m_object, scn->square, scn->m_mtl, scn->m_mtl) == RES_OK);
+  CHK(ssol_object_create(scn->dev, &scn->t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape
+    (scn->t_object, scn->square, scn->v_mtl, scn->v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(scn->dev, &scn->scene) == RES_OK);
+  CHK(ssol_object_instantiate(scn->m_object, &scn->heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scn->scene, scn->heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(scn->t_object, &scn->target) == RES_OK);
+  CHK(ssol_instance_set_transform(scn->target, transform) == RES_OK);
+  CHK(ssol_instance_set_receiver(scn->target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_instance_sample(scn->target, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scn->scene, scn->target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scn->scene, scn->sun) == RES_OK);
+}
+
+static void
+scene_release(struct scene* scn)
+{
+  CHK(ssol_instance_ref_put(scn->heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(scn->target) == RES_OK);
+  CHK(ssol_object_ref_put(scn->m_object) == RES_OK);
+  CHK(ssol_object_ref_put(scn->t_object) == RES_OK);
+  CHK(ssol_material_ref_put(scn->m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(scn->v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(scn->square) == RES_OK);
+  CHK(ssol_scene_ref_put(scn->scene) == RES_OK);
+  CHK(ssol_sun_ref_put(scn->sun) == RES_OK);
+  CHK(ssol_device_ref_put(scn->dev) == RES_OK);
+}
+
+static int
+eq_rel(const double a, const double b)
+{
+  return eq_eps(a, b, 1.e-9 * MMAX(fabs(a), fabs(b)));
+}
+
+/* Check that the estimators give the same results up to the order of the
+ * summation of their weights */
+static void
+check_estimators_eq
+  (struct ssol_estimator* a,
+   struct ssol_estimator* b,
+   struct ssol_instance* target)
+{
+  struct ssol_mc_global global_a, global_b;
+  struct ssol_mc_receiver rcv_a, rcv_b;
+  size_t count_a, count_b;
+
+  CHK(ssol_estimator_get_realisation_count(a, &count_a) == RES_OK);
+  CHK(ssol_estimator_get_realisation_count(b, &count_b) == RES_OK);
+  CHK(count_a == count_b);
+  CHK(ssol_estimator_get_mc_global(a, &global_a) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(b, &global_b) == RES_OK);
+  CHK(eq_rel(global_a.cos_factor.E, global_b.cos_factor.E));
+  CHK(eq_rel(global_a.missing.E, global_b.missing.E));
+  CHK(eq_rel(global_a.missing.SE, global_b.missing.SE));
+  CHK(eq_rel(global_a.absorbed_by_receivers.E,
+    global_b.absorbed_by_receivers.E));
+  CHK(ssol_estimator_get_mc_receiver(a, target, SSOL_FRONT, &rcv_a) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver(b, target, SSOL_FRONT, &rcv_b) == RES_OK);
+  CHK(eq_rel(rcv_a.incoming_flux.E, rcv_b.incoming_flux.E));
+  CHK(eq_rel(rcv_a.incoming_flux.SE, rcv_b.incoming_flux.SE));
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct scene scn1; /* Scene of a single threaded device */
+  struct scene scnN; /* Scene of a multi threaded device */
+  struct ssol_channel channel = SSOL_CHANNEL_NULL;
+  struct ssol_estimator* workers[NWORKERS];
+  struct ssol_estimator* workers_mixed[NWORKERS];
+  struct ssol_estimator* estimator;
+  struct ssp_rng* rng;
+  FILE* stream;
+  size_t iworker;
+  (void)argc, (void)argv;
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  scene_create(&allocator, 1, &scn1);
+  scene_create(&allocator, 4, &scnN);
+
+  /* A worker gives the same results whatever its number of threads */
+  CHK(ssol_solve_partition(scn1.scene, rng, N, 0, NULL, NWORKERS, 1,
+    &workers[0]) == RES_OK);
+  CHK(ssol_solve_partition(scnN.scene, rng, N, 0, NULL, NWORKERS, 1,
+    &workers[1]) == RES_OK);
+  check_estimators_eq(workers[0], workers[1], scnN.target);
+  CHK(ssol_estimator_ref_put(workers[0]) == RES_OK);
+  CHK(ssol_estimator_ref_put(workers[1]) == RES_OK);
+
+  /* Reduce workers that all run on the multi threaded device */
+  FOR_EACH(iworker, 0, NWORKERS) {
+    CHK(ssol_solve_partition(scnN.scene, rng, N, 0, NULL, NWORKERS, iworker,
+      &workers[iworker]) == RES_OK);
+  }
+
+  /* Reduce workers that run on devices with different numbers of threads.
+   * Their estimators are transferred to the multi threaded device */
+  CHK(stream = tmpfile());
+  channel.send = stream_send;
+  channel.receive = stream_receive;
+  channel.context = stream;
+  FOR_EACH(iworker, 0, NWORKERS) {
+    struct scene* worker_scn = iworker % 2 ? &scn1 : &scnN;
+    CHK(ssol_solve_partition(worker_scn->scene, rng, N, 0, NULL, NWORKERS,
+      iworker, &estimator) == RES_OK);
+    CHK(ssol_estimator_send(estimator, &channel) == RES_OK);
+    CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+  }
+  rewind(stream);
+  FOR_EACH(iworker, 0, NWORKERS) {
+    CHK(ssol_estimator_receive
+      (scnN.scene, &channel, &workers_mixed[iworker]) == RES_OK);
+  }
+  CHK(fclose(stream) == 0);
+
+  FOR_EACH(iworker, 1, NWORKERS) {
+    CHK(ssol_estimator_merge(workers[0], workers[iworker]) == RES_OK);
+    CHK(ssol_estimator_merge
+      (workers_mixed[0], workers_mixed[iworker]) == RES_OK);
+    CHK(ssol_estimator_ref_put(workers[iworker]) == RES_OK);
+    CHK(ssol_estimator_ref_put(workers_mixed[iworker]) == RES_OK);
+  }
+  check_estimators_eq(workers[0], workers_mixed[0], scnN.target);
+  CHK(ssol_estimator_ref_put(workers[0]) == RES_OK);
+  CHK(ssol_estimator_ref_put(workers_mixed[0]) == RES_OK);
+
+  scene_release(&scn1);
+  scene_release(&scnN);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
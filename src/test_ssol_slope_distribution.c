@@ -0,0 +1,324 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 10000
+#define DNI 1000
+
+struct slopes_desc {
+  size_t definition[2];
+  const double* densities;
+};
+
+static void
+get_density(const size_t ix, const size_t iy, double* density, void* ctx)
+{
+  const struct slopes_desc* desc = ctx;
+  CHK(desc && ix < desc->definition[0] && iy < desc->definition[1]);
+  *density = desc->densities[iy*desc->definition[0] + ix];
+}
+
+static void
+get_null_density(const size_t ix, const size_t iy, double* density, void* ctx)
+{
+  (void)ix, (void)iy, (void)ctx;
+  *density = 0;
+}
+
+static void
+get_negative_density
+  (const size_t ix, const size_t iy, double* density, void* ctx)
+{
+  (void)ctx;
+  *density = ix == 1 && iy == 1 ? -1 : 1;
+}
+
+/* Expected partial derivative in u of the mirror fragments */
+static double dPdu_ref[3];
+
+static void
+get_shader_normal
+  (struct ssol_device* dev,
+   struct ssol_param_buffer* buf,
+   const double wavelength,
+   const struct ssol_surface_fragment* frag,
+   double* val)
+{
+  (void)dev, (void)buf, (void)wavelength;
+  CHK(d3_eq_eps(frag->dPdu, dPdu_ref, 1.e-6));
+  CHK(eq_eps(d3_dot(frag->dPdv, frag->dPdu), 0, 1.e-6));
+  CHK(eq_eps(d3_dot(frag->dPdv, frag->Ng), 0, 1.e-6));
+  d3_set(val, frag->Ns);
+}
+
+static void
+get_shader_reflectivity
+  (struct ssol_device* dev,
+   struct ssol_param_buffer* buf,
+   const double wavelength,
+   const struct ssol_surface_fragment* frag,
+   double* val)
+{
+  (void)dev, (void)buf, (void)wavelength, (void)frag;
+  *val = 1;
+}
+
+static void
+get_shader_roughness
+  (struct ssol_device* dev,
+   struct ssol_param_buffer* buf,
+   const double wavelength,
+   const struct ssol_surface_fragment* frag,
+   double* val)
+{
+  (void)dev, (void)buf, (void)wavelength, (void)frag;
+  *val = 0;
+}
+
+/* Return the flux incoming onto the target */
+static double
+solve
+  (struct ssol_scene* scene,
+   struct ssp_rng* rng,
+   struct ssol_instance* target,
+   double* SE)
+{
+  struct ssol_estimator* estimator;
+  struct ssol_mc_receiver rcv;
+  double E;
+
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &rcv) == RES_OK);
+  E = rcv.incoming_flux.E;
+  *SE = rcv.incoming_flux.SE;
+  printf("Incoming flux = %g +/- %g\n", E, *SE);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+  return E;
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_data reflectivity = SSOL_DATA_NULL__;
+  struct ssol_data roughness = SSOL_DATA_NULL__;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL__;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_slope_distribution* slopes;
+  struct ssol_slope_distribution* slopes2;
+  struct slopes_desc desc;
+  double densities[64];
+  double transform[12]; /* 3x4 column major matrix */
+  double rotation[12]; /* 3x4 column major matrix */
+  double dir[3];
+  double max_slope[2];
+  double E, E_ref, SE, SE_ref;
+  size_t i;
+  (void)argc, (void)argv;
+
+  /* The target faces the mirror and receives the specular reflection */
+  d33_splat(transform, 0);
+  d3_splat(transform + 9, 0);
+  d33_rotation_pitch(transform, PI); /* flip faces: invert normal */
+  transform[9] = 2; /* +2 offset along X axis */
+  transform[11] = 2; /* +2 offset along Z axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_slope_distribution_create(NULL, &slopes) == RES_BAD_ARG);
+  CHK(ssol_slope_distribution_create(dev, NULL) == RES_BAD_ARG);
+  CHK(ssol_slope_distribution_create(dev, &slopes) == RES_OK);
+  CHK(ssol_slope_distribution_create(dev, &slopes2) == RES_OK);
+
+  CHK(ssol_slope_distribution_ref_get(NULL) == RES_BAD_ARG);
+  CHK(ssol_slope_distribution_ref_get(slopes) == RES_OK);
+  CHK(ssol_slope_distribution_ref_put(NULL) == RES_BAD_ARG);
+  CHK(ssol_slope_distribution_ref_put(slopes) == RES_OK);
+
+  /* A narrow distribution of slopes */
+  FOR_EACH(i, 0, 64) densities[i] = 1;
+  desc.definition[0] = 1;
+  desc.definition[1] = 1;
+  desc.densities = densities;
+  max_slope[0] = max_slope[1] = 1.e-6;
+
+  #define SETUP ssol_slope_distribution_setup
+  CHK(SETUP(NULL, get_density, desc.definition, max_slope, &desc)
+    == RES_BAD_ARG);
+  CHK(SETUP(slopes, NULL, desc.definition, max_slope, &desc) == RES_BAD_ARG);
+  CHK(SETUP(slopes, get_density, NULL, max_slope, &desc) == RES_BAD_ARG);
+  CHK(SETUP(slopes, get_density, desc.definition, NULL, &desc)
+    == RES_BAD_ARG);
+  desc.definition[0] = 0;
+  CHK(SETUP(slopes, get_density, desc.definition, max_slope, &desc)
+    == RES_BAD_ARG);
+  desc.definition[0] = 1;
+  max_slope[1] = 0;
+  CHK(SETUP(slopes, get_density, desc.definition, max_slope, &desc)
+    == RES_BAD_ARG);
+  max_slope[1] = 1.e-6;
+  CHK(SETUP(slopes, get_null_density, desc.definition, max_slope, NULL)
+    == RES_BAD_ARG);
+  desc.definition[0] = desc.definition[1] = 2;
+  CHK(SETUP(slopes, get_negative_density, desc.definition, max_slope, NULL)
+    == RES_BAD_ARG);
+  desc.definition[0] = desc.definition[1] = 1;
+  CHK(SETUP(slopes, get_density, desc.definition, max_slope, &desc)
+    == RES_OK);
+
+  /* A wide distribution of slopes whose densities are not normalised */
+  FOR_EACH(i, 0, 64) densities[i] = (double)(1 + i%3);
+  desc.definition[0] = desc.definition[1] = 8;
+  max_slope[0] = 0.2;
+  max_slope[1] = 0.3;
+  CHK(SETUP(slopes2, get_density, desc.definition, max_slope, &desc)
+    == RES_OK);
+  #undef SETUP
+
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  /* A smooth mirror whose tabulated slopes ignore the roughness */
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  ssol_data_set_real(&reflectivity, 1);
+  ssol_data_set_real(&roughness, 0);
+  CHK(ssol_mirror_setup_uniform
+    (m_mtl, &reflectivity, &roughness, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_mirror_set_slope_distribution(NULL, slopes) == RES_BAD_ARG);
+  CHK(ssol_mirror_set_slope_distribution(v_mtl, slopes) == RES_BAD_ARG);
+  CHK(ssol_mirror_set_slope_distribution(m_mtl, NULL) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_instance_sample(target, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  /* The specular reflection entirely reaches the target */
+  E_ref = solve(scene, rng, target, &SE_ref);
+  CHK(eq_eps(E_ref, 4 * DNI * cos(PI/4), 1.e-6 * E_ref));
+
+  /* The narrow slopes behave as a smooth mirror */
+  CHK(ssol_mirror_set_slope_distribution(m_mtl, slopes) == RES_OK);
+  E = solve(scene, rng, target, &SE);
+  CHK(eq_eps(E, E_ref, 3 * (SE + SE_ref) + 1.e-3 * E_ref));
+
+  /* A failed setup leaves the slopes used by the mirror unchanged */
+  desc.definition[0] = desc.definition[1] = 4;
+  CHK(ssol_slope_distribution_setup(slopes, get_null_density, desc.definition,
+    max_slope, NULL) == RES_BAD_ARG);
+  CHK(ssol_slope_distribution_setup(slopes, get_negative_density,
+    desc.definition, max_slope, NULL) == RES_BAD_ARG);
+  E = solve(scene, rng, target, &SE);
+  CHK(eq_eps(E, E_ref, 3 * (SE + SE_ref) + 1.e-3 * E_ref));
+
+  /* The wide slopes scatter the reflection out of the target. The mirror
+   * holds the slopes that are thus still valid when released */
+  CHK(ssol_mirror_set_slope_distribution(m_mtl, slopes2) == RES_OK);
+  CHK(ssol_slope_distribution_ref_put(slopes2) == RES_OK);
+  E = solve(scene, rng, target, &SE);
+  CHK(E > 0 && E + 3 * SE < E_ref);
+
+  /* Restore the analytic distribution */
+  CHK(ssol_mirror_set_slope_distribution(m_mtl, NULL) == RES_OK);
+  E = solve(scene, rng, target, &SE);
+  CHK(eq_eps(E, E_ref, 1.e-6 * E_ref));
+
+  /* The square has no texcoords: the slopes follow the X axis of the
+   * instance whatever the hit triangle */
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_mirror_set_slope_distribution(m_mtl, slopes) == RES_OK);
+  d3(dPdu_ref, 1, 0, 0);
+  E = solve(scene, rng, target, &SE);
+  CHK(eq_eps(E, E_ref, 3 * (SE + SE_ref) + 1.e-3 * E_ref));
+
+  /* Rotate the heliostat of PI/2 around the Z axis */
+  d33_set_identity(rotation);
+  d3_splat(rotation + 9, 0);
+  d3(rotation + 0, 0, 1, 0);
+  d3(rotation + 3, -1, 0, 0);
+  CHK(ssol_instance_set_transform(heliostat, rotation) == RES_OK);
+  d3(dPdu_ref, 0, 1, 0);
+  E = solve(scene, rng, target, &SE);
+  CHK(eq_eps(E, E_ref, 3 * (SE + SE_ref) + 1.e-3 * E_ref));
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_slope_distribution_ref_put(slopes) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
@@ -74,6 +74,8 @@ main(int argc, char** argv)
   struct ssol_spectrum* spectrum;
   struct ssol_spectrum* abs_spectrum;
   struct ssol_data extinction;
+  struct ssol_data reflectivity = SSOL_DATA_NULL__;
+  struct ssol_data roughness = SSOL_DATA_NULL__;
   struct ssol_atmosphere* atm;
   struct ssol_estimator* estimator;
   struct ssol_mc_sampled sampled;
@@ -526,6 +528,19 @@ main(int argc, char** argv)
   print_rcv(&mc_rcv);
   CHK(eq_eps(mc_rcv.incoming_flux.E, m, 1e-4) == 1);
   CHK(eq_eps(mc_rcv.incoming_flux.SE, std, 1e-4) == 1);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  /* Same mirror whose parameters are declared uniform */
+  ssol_data_set_real(&reflectivity, REFLECTIVITY);
+  ssol_data_set_real(&roughness, 0);
+  CHK(ssol_mirror_setup_uniform
+    (m_mtl2, &reflectivity, &roughness, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_solve(scene, rng, N__, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_mc_global(estimator, &mc_global) == RES_OK);
+  CHK(eq_eps(mc_global.missing.E, m, 1e-4) == 1);
+  CHK(GET_MC_RCV(estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  CHK(eq_eps(mc_rcv.incoming_flux.E, m, 1e-4) == 1);
+  CHK(eq_eps(mc_rcv.incoming_flux.SE, std, 1e-4) == 1);
 
   /* Free data */
   CHK(ssol_instance_ref_put(heliostat2) == RES_OK);
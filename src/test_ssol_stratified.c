@@ -0,0 +1,250 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 10000
+#define DNI 1000
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* heliostat2;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator;
+  struct ssol_estimator* by_area;
+  struct ssol_estimator* by_quota;
+  struct ssol_mc_receiver rcv;
+  struct ssol_mc_receiver rcv_by_area;
+  struct ssol_mc_sampled samp;
+  struct ssol_mc_sampled samp_by_area;
+  struct ssol_mc_sampled samp2_by_area;
+  struct ssol_mc_sampled samp_by_quota;
+  struct ssol_mc_sampled samp2_by_quota;
+  struct ssol_mc_receiver samp_rcv;
+  struct ssol_mc_receiver samp_rcv_by_area;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double transform3[12]; /* 3x4 column major matrix */
+  double dir[3];
+  enum ssol_stratification stratification;
+  size_t count;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  d33_set_identity(transform3);
+  d3_splat(transform3 + 9, 0);
+  transform3[10] = 10; /* +10 offset along Y axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  /* Heliostat whose reflected flux misses the secondary */
+  CHK(ssol_object_instantiate(m_object, &heliostat2) == RES_OK);
+  CHK(ssol_instance_set_transform(heliostat2, transform3) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat2) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_instance_sample(secondary, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_instance_sample(target, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  CHK(ssol_scene_get_stratification(NULL, &stratification) == RES_BAD_ARG);
+  CHK(ssol_scene_get_stratification(scene, NULL) == RES_BAD_ARG);
+  CHK(ssol_scene_get_stratification(scene, &stratification) == RES_OK);
+  CHK(stratification == SSOL_STRATIFICATION_NONE);
+  CHK(ssol_scene_set_stratification
+    (NULL, SSOL_STRATIFICATION_AREA) == RES_BAD_ARG);
+  CHK(ssol_scene_set_stratification
+    (scene, SSOL_STRATIFICATION_COUNT__) == RES_BAD_ARG);
+
+  CHK(ssol_instance_set_sampling_quota(NULL, 1) == RES_BAD_ARG);
+  CHK(ssol_instance_set_sampling_quota(heliostat, 0) == RES_BAD_ARG);
+  CHK(ssol_instance_set_sampling_quota(heliostat, -1) == RES_BAD_ARG);
+  CHK(ssol_instance_set_sampling_quota(heliostat, 3) == RES_OK);
+
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+
+  CHK(ssol_scene_set_stratification
+    (scene, SSOL_STRATIFICATION_AREA) == RES_OK);
+  CHK(ssol_scene_get_stratification(scene, &stratification) == RES_OK);
+  CHK(stratification == SSOL_STRATIFICATION_AREA);
+
+  /* Each sampled instance needs at least one realisation */
+  CHK(ssol_solve(scene, rng, 1, 0, NULL, &by_area) == RES_BAD_ARG);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &by_area) == RES_OK);
+
+  CHK(ssol_scene_set_stratification
+    (scene, SSOL_STRATIFICATION_QUOTA) == RES_OK);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &by_quota) == RES_OK);
+
+  /* The realisations are deterministically split over the heliostats */
+  CHK(ssol_estimator_get_realisation_count(by_area, &count) == RES_OK);
+  CHK(count == N);
+  CHK(ssol_estimator_get_mc_sampled(estimator, heliostat, &samp) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled
+    (by_area, heliostat, &samp_by_area) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled
+    (by_area, heliostat2, &samp2_by_area) == RES_OK);
+  CHK(samp_by_area.nb_samples == N/2);
+  CHK(samp2_by_area.nb_samples == N/2);
+  CHK(ssol_estimator_get_mc_sampled
+    (by_quota, heliostat, &samp_by_quota) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled
+    (by_quota, heliostat2, &samp2_by_quota) == RES_OK);
+  CHK(samp_by_quota.nb_samples == 3*N/4);
+  CHK(samp2_by_quota.nb_samples == N/4);
+
+  /* The stratification does not bias the estimates */
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &rcv) == RES_OK);
+  CHK(ssol_estimator_get_mc_receiver
+    (by_area, target, SSOL_FRONT, &rcv_by_area) == RES_OK);
+  printf("Incoming flux = %g +/- %g; stratified: %g +/- %g\n",
+    rcv.incoming_flux.E, rcv.incoming_flux.SE,
+    rcv_by_area.incoming_flux.E, rcv_by_area.incoming_flux.SE);
+  CHK(rcv.incoming_flux.E > 0);
+  CHK(eq_eps(rcv.incoming_flux.E, rcv_by_area.incoming_flux.E,
+    3 * (rcv.incoming_flux.SE + rcv_by_area.incoming_flux.SE)));
+  CHK(eq_eps(samp.cos_factor.E, samp_by_area.cos_factor.E,
+    3 * (samp.cos_factor.SE + samp_by_area.cos_factor.SE) + 1.e-6));
+  CHK(eq_eps(samp.absorbed_by_receivers.E,
+    samp_by_quota.absorbed_by_receivers.E,
+    3 * (samp.absorbed_by_receivers.SE
+       + samp_by_quota.absorbed_by_receivers.SE)));
+
+  /* The per heliostat estimates use the realisations of their stratum */
+  CHK(ssol_estimator_get_mc_sampled_x_receiver
+    (estimator, heliostat, target, SSOL_FRONT, &samp_rcv) == RES_OK);
+  CHK(ssol_estimator_get_mc_sampled_x_receiver
+    (by_area, heliostat, target, SSOL_FRONT, &samp_rcv_by_area) == RES_OK);
+  CHK(eq_eps(samp_rcv.incoming_flux.E, samp_rcv_by_area.incoming_flux.E,
+    3 * (samp_rcv.incoming_flux.SE + samp_rcv_by_area.incoming_flux.SE)));
+  CHK(samp_rcv_by_area.incoming_flux.SE < samp_rcv.incoming_flux.SE);
+  CHK(samp2_by_area.absorbed_by_receivers.E == 0);
+  CHK(samp2_by_area.absorbed_by_receivers.SE == 0);
+
+  /* Stratified and random estimators cannot be merged */
+  CHK(ssol_estimator_merge(estimator, by_area) == RES_BAD_ARG);
+  CHK(ssol_estimator_merge(by_quota, by_area) == RES_OK);
+
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+  CHK(ssol_estimator_ref_put(by_area) == RES_OK);
+  CHK(ssol_estimator_ref_put(by_quota) == RES_OK);
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(heliostat2) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}
@@ -0,0 +1,370 @@
+/* Copyright (C) 2018, 2019, 2021 |Meso|Star> (contact@meso-star.com)
+ * Copyright (C) 2016, 2018 CNRS
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include "ssol.h"
+#include "test_ssol_utils.h"
+#include "test_ssol_materials.h"
+
+#define HALF_X 1
+#define HALF_Y 1
+#define PLANE_NAME SQUARE
+#include "test_ssol_rect_geometry.h"
+
+#include <rsys/double33.h>
+
+#include <star/ssp.h>
+
+#define N 10000
+#define DNI 1000
+
+static void
+get_wlen(const size_t i, double* wlen, double* data, void* ctx)
+{
+  double wavelengths[3] = { 1, 2, 3 };
+  double intensities[3] = { 1, 0.8, 1 };
+  CHK(i < 3);
+  (void)ctx;
+  *wlen = wavelengths[i];
+  *data = intensities[i];
+}
+
+#define NBINS 8 /* Number of bins of the incidence angle histogram */
+
+struct tally {
+  size_t nhits;
+  size_t npaths;
+  size_t nreceived; /* Number of paths that hit a receiver */
+  double incoming; /* Sum of the incoming flux */
+  double histogram[NBINS]; /* Incoming flux wrt the cosine of incidence */
+};
+
+struct tally_context {
+  uint32_t target; /* Identifier of the target instance */
+  size_t ninits; /* Number of initialised tally data */
+  size_t nreleases; /* Number of released tally data */
+};
+
+static res_T
+tally_init(void* data, void* context)
+{
+  struct tally* tally = data;
+  struct tally_context* ctx = context;
+  size_t i;
+  CHK(tally && ctx);
+  CHK(tally->nhits == 0 && tally->incoming == 0);
+  FOR_EACH(i, 0, NBINS) tally->histogram[i] = 0;
+  ctx->ninits += 1;
+  return RES_OK;
+}
+
+static void
+tally_release(void* data, void* context)
+{
+  struct tally_context* ctx = context;
+  CHK(data && ctx);
+  ctx->nreleases += 1;
+}
+
+static res_T
+tally_hit(void* data, const struct ssol_tally_hit* hit, void* context)
+{
+  struct tally* tally = data;
+  struct tally_context* ctx = context;
+  double cos_theta;
+  size_t ibin;
+  CHK(tally && hit && ctx);
+  CHK(hit->realisation < N);
+  CHK(hit->instance == ctx->target);
+  CHK(hit->side == SSOL_FRONT);
+  CHK(d3_is_normalized(hit->dir));
+  CHK(d3_is_normalized(hit->normal));
+  CHK(hit->wavelength >= 1 && hit->wavelength <= 3);
+  CHK(hit->absorbed_flux <= hit->incoming_flux);
+
+  cos_theta = -d3_dot(hit->dir, hit->normal);
+  CHK(cos_theta >= 0 && cos_theta <= 1 + 1.e-6);
+  ibin = MMIN((size_t)(cos_theta * NBINS), NBINS-1);
+  tally->histogram[ibin] += hit->incoming_flux;
+  tally->incoming += hit->incoming_flux;
+  tally->nhits += 1;
+  return RES_OK;
+}
+
+static res_T
+tally_path_end(void* data, const struct ssol_tally_path* path, void* context)
+{
+  struct tally* tally = data;
+  CHK(tally && path && context);
+  CHK(path->realisation < N);
+  CHK(path->initial_flux >= 0);
+  CHK(path->missing_flux <= path->initial_flux);
+  tally->npaths += 1;
+  tally->nreceived += path->receiver_hit != 0;
+  return RES_OK;
+}
+
+static res_T
+tally_merge(void* dst, const void* src, void* context)
+{
+  struct tally* a = dst;
+  const struct tally* b = src;
+  size_t i;
+  CHK(a && b && context);
+  a->nhits += b->nhits;
+  a->npaths += b->npaths;
+  a->nreceived += b->nreceived;
+  a->incoming += b->incoming;
+  FOR_EACH(i, 0, NBINS) a->histogram[i] += b->histogram[i];
+  return RES_OK;
+}
+
+static res_T
+tally_write(const void* data, FILE* stream, void* context)
+{
+  CHK(data && stream && context);
+  return fwrite(data, sizeof(struct tally), 1, stream) == 1
+    ? RES_OK : RES_IO_ERR;
+}
+
+static res_T
+tally_read(void* data, FILE* stream, void* context)
+{
+  CHK(data && stream && context);
+  return fread(data, sizeof(struct tally), 1, stream) == 1
+    ? RES_OK : RES_IO_ERR;
+}
+
+int
+main(int argc, char** argv)
+{
+  struct mem_allocator allocator;
+  struct ssol_device* dev;
+  struct ssp_rng* rng;
+  struct ssol_scene* scene;
+  struct ssol_shape* square;
+  struct ssol_vertex_data attribs[1] = { SSOL_VERTEX_DATA_NULL__ };
+  struct ssol_material* m_mtl;
+  struct ssol_material* v_mtl;
+  struct ssol_mirror_shader shader = SSOL_MIRROR_SHADER_NULL;
+  struct ssol_object* m_object;
+  struct ssol_object* t_object;
+  struct ssol_instance* heliostat;
+  struct ssol_instance* secondary;
+  struct ssol_instance* target;
+  struct ssol_sun* sun;
+  struct ssol_spectrum* spectrum;
+  struct ssol_estimator* estimator;
+  struct ssol_estimator* estimator2;
+  struct ssol_tally tally = SSOL_TALLY_NULL;
+  struct tally_context ctx;
+  struct ssol_mc_receiver mc_rcv;
+  const struct tally* data;
+  const struct tally* data2;
+  const void* ptr;
+  FILE* stream;
+  double transform1[12]; /* 3x4 column major matrix */
+  double transform2[12]; /* 3x4 column major matrix */
+  double dir[3];
+  double sum;
+  size_t i, id, count;
+  (void)argc, (void)argv;
+
+  d33_splat(transform1, 0);
+  d3_splat(transform1 + 9, 0);
+  d33_rotation_pitch(transform1, PI); /* flip faces: invert normal */
+  transform1[9] = 2; /* +2 offset along X axis */
+  transform1[11] = 2; /* +2 offset along Z axis */
+
+  d33_set_identity(transform2);
+  d3_splat(transform2 + 9, 0);
+  transform2[9] = 4; /* +4 offset along X axis */
+
+  mem_init_proxy_allocator(&allocator, &mem_default_allocator);
+
+  CHK(ssol_device_create
+    (NULL, &allocator, SSOL_NTHREADS_DEFAULT, 0, &dev) == RES_OK);
+  CHK(ssp_rng_create(&allocator, SSP_RNG_THREEFRY, &rng) == RES_OK);
+
+  CHK(ssol_spectrum_create(dev, &spectrum) == RES_OK);
+  CHK(ssol_spectrum_setup(spectrum, get_wlen, 3, NULL) == RES_OK);
+  CHK(ssol_sun_create_directional(dev, &sun) == RES_OK);
+  CHK(ssol_sun_set_direction(sun, d3(dir, 1, 0, -1)) == RES_OK);
+  CHK(ssol_sun_set_spectrum(sun, spectrum) == RES_OK);
+  CHK(ssol_sun_set_dni(sun, DNI) == RES_OK);
+
+  CHK(ssol_shape_create_mesh(dev, &square) == RES_OK);
+  attribs[0].usage = SSOL_POSITION;
+  attribs[0].get = get_position;
+  CHK(ssol_mesh_setup(square, SQUARE_NTRIS__, get_ids,
+    SQUARE_NVERTS__, attribs, 1, (void*)&SQUARE_DESC__) == RES_OK);
+
+  CHK(ssol_material_create_mirror(dev, &m_mtl) == RES_OK);
+  shader.normal = get_shader_normal;
+  shader.reflectivity = get_shader_reflectivity;
+  shader.roughness = get_shader_roughness;
+  CHK(ssol_mirror_setup(m_mtl, &shader, SSOL_MICROFACET_BECKMANN) == RES_OK);
+  CHK(ssol_material_create_virtual(dev, &v_mtl) == RES_OK);
+
+  CHK(ssol_object_create(dev, &m_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(m_object, square, m_mtl, m_mtl) == RES_OK);
+  CHK(ssol_object_create(dev, &t_object) == RES_OK);
+  CHK(ssol_object_add_shaded_shape(t_object, square, v_mtl, v_mtl) == RES_OK);
+
+  CHK(ssol_scene_create(dev, &scene) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &heliostat) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, heliostat) == RES_OK);
+  CHK(ssol_object_instantiate(m_object, &secondary) == RES_OK);
+  CHK(ssol_instance_set_transform(secondary, transform1) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, secondary) == RES_OK);
+  CHK(ssol_object_instantiate(t_object, &target) == RES_OK);
+  CHK(ssol_instance_set_transform(target, transform2) == RES_OK);
+  CHK(ssol_instance_set_receiver(target, SSOL_FRONT, 0) == RES_OK);
+  CHK(ssol_scene_attach_instance(scene, target) == RES_OK);
+  CHK(ssol_scene_attach_sun(scene, sun) == RES_OK);
+
+  ctx.ninits = 0;
+  ctx.nreleases = 0;
+  CHK(ssol_instance_get_id(target, &ctx.target) == RES_OK);
+
+  CHK(ssol_scene_add_tally(NULL, &tally, &id) == RES_BAD_ARG);
+  CHK(ssol_scene_add_tally(scene, NULL, &id) == RES_BAD_ARG);
+  CHK(ssol_scene_add_tally(scene, &tally, &id) == RES_BAD_ARG);
+  tally.sizeof_data = sizeof(struct tally);
+  CHK(ssol_scene_add_tally(scene, &tally, &id) == RES_BAD_ARG);
+  tally.init = tally_init;
+  tally.release = tally_release;
+  tally.hit = tally_hit;
+  tally.path_end = tally_path_end;
+  tally.merge = tally_merge;
+  tally.context = &ctx;
+  CHK(ssol_scene_add_tally(scene, &tally, &id) == RES_OK);
+  CHK(id == 0);
+  CHK(ssol_scene_clear_tallies(NULL) == RES_BAD_ARG);
+  CHK(ssol_scene_clear_tallies(scene) == RES_OK);
+
+  /* No tally */
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_tallies_count(NULL, &count) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_tallies_count(estimator, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_tallies_count(estimator, &count) == RES_OK);
+  CHK(count == 0);
+  CHK(ssol_estimator_get_tally(estimator, 0, &ptr) == RES_BAD_ARG);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+  CHK(ctx.ninits == 0);
+
+  CHK(ssol_scene_add_tally(scene, &tally, &id) == RES_OK);
+  CHK(id == 0);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  CHK(ssol_estimator_get_tallies_count(estimator, &count) == RES_OK);
+  CHK(count == 1);
+  CHK(ssol_estimator_get_tally(NULL, 0, &ptr) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_tally(estimator, 1, &ptr) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_tally(estimator, 0, NULL) == RES_BAD_ARG);
+  CHK(ssol_estimator_get_tally(estimator, 0, &ptr) == RES_OK);
+  data = ptr;
+
+  /* Each realisation is submitted once to the tally */
+  CHK(data->npaths == N);
+  CHK(data->nhits > 0);
+  CHK(data->nreceived > 0 && data->nreceived <= data->nhits);
+
+  /* The tally integrates the incoming flux of the receiver */
+  CHK(ssol_estimator_get_mc_receiver
+    (estimator, target, SSOL_FRONT, &mc_rcv) == RES_OK);
+  printf("Incoming flux = %g +/- %g; tally = %g\n",
+    mc_rcv.incoming_flux.E, mc_rcv.incoming_flux.SE, data->incoming/N);
+  CHK(eq_eps(data->incoming/N, mc_rcv.incoming_flux.E,
+    mc_rcv.incoming_flux.E*1.e-6));
+  sum = 0;
+  FOR_EACH(i, 0, NBINS) sum += data->histogram[i];
+  CHK(eq_eps(sum, data->incoming, data->incoming*1.e-6));
+
+  /* The tallies are merged */
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator2) == RES_OK);
+  CHK(ssol_estimator_merge(estimator, estimator2) == RES_OK);
+  CHK(ssol_estimator_get_tally(estimator, 0, &ptr) == RES_OK);
+  data = ptr;
+  CHK(data->npaths == 2*N);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+
+  /* Tallies without write callback cannot be serialized */
+  stream = tmpfile();
+  CHK(stream != NULL);
+  CHK(ssol_estimator_write(estimator, stream) == RES_BAD_OP);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  /* The tally data are serialized with the estimator */
+  tally.write = tally_write;
+  tally.read = tally_read;
+  CHK(ssol_scene_clear_tallies(scene) == RES_OK);
+  CHK(ssol_scene_add_tally(scene, &tally, &id) == RES_OK);
+  CHK(id == 0);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator) == RES_OK);
+  rewind(stream);
+  CHK(ssol_estimator_write(estimator, stream) == RES_OK);
+  rewind(stream);
+  CHK(ssol_estimator_read(scene, stream, &estimator2) == RES_OK);
+  CHK(ssol_estimator_get_tally(estimator, 0, &ptr) == RES_OK);
+  data = ptr;
+  CHK(ssol_estimator_get_tally(estimator2, 0, &ptr) == RES_OK);
+  data2 = ptr;
+  CHK(data->npaths == N);
+  CHK(data2->npaths == data->npaths);
+  CHK(data2->nhits == data->nhits);
+  CHK(data2->nreceived == data->nreceived);
+  CHK(data2->incoming == data->incoming);
+  FOR_EACH(i, 0, NBINS) CHK(data2->histogram[i] == data->histogram[i]);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+
+  /* Estimators that do not use the same tallies cannot be merged */
+  CHK(ssol_scene_add_tally(scene, &tally, &id) == RES_OK);
+  CHK(id == 1);
+
+  /* ... nor read */
+  rewind(stream);
+  CHK(ssol_estimator_read(scene, stream, &estimator2) == RES_BAD_ARG);
+  CHK(fclose(stream) == 0);
+  CHK(ssol_solve(scene, rng, N, 0, NULL, &estimator2) == RES_OK);
+  CHK(ssol_estimator_get_tallies_count(estimator2, &count) == RES_OK);
+  CHK(count == 2);
+  CHK(ssol_estimator_merge(estimator, estimator2) == RES_BAD_ARG);
+  CHK(ssol_estimator_ref_put(estimator2) == RES_OK);
+  CHK(ssol_estimator_ref_put(estimator) == RES_OK);
+
+  /* The tally data are released */
+  CHK(ctx.ninits > 0);
+  CHK(ctx.ninits == ctx.nreleases);
+
+  CHK(ssol_instance_ref_put(heliostat) == RES_OK);
+  CHK(ssol_instance_ref_put(secondary) == RES_OK);
+  CHK(ssol_instance_ref_put(target) == RES_OK);
+  CHK(ssol_object_ref_put(m_object) == RES_OK);
+  CHK(ssol_object_ref_put(t_object) == RES_OK);
+  CHK(ssol_material_ref_put(m_mtl) == RES_OK);
+  CHK(ssol_material_ref_put(v_mtl) == RES_OK);
+  CHK(ssol_shape_ref_put(square) == RES_OK);
+  CHK(ssol_scene_ref_put(scene) == RES_OK);
+  CHK(ssol_spectrum_ref_put(spectrum) == RES_OK);
+  CHK(ssol_sun_ref_put(sun) == RES_OK);
+  CHK(ssol_device_ref_put(dev) == RES_OK);
+  CHK(ssp_rng_ref_put(rng) == RES_OK);
+
+  check_memory_allocator(&allocator);
+  mem_shutdown_proxy_allocator(&allocator);
+  CHK(mem_allocated_size() == 0);
+
+  return 0;
+}